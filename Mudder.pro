@@ -5,7 +5,8 @@ SUBDIRS += \
     logging \
     core \
     editor \
-    client
+    client \
+    tests
 
 core.depends = logging
 
@@ -16,3 +17,7 @@ client.depends = lua52 \
                  core \
                  logging \
                  editor
+
+tests.depends = lua52 \
+                core \
+                logging
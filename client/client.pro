@@ -49,7 +49,13 @@ SOURCES += main.cpp\
     configoutput.cpp \
     settingsfiltermodel.cpp \
     richtextdelegate.cpp \
-    luastate.cpp
+    luastate.cpp \
+    luajson.cpp \
+    scrollbacksearch.cpp \
+    htmlwriter.cpp \
+    scrollbackexport.cpp \
+    renderscheduler.cpp \
+    glyphcache.cpp
 
 HEADERS  += mainwindow.h \
     console.h \
@@ -91,7 +97,13 @@ HEADERS  += mainwindow.h \
     configoutput.h \
     settingsfiltermodel.h \
     richtextdelegate.h \
-    luastate.h
+    luastate.h \
+    luajson.h \
+    scrollbacksearch.h \
+    htmlwriter.h \
+    scrollbackexport.h \
+    renderscheduler.h \
+    glyphcache.h
 
 FORMS    += mainwindow.ui \
     console.ui \
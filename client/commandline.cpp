@@ -100,14 +100,14 @@ void CommandLine::echoToggled(bool flag)
     m_echoOn = flag;
 }
 
-void CommandLine::processNewBlock(const QTextBlock &block)
+void CommandLine::processNewLine(const QString &text)
 {
     if (m_recentLines.count() >= 100)
     {
         m_recentLines.pop_front();
     }
 
-    m_recentLines.append(block.text());
+    m_recentLines.append(text);
 
     updateCompletions();
 }
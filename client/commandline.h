@@ -28,7 +28,6 @@
 #include <QPlainTextEdit>
 #include <QStringList>
 #include <QStringListModel>
-#include <QTextBlock>
 #include <QVariant>
 
 class CommandLine : public QPlainTextEdit
@@ -42,7 +41,7 @@ public:
 public slots:
     void optionChanged(const QString &key, const QVariant &val);
     void echoToggled(bool flag);
-    void processNewBlock(const QTextBlock &block);
+    void processNewLine(const QString &text);
 
 signals:
     void command(const QString &cmd);
@@ -53,6 +53,9 @@ void ConfigOutput::load()
     ui->checkAntiAliased->setChecked(font.styleStrategy() == QFont::PreferAntialias);
 
     ui->scrollback->setValue(qBound(ui->scrollback->minimum(), m_profile->scrollbackLines(), ui->scrollback->maximum()));
+    ui->checkScrollbackFile->setChecked(m_profile->scrollbackFile());
+    ui->scrollbackFileSize->setValue(qBound(ui->scrollbackFileSize->minimum(), m_profile->scrollbackFileSize(), ui->scrollbackFileSize->maximum()));
+    ui->frameRate->setValue(qBound(ui->frameRate->minimum(), m_profile->frameRate(), ui->frameRate->maximum()));
 }
 
 void ConfigOutput::save()
@@ -64,4 +67,7 @@ void ConfigOutput::save()
     m_profile->setOutputFont(font);
 
     m_profile->setScrollbackLines(ui->scrollback->value());
+    m_profile->setScrollbackFile(ui->checkScrollbackFile->isChecked());
+    m_profile->setScrollbackFileSize(ui->scrollbackFileSize->value());
+    m_profile->setFrameRate(ui->frameRate->value());
 }
@@ -26,6 +26,10 @@
 #include "coreapplication.h"
 #include "consoledocument.h"
 #include "engine.h"
+#include "renderscheduler.h"
+#include "scrollbackexport.h"
+#include "scrollbacksearch.h"
+#include "searchwidget.h"
 #include "logging.h"
 #include "profile.h"
 #include "xmlerror.h"
@@ -35,15 +39,19 @@
 #include "group.h"
 #include "timer.h"
 #include "trigger.h"
-#include <QAbstractTextDocumentLayout>
 #include <QClipboard>
+#include <QDir>
 #include <QFileDialog>
 #include <QFileInfo>
 #include <QMenu>
 #include <QMessageBox>
 #include <QPainter>
-#include <QTextDocumentFragment>
+#include <QProgressDialog>
 #include <QToolTip>
+#include <QtMath>
+
+static const int RECONNECT_DELAY_MIN = 2000;
+static const int RECONNECT_DELAY_MAX = 60000;
 
 Console::Console(QWidget *parent) :
     QWidget(parent),
@@ -71,36 +79,60 @@ Console::Console(QWidget *parent) :
     connect(m_profile, SIGNAL(timerFired(Timer*)), SLOT(processTimer(Timer*)));
 
     m_document = new ConsoleDocument(this);
-    m_document->setMaximumBlockCount(m_profile->scrollbackLines() + 1);
+    m_document->setMaximumLines(m_profile->scrollbackLines() + 1);
     ui->output->setDocument(m_document);
     connect(m_profile, SIGNAL(optionChanged(QString, QVariant)), m_document, SLOT(optionChanged(QString, QVariant)));
 
+    m_scheduler = new RenderScheduler(this);
+    m_scheduler->setFrameRate(m_profile->frameRate());
+    connect(m_profile, SIGNAL(optionChanged(QString, QVariant)), m_scheduler, SLOT(optionChanged(QString, QVariant)));
+    connect(m_scheduler, SIGNAL(frame()), SLOT(renderFrame()));
+    connect(ui->output, SIGNAL(painted(qint64)), m_scheduler, SLOT(recordPaint(qint64)));
+
     m_echoOn = true;
 
+    m_reconnectDelay = RECONNECT_DELAY_MIN;
+    m_userDisconnect = false;
+    m_replacingSession = false;
+    m_reconnectTimer.setSingleShot(true);
+    connect(&m_reconnectTimer, SIGNAL(timeout()), SLOT(reconnect()));
+
     m_mousePressed = false;
-    m_selectionStart = 0;
-    m_selectionEnd = 0;
-    m_clickPos = -1;
+    m_selectionStart = LinePosition();
+    m_selectionEnd = LinePosition();
+    m_clickPos = LinePosition();
+
+    m_searchWidget = 0;
+    m_searchLine = -1;
 
-    m_connection = new Connection(this);
-    connect(m_connection, SIGNAL(dataReceived(QByteArray)), SLOT(dataReceived(QByteArray)));
+    m_export = 0;
+
+    // Socket reads, telnet and decompression run on their own thread
+    m_connection = new Connection;
+    m_networkThread = new QThread(this);
+    m_connection->moveToThread(m_networkThread);
+    connect(m_networkThread, SIGNAL(finished()), m_connection, SLOT(deleteLater()));
+    m_networkThread->start();
+
+    connect(m_connection, SIGNAL(payloadsReady()), SLOT(payloadsReady()));
     connect(m_connection, SIGNAL(connected()), SLOT(connectionEstablished()));
     connect(m_connection, SIGNAL(disconnected()), SLOT(connectionLost()));
+    connect(m_connection, SIGNAL(connectionFailed(QString)), SLOT(connectionFailed(QString)));
     connect(m_connection, SIGNAL(hostFound(QHostInfo)), SLOT(lookupComplete(QHostInfo)));
     connect(m_connection, SIGNAL(echo(bool)), SLOT(echoToggled(bool)));
     connect(m_connection, SIGNAL(echo(bool)), ui->input, SLOT(echoToggled(bool)));
 
     connect(ui->input, SIGNAL(accelerator(QKeySequence)), SLOT(processAccelerators(QKeySequence)));
-    connect(m_document, SIGNAL(blockAdded(QTextBlock)), SLOT(processTriggers(QTextBlock)));
-    connect(m_document, SIGNAL(blockAdded(QTextBlock)), ui->input, SLOT(processNewBlock(QTextBlock)));
-    connect(m_document, SIGNAL(contentsChanged()), ui->output, SLOT(update()));
-    connect(m_document, SIGNAL(contentsChanged()), SLOT(updateScroll()));
+    connect(m_document, SIGNAL(lineStaged(QString)), SLOT(processTriggers(QString)));
+    connect(m_document, SIGNAL(lineAdded(QString)), ui->input, SLOT(processNewLine(QString)));
+    connect(m_document, SIGNAL(contentsChanged()), SLOT(outputChanged()));
+    connect(m_document->documentLayout(), SIGNAL(documentSizeChanged()), SLOT(outputChanged()));
     connect(ui->scrollbar, SIGNAL(valueChanged(int)), SLOT(scrollbarMoved(int)));
+    connect(m_document->search(), SIGNAL(progress(int,bool)), SLOT(searchProgress(int,bool)));
 
     m_engine = new Engine(this);
     m_engine->initialize(this);
     connect(m_connection, SIGNAL(toggleGMCP(bool)), m_engine, SLOT(enableGMCP(bool)));
-    connect(m_connection, SIGNAL(receivedGMCP(QString, QString)), m_engine, SLOT(handleGMCP(QString, QString)));
 
     setWindowTitle("[*]");
     setAttribute(Qt::WA_DeleteOnClose);
@@ -111,6 +143,9 @@ Console::Console(QWidget *parent) :
 
 Console::~Console()
 {
+    m_networkThread->quit();
+    m_networkThread->wait();
+
     delete ui;
 }
 
@@ -177,6 +212,7 @@ Console * Console::openFile(const QString &fileName, QWidget *parent)
     if (console->readFile(fileName))
     {
         console->setCurrentFile(fileName);
+        console->openScrollback();
         return console;
     }
 
@@ -186,65 +222,100 @@ Console * Console::openFile(const QString &fileName, QWidget *parent)
 
 void Console::connectToServer()
 {
+    m_userDisconnect = false;
+    m_reconnectTimer.stop();
+
+    // Connecting again drops the live session first, and that's no reason to reconnect
+    m_replacingSession = m_connection->isConnected();
+
     m_connection->connectRemote(m_profile->address(), m_profile->port());
 }
 
 void Console::disconnectFromServer()
 {
+    m_userDisconnect = true;
+    m_reconnectTimer.stop();
+
     m_connection->disconnectRemote();
 }
 
 void Console::scrollUp(int lines)
 {
-    scrollTo(ui->scrollbar->value() - lines);
+    const ConsoleDocumentLayout *layout = m_document->documentLayout();
+
+    scrollTo(qRound(layout->scrollPosition() - lines * layout->lineSpacing()));
 }
 
 void Console::scrollDown(int lines)
 {
-    scrollTo(ui->scrollbar->value() + lines);
+    const ConsoleDocumentLayout *layout = m_document->documentLayout();
+
+    scrollTo(qRound(layout->scrollPosition() + lines * layout->lineSpacing()));
 }
 
-void Console::scrollTo(int line)
+// The position is in pixels, from the top of the first line to the top of the view
+void Console::scrollTo(int position)
 {
-    line = qBound(ui->scrollbar->minimum(), line, ui->scrollbar->maximum());
+    m_document->documentLayout()->scrollTo(position);
 
-    ui->scrollbar->setValue(line);
-    ui->output->setScrollLines(line);
-    ui->output->update();
+    moveScroll(position);
+    m_scheduler->schedule();
 }
 
 void Console::scrollToTop()
 {
-    scrollTo(ui->scrollbar->minimum());
+    scrollTo(0);
 }
 
+// Where the bottom is gets settled when the frame is drawn, after all the output that's coming
 void Console::scrollToBottom()
 {
-    scrollTo(ui->scrollbar->maximum());
+    m_document->documentLayout()->scrollToBottom();
+    m_scheduler->schedule();
+}
+
+void Console::showSearch()
+{
+    if (!m_searchWidget)
+    {
+        m_searchWidget = new SearchWidget(SearchWidget::CaseSensitive | SearchWidget::WholeWordsOnly |
+                                          SearchWidget::RegEx | SearchWidget::RegWildcard | SearchWidget::RegFixedString,
+                                          SearchWidget::SearchOnly,
+                                          SearchWidget::NextButtons | SearchWidget::PreviousButtons | SearchWidget::HideButtonDown,
+                                          this);
+        m_searchWidget->setCaseSensitive(false);
+        m_searchWidget->setWholeWordsOnly(false);
+        ui->consoleLayout->insertWidget(1, m_searchWidget);
+
+        connect(m_searchWidget, SIGNAL(searchStringChanged(QString)), SLOT(startSearch()));
+        connect(m_searchWidget, SIGNAL(searchOptionsChanged()), SLOT(startSearch()));
+        connect(m_searchWidget, SIGNAL(findNext_clicked()), SLOT(findNext()));
+        connect(m_searchWidget, SIGNAL(findPrevious_clicked()), SLOT(findPrevious()));
+        connect(m_searchWidget, SIGNAL(close_clicked()), SLOT(hideSearch()));
+    }
+
+    m_searchWidget->show();
+    m_searchWidget->setEditorFocus();
 }
 
 void Console::printInfo(const QString &msg)
 {
     m_document->info(msg);
-    scrollToBottom();
 }
 
 void Console::printWarning(const QString &msg)
 {
     m_document->warning(msg);
-    scrollToBottom();
 }
 
 void Console::printError(const QString &msg)
 {
     m_document->error(msg);
-    scrollToBottom();
 }
 
 void Console::tell(const QString &text, const QTextCharFormat &fmt)
 {
     m_document->append(text, fmt);
-    scrollToBottom();
 }
 
 void Console::note(const QString &text, const QTextCharFormat &fmt)
@@ -275,6 +346,17 @@ bool Console::sendAlias(const QString &cmd)
     return true;
 }
 
+bool Console::sendSpeedwalk(const QString &path, bool show)
+{
+    bool result = m_connection->sendSpeedwalk(path);
+    if (result && show)
+    {
+        m_document->command(path);
+        scrollToBottom();
+    }
+    return result;
+}
+
 bool Console::sendGmcp(const QString &msg, const QString &data)
 {
     return m_connection->sendGmcp(msg, data);
@@ -285,6 +367,33 @@ void Console::deleteLines(int count)
     m_document->deleteLines(count);
 }
 
+void Console::gagLine()
+{
+    m_document->omit();
+}
+
+bool Console::substitute(int start, int length, const QString &text)
+{
+    if (!m_document->isStaging())
+    {
+        return false;
+    }
+
+    m_document->substitute(start, length, text);
+    return true;
+}
+
+bool Console::recolor(int start, int length, const QTextCharFormat &fmt)
+{
+    if (!m_document->isStaging())
+    {
+        return false;
+    }
+
+    m_document->recolor(start, length, fmt);
+    return true;
+}
+
 void Console::closeEvent(QCloseEvent *e)
 {
     if (okToContinue())
@@ -308,8 +417,8 @@ void Console::mouseMoveEvent(QMouseEvent *e)
     {
         QPointF hitPos(e->pos().x(), fabs(e->pos().y() - ui->output->height()));
 
-        int pos = m_document->documentLayout()->hitTest(hitPos, Qt::FuzzyHit);
-        if (pos < 0)
+        LinePosition pos(m_document->documentLayout()->hitTest(hitPos));
+        if (!pos.isValid())
         {
             e->ignore();
             return;
@@ -343,7 +452,7 @@ void Console::mousePressEvent(QMouseEvent *e)
     {
         QPointF hitPos(e->pos().x(), fabs(e->pos().y() - ui->output->height()));
 
-        m_clickPos = m_document->documentLayout()->hitTest(hitPos, Qt::ExactHit);
+        m_clickPos = m_document->documentLayout()->hitTest(hitPos);
 
         m_mousePressed = true;
         m_selectionStart = m_clickPos;
@@ -405,20 +514,22 @@ void Console::mouseReleaseEvent(QMouseEvent *e)
         // TODO: don't clear selection when clicking within the selected text?
         QPointF hitPos(e->pos().x(), fabs(e->pos().y() - ui->output->height()));
 
-        if (m_document->documentLayout()->hitTest(hitPos, Qt::ExactHit) == m_clickPos)
+        if (m_document->documentLayout()->hitTest(hitPos) == m_clickPos)
         {
             m_document->selectNone();
 
-            m_selectionStart = 0;
-            m_selectionEnd = 0;
+            m_selectionStart = LinePosition();
+            m_selectionEnd = LinePosition();
         }
 
         m_mousePressed = false;
-        m_clickPos = -1;
+        m_clickPos = LinePosition();
     }
     else
     {
-        QString anchor(m_document->documentLayout()->anchorAt(e->pos()));
+        QPointF hitPos(e->pos().x(), fabs(e->pos().y() - ui->output->height()));
+
+        QString anchor(m_document->documentLayout()->anchorAt(hitPos));
         if (anchor != m_linkHovered)
         {
 
@@ -454,13 +565,37 @@ void Console::wheelEvent(QWheelEvent *e)
     e->accept();
 }
 
+void Console::payloadsReady()
+{
+    m_connection->acknowledgePayloads();
+
+    ConnectionPayload payload;
+    while (m_connection->readPayload(payload))
+    {
+        switch (payload.type)
+        {
+        case ConnectionPayload::Text:
+            m_document->process(payload.data);
+            break;
+
+        case ConnectionPayload::Prompt:
+            m_document->processPrompt(payload.data);
+            break;
+
+        case ConnectionPayload::Gmcp:
+            m_gmcpRouter.route(payload.data);
+            break;
+
+        case ConnectionPayload::Encoding:
+            m_document->setEncoding(payload.data);
+            break;
+        }
+    }
+}
 
 void Console::dataReceived(const QByteArray &data)
 {
     m_document->process(data);
-
-    updateScroll();
-    scrollToBottom();
 }
 
 void Console::processAccelerators(const QKeySequence &key)
@@ -567,10 +702,12 @@ void Console::processEvents(const QString &name, const QVariantList &args)
     }
 }
 
-void Console::processTriggers(QTextBlock block)
+void Console::processTriggers(const QString &text)
 {
+    // Each trigger sees the line as the ones before it left it
+    QString line(text);
+
     bool omitted = false;
-    QString text(block.text());
     QList<Trigger *> triggers(m_profile->rootGroup()->sortedTriggers());
     foreach (Trigger *trigger, triggers)
     {
@@ -578,7 +715,7 @@ void Console::processTriggers(QTextBlock block)
         bool keepEvaluating = trigger->keepEvaluating();
         int pos = 0;
 
-        while (pos < text.length())
+        while (pos < line.length())
         {
             if (!trigger->regex().isValid())
             {
@@ -587,7 +724,7 @@ void Console::processTriggers(QTextBlock block)
                 break;
             }
 
-            matched = trigger->match(text, pos);
+            matched = trigger->match(line, pos);
             if (matched)
             {
                 Group *previousGroup = m_profile->activeGroup();
@@ -615,7 +752,18 @@ void Console::processTriggers(QTextBlock block)
                 break;
             }
 
+            // A substitution in the match moves everything after it
             pos = trigger->matchEnd();
+            if (m_document->isStaging() && m_document->stagedText() != line)
+            {
+                pos += m_document->stagedText().length() - line.length();
+                line = m_document->stagedText();
+            }
+        }
+
+        if (m_document->isStaging())
+        {
+            line = m_document->stagedText();
         }
 
         if (matched && !keepEvaluating)
@@ -685,6 +833,10 @@ void Console::connectionEstablished()
 
     printInfo(tr("Connected to %1:%2.").arg(m_profile->address()).arg(m_profile->port()));
 
+    m_reconnectDelay = RECONNECT_DELAY_MIN;
+    m_reconnectTimer.stop();
+    m_replacingSession = false;
+
     emit connectionStatusChanged(true);
 }
 
@@ -701,6 +853,47 @@ void Console::connectionLost()
           .arg(duration % 1000, 3, 10, QLatin1Char('0')));
 
     emit connectionStatusChanged(false);
+
+    if (m_replacingSession)
+    {
+        m_replacingSession = false;
+        return;
+    }
+
+    scheduleReconnect();
+}
+
+void Console::connectionFailed(const QString &reason)
+{
+    qCDebug(MUDDER_NETWORK) << "Connection failed:" << reason;
+
+    printInfo(tr("Unable to connect to %1:%2: %3").arg(m_profile->address()).arg(m_profile->port()).arg(reason));
+
+    emit connectionStatusChanged(false);
+
+    scheduleReconnect();
+}
+
+void Console::scheduleReconnect()
+{
+    if (m_userDisconnect || !m_profile->autoReconnect() || m_reconnectTimer.isActive())
+    {
+        return;
+    }
+
+    printInfo(tr("Reconnecting in %1 seconds.").arg(m_reconnectDelay / 1000));
+
+    m_reconnectTimer.start(m_reconnectDelay);
+
+    // Back off so a server that's down for a while isn't hammered
+    m_reconnectDelay = qMin(m_reconnectDelay * 2, RECONNECT_DELAY_MAX);
+}
+
+void Console::reconnect()
+{
+    qCDebug(MUDDER_NETWORK) << "Reconnecting to" << m_profile->address() << m_profile->port();
+
+    connectToServer();
 }
 
 void Console::lookupComplete(const QHostInfo &hostInfo)
@@ -724,32 +917,213 @@ void Console::echoToggled(bool on)
 }
 
 void Console::scrollbarMoved(int pos)
+{
+    m_document->documentLayout()->scrollTo(pos);
+    m_scheduler->schedule();
+}
+
+// The scrollbar shows where the layout has the view, in pixels
+void Console::updateScroll()
+{
+    const ConsoleDocumentLayout *layout = m_document->documentLayout();
+
+    ui->scrollbar->setRange(0, qCeil(layout->maximumScroll()));
+    ui->scrollbar->setPageStep(qMax(1, int(layout->viewportHeight())));
+    ui->scrollbar->setSingleStep(qMax(1, qRound(layout->lineSpacing())));
+
+    moveScroll(qRound(layout->scrollPosition()));
+}
+
+void Console::outputChanged()
+{
+    m_scheduler->schedule();
+}
+
+// The view stays on the line it was on, or at the bottom, however much came in
+// or dropped off the top; the scrollbar catches up once lines are in place
+void Console::renderFrame()
+{
+    ui->output->refresh();
+
+    updateScroll();
+}
+
+// Sets the scrollbar without it counting as the user scrolling
+void Console::moveScroll(int position)
 {
     disconnect(ui->scrollbar, SIGNAL(valueChanged(int)), this, SLOT(scrollbarMoved(int)));
 
-    scrollTo(pos);
+    ui->scrollbar->setValue(position);
 
     connect(ui->scrollbar, SIGNAL(valueChanged(int)), SLOT(scrollbarMoved(int)));
 }
 
-void Console::updateScroll()
+void Console::redrawOutput()
+{
+    m_document->documentLayout()->markDirty();
+    m_scheduler->schedule();
+}
+
+void Console::copy()
+{
+    QApplication::clipboard()->setText(m_document->selectedText());
+
+    m_document->selectNone();
+}
+
+void Console::startSearch()
+{
+    const QString text(m_searchWidget->currentSearchString());
+
+    m_searchPattern.clear();
+    m_searchLine = -1;
+
+    if (text.isEmpty())
+    {
+        m_document->search()->stop();
+        m_searchWidget->clearInfoText();
+        redrawOutput();
+        return;
+    }
+
+    QString pattern;
+    QStringList literals;
+    switch (m_searchWidget->patternSyntax())
+    {
+    case SearchWidget::RegEx:
+        pattern = text;
+        literals = TrigramIndex::requiredLiterals(text);
+        break;
+
+    case SearchWidget::RegFixedString:
+        pattern = QRegularExpression::escape(text);
+        literals << text;
+        break;
+
+    default:
+        // * and ? as in QRegExp::Wildcard; the runs between them are literal
+        {
+            QString literal;
+            foreach (const QChar &ch, text)
+            {
+                if (ch == '*' || ch == '?')
+                {
+                    pattern.append(QRegularExpression::escape(literal));
+                    pattern.append(ch == '*' ? ".*" : ".");
+                    literals << literal;
+                    literal.clear();
+                }
+                else
+                {
+                    literal.append(ch);
+                }
+            }
+            pattern.append(QRegularExpression::escape(literal));
+            literals << literal;
+        }
+        break;
+    }
+
+    if (m_searchWidget->wholeWordsOnly())
+    {
+        pattern = QString("\\b(?:%1)\\b").arg(pattern);
+    }
+
+    QRegularExpression regex(pattern);
+    if (!m_searchWidget->caseSensitive())
+    {
+        regex.setPatternOptions(QRegularExpression::CaseInsensitiveOption);
+    }
+
+    if (!regex.isValid())
+    {
+        m_document->search()->stop();
+        m_searchWidget->setInfoText(tr("Invalid pattern"));
+        redrawOutput();
+        return;
+    }
+
+    m_searchPattern = text;
+    m_document->search()->start(regex, literals);
+    redrawOutput();
+}
+
+void Console::searchProgress(int matches, bool finished)
 {
-    if (ui->output->documentLayout())
+    if (finished)
     {
-        ui->scrollbar->setRange(1, ui->output->documentLayout()->documentSize().height());
+        m_searchWidget->setInfoText(tr("%n match(es)", 0, matches));
     }
     else
     {
-        ui->scrollbar->setRange(1, 1);
+        m_searchWidget->setInfoText(tr("%n match(es) so far", 0, matches));
+    }
+
+    // Find as you type: jump to the newest match as soon as there is one
+    if (m_searchLine < 0 && matches > 0)
+    {
+        findPrevious();
     }
-    ui->scrollbar->setPageStep(10);
+
+    redrawOutput();
 }
 
-void Console::copy()
+void Console::findNext()
 {
-    QApplication::clipboard()->setText(m_document->toPlainText(m_document->selection()));
+    // The widget asks for the next match as the text changes, before the search restarts
+    if (m_searchPattern.isEmpty() || m_searchPattern != m_searchWidget->currentSearchString())
+    {
+        return;
+    }
 
-    m_document->selectNone();
+    const ScrollbackSearch *search = m_document->search();
+    qint64 line = search->nextLine(m_searchLine);
+    if (line < 0)
+    {
+        line = search->nextLine(-1);
+    }
+    showMatch(line);
+}
+
+void Console::findPrevious()
+{
+    if (m_searchPattern.isEmpty() || m_searchPattern != m_searchWidget->currentSearchString())
+    {
+        return;
+    }
+
+    const ScrollbackSearch *search = m_document->search();
+    const qint64 end = m_document->lines().lastLine() + 1;
+    qint64 line = search->previousLine(m_searchLine < 0 ? end : m_searchLine);
+    if (line < 0)
+    {
+        line = search->previousLine(end);
+    }
+    showMatch(line);
+}
+
+void Console::hideSearch()
+{
+    m_searchWidget->hide();
+    m_document->search()->stop();
+    m_searchPattern.clear();
+    m_searchLine = -1;
+
+    redrawOutput();
+    ui->input->setFocus();
+}
+
+void Console::showMatch(qint64 line)
+{
+    const LineBuffer &lines = m_document->lines();
+    if (!lines.contains(line))
+    {
+        return;
+    }
+
+    // Keep a few lines below the match in view
+    m_searchLine = line;
+    scrollTo(qRound(m_document->documentLayout()->bottomPosition(qMin(line + 3, lines.lastLine()))));
 }
 
 void Console::copyHtml()
@@ -758,38 +1132,59 @@ void Console::copyHtml()
     QColor fg(m_profile->foreground());
     QColor bg(m_profile->background());
 
-    QString html(QString("<!DOCTYPE HTML PUBLIC '-//W3C//DTD HTML 4.01//EN' 'http://www.w3.org/TR/html4/strict.dtd'>\n"
-        "<html>\n"
-        " <head>\n"
-        "  <style>\n"
-        "  <!--\n"
-        "   body { font-family: '%1', 'Courier New', 'Monospace', 'Courier'; }\n"
-        "   body { font-size: %2pt; }\n"
-        "   body { white-space: pre-wrap; }\n"
-        "   body { color: %3; }\n"
-        "   body { background-color: %4; }\n"
-        "  -->\n"
-        "  </style>\n"
-        "  <title>%5 (%6)</title>\n"
-        "  <meta http-equiv='content-type' content='text/html; charset=utf-8'>\n"
-        " </head>\n"
-        " <body>\n"
-        "%7\n"
-        " </body>\n"
-        "</html>\n")
-        .arg(font.family())
-        .arg(font.pointSize())
-        .arg(fg.name())
-        .arg(bg.name())
-        .arg(windowTitle().remove("[*]"))
-        .arg(QDateTime::currentDateTime().toString())
-        .arg(m_document->toHtml(m_document->selection(), fg, bg, font)));
+    const QString title(QString("%1 (%2)").arg(windowTitle().remove("[*]")).arg(QDateTime::currentDateTime().toString()));
+
+    QString html(m_document->selectedHtml(title, fg, bg, font));
 
     QApplication::clipboard()->setText(html);
 
     m_document->selectNone();
 }
 
+void Console::exportScrollback()
+{
+    if (m_export && m_export->isRunning())
+    {
+        return;
+    }
+
+    QString fileName(QFileDialog::getSaveFileName(this, tr("Export Scrollback"), QString(),
+                                                  tr("HTML files (*.html *.htm);;Text files (*.txt)")));
+    if (fileName.isEmpty())
+    {
+        return;
+    }
+
+    if (!m_export)
+    {
+        m_export = new ScrollbackExport(m_document, this);
+        connect(m_export, SIGNAL(finished(bool,QString)), SLOT(exportFinished(bool,QString)));
+    }
+
+    QProgressDialog *dlg = new QProgressDialog(tr("Exporting scrollback..."), tr("Cancel"), 0, 100, this);
+    dlg->setAttribute(Qt::WA_DeleteOnClose);
+    dlg->setMinimumDuration(500);
+    connect(m_export, SIGNAL(progress(int)), dlg, SLOT(setValue(int)));
+    connect(m_export, SIGNAL(finished(bool,QString)), dlg, SLOT(close()));
+    connect(dlg, SIGNAL(canceled()), m_export, SLOT(cancel()));
+
+    const bool html = !fileName.endsWith(".txt", Qt::CaseInsensitive);
+    const QString title(QString("%1 (%2)").arg(windowTitle().remove("[*]")).arg(QDateTime::currentDateTime().toString()));
+    m_export->start(fileName, html, title, m_profile->foreground(), m_profile->background(), m_profile->outputFont());
+}
+
+void Console::exportFinished(bool ok, const QString &error)
+{
+    if (ok)
+    {
+        printInfo(tr("Scrollback exported."));
+    }
+    else if (!error.isEmpty())
+    {
+        printWarning(tr("Scrollback export failed: %1").arg(error));
+    }
+}
+
 bool Console::okToContinue()
 {
     if (isWindowModified())
@@ -841,6 +1236,27 @@ void Console::setCurrentFile(const QString &fileName)
     setWindowModified(false);
 }
 
+void Console::openScrollback()
+{
+    if (m_isUntitled || !m_profile->scrollbackFile())
+    {
+        return;
+    }
+
+    QFileInfo info(m_fileName);
+    QString fileName(info.absoluteDir().filePath(info.completeBaseName() + ".scrollback"));
+
+    qCDebug(MUDDER_PROFILE) << "Scrollback: filename =" << fileName;
+
+    if (!m_document->attachScrollback(fileName, qint64(m_profile->scrollbackFileSize()) * 1024 * 1024))
+    {
+        printWarning(tr("Unable to open the output buffer file %1").arg(fileName));
+        return;
+    }
+
+    scrollToBottom();
+}
+
 bool Console::readFile(const QString &fileName)
 {
     QFile file(fileName);
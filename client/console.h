@@ -25,10 +25,13 @@
 #define CONSOLE_H
 
 #include "connection.h"
+#include "gmcprouter.h"
+#include "linebuffer.h"
 #include "profile.h"
 #include <QCloseEvent>
 #include <QHostInfo>
-#include <QTextBlock>
+#include <QThread>
+#include <QTimer>
 #include <QWidget>
 
 namespace Ui {
@@ -37,6 +40,9 @@ class Console;
 
 class ConsoleDocument;
 class Engine;
+class RenderScheduler;
+class ScrollbackExport;
+class SearchWidget;
 
 class Console : public QWidget
 {
@@ -54,6 +60,9 @@ public:
     static Console * openFile(const QString &fileName, QWidget *parent = 0);
 
     Profile * profile() { return m_profile; }
+    Connection * connection() { return m_connection; }
+    GmcpRouter * gmcpRouter() { return &m_gmcpRouter; }
+    RenderScheduler * renderScheduler() { return m_scheduler; }
 
     void connectToServer();
     void disconnectFromServer();
@@ -67,7 +76,7 @@ public:
 
     void scrollUp(int lines);
     void scrollDown(int lines);
-    void scrollTo(int line);
+    void scrollTo(int position);
     void scrollToTop();
     void scrollToBottom();
 
@@ -80,10 +89,19 @@ public:
 
     bool send(const QString &cmd, bool show = true);
     bool sendAlias(const QString &cmd);
+    bool sendSpeedwalk(const QString &path, bool show = true);
     bool sendGmcp(const QString &msg, const QString &data = QString());
 
     void deleteLines(int count);
 
+    // Only while the triggers are looking at a line
+    void gagLine();
+    bool substitute(int start, int length, const QString &text);
+    bool recolor(int start, int length, const QTextCharFormat &fmt);
+
+    void showSearch();
+    void exportScrollback();
+
 signals:
     void connectionStatusChanged(bool connected);
     void modified();
@@ -96,11 +114,12 @@ protected:
     virtual void wheelEvent(QWheelEvent *e);
 
 public slots:
+    void payloadsReady();
     void dataReceived(const QByteArray &data);
     void processAccelerators(const QKeySequence &key);
     void processAliases(const QString &cmd);
     void processEvents(const QString &name, const QVariantList &args);
-    void processTriggers(QTextBlock block);
+    void processTriggers(const QString &text);
     void processTimer(Timer *timer);
 
 private slots:
@@ -109,19 +128,34 @@ private slots:
     void scriptEntered(const QString &code);
     void connectionEstablished();
     void connectionLost();
+    void connectionFailed(const QString &reason);
+    void reconnect();
     void lookupComplete(const QHostInfo &hostInfo);
     void echoToggled(bool on);
     void scrollbarMoved(int pos);
     void updateScroll();
+    void outputChanged();
+    void renderFrame();
     void copy();
     void copyHtml();
+    void startSearch();
+    void searchProgress(int matches, bool finished);
+    void findNext();
+    void findPrevious();
+    void hideSearch();
+    void exportFinished(bool ok, const QString &error);
 
 private:
     bool okToContinue();
     bool saveFile(const QString &fileName);
     void setCurrentFile(const QString &fileName);
     bool readFile(const QString &fileName);
+    void openScrollback();
     bool writeFile(const QString &fileName);
+    void scheduleReconnect();
+    void showMatch(qint64 line);
+    void redrawOutput();
+    void moveScroll(int position);
 
     Ui::Console *ui;
 
@@ -133,14 +167,30 @@ private:
     Engine *m_engine;
     Profile *m_profile;
     Connection *m_connection;
+    QThread *m_networkThread;
+    GmcpRouter m_gmcpRouter;
+
+    // The display is drawn a frame at a time, however fast the output comes
+    RenderScheduler *m_scheduler;
+
+    QTimer m_reconnectTimer;
+    int m_reconnectDelay;
+    bool m_userDisconnect;
+    bool m_replacingSession;
 
     bool m_echoOn;
 
     QString m_linkHovered;
     bool m_mousePressed;
-    int m_selectionStart;
-    int m_selectionEnd;
-    int m_clickPos;
+    LinePosition m_selectionStart;
+    LinePosition m_selectionEnd;
+    LinePosition m_clickPos;
+
+    SearchWidget *m_searchWidget;
+    QString m_searchPattern;
+    qint64 m_searchLine;
+
+    ScrollbackExport *m_export;
 };
 
 #endif // CONSOLE_H
@@ -22,13 +22,17 @@
 
 
 #include "consoledisplay.h"
+#include <QElapsedTimer>
 #include <QPainter>
+#include <QResizeEvent>
 
 ConsoleDisplay::ConsoleDisplay(QWidget *parent) :
     QWidget(parent)
 {
     m_document = 0;
-    m_scrollLines = 0;
+
+    // Every paint covers what it's given, which lets scrolling copy pixels instead of repainting
+    setAttribute(Qt::WA_OpaquePaintEvent);
 
     QPalette pal(palette());
     pal.setBrush(QPalette::Base, Qt::black);
@@ -44,37 +48,49 @@ ConsoleDocumentLayout *ConsoleDisplay::documentLayout()
         return 0;
     }
 
-    return qobject_cast<ConsoleDocumentLayout*>(m_document->documentLayout());
+    return m_document->documentLayout();
+}
+
+// Brings the display up to date with as little painting as it can: what's
+// already there is shifted when the view scrolls, so only lines that weren't
+// on screen before, or that changed, are drawn
+void ConsoleDisplay::refresh()
+{
+    if (!m_document)
+    {
+        return;
+    }
+
+    const LayoutDamage damage(m_document->documentLayout()->takeDamage());
+    if (damage.scroll != 0)
+    {
+        scroll(0, damage.scroll, damage.area);
+    }
+
+    if (!damage.dirty.isEmpty())
+    {
+        update(damage.dirty);
+    }
 }
 
 void ConsoleDisplay::paintEvent(QPaintEvent *e)
 {
-    Q_UNUSED(e)
+    QElapsedTimer timer;
+    timer.start();
 
     QPainter painter(this);
-    painter.fillRect(rect(), palette().window());
+    painter.setClipRect(e->rect());
+    painter.setBackground(palette().window());
+    painter.fillRect(e->rect(), palette().window());
 
     if (!m_document)
     {
         return;
     }
 
-    QVector<QAbstractTextDocumentLayout::Selection> selections;
-    if (m_document->hasSelection())
-    {
-        QAbstractTextDocumentLayout::Selection selection;
-        selection.cursor = m_document->selection();
-        selection.format = m_document->formatSelection();
-        selections.append(selection);
-    }
+    m_document->documentLayout()->draw(&painter, viewport());
 
-    QAbstractTextDocumentLayout::PaintContext ctx;
-    ctx.clip = rect().marginsRemoved(QMargins(2, 2, 2, 2));
-    ctx.selections = selections;
-    ctx.palette = palette();
-    ctx.cursorPosition = m_scrollLines;
-
-    m_document->documentLayout()->draw(&painter, ctx);
+    emit painted(timer.nsecsElapsed() / 1000);
 }
 
 void ConsoleDisplay::resizeEvent(QResizeEvent *e)
@@ -83,6 +99,8 @@ void ConsoleDisplay::resizeEvent(QResizeEvent *e)
     {
         documentLayout()->setTextWidth(e->size().width());
     }
+
+    documentLayout()->setViewportHeight(viewport().height());
 }
 
 void ConsoleDisplay::optionChanged(const QString &key, const QVariant &val)
@@ -24,7 +24,6 @@
 #ifndef CONSOLEDISPLAY_H
 #define CONSOLEDISPLAY_H
 
-#include <QAbstractTextDocumentLayout>
 #include <QVariant>
 #include <QWidget>
 #include "consoledocument.h"
@@ -38,11 +37,13 @@ public:
 
     void setDocument(ConsoleDocument *doc) { m_document = doc; }
 
-    void setScrollLines(int lines) { m_scrollLines = lines; }
-    int scrollLines() const { return m_scrollLines; }
-
     ConsoleDocumentLayout * documentLayout();
 
+    void refresh();
+
+signals:
+    void painted(qint64 usecs);
+
 protected:
     virtual void paintEvent(QPaintEvent *e);
     virtual void resizeEvent(QResizeEvent *e);
@@ -51,9 +52,9 @@ private slots:
     void optionChanged(const QString &key, const QVariant &val);
 
 private:
-    ConsoleDocument *m_document;
+    QRect viewport() const { return rect().marginsRemoved(QMargins(2, 2, 2, 2)); }
 
-    int m_scrollLines;
+    ConsoleDocument *m_document;
 };
 
 #endif // CONSOLEDISPLAY_H
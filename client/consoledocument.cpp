@@ -21,40 +21,75 @@
 */
 
 
-#include <QTextBlock>
-#include <QTextDocumentFragment>
 #include "consoledocument.h"
 #include "consoledocumentlayout.h"
+#include "htmlwriter.h"
+#include "scrollbacksearch.h"
 #include "logging.h"
+#include "bytescan.h"
+#include <QDataStream>
+#include <cstring>
+
+static const char ESC = '\x1B';
+static const char ANSI_START = '[';
+static const char ANSI_SEPARATOR = ';';
+static const char ANSI_END = 'm';
+static const char CR = '\r';
+static const char LF = '\n';
+
+// Keeps a run of digits from overflowing
+static const int MAX_ANSI_VALUE = 65535;
+
+// Used for the first 16 entries of the 256 colour palette too
+static const QRgb ANSI_COLORS[16] =
+{
+    0xFF000000, 0xFF800000, 0xFF008000, 0xFF808000, 0xFF000080, 0xFF800080, 0xFF008080, 0xFFC0C0C0,
+    0xFF808080, 0xFFFF0000, 0xFF00FF00, 0xFFFFFF00, 0xFF0000FF, 0xFFFF00FF, 0xFF00FFFF, 0xFFFFFFFF
+};
+
+// xterm's 6x6x6 cube steps
+static const int ANSI_CUBE_LEVELS[6] = { 0, 95, 135, 175, 215, 255 };
+
+static QRgb paletteColor(int index)
+{
+    if (index < 16)
+    {
+        return ANSI_COLORS[index];
+    }
+
+    if (index < 232)
+    {
+        index -= 16;
+        return qRgb(ANSI_CUBE_LEVELS[index / 36], ANSI_CUBE_LEVELS[(index / 6) % 6], ANSI_CUBE_LEVELS[index % 6]);
+    }
 
-static const QLatin1Char ESC('\x1B');
-static const QLatin1Char ANSI_START('[');
-static const QLatin1Char ANSI_SEPARATOR(';');
-static const QLatin1Char ANSI_END('m');
-static const QLatin1Char GA('\xFF');
-static const QLatin1Char CR('\r');
-static const QLatin1Char LF('\n');
-static const QString CRLF(QString(CR) + QString(LF));
-static const QString CRLFGA(CRLF + GA);
-static const QString DIGITS("0123456789");
+    const int level = 8 + (index - 232) * 10;
+    return qRgb(level, level, level);
+}
 
 ConsoleDocument::ConsoleDocument(QObject *parent) :
-    QTextDocument(parent),
-    m_cursor(this),
-    m_selection(this)
+    QObject(parent)
 {
-    m_gotESC = false;
-    m_gotHeader = false;
+    m_ansiState = AnsiNone;
+    m_ansiCount = 0;
+    m_ansiPrivate = false;
+
+    m_committing = false;
+
+    m_formatTableStale = false;
 
-    m_waitHighColorMode = false;
-    m_fgHighColorMode = false;
-    m_bgHighColorMode = false;
     m_isPrompt = false;
     m_omit = false;
 
+    m_staging = false;
+    m_stagedChanged = false;
+
     m_formatSelection.setForeground(QColor("gainsboro"));
     m_formatSelection.setBackground(QColor("dodgerblue"));
 
+    m_formatHighlight.setForeground(Qt::black);
+    m_formatHighlight.setBackground(QColor("gold"));
+
     m_formatCommand.setForeground(Qt::darkYellow);
     m_formatCommand.setBackground(Qt::NoBrush);
 
@@ -71,353 +106,919 @@ ConsoleDocument::ConsoleDocument(QObject *parent) :
     m_formatDefault.setForeground(Qt::lightGray);
     m_formatDefault.setBackground(Qt::NoBrush);
 
-    m_formatCurrent = m_formatDefault;
+    m_formatCurrent = styleFormat(m_style);
 
-    m_cursor.setCharFormat(m_formatCurrent);
+    // There is always a line to write into, as with an empty QTextDocument
+    m_lines.appendLine();
 
-    setDocumentLayout(new ConsoleDocumentLayout(this));
+    m_layout = new ConsoleDocumentLayout(this);
+    m_search = new ScrollbackSearch(this);
 }
 
-QString ConsoleDocument::toPlainText(int start, int stop)
+ConsoleDocument::~ConsoleDocument()
 {
-    QTextCursor cursor(this);
-    cursor.setPosition(qMax(start, 0));
-    cursor.setPosition(qMin(stop, characterCount() - 1), QTextCursor::KeepAnchor);
+    // The buffer writes out what's only in memory as it closes the file
+    flushFormatTable();
+}
+
+void ConsoleDocument::setMaximumLines(int lines)
+{
+    m_lines.setMaximumLines(lines);
 
-    return toPlainText(cursor);
+    emit contentsChanged();
 }
 
-QString ConsoleDocument::toPlainText(QTextCursor cur)
+bool ConsoleDocument::attachScrollback(const QString &fileName, qint64 maximumSize)
 {
-    if (cur.isNull())
+    const int existing = m_lines.count();
+
+    m_lines.setFileTable(formatTable());
+    if (!m_lines.attachFile(fileName, maximumSize))
     {
-        cur = QTextCursor(this);
-        cur.select(QTextCursor::Document);
+        return false;
     }
 
-    return cur.selection().toPlainText();
+    // Format ids are only good for the session that made them
+    const QList<QByteArray> &tables = m_lines.restoredTables();
+    for (int n = 0; n < tables.size(); n++)
+    {
+        m_lines.setTableMap(n, restoreFormats(tables.at(n)));
+    }
+    m_lines.setFileTable(formatTable());
+    m_formatTableStale = false;
+
+    // Lines already here were renumbered to follow the restored ones; the
+    // restored lines aren't indexed and a search reads them straight through
+    m_search->stop();
+    m_index.clear();
+    reindex(m_lines.lastLine() - existing + 1);
+
+    m_selectionStart = LinePosition();
+    m_selectionEnd = LinePosition();
+    m_layout->invalidate();
+
+    emit contentsChanged();
+
+    return true;
 }
 
-QString ConsoleDocument::toHtml(int start, int stop, const QColor &fg, const QColor &bg, const QFont &font)
+QString ConsoleDocument::selectedText() const
 {
-    QTextCursor cursor(this);
-    cursor.setPosition(qMax(start, 0));
-    cursor.setPosition(qMin(stop, characterCount() - 1), QTextCursor::KeepAnchor);
+    QString text;
+    if (!hasSelection())
+    {
+        return text;
+    }
+
+    const qint64 first = qMax(m_selectionStart.line, m_lines.firstLine());
+    const qint64 last = qMin(m_selectionEnd.line, m_lines.lastLine());
 
-    return toHtml(cursor, fg, bg, font);
+    for (qint64 line = first; line <= last; line++)
+    {
+        QString lineText(m_lines.text(line));
+
+        const int start = line == m_selectionStart.line ? m_selectionStart.column : 0;
+        const int stop = line == m_selectionEnd.line ? m_selectionEnd.column : lineText.length();
+
+        text.append(lineText.mid(start, stop - start));
+        if (line < last)
+        {
+            text.append('\n');
+        }
+    }
+
+    return text;
 }
 
-QString ConsoleDocument::toHtml(QTextCursor cur, const QColor &fg, const QColor &bg, const QFont &font)
+QString ConsoleDocument::selectedHtml(const QString &title, const QColor &fg, const QColor &bg, const QFont &font) const
 {
-    if (cur.isNull())
+    if (!hasSelection())
     {
-        cur = QTextCursor(this);
-        cur.select(QTextCursor::Document);
+        return QString();
     }
 
-    QString text;
-    if (!cur.hasSelection())
+    const qint64 first = qMax(m_selectionStart.line, m_lines.firstLine());
+    const qint64 last = qMin(m_selectionEnd.line, m_lines.lastLine());
+
+    HtmlWriter writer(m_formats, fg, bg, font);
+
+    // The stylesheet only lists the classes the selection used, so it's written last
+    QString body;
+    for (qint64 line = first; line <= last; line++)
     {
-        return text;
+        const int start = line == m_selectionStart.line ? m_selectionStart.column : 0;
+        const int stop = line == m_selectionEnd.line ? m_selectionEnd.column : -1;
+        writer.writeLine(body, m_lines.text(line), m_lines.runs(line), start, stop);
+
+        if (line < last)
+        {
+            body.append("\n");
+        }
+    }
+
+    return writer.header(title) + body + HtmlWriter::footer();
+}
+
+void ConsoleDocument::deleteLines(int count)
+{
+    if (count < 1)
+    {
+        return;
     }
 
-    bool bold = false;
-    bool italics = false;
-    bool underline = false;
-    bool opened = false;
+    qint64 last = m_lines.lastLine();
+    if (m_staging)
+    {
+        // The line the triggers are looking at counts as the last one; the
+        // open line only holds the start of it
+        omit();
+        count--;
+        last--;
+    }
+    else if (!m_isPrompt)
+    {
+        // The open line after a finished one is still empty, so it stays
+        last--;
+    }
 
-    QColor background(bg);
-    QColor foreground(fg);
-    QFont fonted(font);
+    if (count > 0)
+    {
+        removeLines(last - count + 1, count);
+    }
 
-    int selectionStart = cur.selectionStart();
-    int selectionEnd = cur.selectionEnd();
+    emit contentsChanged();
+}
+
+void ConsoleDocument::removeLines(qint64 first, int count)
+{
+    qCDebug(MUDDER_DOCUMENT) << "Delete lines" << first << count;
 
-    cur.setPosition(selectionStart);
-    while (cur.position() < selectionEnd && !cur.atEnd())
+    m_lines.remove(first, count);
+    m_layout->removeLines(first, count);
+
+    // Later lines moved up to fill the gap
+    m_search->linesRemoved(first);
+    reindex(first);
+
+    if (m_lines.isEmpty() || first > m_lines.lastLine())
     {
-        QChar ch(characterAt(cur.position()));
+        // The line being written went too
+        appendLine();
+        m_isPrompt = false;
+    }
+}
 
-        cur.setPosition(cur.position() + 1);
-        if (ch.toLatin1() == 0)
+void ConsoleDocument::process(const QByteArray &data)
+{
+    if (m_committing)
+    {
+        processNested(data);
+        return;
+    }
+
+    lex(data.constData(), data.length(), m_decoder);
+
+    m_committing = true;
+    commitRuns();
+    m_committing = false;
+}
+
+// The server ended a prompt with telnet GA or EOR, so the open line ends here without a newline
+void ConsoleDocument::processPrompt(const QByteArray &data)
+{
+    if (m_committing)
+    {
+        processNested(data);
+        return;
+    }
+
+    lex(data.constData(), data.length(), m_decoder);
+
+    m_runs.append(TextRun(m_text, m_formatCurrent, TextRun::Prompt));
+    m_text.clear();
+
+    m_committing = true;
+    commitRuns();
+    m_committing = false;
+}
+
+// Text a trigger simulates arrives while the chunk that set it off is going
+// in, with the tail of that chunk still in the lexer: an unfinished line, an
+// escape or a character cut short. The simulated text is lexed on its own so
+// it neither joins nor finishes any of them, and its styles don't carry over.
+void ConsoleDocument::processNested(const QByteArray &data)
+{
+    QString text;
+    text.swap(m_text);
+
+    const AnsiState ansiState = m_ansiState;
+    int ansiParameters[MAX_ANSI_PARAMETERS];
+    memcpy(ansiParameters, m_ansiParameters, sizeof(ansiParameters));
+    const int ansiCount = m_ansiCount;
+    const bool ansiPrivate = m_ansiPrivate;
+    const AnsiStyle style(m_style);
+    const int formatCurrent = m_formatCurrent;
+
+    m_ansiState = AnsiNone;
+    m_ansiCount = 0;
+    m_ansiPrivate = false;
+
+    // Starts with nothing pending, in whatever encoding the server text is in
+    m_nestedDecoder.setEncoding(m_decoder.encoding());
+
+    lex(data.constData(), data.length(), m_nestedDecoder);
+
+    // Whatever the simulated text left unfinished goes in as it is
+    if (!m_text.isEmpty())
+    {
+        m_runs.append(TextRun(m_text, m_formatCurrent));
+    }
+
+    m_text = text;
+    m_ansiState = ansiState;
+    memcpy(m_ansiParameters, ansiParameters, sizeof(ansiParameters));
+    m_ansiCount = ansiCount;
+    m_ansiPrivate = ansiPrivate;
+    m_style = style;
+    m_formatCurrent = formatCurrent;
+
+    commitRuns();
+}
+
+void ConsoleDocument::lex(const char *bytes, int length, StreamDecoder &decoder)
+{
+    int pos = 0;
+    while (pos < length)
+    {
+        if (m_ansiState != AnsiNone)
         {
+            pos = processEscape(bytes, pos, length);
             continue;
         }
 
-        QTextCharFormat fmt(cur.charFormat());
-        bool boldNow = fmt.fontWeight() >= QFont::Bold;
-        bool italicsNow = fmt.fontItalic();
-        bool underlineNow = fmt.fontUnderline();
-        QColor backgroundNow(fmt.background() != Qt::NoBrush?fmt.background().color():bg);
-        QColor foregroundNow(fmt.foreground() != Qt::NoBrush?fmt.foreground().color():fg);
-        QFont fontNow(fmt.font());
+        // Everything up to the next control byte is plain text; escapes and line ends are
+        // all ASCII, so they can't sit inside a multi-byte character and the bytes in
+        // between go to the decoder whole
+        const int next = pos + ByteScan::findAny(bytes + pos, length - pos, ESC, CR, LF);
+        decoder.decode(bytes + pos, next - pos, m_text);
 
-        if (bold != boldNow ||
-            italics != italicsNow ||
-            underline != underlineNow ||
-            background != backgroundNow ||
-            foreground != foregroundNow ||
-            fonted != fontNow)
+        if (next >= length)
         {
-            if (opened)
-            {
-                text.append("</span>");
-            }
+            break;
+        }
 
-            QString style("<span style='");
-            if (backgroundNow != bg)
-            {
-                style.append(QString("background: %1; ").arg(backgroundNow.name()));
-            }
-            if (foregroundNow != fg)
-            {
-                style.append(QString("color: %1; ").arg(foregroundNow.name()));
-            }
-            if (fontNow.family() != font.family())
-            {
-                style.append(QString("font-family: %1; ").arg(fontNow.family()));
-            }
-            if (fontNow.pointSize() != font.pointSize())
-            {
-                style.append(QString("font-size: %1pt; ").arg(fontNow.pointSize()));
-            }
-            if (boldNow)
+        switch (bytes[next])
+        {
+        case ESC:
+            m_ansiState = AnsiEscape;
+            break;
+
+        default:
+            m_runs.append(TextRun(m_text, m_formatCurrent, TextRun::Line));
+            m_text.clear();
+        }
+
+        pos = next + 1;
+    }
+}
+
+void ConsoleDocument::setEncoding(const QByteArray &encoding)
+{
+    if (!m_decoder.setEncoding(encoding))
+    {
+        qCWarning(MUDDER_DOCUMENT) << "Unknown encoding:" << encoding;
+    }
+}
+
+int ConsoleDocument::processEscape(const char *data, int pos, int length)
+{
+    for (; pos < length; pos++)
+    {
+        const char ch = data[pos];
+
+        if (m_ansiState == AnsiEscape)
+        {
+            if (ch != ANSI_START)
             {
-                style.append("font-weight: bold; ");
+                // Not a control sequence, so the byte is read again as text
+                m_ansiState = AnsiNone;
+                return pos;
             }
-            if (italicsNow)
+
+            m_ansiState = AnsiParameters;
+            m_ansiCount = 0;
+            m_ansiParameters[0] = 0;
+            m_ansiPrivate = false;
+            continue;
+        }
+
+        if (ch >= '0' && ch <= '9')
+        {
+            if (m_ansiCount < MAX_ANSI_PARAMETERS)
             {
-                style.append("font-style: italics; ");
+                int &value = m_ansiParameters[m_ansiCount];
+                value = qMin(value * 10 + (ch - '0'), MAX_ANSI_VALUE);
             }
-            if (underlineNow)
+        }
+        else if (ch == ANSI_SEPARATOR)
+        {
+            if (++m_ansiCount < MAX_ANSI_PARAMETERS)
             {
-                style.append("font-decoration: underline; ");
+                m_ansiParameters[m_ansiCount] = 0;
             }
-            style.append("'>");
+        }
+        else if (ch >= 0x20 && ch <= 0x3F)
+        {
+            // Private or intermediate bytes, so whatever this is, it isn't SGR
+            m_ansiPrivate = true;
+        }
+        else if (ch >= 0x40 && ch <= 0x7E)
+        {
+            m_ansiState = AnsiNone;
 
-            if (style.contains(":"))
+            if (ch == ANSI_END && !m_ansiPrivate)
             {
-                text.append(style);
-                opened = true;
+                processSgr();
             }
 
-            bold = boldNow;
-            italics = italicsNow;
-            underline = underlineNow;
-            background = backgroundNow;
-            foreground = foregroundNow;
-            fonted = fontNow;
+            return pos + 1;
+        }
+        else
+        {
+            // A control byte cuts the sequence short and is handled as usual
+            m_ansiState = AnsiNone;
+            return pos;
         }
+    }
 
-        switch (ch.toLatin1())
+    return pos;
+}
+
+void ConsoleDocument::processSgr()
+{
+    // Text so far keeps the style it arrived in
+    if (!m_text.isEmpty())
+    {
+        m_runs.append(TextRun(m_text, m_formatCurrent));
+        m_text.clear();
+    }
+
+    const int count = qMin(m_ansiCount + 1, MAX_ANSI_PARAMETERS);
+    for (int n = 0; n < count; n++)
+    {
+        const int code = m_ansiParameters[n];
+        switch (code)
         {
-        case '<':
-            text.append("&lt;");
+        case 0:
+            m_style = AnsiStyle();
             break;
 
-        case '>':
-            text.append("&gt;");
+        case 1:
+            m_style.attributes |= AnsiStyle::Bold;
             break;
 
-        case '&':
-            text.append("&amp;");
+        case 2:
+            m_style.attributes |= AnsiStyle::Faint;
             break;
 
-        case '\'':
-            text.append("&apos;");
+        case 22:
+            m_style.attributes &= ~(AnsiStyle::Bold | AnsiStyle::Faint);
             break;
 
-        case '\"':
-            text.append("&quot;");
+        case 3:
+            m_style.attributes |= AnsiStyle::Italic;
             break;
 
-        default:
-            text.append(ch);
+        case 23:
+            m_style.attributes &= ~AnsiStyle::Italic;
             break;
+
+        case 4:
+            m_style.attributes |= AnsiStyle::Underline;
+            break;
+
+        case 24:
+            m_style.attributes &= ~AnsiStyle::Underline;
+            break;
+
+        case 7:
+            m_style.attributes |= AnsiStyle::Inverse;
+            break;
+
+        case 27:
+            m_style.attributes &= ~AnsiStyle::Inverse;
+            break;
+
+        case 38:
+            n += processExtendedColor(n, count, m_style.foreground);
+            break;
+
+        case 39:
+            m_style.foreground = AnsiStyle::Default;
+            break;
+
+        case 48:
+            n += processExtendedColor(n, count, m_style.background);
+            break;
+
+        case 49:
+            m_style.background = AnsiStyle::Default;
+            break;
+
+        default:
+            if (code >= 30 && code <= 37)
+            {
+                m_style.foreground = AnsiStyle::Palette | (code - 30);
+            }
+            else if (code >= 40 && code <= 47)
+            {
+                m_style.background = AnsiStyle::Palette | (code - 40);
+            }
+            else if (code >= 90 && code <= 97)
+            {
+                m_style.foreground = AnsiStyle::Palette | (code - 90 + 8);
+            }
+            else if (code >= 100 && code <= 107)
+            {
+                m_style.background = AnsiStyle::Palette | (code - 100 + 8);
+            }
         }
+    }
 
-        if (cur.atBlockEnd())
+    m_formatCurrent = styleFormat(m_style);
+}
+
+// 38;5;n picks from the 256 colour palette and 38;2;r;g;b is truecolor; returns how many parameters were used
+int ConsoleDocument::processExtendedColor(int pos, int count, quint32 &color)
+{
+    if (pos + 2 < count && m_ansiParameters[pos + 1] == 5)
+    {
+        color = AnsiStyle::Palette | qMin(m_ansiParameters[pos + 2], 255);
+        return 2;
+    }
+
+    if (pos + 4 < count && m_ansiParameters[pos + 1] == 2)
+    {
+        color = AnsiStyle::Rgb | (qMin(m_ansiParameters[pos + 2], 255) << 16) | (qMin(m_ansiParameters[pos + 3], 255) << 8) | qMin(m_ansiParameters[pos + 4], 255);
+        return 4;
+    }
+
+    // Malformed, so skip the rest rather than read the components as attributes
+    return count - pos - 1;
+}
+
+int ConsoleDocument::styleFormat(const AnsiStyle &style)
+{
+    QHash<AnsiStyle, int>::const_iterator it = m_styleFormats.constFind(style);
+    if (it != m_styleFormats.constEnd())
+    {
+        return it.value();
+    }
+
+    const int id = m_formats.size();
+    m_formats.append(buildStyleFormat(style));
+    m_styleFormats.insert(style, id);
+    internFormat(id);
+
+    return id;
+}
+
+QTextCharFormat ConsoleDocument::buildStyleFormat(const AnsiStyle &style) const
+{
+    QTextCharFormat fmt(m_formatDefault);
+
+    QBrush foreground(m_formatDefault.foreground());
+    if (style.foreground & AnsiStyle::Palette)
+    {
+        int index = style.foreground & 0xFF;
+
+        // Bold brightens the eight basic colours, as it always has here
+        if ((style.attributes & AnsiStyle::Bold) && index < 8)
         {
-            if (opened)
-            {
-                text.append("</span>");
+            index += 8;
+        }
+
+        foreground = QColor(paletteColor(index));
+    }
+    else if (style.foreground & AnsiStyle::Rgb)
+    {
+        foreground = QColor(QRgb(0xFF000000 | (style.foreground & 0xFFFFFF)));
+    }
+    else if (style.attributes & AnsiStyle::Bold)
+    {
+        foreground = QColor(ANSI_COLORS[15]);
+    }
+
+    if ((style.attributes & AnsiStyle::Faint) && foreground.style() != Qt::NoBrush)
+    {
+        // Half way to black, as most terminals draw it
+        const QColor c(foreground.color());
+        foreground = QColor(c.red() / 2, c.green() / 2, c.blue() / 2);
+    }
+
+    QBrush background(m_formatDefault.background());
+    if (style.background & AnsiStyle::Palette)
+    {
+        background = QColor(paletteColor(style.background & 0xFF));
+    }
+    else if (style.background & AnsiStyle::Rgb)
+    {
+        background = QColor(QRgb(0xFF000000 | (style.background & 0xFFFFFF)));
+    }
+
+    if (style.attributes & AnsiStyle::Inverse)
+    {
+        QBrush swapped(background.style() == Qt::NoBrush ? QBrush(Qt::black) : background);
+        background = foreground;
+        foreground = swapped;
+    }
+
+    fmt.setForeground(foreground);
+    fmt.setBackground(background);
+    fmt.setFontItalic(style.attributes & AnsiStyle::Italic);
+    fmt.setFontUnderline(style.attributes & AnsiStyle::Underline);
+
+    return fmt;
+}
+
+// QTextFormat has no qHash, but equal formats serialize the same
+static QByteArray formatKey(const QTextFormat &fmt)
+{
+    QByteArray key;
+    QDataStream out(&key, QIODevice::WriteOnly);
+    out << fmt;
+    return key;
+}
+
+// Notes, commands and every ColorMatch on every line come through here
+int ConsoleDocument::formatId(const QTextCharFormat &fmt)
+{
+    const QByteArray key(formatKey(fmt));
+
+    QHash<QByteArray, int>::const_iterator it = m_formatIds.constFind(key);
+    if (it != m_formatIds.constEnd())
+    {
+        return it.value();
+    }
+
+    const int id = m_formats.size();
+    m_formats.append(fmt);
+    m_formatIds.insert(key, id);
+    m_formatTableStale = true;
+
+    return id;
+}
+
+void ConsoleDocument::internFormat(int id)
+{
+    const QByteArray key(formatKey(m_formats.at(id)));
+
+    // The lowest id wins, as it would for a search from the start
+    if (!m_formatIds.contains(key))
+    {
+        m_formatIds.insert(key, id);
+    }
+    m_formatTableStale = true;
+}
+
+// Styles are saved as styles so they come back in the current colours
+QByteArray ConsoleDocument::formatTable() const
+{
+    QHash<int, AnsiStyle> styles;
+    QHash<AnsiStyle, int>::const_iterator it;
+    for (it = m_styleFormats.constBegin(); it != m_styleFormats.constEnd(); ++it)
+    {
+        styles.insert(it.value(), it.key());
+    }
+
+    QByteArray table;
+    QDataStream out(&table, QIODevice::WriteOnly);
+    out << quint32(m_formats.size());
+    for (int n = 0; n < m_formats.size(); n++)
+    {
+        QHash<int, AnsiStyle>::const_iterator style = styles.constFind(n);
+        if (style != styles.constEnd())
+        {
+            out << quint8(1) << style->foreground << style->background << style->attributes;
+        }
+        else
+        {
+            out << quint8(0) << m_formats.at(n);
+        }
+    }
+
+    return table;
+}
+
+// Serializing the table on every new format would cost a pass over all of
+// them each time; it only has to be current when a segment can be written
+void ConsoleDocument::flushFormatTable()
+{
+    if (!m_formatTableStale)
+    {
+        return;
+    }
+    m_formatTableStale = false;
+
+    if (m_lines.isAttached())
+    {
+        m_lines.setFileTable(formatTable());
+    }
+}
 
-                bold = false;
-                italics = false;
-                underline = false;
-                background = bg;
-                foreground = fg;
-                fonted = font;
+QVector<int> ConsoleDocument::restoreFormats(const QByteArray &table)
+{
+    QVector<int> map;
 
-                opened = false;
-            }
+    QDataStream in(table);
+    quint32 count = 0;
+    in >> count;
+    for (quint32 n = 0; n < count && in.status() == QDataStream::Ok; n++)
+    {
+        quint8 kind = 0;
+        in >> kind;
 
-            text.append("\n");
+        if (kind == 1)
+        {
+            AnsiStyle style;
+            in >> style.foreground >> style.background >> style.attributes;
+            map.append(styleFormat(style));
         }
-    }
+        else
+        {
+            QTextFormat saved;
+            in >> saved;
 
-    if (opened)
-    {
-        text.append("</span>");
+            QTextCharFormat fmt(saved.toCharFormat());
+            fmt.setFont(m_formatDefault.font());
+            map.append(formatId(fmt));
+        }
     }
 
-    return text;
+    return map;
 }
 
-void ConsoleDocument::deleteBlock(const QTextBlock &block)
+void ConsoleDocument::rebuildFormats()
 {
-    if (!block.isValid())
+    // Ids stay put, so every line already in the buffer picks up the change
+    for (int n = 0; n < m_formats.size(); n++)
     {
-        return;
+        m_formats[n].setFont(m_formatDefault.font());
     }
 
-    QTextCursor cur(block);
-    cur.select(QTextCursor::BlockUnderCursor);
-    if (cur.isNull() || !cur.hasSelection())
+    QHash<AnsiStyle, int>::const_iterator it;
+    for (it = m_styleFormats.constBegin(); it != m_styleFormats.constEnd(); ++it)
     {
-        return;
+        m_formats[it.value()] = buildStyleFormat(it.key());
     }
 
-    qCDebug(MUDDER_DOCUMENT) << "Deleting block" << block.blockNumber() << block.text();
-
-    // HACK: restore format
-    QTextCharFormat fmt(m_cursor.charFormat());
+    m_formatIds.clear();
+    for (int n = 0; n < m_formats.size(); n++)
+    {
+        internFormat(n);
+    }
 
-    cur.removeSelectedText();
+    m_layout->invalidate();
 
-    m_cursor.setCharFormat(fmt);
+    emit contentsChanged();
 }
 
-void ConsoleDocument::deleteLines(int count)
+void ConsoleDocument::commitRuns()
 {
-    if (count < 1)
+    // Text a trigger simulates waits until the line it's looking at is in
+    if (m_staging)
     {
         return;
     }
 
-    count = qMin(count, blockCount());
+    // Taken first, a trigger may feed more text through process() while these are going in
+    QList<TextRun> runs;
+    runs.swap(m_runs);
 
-    QTextBlock block(findBlockByNumber(blockCount() - count));
-    if (!m_isPrompt && block.isValid() && block.previous().isValid())
+    if (m_isPrompt)
     {
-        block = block.previous();
+        newLine();
     }
 
-    // HACK: restore format
-    QTextCharFormat fmt(m_cursor.charFormat());
+    for (int n = 0; n < runs.size(); n++)
+    {
+        const TextRun run(runs.at(n));
+        if (run.end == TextRun::None)
+        {
+            insertText(run.text, run.format);
+            continue;
+        }
 
-    QTextCursor cur(this);
-    cur.setPosition(block.position());
-    cur.movePosition(QTextCursor::NextBlock, QTextCursor::KeepAnchor, count);
+        stageLine(run.text, run.format, run.end == TextRun::Prompt);
 
-    qCDebug(MUDDER_DOCUMENT) << "Delete lines" << cur.selectionStart() << cur.selectionEnd();
+        // Anything the triggers simulated follows the line that set them off
+        if (!m_runs.isEmpty())
+        {
+            for (int k = m_runs.size() - 1; k >= 0; k--)
+            {
+                runs.insert(n + 1, m_runs.at(k));
+            }
+            m_runs.clear();
 
-    cur.removeSelectedText();
+            if (m_isPrompt)
+            {
+                newLine();
+            }
+        }
+    }
 
-    m_cursor.setCharFormat(fmt);
+    // One notification for the whole chunk, so the display and scrollbar hear about it once
+    emit contentsChanged();
 }
 
-void ConsoleDocument::process(const QByteArray &data)
+// The line is finished but not yet in the buffer. Only its tail is new: any
+// text from earlier chunks is already on the open line, and stays there
+// untouched unless a trigger gags or changes the line.
+void ConsoleDocument::stageLine(const QString &text, int format, bool prompt)
 {
-    if (m_isPrompt)
+    const qint64 open = m_lines.lastLine();
+    const int shown = m_lines.length(open);
+
+    m_stagedText = text;
+    m_stagedRuns.clear();
+    if (shown > 0)
     {
-        newLine();
+        m_stagedText.prepend(m_lines.text(open));
+        m_stagedRuns = m_lines.runs(open);
     }
+    if (!text.isEmpty())
+    {
+        m_stagedRuns.append(LineRun(shown, format));
+    }
+    m_stagedChanged = false;
+    m_omit = false;
+
+    m_staging = true;
+    emit lineStaged(m_stagedText);
+    m_staging = false;
 
-    for (int pos = 0; pos < data.length(); pos++)
+    if (m_omit)
     {
-        uchar ch = (uchar)data.at(pos);
-        if (ch == ESC)
+        m_omit = false;
+
+        if (shown > 0)
         {
-            m_gotESC = true;
-            continue;
+            clearOpenLine();
         }
-        else if (m_gotESC && ch == ANSI_START)
+        m_isPrompt = false;
+    }
+    else
+    {
+        if (!m_stagedChanged)
         {
-            m_gotESC = false;
-            m_gotHeader = true;
-            continue;
+            insertText(text, format);
         }
-        else if (m_gotHeader)
+        else
         {
-            if (DIGITS.contains(ch))
+            if (shown > 0)
             {
-                m_ansiCode.append(ch);
+                clearOpenLine();
             }
-            else if (ch == ANSI_SEPARATOR)
+
+            for (int n = 0; n < m_stagedRuns.size(); n++)
             {
-                m_codes.append(m_ansiCode.toInt());
-                m_ansiCode.clear();
+                const int start = m_stagedRuns.at(n).offset;
+                const int end = n + 1 < m_stagedRuns.size() ? m_stagedRuns.at(n + 1).offset : m_stagedText.length();
+                insertText(m_stagedText.mid(start, end - start), m_stagedRuns.at(n).format);
             }
-            else if (ch == ANSI_END)
-            {
-                m_gotHeader = false;
+        }
 
-                m_codes.append(m_ansiCode.toInt());
-                m_ansiCode.clear();
+        m_isPrompt = prompt;
+        if (!m_isPrompt)
+        {
+            newLine();
+        }
 
-                foreach(int code, m_codes)
-                {
-                    processAnsi(code);
-                }
+        emit lineAdded(m_stagedText);
+    }
 
-                m_cursor.insertText(m_text);
-                m_text.clear();
+    flushDeferred();
+}
 
-                m_cursor.mergeCharFormat(m_formatCurrent);
+void ConsoleDocument::substitute(int start, int length, const QString &text)
+{
+    if (!m_staging)
+    {
+        return;
+    }
 
-                m_codes.clear();
-            }
-            else
-            {
-                m_ansiCode.clear();
-                m_gotHeader = false;
-            }
-            continue;
+    start = qBound(0, start, m_stagedText.length());
+    length = qBound(0, length, m_stagedText.length() - start);
+
+    // The new text takes the format of what it replaces
+    QVector<int> formats(stagedFormats());
+    int format = m_formatCurrent;
+    if (!formats.isEmpty())
+    {
+        format = formats.at(qMin(start, formats.size() - 1));
+    }
+
+    formats.remove(start, length);
+    formats.insert(start, text.length(), format);
+    m_stagedText.replace(start, length, text);
+
+    setStagedFormats(formats);
+}
+
+void ConsoleDocument::recolor(int start, int length, const QTextCharFormat &fmt)
+{
+    if (!m_staging)
+    {
+        return;
+    }
+
+    start = qBound(0, start, m_stagedText.length());
+    length = qBound(0, length, m_stagedText.length() - start);
+
+    QVector<int> formats(stagedFormats());
+    QHash<int, int> merged;
+    for (int n = start; n < start + length; n++)
+    {
+        const int id = formats.at(n);
+        if (!merged.contains(id))
+        {
+            QTextCharFormat layered(m_formats.at(id));
+            layered.merge(fmt);
+            merged.insert(id, formatId(layered));
         }
+        formats[n] = merged.value(id);
+    }
+
+    setStagedFormats(formats);
+}
 
-        if (m_gotHeader)
+// Lines are short and edited rarely, so edits work on a format per character
+QVector<int> ConsoleDocument::stagedFormats() const
+{
+    QVector<int> formats(m_stagedText.length(), m_formatCurrent);
+    for (int n = 0; n < m_stagedRuns.size(); n++)
+    {
+        const int end = n + 1 < m_stagedRuns.size() ? m_stagedRuns.at(n + 1).offset : formats.size();
+        for (int pos = m_stagedRuns.at(n).offset; pos < end; pos++)
         {
-            return;
+            formats[pos] = m_stagedRuns.at(n).format;
         }
+    }
+    return formats;
+}
 
-        if (CRLFGA.contains(ch))
+void ConsoleDocument::setStagedFormats(const QVector<int> &formats)
+{
+    m_stagedRuns.clear();
+    for (int pos = 0; pos < formats.size(); pos++)
+    {
+        if (m_stagedRuns.isEmpty() || m_stagedRuns.last().format != formats.at(pos))
         {
-            m_isPrompt = ch == GA;
+            m_stagedRuns.append(LineRun(pos, formats.at(pos)));
+        }
+    }
 
-            m_cursor.insertText(m_text);
-            m_text.clear();
+    m_stagedChanged = true;
+}
+
+// Drops what's been written to the open line so far
+void ConsoleDocument::clearOpenLine()
+{
+    m_lines.remove(m_lines.lastLine());
+    appendLine();
 
-//            QTextBlock b(m_cursor.block());
-//            qCDebug(MUDDER_DOCUMENT) << "Text line number:" << b.blockNumber();
-//            for (QTextBlock::iterator it = b.begin(); !it.atEnd(); it++)
-//            {
-//                QTextFragment f(it.fragment());
-//                if (f.isValid())
-//                {
-//                    qCDebug(MUDDER_DOCUMENT) << "Text fragment:" << f.text() << f.position() << f.length() << f.charFormat().foreground().color().name();
-//                }
-//            }
+    m_layout->invalidate(m_lines.lastLine());
+}
 
-            QTextBlock added(m_cursor.block());
+void ConsoleDocument::outputText(const QString &text, int format, bool newline, bool ownLine)
+{
+    if (m_staging)
+    {
+        m_deferred.append(DeferredText(text, format, newline, ownLine));
+        return;
+    }
 
-            if (!m_isPrompt)
-            {
-                newLine();
-            }
+    if (ownLine && m_lines.length(m_lines.lastLine()) > 0)
+    {
+        newLine();
+    }
 
-            emit blockAdded(added);
+    insertText(text, format);
 
-            if (m_omit)
-            {
-                deleteBlock(added);
-                m_omit = false;
-            }
+    if (newline)
+    {
+        newLine();
+    }
+}
 
-            continue;
-        }
+void ConsoleDocument::flushDeferred()
+{
+    QList<DeferredText> deferred;
+    deferred.swap(m_deferred);
 
-        m_text.append(ch);
+    foreach (const DeferredText &text, deferred)
+    {
+        outputText(text.text, text.format, text.newline, text.ownLine);
     }
 }
 
@@ -432,36 +1033,21 @@ void ConsoleDocument::error(const QString &msg)
 {
     qCDebug(MUDDER_DOCUMENT) << "Error" << msg;
 
-    if (!m_cursor.block().text().isEmpty())
-    {
-        newLine();
-    }
-
-    appendText(m_formatError, msg);
+    appendText(m_formatError, msg, true, true);
 }
 
 void ConsoleDocument::warning(const QString &msg)
 {
     qCDebug(MUDDER_DOCUMENT) << "Warning" << msg;
 
-    if (!m_cursor.block().text().isEmpty())
-    {
-        newLine();
-    }
-
-    appendText(m_formatWarning, msg);
+    appendText(m_formatWarning, msg, true, true);
 }
 
 void ConsoleDocument::info(const QString &msg)
 {
     qCDebug(MUDDER_DOCUMENT) << "Info" << msg;
 
-    if (!m_cursor.block().text().isEmpty())
-    {
-        newLine();
-    }
-
-    appendText(m_formatInfo, msg);
+    appendText(m_formatInfo, msg, true, true);
 }
 
 void ConsoleDocument::append(const QString &msg, const QColor &fg, const QColor &bg)
@@ -478,7 +1064,9 @@ void ConsoleDocument::append(const QString &msg, const QTextCharFormat &fmt)
 
     if (fmt.isEmpty() || !fmt.isValid())
     {
-        m_cursor.insertText(msg);
+        outputText(msg, m_formatCurrent, false, false);
+
+        emit contentsChanged();
     }
     else
     {
@@ -492,9 +1080,7 @@ void ConsoleDocument::optionChanged(const QString &key, const QVariant &val)
     {
         m_formatDefault.setFont(val.value<QFont>());
 
-        QTextCharFormat fmt;
-        fmt.setFont(m_formatDefault.font());
-        m_cursor.mergeCharFormat(fmt);
+        rebuildFormats();
     }
     else if (key == "foregroundColor")
     {
@@ -504,10 +1090,12 @@ void ConsoleDocument::optionChanged(const QString &key, const QVariant &val)
             return;
         }
         m_formatDefault.setForeground(c);
+
+        rebuildFormats();
     }
     else if (key == "scrollbackLines")
     {
-        setMaximumBlockCount(val.toInt() + 1);
+        setMaximumLines(val.toInt() + 1);
     }
     else if (key == "noteBackgroundColor")
     {
@@ -557,351 +1145,115 @@ void ConsoleDocument::optionChanged(const QString &key, const QVariant &val)
     }
 }
 
-void ConsoleDocument::select(int start, int stop)
+void ConsoleDocument::select(const LinePosition &start, const LinePosition &stop)
 {
-    if (start == stop)
+    if (start == stop || !start.isValid() || !stop.isValid())
     {
         selectNone();
         return;
     }
 
-    start = qBound(0, start, characterCount());
-    stop = qBound(0, stop, characterCount());
-
-    m_selection.setPosition(start);
-    m_selection.setPosition(stop, QTextCursor::KeepAnchor);
+    markSelection();
+    m_selectionStart = qMin(start, stop);
+    m_selectionEnd = qMax(start, stop);
+    markSelection();
 
     emit contentsChanged();
 }
 
 void ConsoleDocument::selectAll()
 {
-    m_selection.select(QTextCursor::Document);
+    markSelection();
+    m_selectionStart = LinePosition(m_lines.firstLine(), 0);
+    m_selectionEnd = LinePosition(m_lines.lastLine(), m_lines.length(m_lines.lastLine()));
+    markSelection();
 
     emit contentsChanged();
 }
 
 void ConsoleDocument::selectNone()
 {
-    m_selection.clearSelection();
+    markSelection();
+    m_selectionStart = LinePosition();
+    m_selectionEnd = LinePosition();
 
     emit contentsChanged();
 }
 
-void ConsoleDocument::clear()
+// The lines under the selection need drawing again when it moves
+void ConsoleDocument::markSelection()
 {
-    QTextDocument::clear();
-
-    m_cursor = QTextCursor(this);
-    m_cursor.setCharFormat(m_formatCurrent);
-
-    m_selection = QTextCursor(this);
+    if (hasSelection())
+    {
+        m_layout->markDirty(m_selectionStart.line, m_selectionEnd.line);
+    }
 }
 
-void ConsoleDocument::newLine()
+void ConsoleDocument::clear()
 {
-    qCDebug(MUDDER_DOCUMENT) << "New line";
-
-    m_cursor.insertBlock();
+    m_lines.clear();
+    appendLine();
     m_isPrompt = false;
-}
-
-void ConsoleDocument::processAnsi(int code)
-{
-    if (m_waitHighColorMode)
-    {
-        if (code == 38)
-        {
-            m_fgHighColorMode = true;
-        }
-        else if (code == 48)
-        {
-            m_bgHighColorMode = true;
-        }
-        else if ((m_fgHighColorMode || m_bgHighColorMode) && code == 5)
-        {
-            m_waitHighColorMode = true;
-        }
-        else if (m_fgHighColorMode)
-        {
-            if (code < 16)
-            {
-                m_fgHighColorMode = false;
-                m_waitHighColorMode = false;
-
-                bool bold = false;
-                if (code >= 8)
-                {
-                    code -= 8;
-                    bold = true;
-                }
-
-                switch (code)
-                {
-                case 0:
-                    m_formatCurrent.setForeground(translateColor(bold?"lightblack":"black"));
-                    break;
-
-                case 1:
-                    m_formatCurrent.setForeground(translateColor(bold?"lightred":"red"));
-                    break;
-
-                case 2:
-                    m_formatCurrent.setForeground(translateColor(bold?"lightgreen":"green"));
-                    break;
-
-                case 3:
-                    m_formatCurrent.setForeground(translateColor(bold?"lightyellow":"yellow"));
-                    break;
-
-                case 4:
-                    m_formatCurrent.setForeground(translateColor(bold?"lightblue":"blue"));
-                    break;
-
-                case 5:
-                    m_formatCurrent.setForeground(translateColor(bold?"lightmagenta":"magenta"));
-                    break;
-
-                case 6:
-                    m_formatCurrent.setForeground(translateColor(bold?"lightcyan":"cyan"));
-                    break;
-
-                case 7:
-                    m_formatCurrent.setForeground(translateColor(bold?"lightwhite":"white"));
-                    break;
-                }
-            }
-            else if (code < 232)
-            {
-                code -= 16;
-
-                int r = code / 36;
-                int g = (code - r * 36) / 6;
-                int b = (code - r * 36) - g * 6;
-
-                m_formatCurrent.setForeground(QColor(r * 42, g * 42, b * 42));
-            }
-            else
-            {
-                code = (code - 232) * 10;
-
-                m_formatCurrent.setForeground(QColor(code, code, code));
-            }
-        }
-        else if (m_bgHighColorMode)
-        {
-            m_bgHighColorMode = false;
-            m_waitHighColorMode = false;
-
-            int bold = false;
-            if (code >= 8)
-            {
-                code -= 8;
-                bold = true;
-            }
 
-            switch (code)
-            {
-            case 0:
-                m_formatCurrent.setBackground(bold?translateColor("lightblack"):QColor());
-                break;
-
-            case 1:
-                m_formatCurrent.setBackground(translateColor(bold?"lightred":"red"));
-                break;
+    m_search->stop();
+    m_index.clear();
 
-            case 2:
-                m_formatCurrent.setBackground(translateColor(bold?"lightgreen":"green"));
-                break;
+    m_layout->invalidate();
 
-            case 3:
-                m_formatCurrent.setBackground(translateColor(bold?"lightyellow":"yellow"));
-                break;
+    selectNone();
+}
 
-            case 4:
-                m_formatCurrent.setBackground(translateColor(bold?"lightblue":"blue"));
-                break;
+// Appending can write out an older segment, whose lines may use formats made since
+void ConsoleDocument::appendLine()
+{
+    flushFormatTable();
 
-            case 5:
-                m_formatCurrent.setBackground(translateColor(bold?"lightmagenta":"magenta"));
-                break;
+    m_lines.appendLine();
+}
 
-            case 6:
-                m_formatCurrent.setBackground(translateColor(bold?"lightcyan":"cyan"));
-                break;
+void ConsoleDocument::newLine()
+{
+    qCDebug(MUDDER_DOCUMENT) << "New line";
 
-            case 7:
-                m_formatCurrent.setBackground(translateColor(bold?"lightwhite":"white"));
-                break;
-            }
-        }
-        else if (code < 232)
-        {
-            code -= 16;
+    const qint64 finished = m_lines.lastLine();
+    m_index.addLine(finished, m_lines.text(finished));
 
-            int r = code / 36;
-            int g = (code - r * 36) / 6;
-            int b = (code - r * 36) - g * 6;
+    appendLine();
+    m_index.removeBefore(m_lines.firstLine());
+    m_isPrompt = false;
+}
 
-            m_formatCurrent.setBackground(QColor(r * 42, g * 42, b * 42));
-        }
-        else
-        {
-            code = (code - 232) * 10;
+void ConsoleDocument::reindex(qint64 first)
+{
+    m_index.removeFrom(first);
 
-            m_formatCurrent.setBackground(QColor(code, code, code));
-        }
-    }
-    else
+    // The last line is still being written
+    for (qint64 line = qMax(first, m_lines.firstLine()); line < m_lines.lastLine(); line++)
     {
-        static bool bold = false;
-        switch (code)
-        {
-        case 0:
-            m_fgHighColorMode = false;
-            m_bgHighColorMode = false;
-            m_waitHighColorMode = false;
-
-            bold = false;
-
-            m_formatCurrent = m_formatDefault;
-            return;
-
-        case 1:
-            bold = true;
-            break;
-
-        case 2:
-        case 22:
-            bold = false;
-            break;
-
-        case 3:
-        case 23:
-            m_formatCurrent.setFontItalic(true);
-            break;
-
-        case 4:
-        case 24:
-            m_formatCurrent.setFontUnderline(true);
-            break;
-
-        case 30:
-            m_formatCurrent.setForeground(translateColor(bold?"lightblack":"black"));
-            break;
-
-        case 31:
-            m_formatCurrent.setForeground(translateColor(bold?"lightred":"red"));
-            break;
-
-        case 32:
-            m_formatCurrent.setForeground(translateColor(bold?"lightgreen":"green"));
-            break;
-
-        case 33:
-            m_formatCurrent.setForeground(translateColor(bold?"lightyellow":"yellow"));
-            break;
-
-        case 34:
-            m_formatCurrent.setForeground(translateColor(bold?"lightblue":"blue"));
-            break;
-
-        case 35:
-            m_formatCurrent.setForeground(translateColor(bold?"lightmagenta":"magenta"));
-            break;
-
-        case 36:
-            m_formatCurrent.setForeground(translateColor(bold?"lightcyan":"cyan"));
-            break;
-
-        case 37:
-            m_formatCurrent.setForeground(translateColor(bold?"lightwhite":"white"));
-            break;
-
-        case 39:
-            m_formatCurrent.setBackground(QColor());
-            break;
-
-        case 40:
-            m_formatCurrent.setBackground(translateColor("black"));
-            break;
-
-        case 41:
-            m_formatCurrent.setBackground(translateColor("red"));
-            break;
-
-        case 42:
-            m_formatCurrent.setBackground(translateColor("green"));
-            break;
-
-        case 43:
-            m_formatCurrent.setBackground(translateColor("yellow"));
-            break;
-
-        case 44:
-            m_formatCurrent.setBackground(translateColor("blue"));
-            break;
-
-        case 45:
-            m_formatCurrent.setBackground(translateColor("magenta"));
-            break;
-
-        case 46:
-            m_formatCurrent.setBackground(translateColor("cyan"));
-            break;
-
-        case 47:
-            m_formatCurrent.setBackground(translateColor("white"));
-            break;
-        }
+        m_index.addLine(line, m_lines.text(line));
     }
 }
 
-inline QColor ConsoleDocument::translateColor(const QString &name)
+void ConsoleDocument::insertText(const QString &text, int format)
 {
-    static QMap<QString, QColor> colors;
-    if (colors.count() < 1)
-    {
-        colors["black"] = QColor(Qt::black);
-        colors["lightblack"] = QColor(Qt::darkGray);
-        colors["red"] = QColor(Qt::darkRed);
-        colors["lightred"] = QColor(Qt::red);
-        colors["green"] = QColor(Qt::darkGreen);
-        colors["lightgreen"] = QColor(Qt::green);
-        colors["blue"] = QColor(Qt::darkBlue);
-        colors["lightblue"] = QColor(Qt::blue);
-        colors["yellow"] = QColor(Qt::darkYellow);
-        colors["lightyellow"] = QColor(Qt::yellow);
-        colors["cyan"] = QColor(Qt::darkCyan);
-        colors["lightcyan"] = QColor(Qt::cyan);
-        colors["magenta"] = QColor(Qt::darkMagenta);
-        colors["lightmagenta"] = QColor(Qt::magenta);
-        colors["white"] = QColor(Qt::lightGray);
-        colors["lightwhite"] = QColor(Qt::white);
-    }
-
-    if (!colors.contains(name))
+    if (text.isEmpty())
     {
-        return QColor();
+        return;
     }
 
-    return colors[name];
+    m_lines.appendText(text, format);
+    m_layout->invalidate(m_lines.lastLine());
 }
 
-inline void ConsoleDocument::appendText(const QTextCharFormat &fmt, const QString &text, bool newline)
+inline void ConsoleDocument::appendText(const QTextCharFormat &fmt, const QString &text, bool newline, bool ownLine)
 {
     qCDebug(MUDDER_DOCUMENT) << "Appending text" << text << "format valid" << fmt.isValid();
 
-    QTextCharFormat previousFormat(m_cursor.charFormat());
-
-    m_cursor.mergeCharFormat(fmt);
+    // Layered over the server's current style, as merging into the cursor format used to do
+    QTextCharFormat merged(m_formats.at(m_formatCurrent));
+    merged.merge(fmt);
 
-    m_cursor.insertText(text);
-
-    if (newline)
-    {
-        newLine();
-    }
+    outputText(text, formatId(merged), newline, ownLine);
 
-    m_cursor.setCharFormat(previousFormat);
+    emit contentsChanged();
 }
@@ -24,34 +24,96 @@
 #ifndef CONSOLEDOCUMENT_H
 #define CONSOLEDOCUMENT_H
 
+#include <QHash>
 #include <QList>
-#include <QTextBlock>
+#include <QObject>
 #include <QTextCharFormat>
-#include <QTextCursor>
-#include <QTextDocument>
+#include <QVector>
+#include "linebuffer.h"
+#include "streamdecoder.h"
+#include "trigramindex.h"
 
-class ConsoleDocument : public QTextDocument
+class ConsoleDocumentLayout;
+class ScrollbackSearch;
+
+// SGR attributes packed small enough to key the format table; a colour is
+// Default, Palette with the index in the low byte, or Rgb with 0xRRGGBB
+struct AnsiStyle
+{
+    enum ColorType
+    {
+        Default = 0,
+        Palette = 1 << 24,
+        Rgb = 2 << 24
+    };
+
+    enum Attribute
+    {
+        Bold = 0x01,
+        Italic = 0x02,
+        Underline = 0x04,
+        Inverse = 0x08,
+        Faint = 0x10
+    };
+
+    AnsiStyle() : foreground(Default), background(Default), attributes(0) {}
+
+    bool operator==(const AnsiStyle &other) const
+    {
+        return foreground == other.foreground && background == other.background && attributes == other.attributes;
+    }
+
+    quint32 foreground;
+    quint32 background;
+    quint8 attributes;
+};
+
+inline uint qHash(const AnsiStyle &style, uint seed = 0)
+{
+    return qHash(style.foreground, seed) ^ qHash((quint64(style.background) << 8) | style.attributes, seed);
+}
+
+class ConsoleDocument : public QObject
 {
     Q_OBJECT
 public:
     explicit ConsoleDocument(QObject *parent = 0);
-
-    bool hasSelection() const { return m_selection.hasSelection(); }
-    QTextCursor selection() const { return m_selection; }
+    ~ConsoleDocument();
+
+    ConsoleDocumentLayout * documentLayout() const { return m_layout; }
+
+    const LineBuffer & lines() const { return m_lines; }
+    const TrigramIndex & index() const { return m_index; }
+    ScrollbackSearch * search() const { return m_search; }
+    const QTextCharFormat & format(int id) const { return m_formats.at(id); }
+    const QVector<QTextCharFormat> & formats() const { return m_formats; }
+    const QTextCharFormat & defaultFormat() const { return m_formatDefault; }
+    void setMaximumLines(int lines);
+    bool attachScrollback(const QString &fileName, qint64 maximumSize);
+
+    bool hasSelection() const { return m_selectionStart != m_selectionEnd; }
+    LinePosition selectionStart() const { return m_selectionStart; }
+    LinePosition selectionEnd() const { return m_selectionEnd; }
     QTextCharFormat formatSelection() const { return m_formatSelection; }
+    QTextCharFormat formatHighlight() const { return m_formatHighlight; }
 
-    QString toPlainText(int start, int stop);
-    QString toPlainText(QTextCursor cur = QTextCursor());
-
-    QString toHtml(int start, int stop, const QColor &fg = QColor(), const QColor &bg = QColor(), const QFont &font = QFont());
-    QString toHtml(QTextCursor cur = QTextCursor(), const QColor &fg = QColor(), const QColor &bg = QColor(), const QFont &font = QFont());
+    QString selectedText() const;
+    QString selectedHtml(const QString &title, const QColor &fg = QColor(), const QColor &bg = QColor(), const QFont &font = QFont()) const;
 
-    void deleteBlock(const QTextBlock &block);
     void deleteLines(int count);
+
+    // A finished line is staged while lineStaged() is out; the triggers can gag
+    // it, rewrite it or recolour parts of it before it goes into the buffer
+    bool isStaging() const { return m_staging; }
+    const QString & stagedText() const { return m_stagedText; }
     void omit() { m_omit = true; }
+    void substitute(int start, int length, const QString &text);
+    void recolor(int start, int length, const QTextCharFormat &fmt);
 
 public slots:
     void process(const QByteArray &data);
+    void processPrompt(const QByteArray &data);
+    void setEncoding(const QByteArray &encoding);
     void command(const QString &cmd);
     void error(const QString &msg);
     void warning(const QString &msg);
@@ -59,44 +121,131 @@ public slots:
     void append(const QString &msg, const QColor &fg, const QColor &bg);
     void append(const QString &msg, const QTextCharFormat &fmt = QTextCharFormat());
     void optionChanged(const QString &key, const QVariant &val);
-    void select(int start, int stop);
+    void select(const LinePosition &start, const LinePosition &stop);
     void selectAll();
     void selectNone();
-    virtual void clear();
+    void clear();
 
 signals:
-    void blockAdded(QTextBlock block);
+    void lineStaged(const QString &text);
+    void lineAdded(const QString &text);
+    void contentsChanged();
 
 private:
     void newLine();
-    void processAnsi(int code);
-    QColor translateColor(const QString &name);
-    void appendText(const QTextCharFormat &fmt, const QString &text, bool newline = true);
-
-    QTextCursor m_cursor;
-    QTextCursor m_selection;
+    void appendLine();
+    void insertText(const QString &text, int format);
+    void removeLines(qint64 first, int count);
+    void reindex(qint64 first);
+    void lex(const char *bytes, int length, StreamDecoder &decoder);
+    void processNested(const QByteArray &data);
+    int processEscape(const char *data, int pos, int length);
+    void processSgr();
+    void commitRuns();
+    void stageLine(const QString &text, int format, bool prompt);
+    QVector<int> stagedFormats() const;
+    void setStagedFormats(const QVector<int> &formats);
+    void clearOpenLine();
+    void markSelection();
+    void outputText(const QString &text, int format, bool newline, bool ownLine);
+    void flushDeferred();
+    int processExtendedColor(int pos, int count, quint32 &color);
+    int styleFormat(const AnsiStyle &style);
+    QTextCharFormat buildStyleFormat(const AnsiStyle &style) const;
+    int formatId(const QTextCharFormat &fmt);
+    void internFormat(int id);
+    void rebuildFormats();
+    QByteArray formatTable() const;
+    void flushFormatTable();
+    QVector<int> restoreFormats(const QByteArray &table);
+    void appendText(const QTextCharFormat &fmt, const QString &text, bool newline = true, bool ownLine = false);
+
+    ConsoleDocumentLayout *m_layout;
+    LineBuffer m_lines;
+    // Finished lines only; the one being written is indexed when it ends
+    TrigramIndex m_index;
+    ScrollbackSearch *m_search;
+
+    LinePosition m_selectionStart;
+    LinePosition m_selectionEnd;
+
+    // Text lexed from one chunk, waiting to go into the buffer in one pass
+    struct TextRun
+    {
+        enum End
+        {
+            None,
+            Line,
+            Prompt
+        };
+
+        TextRun(const QString &t, int f, End e = None) : text(t), format(f), end(e) {}
+
+        QString text;
+        int format;
+        End end;
+    };
+
+    StreamDecoder m_decoder;
+    QList<TextRun> m_runs;
+    // Set while a chunk's runs go in, when triggers may feed more text through process()
+    bool m_committing;
+    StreamDecoder m_nestedDecoder;
+
+    bool m_staging;
+    QString m_stagedText;
+    QVector<LineRun> m_stagedRuns;
+    bool m_stagedChanged;
+
+    // Notes and commands from the triggers, held until the line they saw is in
+    struct DeferredText
+    {
+        DeferredText(const QString &t, int f, bool n, bool o) : text(t), format(f), newline(n), ownLine(o) {}
+
+        QString text;
+        int format;
+        bool newline;
+        bool ownLine;
+    };
+
+    QList<DeferredText> m_deferred;
 
     QString m_text;
     QString m_input;
-    QString m_ansiCode;
-    QList<int> m_codes;
 
-    bool m_gotESC;
-    bool m_gotHeader;
+    enum AnsiState
+    {
+        AnsiNone,
+        AnsiEscape,
+        AnsiParameters
+    };
+
+    // Parameters past this are dropped, which still covers 38;2;r;g;b with room to spare
+    static const int MAX_ANSI_PARAMETERS = 16;
+
+    AnsiState m_ansiState;
+    int m_ansiParameters[MAX_ANSI_PARAMETERS];
+    int m_ansiCount;
+    bool m_ansiPrivate;
+
+    AnsiStyle m_style;
+    // Lines refer to formats by index; each distinct style is built once and
+    // rebuilt in place when the default format changes
+    QVector<QTextCharFormat> m_formats;
+    QHash<AnsiStyle, int> m_styleFormats;
+    // Every format by its serialized properties, for formatId()
+    QHash<QByteArray, int> m_formatIds;
+    // Formats added since the file's table was last serialized
+    bool m_formatTableStale;
+    int m_formatCurrent;
 
-    bool m_waitHighColorMode;
-    bool m_fgHighColorMode;
-    bool m_bgHighColorMode;
-    bool m_isHighColorMode;
     bool m_isPrompt;
     bool m_omit;
 
-    int m_gagLine;
-
     QTextCharFormat m_formatDefault;
     QTextCharFormat m_formatSelection;
+    QTextCharFormat m_formatHighlight;
     QTextCharFormat m_formatCommand;
-    QTextCharFormat m_formatCurrent;
     QTextCharFormat m_formatError;
     QTextCharFormat m_formatWarning;
     QTextCharFormat m_formatInfo;
@@ -22,17 +22,50 @@
 
 
 #include "consoledocumentlayout.h"
-#include <QFontMetrics>
-#include <QTextBlock>
+#include "consoledocument.h"
+#include "scrollbacksearch.h"
+#include <QElapsedTimer>
+#include <QFontMetricsF>
+#include <QTextCharFormat>
+#include <QtAlgorithms>
+#include <QtMath>
+#include <QVarLengthArray>
 #include "logging.h"
 
-ConsoleDocumentLayout::ConsoleDocumentLayout(QTextDocument *doc) :
-    QAbstractTextDocumentLayout(doc),
+// Laid-out lines kept around; a screenful is far fewer than this
+static const int LAYOUT_CACHE_LINES = 2000;
+
+// Kilobytes of line tiles; a few screenfuls at any common size
+static const int TILE_CACHE_KB = 32 * 1024;
+static const qreal DOCUMENT_MARGIN = 4;
+
+// Lines whose heights are estimated again per step of a rewrap, and how long
+// one call to rewrap() may spend on them before letting events through
+static const int REWRAP_LINES = 1024;
+static const int REWRAP_BUDGET = 4;
+
+ConsoleDocumentLayout::ConsoleDocumentLayout(ConsoleDocument *doc) :
+    QObject(doc),
+    m_document(doc),
+    m_layouts(LAYOUT_CACHE_LINES),
+    m_gridEnabled(true),
+    m_tiles(TILE_CACHE_KB),
+    m_tilesEnabled(true),
     m_width(0),
-    m_maximumWidth(0),
-    m_maximumWidthBlockNumber(0),
-    m_blockCount(1),
-    m_scroll(0)
+    m_charWidth(1),
+    m_lineHeight(1),
+    m_generation(0),
+    m_metricsStale(true),
+    m_rewrapNext(-1),
+    m_rewrapQueued(false),
+    m_viewportHeight(0),
+    m_atBottom(true),
+    m_anchorLine(-1),
+    m_anchorOffset(0),
+    m_drawnBottom(-1),
+    m_dirtyAll(true),
+    m_dirtyFirst(-1),
+    m_dirtyLast(-1)
 {
 }
 
@@ -40,366 +73,872 @@ ConsoleDocumentLayout::~ConsoleDocumentLayout()
 {
 }
 
-void ConsoleDocumentLayout::draw(QPainter *painter, const PaintContext &context)
+void ConsoleDocumentLayout::draw(QPainter *painter, const QRectF &clip)
 {
-    QRectF r(context.clip);
+    // Only what's inside the painter's clip is drawn, though every line is
+    // still placed so the next frame knows where things are
+    const bool clipped = painter->hasClipping();
+    const QRectF exposed(painter->clipBoundingRect());
 
-    int y = r.height();
+    m_drawnArea = QRectF(0, 0, clip.right() + 1, clip.height());
+    m_drawnBottom = placeLines(m_drawnRects, m_drawnArea.width());
 
-    QTextBlock textBlock(bottomBlock(context.cursorPosition));
-    while (y > 0 && textBlock.isValid())
+    for (int n = 0; n < m_drawnRects.size(); n++)
     {
-        QTextLayout * textLayout = textBlock.layout();
+        const qint64 line = m_drawnBottom - n;
+        const QRectF &rect = m_drawnRects.at(n);
 
-        QVector<QTextLayout::FormatRange> selections;
-        int blockPos = textBlock.position();
-        int blockLen = textBlock.length();
-        foreach (const QAbstractTextDocumentLayout::Selection &sel, context.selections)
+        if (rect.height() <= 0 || (clipped && !exposed.intersects(rect)))
         {
-            const int selStart = sel.cursor.selectionStart() - blockPos;
-            const int selEnd = sel.cursor.selectionEnd() - blockPos;
+            continue;
+        }
+
+        const ConsoleLine *layout = lineLayout(line);
+        if (m_tilesEnabled)
+        {
+            drawTile(painter, line, layout, rect);
+        }
+        else
+        {
+            drawLine(painter, line, layout, rect.topLeft());
+        }
+    }
+}
+
+// The point is measured up from the bottom of the display, as drawing goes
+LinePosition ConsoleDocumentLayout::hitTest(const QPointF &point) const
+{
+    const LineBuffer &lines = m_document->lines();
+
+    // Lines in view are where they were placed; above the view, where a
+    // selection can be dragged to, they carry on upwards
+    QVector<QRectF> rects;
+    qint64 line = placeLines(rects, 0);
+
+    const qreal viewY = m_viewportHeight - point.y();
+    qreal top = m_viewportHeight;
+
+    for (int n = 0; lines.contains(line); n++, line--)
+    {
+        const ConsoleLine *layout = lineLayout(line);
+        const qreal height = n < rects.size() ? rects.at(n).height() : layout->height;
+        top = n < rects.size() ? rects.at(n).top() : top - height;
+
+        if (height > 0 && viewY >= top)
+        {
+            const qreal y = viewY - top;
+
+            if (!layout->textLayout)
+            {
+                const int row = qBound(0, int(y / m_glyphs.cellHeight()), layout->rows - 1);
+                const int column = qBound(0, qRound((point.x() - DOCUMENT_MARGIN) / m_glyphs.cellWidth()), layout->columns);
+
+                return LinePosition(line, qMin(row * layout->columns + column, layout->text.length()));
+            }
 
-            if (selStart < blockLen && selEnd > 0 && selEnd > selStart)
+            const QTextLayout *textLayout = layout->textLayout;
+            for (int n = 0; n < textLayout->lineCount(); n++)
             {
-                QTextLayout::FormatRange o;
-                o.start = selStart;
-                o.length = selEnd - selStart;
-                o.format = sel.format;
-                selections.append(o);
+                QTextLine textLine(textLayout->lineAt(n));
+                if (y < textLine.y() + textLine.height() || n == textLayout->lineCount() - 1)
+                {
+                    return LinePosition(line, textLine.xToCursor(point.x(), QTextLine::CursorBetweenCharacters));
+                }
             }
+
+            return LinePosition(line, 0);
         }
+    }
 
-        y -= blockBoundingRect(textBlock).height();
+    return LinePosition();
+}
 
-        textLayout->draw(painter, QPoint(0, y), selections);
+QString ConsoleDocumentLayout::anchorAt(const QPointF &point) const
+{
+    const LinePosition pos(hitTest(point));
+    if (!pos.isValid())
+    {
+        return QString();
+    }
 
-        textBlock = textBlock.previous();
+    const QVector<LineRun> runs(m_document->lines().runs(pos.line));
+    for (int n = runs.size() - 1; n >= 0; n--)
+    {
+        if (runs.at(n).offset <= pos.column)
+        {
+            return m_document->format(runs.at(n).format).anchorHref();
+        }
     }
+
+    return QString();
+}
+
+// As wide as the widest line once it's wrapped, and as tall as all of them
+QSizeF ConsoleDocumentLayout::documentSize() const
+{
+    sync();
+
+    return QSizeF(qMin(m_index.maximumWidth() * m_charWidth, availableWidth()) + 2 * DOCUMENT_MARGIN, m_index.totalHeight());
 }
 
-int ConsoleDocumentLayout::hitTest(const QPointF &point, Qt::HitTestAccuracy accuracy) const
+qreal ConsoleDocumentLayout::lineSpacing() const
 {
-    Q_UNUSED(accuracy)
+    sync();
 
-    QTextBlock textBlock(bottomBlock());
-    ensureBlockLayout(textBlock);
-    if (!textBlock.isValid())
+    return m_lineHeight;
+}
+
+void ConsoleDocumentLayout::setViewportHeight(qreal height)
+{
+    m_viewportHeight = qMax(qreal(0), height);
+}
+
+qreal ConsoleDocumentLayout::scrollPosition() const
+{
+    const qreal maximum = maximumScroll();
+    if (m_atBottom || m_anchorLine > m_index.lastLine())
     {
-        return -1;
+        return maximum;
     }
 
-    QPointF offset;
-    QRectF rectBlock(blockBoundingRect(textBlock));
-    while (textBlock.isValid() && !rectBlock.contains(point))
+    // The line the view was on has since been evicted
+    if (m_anchorLine < m_index.firstLine())
     {
-        offset.ry() += rectBlock.height();
-
-        textBlock = textBlock.previous();
-        rectBlock = blockBoundingRect(textBlock).adjusted(0, offset.y(), 0, offset.y());
+        return 0;
     }
 
-    if (!textBlock.isValid())
+    return qBound(qreal(0), m_index.offset(m_anchorLine) + m_anchorOffset, maximum);
+}
+
+qreal ConsoleDocumentLayout::maximumScroll() const
+{
+    sync();
+
+    return qMax(qreal(0), m_index.totalHeight() - m_viewportHeight);
+}
+
+// Scrolling all the way down is taken to mean following the output again
+void ConsoleDocumentLayout::scrollTo(qreal position)
+{
+    const qreal maximum = maximumScroll();
+    if (maximum <= 0 || position >= maximum)
     {
-        return -1;
+        scrollToBottom();
+        return;
     }
 
-    int charOffset = 0;
-    QPointF pos(point - offset);
-    QTextLayout *textLayout = textBlock.layout();
+    position = qMax(qreal(0), position);
 
-    for (int n = 0; n < textLayout->lineCount(); n++)
+    m_atBottom = false;
+    m_anchorLine = m_index.lineAt(position);
+    m_anchorOffset = position - m_index.offset(m_anchorLine);
+
+    // Scrolled back into lines the rewrap hasn't reached yet; those around
+    // the view are seen to now, keeping the view where it was put
+    if (m_anchorLine <= m_rewrapNext)
     {
-        QTextLine line(textLayout->lineAt(n));
-        const QRectF lineRect(line.naturalTextRect());
+        reestimateAround(m_anchorLine);
+    }
+}
 
-        if (lineRect.top() > pos.y())
-        {
-            charOffset = qMax(charOffset, line.textStart() + line.textLength());
-        }
-        else if (lineRect.bottom() <= pos.y())
-        {
-            charOffset = qMin(charOffset, line.textStart());
-        }
-        else
-        {
-            charOffset = line.xToCursor(pos.x(), QTextLine::CursorBetweenCharacters);
-            break;
-        }
+void ConsoleDocumentLayout::scrollToBottom()
+{
+    m_atBottom = true;
+    m_anchorLine = -1;
+    m_anchorOffset = 0;
+}
+
+qreal ConsoleDocumentLayout::bottomPosition(qint64 line) const
+{
+    sync();
+
+    return qBound(qreal(0), m_index.offset(line) + m_index.height(line) - m_viewportHeight, maximumScroll());
+}
+
+// Lines wrap differently now. Nothing is thrown away here, as this comes
+// for every step of dragging the window edge: layouts from before are
+// passed over by generation and replaced as they're needed, and heights
+// are estimated again from the widths the lines have unwrapped.
+void ConsoleDocumentLayout::setTextWidth(qreal width)
+{
+    m_width = width;
+
+    invalidate();
+}
+
+// The open line has changed; its estimate goes until it's laid out again
+void ConsoleDocumentLayout::invalidate(qint64 line)
+{
+    m_layouts.remove(line);
+
+    if (m_index.contains(line))
+    {
+        const qreal width = m_document->lines().length(line);
+        m_index.setLine(line, estimatedHeight(line, width), width);
     }
 
-    return textBlock.position() + charOffset;
+    markDirty(line, line);
+}
+
+// The width, formats or font may have changed, which changes how big every line is
+void ConsoleDocumentLayout::invalidate()
+{
+    m_generation++;
+    m_metricsStale = true;
+    m_rewrapNext = m_index.lastLine();
+
+    scheduleRewrap();
+    markDirty();
 }
 
-int ConsoleDocumentLayout::pageCount() const
+void ConsoleDocumentLayout::removeLines(qint64 first, int count)
 {
-    return 1;
+    m_layouts.clear();
+    m_index.remove(first, count);
+
+    markDirty();
 }
 
-QSizeF ConsoleDocumentLayout::documentSize() const
+void ConsoleDocumentLayout::setGridEnabled(bool flag)
 {
-    return QSizeF(m_maximumWidth, document()->lineCount());
+    m_gridEnabled = flag;
+
+    invalidate();
 }
 
-QRectF ConsoleDocumentLayout::frameBoundingRect(QTextFrame *frame) const
+void ConsoleDocumentLayout::setTilesEnabled(bool flag)
 {
-    Q_UNUSED(frame)
+    m_tilesEnabled = flag;
+
+    m_tiles.clear();
+}
 
-    return QRectF(0, 0, qMax(m_width, m_maximumWidth), qreal(INT_MAX));
+bool ConsoleDocumentLayout::isFixedPitch() const
+{
+    m_glyphs.setFont(m_document->defaultFormat().font());
+
+    return m_glyphs.isFixedPitch();
+}
+
+void ConsoleDocumentLayout::markDirty(qint64 first, qint64 last)
+{
+    if (last - first < m_tiles.size())
+    {
+        for (qint64 line = first; line <= last; line++)
+        {
+            m_tiles.remove(line);
+        }
+    }
+    else
+    {
+        m_tiles.clear();
+    }
+
+    if (m_dirtyFirst < 0)
+    {
+        m_dirtyFirst = first;
+        m_dirtyLast = last;
+    }
+    else
+    {
+        m_dirtyFirst = qMin(m_dirtyFirst, first);
+        m_dirtyLast = qMax(m_dirtyLast, last);
+    }
 }
 
+void ConsoleDocumentLayout::markDirty()
+{
+    m_tiles.clear();
+
+    m_dirtyAll = true;
+}
 
-QRectF ConsoleDocumentLayout::blockBoundingRect(const QTextBlock &block) const
+LayoutDamage ConsoleDocumentLayout::takeDamage()
 {
-    if (!block.isValid())
+    const bool all = m_dirtyAll;
+    const qint64 first = m_dirtyFirst;
+    const qint64 last = m_dirtyLast;
+
+    m_dirtyAll = false;
+    m_dirtyFirst = -1;
+    m_dirtyLast = -1;
+
+    LayoutDamage damage;
+    damage.area = m_drawnArea.toAlignedRect();
+
+    if (all)
     {
-        return QRectF();
+        damage.dirty = damage.area;
+        return damage;
     }
 
-    QTextLayout *textLayout = block.layout();
-    if (!textLayout->lineCount())
+    // Where the next draw will put each line, to hold up against the last one
+    QVector<QRectF> rects;
+    const qint64 bottom = placeLines(rects, m_drawnArea.width());
+
+    if (bottom == m_drawnBottom && rects == m_drawnRects && first < 0)
     {
-        const_cast<ConsoleDocumentLayout*>(this)->layoutBlock(block);
+        return damage;
     }
 
-    QRectF boundingRect;
-    if (block.isVisible())
+    // Lines on screen both times have to have moved together, by whole
+    // pixels, for what's there to be shifted rather than painted again
+    bool shift = false;
+    qreal dy = 0;
+    QRectF dirty;
+    for (int n = 0; n < rects.size(); n++)
     {
-        boundingRect = QRectF(QPointF(0, 0), textLayout->boundingRect().bottomRight());
+        const qint64 line = bottom - n;
+        const QRectF &rect = rects.at(n);
+        if (rect.height() <= 0)
+        {
+            continue;
+        }
 
-        if (textLayout->lineCount() == 1)
+        const int old = int(m_drawnBottom - line);
+        if (old < 0 || old >= m_drawnRects.size())
         {
-            boundingRect.setWidth(qMax(boundingRect.width(), textLayout->lineAt(0).naturalTextWidth()));
+            dirty |= rect;
+            continue;
         }
 
-        qreal margin = document()->documentMargin();
-        boundingRect.adjust(0, 0, margin, 0);
+        const QRectF &drawn = m_drawnRects.at(old);
+        if (!shift)
+        {
+            shift = true;
+            dy = rect.top() - drawn.top();
+        }
+
+        if (!qFuzzyCompare(rect.height(), drawn.height()) || !qFuzzyCompare(rect.top() - drawn.top() + 1, dy + 1))
+        {
+            damage.dirty = damage.area;
+            return damage;
+        }
 
-        if (!block.next().isValid())
+        if (line >= first && line <= last)
         {
-            boundingRect.adjust(0, 0, 0, margin);
+            dirty |= rect;
         }
     }
 
-    return boundingRect;
+    if (!shift || qAbs(dy) >= m_drawnArea.height() || !qFuzzyCompare(dy + 1, qreal(qRound(dy)) + 1))
+    {
+        damage.dirty = damage.area;
+        return damage;
+    }
+
+    // The display is about to look like this
+    m_drawnRects = rects;
+    m_drawnBottom = bottom;
+
+    damage.scroll = qRound(dy);
+    damage.dirty = dirty.toAlignedRect();
+
+    return damage;
 }
 
-void ConsoleDocumentLayout::ensureBlockLayout(const QTextBlock &block) const
+// Brings the index up to date with the buffer: lines evicted from the top or
+// removed from the end since it was last looked at go, new lines come in with
+// estimated heights, and the line that was open last time is estimated again
+void ConsoleDocumentLayout::sync() const
 {
-    if (!block.isValid())
+    const LineBuffer &lines = m_document->lines();
+
+    // Restored scrollback puts lines ahead of the ones here, renumbering them
+    if (m_index.firstLine() > lines.firstLine())
+    {
+        m_index.clear(lines.firstLine());
+    }
+
+    if (m_index.firstLine() < lines.firstLine())
+    {
+        m_index.removeFirst(int(qMin(lines.firstLine() - m_index.firstLine(), qint64(INT_MAX))));
+    }
+    if (m_index.isEmpty())
+    {
+        m_index.clear(lines.firstLine());
+    }
+
+    if (m_index.lastLine() > lines.lastLine())
+    {
+        m_index.removeLast(int(m_index.lastLine() - lines.lastLine()));
+    }
+
+    // Right away for the lines in view and a couple of screenfuls around
+    // them, which is all the next frame needs; the rest is left to rewrap()
+    if (m_metricsStale)
+    {
+        updateMetrics();
+        reestimateAround(m_atBottom ? m_index.lastLine() : m_anchorLine);
+    }
+
+    if (m_index.lastLine() == lines.lastLine())
     {
         return;
     }
 
-    QTextLayout *textLayout = block.layout();
-    if (!textLayout->lineCount())
+    if (!m_index.isEmpty())
+    {
+        const qint64 line = m_index.lastLine();
+        const qreal width = m_index.width(line);
+        const ConsoleLine *layout = m_layouts.object(line);
+        const bool current = layout && layout->generation == m_generation;
+        m_index.setLine(line, current ? layout->height : estimatedHeight(line, width), width);
+    }
+
+    for (qint64 line = m_index.lastLine() + 1; line <= lines.lastLine(); line++)
     {
-        const_cast<ConsoleDocumentLayout*>(this)->layoutBlock(block);
+        const qreal width = lines.length(line);
+        m_index.append(estimatedHeight(line, width), width);
     }
 }
 
-void ConsoleDocumentLayout::setTextWidth(qreal width)
+void ConsoleDocumentLayout::updateMetrics() const
 {
-    m_width = width;
-    m_maximumWidth = width;
+    m_metricsStale = false;
+
+    const QFont font(m_document->defaultFormat().font());
+    m_glyphs.setFont(font);
 
-    relayout();
+    m_charWidth = qMax(qreal(1), m_glyphs.isFixedPitch() ? m_glyphs.cellWidth() : QFontMetricsF(font).averageCharWidth());
+    m_lineHeight = qMax(qreal(1), QFontMetricsF(font).lineSpacing());
 }
 
-void ConsoleDocumentLayout::documentChanged(int from, int charsRemoved, int charsAdded)
+// Lines laid out since the last change already have their exact heights;
+// estimating again is harmless for the rest, so ranges may overlap
+void ConsoleDocumentLayout::reestimate(qint64 first, qint64 last) const
 {
-    Q_UNUSED(charsRemoved)
+    first = qMax(first, m_index.firstLine());
+    last = qMin(last, m_index.lastLine());
 
-    QTextDocument *doc = document();
-    int newBlockCount = doc->blockCount();
-
-    QTextBlock changeStartBlock(doc->findBlock(from));
-    QTextBlock changeEndBlock(doc->findBlock(qMax(0, from + charsAdded - 1)));
-
-    QTextBlock block(changeStartBlock);
-    if (changeStartBlock == changeEndBlock && newBlockCount == m_blockCount)
+    for (qint64 line = first; line <= last; line++)
     {
-        int blockLineCount = block.layout()->lineCount();
-        if (block.isValid() && blockLineCount)
+        const ConsoleLine *layout = m_layouts.object(line);
+        if (layout && layout->generation == m_generation)
         {
-            QRectF oldBoundingRect(blockBoundingRect(block));
-            layoutBlock(block);
-
-            QRectF newBoundingRect(blockBoundingRect(block));
-            if (newBoundingRect.height() == oldBoundingRect.height())
-            {
-                return;
-            }
+            continue;
         }
+
+        const qreal width = m_index.width(line);
+        m_index.setLine(line, estimatedHeight(line, width), width);
     }
-    else
+}
+
+// Two screenfuls of lines either way, at least one of them in view
+void ConsoleDocumentLayout::reestimateAround(qint64 line) const
+{
+    const int rows = qCeil(m_viewportHeight / m_lineHeight) + 1;
+
+    reestimate(line - 2 * rows, line + 2 * rows);
+}
+
+void ConsoleDocumentLayout::scheduleRewrap()
+{
+    if (!m_rewrapQueued)
     {
-        do
-        {
-            block.clearLayout();
-            if (block == changeEndBlock)
-            {
-                break;
-            }
-            block = block.next();
-        } while (block.isValid());
+        m_rewrapQueued = true;
+        QMetaObject::invokeMethod(this, "rewrap", Qt::QueuedConnection);
     }
+}
 
-    if (newBlockCount != m_blockCount)
-    {
-        int changeEnd = changeEndBlock.blockNumber();
-        int blockDiff = newBlockCount - m_blockCount;
-        int oldChangeEnd = changeEnd - blockDiff;
+// Works back from the newest of the lines left over from before the last
+// change, which are the likeliest to be scrolled to, a budget at a time
+void ConsoleDocumentLayout::rewrap()
+{
+    m_rewrapQueued = false;
 
-        if (m_maximumWidthBlockNumber > oldChangeEnd)
-        {
-            m_maximumWidthBlockNumber += blockDiff;
-        }
+    sync();
 
-        m_blockCount = newBlockCount;
-        if (m_blockCount == 1)
+    QElapsedTimer timer;
+    timer.start();
+
+    while (m_rewrapNext >= m_index.firstLine())
+    {
+        const qint64 first = qMax(m_index.firstLine(), m_rewrapNext - REWRAP_LINES + 1);
+        reestimate(first, m_rewrapNext);
+        m_rewrapNext = first - 1;
+
+        if (timer.elapsed() >= REWRAP_BUDGET && m_rewrapNext >= m_index.firstLine())
         {
-            m_maximumWidth = blockWidth(doc->firstBlock());
+            scheduleRewrap();
+            break;
         }
     }
+
+    emit documentSizeChanged();
 }
 
-QTextBlock ConsoleDocumentLayout::bottomBlock(int scroll) const
+qreal ConsoleDocumentLayout::availableWidth() const
 {
-    if (!document())
+    qreal width = m_width;
+    if (width <= 0)
     {
-        return QTextBlock();
+        width = qreal(INT_MAX);
     }
 
-    QTextBlock block;
-    if (scroll > 0)
-    {
-        m_scroll = scroll;
-        block = document()->findBlockByNumber(m_scroll - 1);
-    }
-    else if (scroll < 0 && m_scroll > 0)
+    return width - 2 * DOCUMENT_MARGIN;
+}
+
+// Rows that a line this many average characters wide wraps into; the line
+// still being written takes no room until there's something on it
+qreal ConsoleDocumentLayout::estimatedHeight(qint64 line, qreal width) const
+{
+    if (width <= 0 && line == m_document->lines().lastLine())
     {
-        block = document()->findBlockByNumber(m_scroll - 1);
+        return 0;
     }
-    else
+
+    const int columns = qMax(1, int(availableWidth() / m_charWidth));
+    const int length = qRound(width);
+
+    return qMax(1, (length + columns - 1) / columns) * m_lineHeight;
+}
+
+// Where the lines in view go, bottom line first, and which line that is.
+// Scrolled back, lines are placed down from the one the view is held on;
+// otherwise, or when they run out before the view is full, up from the last.
+// Either way lines are laid out as they're placed, so positions are exact.
+qint64 ConsoleDocumentLayout::placeLines(QVector<QRectF> &rects, qreal width) const
+{
+    sync();
+
+    const LineBuffer &lines = m_document->lines();
+
+    rects.clear();
+
+    if (!m_atBottom && m_index.totalHeight() > m_viewportHeight)
     {
-        if (scroll == 0)
+        qint64 line = m_anchorLine;
+        qreal y = -m_anchorOffset;
+        if (line < lines.firstLine())
+        {
+            line = lines.firstLine();
+            y = 0;
+        }
+
+        while (y < m_viewportHeight && lines.contains(line))
         {
-            m_scroll = 0;
+            const qreal height = m_index.contains(line) && m_index.height(line) <= 0 ? 0 : lineLayout(line)->height;
+            rects.prepend(QRectF(0, y, width, height));
+            y += height;
+            line++;
         }
 
-        block = document()->lastBlock();
+        if (y >= m_viewportHeight)
+        {
+            return line - 1;
+        }
+
+        rects.clear();
     }
 
-    if (block.text().isEmpty())
+    qreal y = m_viewportHeight;
+
+    qint64 line = lines.lastLine();
+    while (y > 0 && lines.contains(line))
     {
-        return block.previous();
+        const qreal height = m_index.contains(line) && m_index.height(line) <= 0 ? 0 : lineLayout(line)->height;
+        y -= height;
+        rects.append(QRectF(0, y, width, height));
+        line--;
     }
 
-    return block;
+    return lines.lastLine();
 }
 
-void ConsoleDocumentLayout::layoutBlock(const QTextBlock &block)
+ConsoleLine * ConsoleDocumentLayout::lineLayout(qint64 line) const
 {
-    QTextDocument *doc = document();
-    qreal margin = doc->documentMargin();
-    qreal blockMaximumWidth = 0;
+    ConsoleLine *layout = m_layouts.object(line);
+    if (layout && layout->generation == m_generation)
+    {
+        return layout;
+    }
 
-    qreal height = 0;
-    QTextLayout *textLayout = block.layout();
-    QTextOption option = doc->defaultTextOption();
-    textLayout->setTextOption(option);
+    const LineBuffer &lines = m_document->lines();
+
+    layout = new ConsoleLine;
+    layout->generation = m_generation;
+    layout->text = lines.text(line);
+    layout->runs = lines.runs(line);
 
-    int extraMargin = 0;
-    if (option.flags() & QTextOption::AddSpaceForLineAndParagraphSeparators)
+    const QString &text = layout->text;
+    const QVector<LineRun> &runs = layout->runs;
+
+    const qreal availableWidth = this->availableWidth();
+
+    // The open line stays out of the way until there's something on it
+    const bool open = text.isEmpty() && line == lines.lastLine();
+
+    if (fitsGrid(layout))
     {
-        QFontMetrics metrics(block.charFormat().font());
-        extraMargin += metrics.width(QChar(0x21B5));
+        const qreal cellWidth = m_glyphs.cellWidth();
+
+        layout->columns = qMax(1, int(availableWidth / cellWidth));
+        layout->rows = qMax(1, (text.length() + layout->columns - 1) / layout->columns);
+        layout->height = layout->rows * m_glyphs.cellHeight();
+
+        m_index.setLine(line, open ? 0 : layout->height, text.length());
+
+        m_layouts.insert(line, layout);
+
+        return layout;
     }
 
-    textLayout->beginLayout();
-    qreal availableWidth = m_width;
-    if (availableWidth <= 0)
+    QList<QTextLayout::FormatRange> formats;
+    for (int n = 0; n < runs.size(); n++)
     {
-        availableWidth = qreal(INT_MAX);
+        QTextLayout::FormatRange range;
+        range.start = runs.at(n).offset;
+        range.length = (n + 1 < runs.size() ? runs.at(n + 1).offset : text.length()) - range.start;
+        range.format = m_document->format(runs.at(n).format);
+        formats.append(range);
     }
-    availableWidth -= 2 * margin + extraMargin;
 
+    QTextLayout *textLayout = new QTextLayout(text, m_document->defaultFormat().font());
+    textLayout->setAdditionalFormats(formats);
+    textLayout->setCacheEnabled(true);
+
+    QTextOption option;
+    option.setWrapMode(QTextOption::WrapAtWordBoundaryOrAnywhere);
+    textLayout->setTextOption(option);
+
+    qreal height = 0;
+    qreal width = 0;
+
+    textLayout->beginLayout();
     while (true)
     {
-        QTextLine line(textLayout->createLine());
-        if (!line.isValid())
+        QTextLine textLine(textLayout->createLine());
+        if (!textLine.isValid())
         {
             break;
         }
 
-        line.setLeadingIncluded(true);
-        line.setLineWidth(availableWidth);
-        line.setPosition(QPointF(margin, height));
-
-        height += line.height();
+        textLine.setLeadingIncluded(true);
+        textLine.setLineWidth(availableWidth);
+        textLine.setPosition(QPointF(DOCUMENT_MARGIN, height));
 
-        blockMaximumWidth = qMax(blockMaximumWidth, line.naturalTextWidth() + 2 * margin);
+        height += textLine.height();
+        width += textLine.naturalTextWidth();
     }
     textLayout->endLayout();
 
-    const_cast<QTextBlock&>(block).setLineCount(block.isVisible() ? textLayout->lineCount() : 0);
+    layout->textLayout = textLayout;
+    layout->rows = textLayout->lineCount();
+    layout->height = height;
+
+    // Unwrapped, the rows would sit end to end
+    m_index.setLine(line, open ? 0 : height, width / m_charWidth);
+
+    m_layouts.insert(line, layout);
+
+    return layout;
+}
+
+// Complex scripts, wide characters and fonts that don't keep to the cell size all need QTextLayout
+bool ConsoleDocumentLayout::fitsGrid(const ConsoleLine *layout) const
+{
+    if (!m_gridEnabled)
+    {
+        return false;
+    }
 
-    if (blockMaximumWidth > m_maximumWidth)
+    m_glyphs.setFont(m_document->defaultFormat().font());
+    if (!m_glyphs.fits(layout->text))
     {
-        m_maximumWidth = blockMaximumWidth;
-        m_maximumWidthBlockNumber = block.blockNumber();
+        return false;
     }
-    else if (block.blockNumber() == m_maximumWidthBlockNumber && blockMaximumWidth < m_maximumWidth)
+
+    foreach (const LineRun &run, layout->runs)
     {
-        m_maximumWidth = 0;
+        if (!m_glyphs.fits(m_document->format(run.format).font()))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void ConsoleDocumentLayout::drawGrid(QPainter *painter, const ConsoleLine *layout, const QPointF &pos,
+                                     const QVector<QTextLayout::FormatRange> &selections) const
+{
+    const QVector<LineRun> &runs = layout->runs;
+    const int length = layout->text.length();
+
+    // A span starts wherever a style run or one of the selections does
+    QVarLengthArray<int, 32> cuts;
+    cuts.append(0);
+    cuts.append(length);
+    foreach (const LineRun &run, runs)
+    {
+        cuts.append(qBound(0, run.offset, length));
+    }
+    foreach (const QTextLayout::FormatRange &range, selections)
+    {
+        cuts.append(qBound(0, range.start, length));
+        cuts.append(qBound(0, range.start + range.length, length));
+    }
+    qSort(cuts.begin(), cuts.end());
+
+    int run = 0;
+    for (int n = 0; n + 1 < cuts.size(); n++)
+    {
+        const int start = cuts.at(n);
+        const int stop = cuts.at(n + 1);
+        if (start == stop)
+        {
+            continue;
+        }
+
+        while (run + 1 < runs.size() && runs.at(run + 1).offset <= start)
+        {
+            run++;
+        }
+
+        QTextCharFormat fmt(runs.isEmpty() ? m_document->defaultFormat() : m_document->format(runs.at(run).format));
+        foreach (const QTextLayout::FormatRange &range, selections)
+        {
+            if (range.start <= start && range.start + range.length >= stop)
+            {
+                fmt.merge(range.format);
+            }
+        }
 
-        QTextBlock maximumBlock;
-        QTextBlock b(doc->firstBlock());
-        while (b.isValid())
+        drawCells(painter, layout, pos, start, stop, fmt);
+    }
+
+    // A selection that runs on past the end takes in the line break, one cell wide
+    const int row = length / layout->columns;
+    if (row < layout->rows)
+    {
+        foreach (const QTextLayout::FormatRange &range, selections)
         {
-            qreal blockMaximumWidth = blockWidth(b);
-            if (blockMaximumWidth > m_maximumWidth)
+            if (range.start + range.length > length && range.format.background().style() != Qt::NoBrush)
             {
-                m_maximumWidth = blockMaximumWidth;
-                maximumBlock = b;
+                const QPointF cell(pos.x() + (length % layout->columns) * m_glyphs.cellWidth(),
+                                   pos.y() + row * m_glyphs.cellHeight());
+                painter->fillRect(QRectF(cell, QSizeF(m_glyphs.cellWidth(), m_glyphs.cellHeight())),
+                                  range.format.background());
             }
-            b = b.next();
         }
+    }
+}
+
+void ConsoleDocumentLayout::drawCells(QPainter *painter, const ConsoleLine *layout, const QPointF &pos,
+                                      int start, int stop, const QTextCharFormat &fmt) const
+{
+    const qreal cellWidth = m_glyphs.cellWidth();
+    const qreal cellHeight = m_glyphs.cellHeight();
+    const int columns = layout->columns;
+
+    const QFont font(fmt.font());
+    const QBrush background(fmt.background());
+    const QColor color(fmt.foreground().style() == Qt::NoBrush ? painter->pen().color() : fmt.foreground().color());
+
+    // Row by row where the span wraps
+    while (start < stop)
+    {
+        const int row = start / columns;
+        const int column = start % columns;
+        const int count = qMin(stop - start, columns - column);
 
-        if (maximumBlock.isValid())
+        const QPointF cell(pos.x() + column * cellWidth, pos.y() + row * cellHeight);
+        if (background.style() != Qt::NoBrush)
         {
-            m_maximumWidthBlockNumber = maximumBlock.blockNumber();
+            painter->fillRect(QRectF(cell, QSizeF(count * cellWidth, cellHeight)), background);
         }
+
+        m_glyphs.draw(painter, cell, layout->text.constData() + start, count, font, color);
+
+        start += count;
     }
 }
 
-qreal ConsoleDocumentLayout::blockWidth(const QTextBlock &block)
+// Search matches and the selection, to be drawn over the line's own formats
+QVector<QTextLayout::FormatRange> ConsoleDocumentLayout::overlays(qint64 line, const ConsoleLine *layout) const
 {
-    QTextLayout *textLayout = block.layout();
-    if (!textLayout->lineCount())
+    QVector<QTextLayout::FormatRange> selections;
+
+    const ScrollbackSearch *search = m_document->search();
+    if (search->isActive() && search->count() > 0)
     {
-        return 0;
+        foreach (const SearchMatch &match, search->matches(line))
+        {
+            QTextLayout::FormatRange o;
+            o.start = match.start;
+            o.length = match.length;
+            o.format = m_document->formatHighlight();
+            selections.append(o);
+        }
     }
 
-    qreal blockWidth = 0;
-    for (int n = 0; n < textLayout->lineCount(); n++)
+    // The selection goes last so it's painted over any matches
+    const LinePosition selectionStart(m_document->selectionStart());
+    const LinePosition selectionEnd(m_document->selectionEnd());
+    if (m_document->hasSelection() && line >= selectionStart.line && line <= selectionEnd.line)
     {
-        QTextLine line(textLayout->lineAt(n));
-        blockWidth = qMax(line.naturalTextWidth() + 8, blockWidth);
+        QTextLayout::FormatRange o;
+        o.start = line == selectionStart.line ? selectionStart.column : 0;
+        o.length = (line == selectionEnd.line ? selectionEnd.column : layout->text.length() + 1) - o.start;
+        o.format = m_document->formatSelection();
+
+        if (o.length > 0)
+        {
+            selections.append(o);
+        }
     }
 
-    return blockWidth;
+    return selections;
 }
 
-void ConsoleDocumentLayout::relayout()
+void ConsoleDocumentLayout::drawLine(QPainter *painter, qint64 line, const ConsoleLine *layout, const QPointF &pos) const
 {
-    QTextBlock block(document()->firstBlock());
-    while (block.isValid())
+    const QVector<QTextLayout::FormatRange> selections(overlays(line, layout));
+
+    if (layout->textLayout)
+    {
+        layout->textLayout->draw(painter, pos, selections);
+    }
+    else
     {
-        block.layout()->clearLayout();
-        block.setLineCount(block.isVisible() ? 1 : 0);
-        block = block.next();
+        drawGrid(painter, layout, pos + QPointF(DOCUMENT_MARGIN, 0), selections);
     }
+}
+
+// Lines are drawn once into a pixmap of their own, which is copied from then
+// on until the line, its overlays, the formats or the width change
+void ConsoleDocumentLayout::drawTile(QPainter *painter, qint64 line, const ConsoleLine *layout, const QRectF &rect)
+{
+    const int ratio = qMax(1, painter->device()->devicePixelRatio());
+    const QColor background(painter->background().color());
 
-    emit update();
+    LineTile *tile = m_tiles.object(line);
+    if (tile && tile->width == rect.width() && tile->ratio == ratio && tile->background == background.rgba())
+    {
+        painter->drawPixmap(rect.topLeft(), tile->pixmap);
+        return;
+    }
+
+    const QSize size(qCeil(rect.width()) * ratio, qCeil(rect.height()) * ratio);
+
+    tile = new LineTile;
+    tile->width = rect.width();
+    tile->ratio = ratio;
+    tile->background = background.rgba();
+    tile->pixmap = QPixmap(size);
+    tile->pixmap.setDevicePixelRatio(ratio);
+    tile->pixmap.fill(background);
+
+    QPainter tilePainter(&tile->pixmap);
+    tilePainter.setPen(painter->pen());
+    tilePainter.setFont(painter->font());
+    drawLine(&tilePainter, line, layout, QPointF(0, 0));
+    tilePainter.end();
+
+    painter->drawPixmap(rect.topLeft(), tile->pixmap);
+
+    // Cost in kilobytes; a tile bigger than the whole cache is dropped right here
+    m_tiles.insert(line, tile, qMax(1, size.width() * size.height() / 256));
 }
+
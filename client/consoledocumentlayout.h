@@ -24,46 +24,178 @@
 #ifndef CONSOLEDOCUMENTLAYOUT_H
 #define CONSOLEDOCUMENTLAYOUT_H
 
-#include <QAbstractTextDocumentLayout>
-#include <QTextDocument>
+#include <QCache>
+#include <QObject>
+#include <QPainter>
+#include <QPixmap>
+#include <QTextLayout>
+#include <QVector>
+#include "glyphcache.h"
+#include "layoutindex.h"
+#include "linebuffer.h"
+
+class ConsoleDocument;
+
+// A line ready to draw. When the glyph cache can take all of it, it's a grid
+// of cells wrapped at the column count; otherwise it has a QTextLayout. It's
+// only good for the generation of width and formats it was laid out in.
+struct ConsoleLine
+{
+    ConsoleLine() : textLayout(0), columns(0), rows(0), height(0), generation(0) {}
+    ~ConsoleLine() { delete textLayout; }
+
+    QTextLayout *textLayout;
+    QString text;
+    QVector<LineRun> runs;
+    int columns;
+    int rows;
+    qreal height;
+    int generation;
+
+private:
+    Q_DISABLE_COPY(ConsoleLine)
+};
+
+// A line as last drawn, to be copied to the display while nothing about it changes
+struct LineTile
+{
+    QPixmap pixmap;
+    qreal width;
+    int ratio;
+    QRgb background;
+};
+
+// What it takes to bring the display up to date: shift what's in the area
+// by this many pixels, then paint what's dirty
+struct LayoutDamage
+{
+    LayoutDamage() : scroll(0) {}
 
-class ConsoleDocumentLayout : public QAbstractTextDocumentLayout
+    int scroll;
+    QRect area;
+    QRect dirty;
+};
+
+// Lays out and draws the lines of a ConsoleDocument; only lines that get
+// drawn or hit-tested are laid out, and those are cached. Every line has a
+// height in the index, estimated from its length until it's laid out, so the
+// view can be scrolled a pixel at a time through lines of any height.
+class ConsoleDocumentLayout : public QObject
 {
     Q_OBJECT
 public:
-    explicit ConsoleDocumentLayout(QTextDocument *doc);
+    explicit ConsoleDocumentLayout(ConsoleDocument *doc);
     ~ConsoleDocumentLayout();
 
-    virtual void draw(QPainter *painter, const PaintContext &context);
-    virtual int hitTest(const QPointF &point, Qt::HitTestAccuracy accuracy) const;
+    ConsoleDocument * document() const { return m_document; }
+
+    void draw(QPainter *painter, const QRectF &clip);
+    LinePosition hitTest(const QPointF &point) const;
+    QString anchorAt(const QPointF &point) const;
+
+    QSizeF documentSize() const;
+    qreal lineSpacing() const;
+
+    // The view is scrolled by the offset of its top edge into the document.
+    // It holds on to the line there while lines above it come and go or turn
+    // out taller or shorter than estimated, unless it's at the bottom, where
+    // it stays to follow new lines.
+    qreal viewportHeight() const { return m_viewportHeight; }
+    void setViewportHeight(qreal height);
+    qreal scrollPosition() const;
+    qreal maximumScroll() const;
+    void scrollTo(qreal position);
+    void scrollToBottom();
+    bool isAtBottom() const { return m_atBottom; }
+    // Top of the view that puts the bottom of this line at the bottom
+    qreal bottomPosition(qint64 line) const;
 
-    virtual int pageCount() const;
-    virtual QSizeF documentSize() const;
+    qreal textWidth() const { return m_width; }
+    void setTextWidth(qreal width);
 
-    virtual QRectF frameBoundingRect(QTextFrame *frame) const;
-    virtual QRectF blockBoundingRect(const QTextBlock &block) const;
+    void invalidate(qint64 line);
+    void invalidate();
+    // Later lines move up to fill the gap, as in the LineBuffer
+    void removeLines(qint64 first, int count);
 
-    void ensureBlockLayout(const QTextBlock &block) const;
+    // Fixed-pitch output is drawn cell by cell from cached glyphs unless this is off
+    bool isGridEnabled() const { return m_gridEnabled; }
+    void setGridEnabled(bool flag);
+    bool isFixedPitch() const;
 
-    qreal textWidth() const { return m_width; }
-    void setTextWidth(qreal width);
+    bool isTilesEnabled() const { return m_tilesEnabled; }
+    void setTilesEnabled(bool flag);
 
-protected:
-    virtual void documentChanged(int from, int charsRemoved, int charsAdded);
+    // Lines that look different now, although their layout may still be good
+    void markDirty(qint64 first, qint64 last);
+    void markDirty();
 
-private:
-    QTextBlock bottomBlock(int scroll = -1) const;
+    // Measured against the last draw; nothing to do when none of what changed is on screen
+    LayoutDamage takeDamage();
 
-    void layoutBlock(const QTextBlock &block);
-    qreal blockWidth(const QTextBlock &block);
+signals:
+    void documentSizeChanged();
 
-    void relayout();
+private slots:
+    void rewrap();
+
+private:
+    void sync() const;
+    void updateMetrics() const;
+    void reestimate(qint64 first, qint64 last) const;
+    void reestimateAround(qint64 line) const;
+    void scheduleRewrap();
+    qreal availableWidth() const;
+    qreal estimatedHeight(qint64 line, qreal width) const;
+    qint64 placeLines(QVector<QRectF> &rects, qreal width) const;
+    ConsoleLine * lineLayout(qint64 line) const;
+    bool fitsGrid(const ConsoleLine *layout) const;
+    void drawGrid(QPainter *painter, const ConsoleLine *layout, const QPointF &pos,
+                  const QVector<QTextLayout::FormatRange> &selections) const;
+    void drawCells(QPainter *painter, const ConsoleLine *layout, const QPointF &pos,
+                   int start, int stop, const QTextCharFormat &fmt) const;
+    QVector<QTextLayout::FormatRange> overlays(qint64 line, const ConsoleLine *layout) const;
+    void drawLine(QPainter *painter, qint64 line, const ConsoleLine *layout, const QPointF &pos) const;
+    void drawTile(QPainter *painter, qint64 line, const ConsoleLine *layout, const QRectF &rect);
+
+    ConsoleDocument *m_document;
+
+    mutable QCache<qint64, ConsoleLine> m_layouts;
+    mutable GlyphCache m_glyphs;
+    bool m_gridEnabled;
+
+    QCache<qint64, LineTile> m_tiles;
+    bool m_tilesEnabled;
 
     qreal m_width;
-    qreal m_maximumWidth;
-    int m_maximumWidthBlockNumber;
-    int m_blockCount;
-    mutable int m_scroll;
+
+    // Widths are kept in average characters, and heights are estimated from
+    // them at this much per character and line until the line is laid out
+    mutable LayoutIndex m_index;
+    mutable qreal m_charWidth;
+    mutable qreal m_lineHeight;
+
+    // Bumped whenever the width, the font or the formats change. Lines up to
+    // m_rewrapNext still have heights from before; those around the view are
+    // estimated again straight away and the rest in idle time.
+    int m_generation;
+    mutable bool m_metricsStale;
+    qint64 m_rewrapNext;
+    bool m_rewrapQueued;
+
+    qreal m_viewportHeight;
+    bool m_atBottom;
+    qint64 m_anchorLine;
+    qreal m_anchorOffset;
+
+    // Where each line went in the last draw, bottom line first
+    QVector<QRectF> m_drawnRects;
+    QRectF m_drawnArea;
+    qint64 m_drawnBottom;
+
+    bool m_dirtyAll;
+    qint64 m_dirtyFirst;
+    qint64 m_dirtyLast;
 };
 
 #endif // CONSOLEDOCUMENTLAYOUT_H
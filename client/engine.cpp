@@ -28,9 +28,11 @@
 #include "logging.h"
 #include "console.h"
 #include "event.h"
+#include "luajson.h"
 #include "matchable.h"
 #include "profile.h"
 #include "profileitem.h"
+#include "renderscheduler.h"
 
 using namespace luabridge;
 
@@ -62,6 +64,50 @@ inline bool lua_isarray(lua_State *L, int index)
     return true;
 }
 
+// Tables compare by contents, so a re-sent but identical value isn't a change
+static bool lua_deepequal(lua_State *L, int a, int b, int depth = 0)
+{
+    a = lua_absindex(L, a);
+    b = lua_absindex(L, b);
+
+    if (lua_rawequal(L, a, b))
+    {
+        return true;
+    }
+
+    if (!lua_istable(L, a) || !lua_istable(L, b) || depth > 32 || !lua_checkstack(L, 4))
+    {
+        return false;
+    }
+
+    int count = 0;
+    lua_pushnil(L);
+    while (lua_next(L, a))
+    {
+        count++;
+
+        lua_pushvalue(L, -2);
+        lua_rawget(L, b);
+        bool same = lua_deepequal(L, -2, -1, depth + 1);
+        lua_pop(L, 2);
+
+        if (!same)
+        {
+            lua_pop(L, 1);
+            return false;
+        }
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, b))
+    {
+        count--;
+        lua_pop(L, 1);
+    }
+
+    return count == 0;
+}
+
 namespace luabridge
 {
 
@@ -90,6 +136,12 @@ struct Stack <QVariant>
             return;
         }
 
+        if (value.userType() == qMetaTypeId<LuaRegistryRef>())
+        {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, value.value<LuaRegistryRef>().ref);
+            return;
+        }
+
         switch (value.userType())
         {
         case QMetaType::Bool:
@@ -362,8 +414,17 @@ void Engine::initialize(Console *c)
         .addCFunction("Send", Engine::send)
         .addCFunction("SendAlias", Engine::sendAlias)
         .addCFunction("SendGmcp", Engine::sendGmcp)
+        .addCFunction("Speedwalk", Engine::speedwalk)
+        .addCFunction("GetSendQueue", Engine::getSendQueue)
+        .addCFunction("SetSendRate", Engine::setSendRate)
+        .addCFunction("GetLatency", Engine::getLatency)
+        .addCFunction("GetFrameStats", Engine::getFrameStats)
+        .addCFunction("ResetFrameStats", Engine::resetFrameStats)
         .addCFunction("DeleteLine", Engine::deleteLine)
         .addCFunction("DeleteLines", Engine::deleteLines)
+        .addCFunction("GagLine", Engine::gagLine)
+        .addCFunction("Substitute", Engine::substitute)
+        .addCFunction("ColorMatch", Engine::colorMatch)
         .addCFunction("Simulate", Engine::simulate)
         .addCFunction("JsonDecode", Engine::jsonDecode)
         .addCFunction("JsonEncode", Engine::jsonEncode)
@@ -376,7 +437,14 @@ void Engine::initialize(Console *c)
         .addCFunction("Version", Engine::version)
         .addCFunction("RaiseEvent", Engine::raiseEvent)
         .addCFunction("RegisterEvent", Engine::registerEvent)
-        .addCFunction("UnregisterEvent", Engine::unregisterEvent);
+        .addCFunction("UnregisterEvent", Engine::unregisterEvent)
+        .addCFunction("SubscribeGmcp", Engine::subscribeGmcp)
+        .addCFunction("UnsubscribeGmcp", Engine::unsubscribeGmcp)
+        .addCFunction("SendMsdp", Engine::sendMsdp);
+
+    // What JsonDecode() and GMCP give for a JSON null, so scripts can test for it
+    LuaJson::pushNull(m_global);
+    lua_setglobal(m_global, "JsonNull");
 
     lua_settop(m_global, 0);
 
@@ -820,7 +888,18 @@ int Engine::sendGmcp(lua_State *L)
     QString msg(luaL_checkstring(L, 1));
 
     bool result = false;
-    if (!lua_isnone(L, 2))
+    if (lua_istable(L, 2))
+    {
+        QByteArray json;
+        QString err;
+        if (!LuaJson::encode(L, 2, json, &err))
+        {
+            return luaL_error(L, "SendGmcp: %s", qPrintable(err));
+        }
+
+        result = c->connection()->sendGmcpData(msg, json);
+    }
+    else if (!lua_isnone(L, 2))
     {
         result = c->sendGmcp(msg, LuaRef::fromStack(L, 2));
     }
@@ -833,6 +912,104 @@ int Engine::sendGmcp(lua_State *L)
     return 1;
 }
 
+int Engine::speedwalk(lua_State *L)
+{
+    Console *c = registryObject<Console>(L, "CONSOLE");
+
+    bool echo = true;
+    if (lua_isboolean(L, 2))
+    {
+        echo = lua_toboolean(L, 2) != 0;
+    }
+
+    push(L, c->sendSpeedwalk(luaL_checkstring(L, 1), echo));
+    return 1;
+}
+
+int Engine::getSendQueue(lua_State *L)
+{
+    Console *c = registryObject<Console>(L, "CONSOLE");
+    ConnectionStats stats(c->connection()->stats());
+
+    LuaRef queue(newTable(L));
+    queue["depth"] = stats.queueDepth;
+    queue["priorityBytes"] = stats.priorityBytes;
+    queue["flushes"] = double(stats.flushes);
+    queue["commands"] = double(stats.commandsSent);
+    queue["bytes"] = double(stats.bytesSent);
+    queue["throttled"] = double(stats.throttled);
+    queue["rate"] = stats.sendRate;
+    queue["burst"] = stats.sendBurst;
+
+    queue.push(L);
+    return 1;
+}
+
+int Engine::setSendRate(lua_State *L)
+{
+    Console *c = registryObject<Console>(L, "CONSOLE");
+
+    int rate = luaL_checkint(L, 1);
+    int burst = luaL_optint(L, 2, 0);
+
+    c->connection()->setSendRate(rate, burst);
+
+    return 0;
+}
+
+int Engine::getLatency(lua_State *L)
+{
+    Console *c = registryObject<Console>(L, "CONSOLE");
+    LatencyStats stats(c->connection()->latency());
+
+    LuaRef latency(newTable(L));
+    latency["samples"] = double(stats.samples);
+    latency["last"] = stats.last;
+    latency["min"] = stats.min;
+    latency["avg"] = stats.average;
+    latency["p50"] = stats.p50;
+    latency["p95"] = stats.p95;
+    latency["p99"] = stats.p99;
+    latency["max"] = stats.max;
+    latency["ewma"] = stats.ewma;
+
+    latency.push(L);
+    return 1;
+}
+
+int Engine::getFrameStats(lua_State *L)
+{
+    Console *c = registryObject<Console>(L, "CONSOLE");
+    FrameStats stats(c->renderScheduler()->stats());
+
+    LuaRef frames(newTable(L));
+    frames["rate"] = stats.frameRate;
+    frames["requests"] = double(stats.requests);
+    frames["frames"] = double(stats.frames);
+    frames["fps"] = stats.fps;
+    frames["paints"] = double(stats.paint.samples);
+    frames["last"] = stats.paint.last;
+    frames["min"] = stats.paint.min;
+    frames["avg"] = stats.paint.average;
+    frames["p50"] = stats.paint.p50;
+    frames["p95"] = stats.paint.p95;
+    frames["p99"] = stats.paint.p99;
+    frames["max"] = stats.paint.max;
+    frames["ewma"] = stats.paint.ewma;
+
+    frames.push(L);
+    return 1;
+}
+
+int Engine::resetFrameStats(lua_State *L)
+{
+    Console *c = registryObject<Console>(L, "CONSOLE");
+
+    c->renderScheduler()->resetStats();
+
+    return 0;
+}
+
 int Engine::deleteLine(lua_State *L)
 {
     Console *c = registryObject<Console>(L, "CONSOLE");
@@ -851,6 +1028,52 @@ int Engine::deleteLines(lua_State *L)
     return 0;
 }
 
+int Engine::gagLine(lua_State *L)
+{
+    Console *c = registryObject<Console>(L, "CONSOLE");
+
+    c->gagLine();
+
+    return 0;
+}
+
+// Substitute(text [, capture]) swaps what the calling trigger matched, or one of its captures
+int Engine::substitute(lua_State *L)
+{
+    Console *c = registryObject<Console>(L, "CONSOLE");
+
+    QString text(luaL_checkstring(L, 1));
+
+    int start;
+    int length;
+    lua_pushboolean(L, matchSpan(L, 2, start, length) && c->substitute(start, length, text));
+    return 1;
+}
+
+// ColorMatch(fg, bg [, capture]) recolours the same span
+int Engine::colorMatch(lua_State *L)
+{
+    Console *c = registryObject<Console>(L, "CONSOLE");
+
+    QString fg(luaL_checkstring(L, 1));
+    QString bg(luaL_checkstring(L, 2));
+
+    QTextCharFormat fmt;
+    if (!fg.isEmpty())
+    {
+        fmt.setForeground(QColor(fg));
+    }
+    if (!bg.isEmpty())
+    {
+        fmt.setBackground(QColor(bg));
+    }
+
+    int start;
+    int length;
+    lua_pushboolean(L, matchSpan(L, 3, start, length) && c->recolor(start, length, fmt));
+    return 1;
+}
+
 int Engine::simulate(lua_State *L)
 {
     Console *c = registryObject<Console>(L, "CONSOLE");
@@ -877,16 +1100,13 @@ int Engine::jsonDecode(lua_State *L)
     }
     else
     {
-        QString data(luaL_checkstring(L, 1));
-        QJsonDocument doc(QJsonDocument::fromJson(data.toUtf8()));
+        size_t length;
+        const char *data = luaL_checklstring(L, 1, &length);
 
-        if (doc.isEmpty())
+        // Anything that isn't JSON comes back unchanged
+        if (!LuaJson::decode(L, data, int(length)))
         {
-            lua_pushstring(L, qPrintable(data));
-        }
-        else
-        {
-            push(L, QVariant(doc));
+            lua_pushvalue(L, 1);
         }
     }
 
@@ -899,31 +1119,20 @@ int Engine::jsonEncode(lua_State *L)
     {
         lua_pushnil(L);
     }
-    else
+    else if (lua_istable(L, 1))
     {
-        QVariant var(LuaRef::fromStack(L, 1).cast<QVariant>());
-        if (var.isNull())
+        QByteArray json;
+        QString err;
+        if (!LuaJson::encode(L, 1, json, &err))
         {
-            lua_pushnil(L);
+            return luaL_error(L, "JsonEncode: %s", qPrintable(err));
         }
-        else
-        {
-            switch (var.type())
-            {
-            case QVariant::Map:
-            case QVariant::List:
-            case QVariant::StringList:
-            {
-                QJsonDocument json(QJsonDocument::fromVariant(var));
-                lua_pushstring(L, json.toJson(QJsonDocument::Compact));
-            }
-                break;
 
-            default:
-                push(L, var);
-                break;
-            }
-        }
+        lua_pushlstring(L, json.constData(), json.length());
+    }
+    else
+    {
+        lua_pushvalue(L, 1);
     }
 
     return 1;
@@ -1060,6 +1269,8 @@ int Engine::registerEvent(lua_State *L)
     event->setSequence(qBound(1, luaL_optint(L, 3, 1000), 100000));
     h->append(event);
 
+    registryObject<Engine>(L, "ENGINE")->watchGmcp(name, true);
+
     qSort(h->begin(), h->end());
 
     push(L, reference);
@@ -1079,6 +1290,8 @@ int Engine::unregisterEvent(lua_State *L)
         {
             luaL_unref(L, LUA_REGISTRYINDEX, reference);
 
+            registryObject<Engine>(L, "ENGINE")->watchGmcp(event->pattern(), false);
+
             h->removeOne(event);
 
             delete event;
@@ -1106,41 +1319,311 @@ void Engine::enableGMCP(bool flag)
     }
 }
 
-void Engine::handleGMCP(const QString &name, const QString &args)
+void Engine::handleGmcp(const GmcpMessage &msg)
 {
-    QStringList modules(name.split('.', QString::SkipEmptyParts));
-    if (modules.isEmpty())
+    lua_State *L = m_global;
+
+    QByteArray data(msg.data());
+    if (!LuaJson::decode(L, data.constData(), data.length()))
     {
-        return;
+        lua_pushlstring(L, data.constData(), data.length());
+    }
+    else if (LuaJson::isNull(L, -1))
+    {
+        // A null message clears the cached state like a null field does
+        lua_pop(L, 1);
+        lua_pushnil(L);
     }
+    int message = lua_gettop(L);
 
-    QString primaryKey(modules.takeLast());
+    // Find gmcp.Char, creating the intermediate tables as needed
+    QList<QByteArray> modules(msg.name().split('.'));
+    QByteArray primaryKey(modules.takeLast());
 
-    LuaRef data(getGlobal(m_global, "gmcp"));
-    foreach (QString key, modules)
+    lua_getglobal(L, "gmcp");
+    foreach (const QByteArray &key, modules)
     {
-        LuaRef val(data[qPrintable(key)]);
-        if (val.isNil())
+        lua_pushlstring(L, key.constData(), key.length());
+        lua_rawget(L, -2);
+        if (!lua_istable(L, -1))
         {
-            data[qPrintable(key)] = newTable(m_global);
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushlstring(L, key.constData(), key.length());
+            lua_pushvalue(L, -2);
+            lua_rawset(L, -4);
         }
-        data = LuaRef(data[qPrintable(key)]);
+        lua_remove(L, -2);
     }
+    int parent = lua_gettop(L);
 
-    QVariantList varArgs;
-    QJsonDocument doc(QJsonDocument::fromJson(args.toUtf8()));
-    if (doc.isEmpty())
+    QString name(QString::fromUtf8(msg.name()));
+    QList<QPair<QString, QPair<int, int> > > changes;
+
+    if (lua_istable(L, message) && lua_rawlen(L, message) == 0)
     {
-        varArgs << qPrintable(args);
-        data[qPrintable(primaryKey)] = qPrintable(args);
+        // Objects are merged into the cached state a field at a time
+        lua_pushlstring(L, primaryKey.constData(), primaryKey.length());
+        lua_rawget(L, parent);
+        if (!lua_istable(L, -1))
+        {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushlstring(L, primaryKey.constData(), primaryKey.length());
+            lua_pushvalue(L, -2);
+            lua_rawset(L, parent);
+        }
+        int state = lua_gettop(L);
+
+        lua_pushnil(L);
+        while (lua_next(L, message))
+        {
+            // An explicit null removes the field from the cached state
+            if (LuaJson::isNull(L, -1))
+            {
+                lua_pop(L, 1);
+                lua_pushnil(L);
+            }
+
+            lua_pushvalue(L, -2);
+            lua_rawget(L, state);
+
+            if (lua_deepequal(L, -2, -1))
+            {
+                lua_pop(L, 2);
+                continue;
+            }
+
+            QString field;
+            if (!m_gmcpFields.isEmpty() && lua_type(L, -3) == LUA_TSTRING)
+            {
+                field = name + '.' + QString::fromUtf8(lua_tostring(L, -3));
+            }
+
+            if (!field.isEmpty() && m_gmcpFields.contains(field.toLower()))
+            {
+                int previous = luaL_ref(L, LUA_REGISTRYINDEX);
+                lua_pushvalue(L, -1);
+                int current = luaL_ref(L, LUA_REGISTRYINDEX);
+                changes.append(qMakePair(field, qMakePair(current, previous)));
+            }
+            else
+            {
+                lua_pop(L, 1);
+            }
+
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, state);
+        }
+    }
+    else
+    {
+        lua_pushlstring(L, primaryKey.constData(), primaryKey.length());
+        lua_pushvalue(L, message);
+        lua_rawset(L, parent);
+    }
+
+    lua_settop(L, message);
+    int value = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_settop(L, message - 1);
+
+    processEvents(QString("onGMCP %1").arg(name), QVariantList() << QVariant::fromValue(LuaRegistryRef(value)));
+
+    // Field handlers only hear about fields that actually changed, with the new and old values
+    for (int n = 0; n < changes.count(); n++)
+    {
+        const QPair<int, int> &refs = changes.at(n).second;
+
+        processGmcpField(changes.at(n).first, QVariantList() << QVariant::fromValue(LuaRegistryRef(refs.first)) << QVariant::fromValue(LuaRegistryRef(refs.second)));
+
+        luaL_unref(L, LUA_REGISTRYINDEX, refs.first);
+        luaL_unref(L, LUA_REGISTRYINDEX, refs.second);
+    }
+
+    luaL_unref(L, LUA_REGISTRYINDEX, value);
+}
+
+void Engine::processGmcpField(const QString &field, const QVariantList &args)
+{
+    EventList *h = registryData<EventList>(m_global, "HANDLERS");
+
+    // The event patterns are regular expressions that would also match the
+    // whole package, so field events go only to handlers named for the field
+    foreach (Event *event, *h)
+    {
+        QString prefix;
+        if (gmcpPrefix(event->pattern(), prefix) && prefix.compare(field, Qt::CaseInsensitive) == 0)
+        {
+            event->execute(this, args);
+        }
+    }
+}
+
+bool Engine::matchSpan(lua_State *L, int arg, int &start, int &length)
+{
+    Matchable *item = registryObject<Matchable>(L, "CALLER");
+    if (!item || !item->lastMatch())
+    {
+        return false;
+    }
+
+    const QRegularExpressionMatch *match = item->lastMatch();
+    if (lua_isnoneornil(L, arg))
+    {
+        start = match->capturedStart();
+        length = match->capturedLength();
+    }
+    else if (lua_type(L, arg) == LUA_TNUMBER)
+    {
+        const int capture = luaL_checkinteger(L, arg);
+        start = match->capturedStart(capture);
+        length = match->capturedLength(capture);
+    }
+    else
+    {
+        const QString name(luaL_checkstring(L, arg));
+        start = match->capturedStart(name);
+        length = match->capturedLength(name);
+    }
+
+    return start >= 0;
+}
+
+bool Engine::gmcpPrefix(const QString &eventName, QString &prefix)
+{
+    static const QString GMCP_EVENT("onGMCP");
+
+    QString pattern(eventName.trimmed());
+    if (pattern.startsWith('^'))
+    {
+        pattern.remove(0, 1);
+    }
+
+    if (!pattern.startsWith(GMCP_EVENT))
+    {
+        return false;
+    }
+
+    // Event names are regular expressions; a plain dotted package name is
+    // watched as a prefix, anything fancier has to see every message
+    prefix = pattern.mid(GMCP_EVENT.length()).trimmed();
+    prefix.remove('\\');
+    if (prefix.endsWith(".*"))
+    {
+        prefix.chop(2);
+    }
+    if (!QRegularExpression("^[\\w.]*$").match(prefix).hasMatch())
+    {
+        prefix.clear();
+    }
+
+    return true;
+}
+
+void Engine::watchGmcp(const QString &eventName, bool on)
+{
+    QString prefix;
+    if (!gmcpPrefix(eventName, prefix))
+    {
+        return;
+    }
+
+    Console *c = registryObject<Console>(m_global, "CONSOLE");
+    GmcpRouter *router = c->gmcpRouter();
+
+    QStringList subscriptions;
+    if (prefix.isEmpty())
+    {
+        subscriptions << "*";
     }
     else
     {
-        varArgs << QVariant(doc);
-        data[qPrintable(primaryKey)] = QVariant(doc);
+        subscriptions << prefix << prefix + ".*";
+
+        // Char.Vitals.hp could be a field of Char.Vitals, so the packages above it are needed too
+        QStringList parts(prefix.split('.'));
+        if (parts.count() > 1)
+        {
+            QString key(prefix.toLower());
+            if (on)
+            {
+                m_gmcpFields[key]++;
+            }
+            else if (--m_gmcpFields[key] <= 0)
+            {
+                m_gmcpFields.remove(key);
+            }
+
+            // MSDP only sends what has been asked for, so ask for the variables being watched
+            if (parts.first().compare("MSDP", Qt::CaseInsensitive) == 0)
+            {
+                QString variable(parts.at(1));
+                if (on && m_msdpReports[variable]++ == 0)
+                {
+                    c->connection()->reportMsdp(variable);
+                }
+                else if (!on && m_msdpReports.contains(variable) && --m_msdpReports[variable] <= 0)
+                {
+                    m_msdpReports.remove(variable);
+                    c->connection()->unreportMsdp(variable);
+                }
+            }
+
+            while (parts.count() > 1)
+            {
+                parts.removeLast();
+                subscriptions << parts.join('.');
+            }
+        }
     }
 
-    processEvents(QString("onGMCP %1").arg(name), varArgs);
+    foreach (const QString &subscription, subscriptions)
+    {
+        if (on)
+        {
+            router->subscribe(subscription, this);
+        }
+        else
+        {
+            router->unsubscribe(subscription, this);
+        }
+    }
+}
+
+int Engine::subscribeGmcp(lua_State *L)
+{
+    Engine *e = registryObject<Engine>(L, "ENGINE");
+
+    e->watchGmcp(QString("onGMCP %1").arg(luaL_checkstring(L, 1)), true);
+
+    return 0;
+}
+
+int Engine::unsubscribeGmcp(lua_State *L)
+{
+    Engine *e = registryObject<Engine>(L, "ENGINE");
+
+    e->watchGmcp(QString("onGMCP %1").arg(luaL_checkstring(L, 1)), false);
+
+    return 0;
+}
+
+int Engine::sendMsdp(lua_State *L)
+{
+    Console *c = registryObject<Console>(L, "CONSOLE");
+
+    QString variable(luaL_checkstring(L, 1));
+
+    QStringList values;
+    int numArgs = lua_gettop(L);
+    for (int n = 2; n <= numArgs; n++)
+    {
+        values << QString::fromUtf8(luaL_checkstring(L, n));
+    }
+
+    push(L, c->connection()->sendMsdp(variable, values));
+    return 1;
 }
 
 int Engine::loadResource(lua_State *L, const QString &resource)
@@ -24,16 +24,28 @@
 #ifndef ENGINE_H
 #define ENGINE_H
 
+#include <QHash>
 #include <QObject>
 #include <QString>
 #include <QVariant>
+#include "gmcprouter.h"
 #include "luastate.h"
 
 class Console;
 class Event;
 class Matchable;
 
-class Engine : public QObject
+// A value parked in the Lua registry so it can travel in a QVariantList of event arguments
+struct LuaRegistryRef
+{
+    LuaRegistryRef(int r = LUA_NOREF) : ref(r) {}
+
+    int ref;
+};
+
+Q_DECLARE_METATYPE(LuaRegistryRef)
+
+class Engine : public QObject, public GmcpHandler
 {
     Q_OBJECT
 public:
@@ -56,6 +68,8 @@ public:
 
     void processEvents(const QString &name, const QVariantList &args = QVariantList());
 
+    virtual void handleGmcp(const GmcpMessage &msg);
+
     void saveArguments(const QVariantList &args);
     void saveCaptures(const Matchable *item);
     void clearArguments();
@@ -69,8 +83,17 @@ public:
     static int send(lua_State *L);
     static int sendAlias(lua_State *L);
     static int sendGmcp(lua_State *L);
+    static int speedwalk(lua_State *L);
+    static int getSendQueue(lua_State *L);
+    static int setSendRate(lua_State *L);
+    static int getLatency(lua_State *L);
+    static int getFrameStats(lua_State *L);
+    static int resetFrameStats(lua_State *L);
     static int deleteLine(lua_State *L);
     static int deleteLines(lua_State *L);
+    static int gagLine(lua_State *L);
+    static int substitute(lua_State *L);
+    static int colorMatch(lua_State *L);
     static int simulate(lua_State *L);
     static int jsonDecode(lua_State *L);
     static int jsonEncode(lua_State *L);
@@ -84,20 +107,34 @@ public:
     static int raiseEvent(lua_State *L);
     static int registerEvent(lua_State *L);
     static int unregisterEvent(lua_State *L);
+    static int subscribeGmcp(lua_State *L);
+    static int unsubscribeGmcp(lua_State *L);
+    static int sendMsdp(lua_State *L);
 
 public slots:
     void enableGMCP(bool flag);
-    void handleGMCP(const QString &name, const QString &args);
 
 protected:
     int loadResource(lua_State *L, const QString &resource);
 
+private:
+    void watchGmcp(const QString &eventName, bool on);
+    void processGmcpField(const QString &field, const QVariantList &args);
+    static bool gmcpPrefix(const QString &eventName, QString &prefix);
+    static bool matchSpan(lua_State *L, int arg, int &start, int &length);
+
 private:
     LuaState m_global;
 
     QString m_chunk;
 
     bool m_GMCP;
+
+    // Lower-cased names that have a field-level onGMCP handler, with a count of each
+    QHash<QString, int> m_gmcpFields;
+
+    // MSDP variables reported on behalf of handlers watching MSDP.<variable>
+    QHash<QString, int> m_msdpReports;
 };
 
 #endif // ENGINE_H
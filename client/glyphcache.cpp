@@ -0,0 +1,255 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#include "glyphcache.h"
+#include <QFontInfo>
+#include <QFontMetricsF>
+#include <QtMath>
+#include <QVarLengthArray>
+
+static const int SHEET_COLUMNS = 16;
+static const int SHEET_ROWS = 8;
+
+// Past this many font and colour pairs the sheets are dropped and built again as needed
+static const int MAX_SHEETS = 256;
+
+GlyphCache::GlyphCache() :
+    m_fixedPitch(false),
+    m_cellWidth(0),
+    m_cellHeight(0),
+    m_ascent(0),
+    m_pixelRatio(1)
+{
+}
+
+GlyphCache::~GlyphCache()
+{
+    clear();
+}
+
+void GlyphCache::setFont(const QFont &font)
+{
+    if (m_cellWidth > 0 && font == m_font)
+    {
+        return;
+    }
+
+    clear();
+
+    m_font = font;
+
+    QFontMetricsF metrics(font);
+    m_cellWidth = metrics.width(QLatin1Char('M'));
+    m_cellHeight = metrics.lineSpacing();
+    m_ascent = metrics.ascent();
+
+    // Some fonts say they're fixed-pitch and aren't quite
+    m_fixedPitch = QFontInfo(font).fixedPitch() &&
+                   qFuzzyCompare(metrics.width(QLatin1Char('i')), m_cellWidth) &&
+                   qFuzzyCompare(metrics.width(QLatin1Char('W')), m_cellWidth);
+}
+
+void GlyphCache::clear()
+{
+    qDeleteAll(m_sheets);
+    m_sheets.clear();
+
+    m_fitsChar.clear();
+    m_fitsFont.clear();
+}
+
+bool GlyphCache::fits(const QString &text)
+{
+    if (!m_fixedPitch)
+    {
+        return false;
+    }
+
+    QFontMetricsF metrics(m_font);
+
+    const QChar *ch = text.constData();
+    const QChar *end = ch + text.length();
+    for (; ch != end; ++ch)
+    {
+        const ushort u = ch->unicode();
+        if (u >= 0x20 && u < 0x7f)
+        {
+            continue;
+        }
+
+        QHash<ushort, bool>::const_iterator it = m_fitsChar.constFind(u);
+        if (it == m_fitsChar.constEnd())
+        {
+            // Latin, Greek, Cyrillic, dashes and quotes, box drawing; combining
+            // marks, wide characters and anything that needs shaping are left out
+            const bool simple = (u >= 0xa0 && u < 0x300) ||
+                                (u >= 0x370 && u < 0x483) ||
+                                (u >= 0x48a && u < 0x530) ||
+                                (u >= 0x2010 && u < 0x2028) ||
+                                (u >= 0x2500 && u < 0x25a0);
+
+            it = m_fitsChar.insert(u, simple && metrics.inFont(*ch) &&
+                                   qFuzzyCompare(metrics.width(*ch), m_cellWidth));
+        }
+
+        if (!it.value())
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Bold or italic faces of the same family usually keep the cell size, but not always
+bool GlyphCache::fits(const QFont &font)
+{
+    if (!m_fixedPitch)
+    {
+        return false;
+    }
+
+    if (font == m_font)
+    {
+        return true;
+    }
+
+    const QString key(font.key());
+    QHash<QString, bool>::const_iterator it = m_fitsFont.constFind(key);
+    if (it == m_fitsFont.constEnd())
+    {
+        QFontMetricsF metrics(font);
+        it = m_fitsFont.insert(key, qFuzzyCompare(metrics.width(QLatin1Char('M')), m_cellWidth) &&
+                               qFuzzyCompare(metrics.width(QLatin1Char('i')), m_cellWidth) &&
+                               metrics.lineSpacing() <= m_cellHeight);
+    }
+
+    return it.value();
+}
+
+void GlyphCache::draw(QPainter *painter, const QPointF &pos, const QChar *text, int count,
+                      const QFont &font, const QColor &color)
+{
+    const int ratio = qMax(1, painter->device()->devicePixelRatio());
+    if (ratio != m_pixelRatio)
+    {
+        qDeleteAll(m_sheets);
+        m_sheets.clear();
+        m_pixelRatio = ratio;
+    }
+
+    GlyphSheet *glyphs = sheet(font, color);
+
+    // One call for the whole run; the sheet may grow while the glyphs are gathered
+    QVarLengthArray<QPainter::PixmapFragment, 256> fragments;
+    for (int n = 0; n < count; n++)
+    {
+        if (text[n] == QLatin1Char(' '))
+        {
+            continue;
+        }
+
+        const QRectF source(slotRect(slot(glyphs, text[n])));
+        const QPointF centre(pos.x() + n * m_cellWidth + source.width() / (2 * ratio),
+                             pos.y() + source.height() / (2 * ratio));
+        fragments.append(QPainter::PixmapFragment::create(centre, source, 1.0 / ratio, 1.0 / ratio));
+    }
+
+    if (!fragments.isEmpty())
+    {
+        painter->drawPixmapFragments(fragments.constData(), fragments.size(), glyphs->pixmap);
+    }
+}
+
+GlyphSheet * GlyphCache::sheet(const QFont &font, const QColor &color)
+{
+    const QString key(font.key() + QLatin1Char('/') + QString::number(color.rgba(), 16));
+
+    GlyphSheet *glyphs = m_sheets.value(key);
+    if (glyphs)
+    {
+        return glyphs;
+    }
+
+    if (m_sheets.size() >= MAX_SHEETS)
+    {
+        qDeleteAll(m_sheets);
+        m_sheets.clear();
+    }
+
+    const QRectF cell(slotRect(0));
+
+    glyphs = new GlyphSheet;
+    glyphs->font = font;
+    glyphs->color = color;
+    glyphs->pixmap = QPixmap(int(cell.width()) * SHEET_COLUMNS, int(cell.height()) * SHEET_ROWS);
+    glyphs->pixmap.fill(Qt::transparent);
+    m_sheets.insert(key, glyphs);
+
+    return glyphs;
+}
+
+int GlyphCache::slot(GlyphSheet *sheet, QChar ch)
+{
+    QHash<ushort, int>::const_iterator it = sheet->slots.constFind(ch.unicode());
+    if (it != sheet->slots.constEnd())
+    {
+        return it.value();
+    }
+
+    const int n = sheet->count++;
+    const QRectF rect(slotRect(n));
+
+    // Full: twice the rows, with the glyphs already there left where they were
+    if (rect.bottom() > sheet->pixmap.height())
+    {
+        QPixmap grown(sheet->pixmap.width(), sheet->pixmap.height() * 2);
+        grown.fill(Qt::transparent);
+
+        QPainter painter(&grown);
+        painter.drawPixmap(0, 0, sheet->pixmap);
+        painter.end();
+
+        sheet->pixmap = grown;
+    }
+
+    QPainter painter(&sheet->pixmap);
+    painter.setClipRect(rect);
+    painter.scale(m_pixelRatio, m_pixelRatio);
+    painter.setFont(sheet->font);
+    painter.setPen(sheet->color);
+    painter.drawText(QPointF(rect.left() / m_pixelRatio, rect.top() / m_pixelRatio + m_ascent), QString(ch));
+
+    sheet->slots.insert(ch.unicode(), n);
+
+    return n;
+}
+
+// In device pixels, whole ones so neighbouring glyphs never bleed into each other
+QRectF GlyphCache::slotRect(int slot) const
+{
+    const qreal width = qCeil(m_cellWidth * m_pixelRatio);
+    const qreal height = qCeil(m_cellHeight * m_pixelRatio);
+
+    return QRectF((slot % SHEET_COLUMNS) * width, (slot / SHEET_COLUMNS) * height, width, height);
+}
@@ -0,0 +1,86 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#ifndef GLYPHCACHE_H
+#define GLYPHCACHE_H
+
+#include <QColor>
+#include <QFont>
+#include <QHash>
+#include <QPainter>
+#include <QPixmap>
+#include <QString>
+
+// Every glyph drawn so far in one font and colour, rendered once into a
+// pixmap of cells sixteen to a row
+struct GlyphSheet
+{
+    GlyphSheet() : count(0) {}
+
+    QFont font;
+    QColor color;
+    QPixmap pixmap;
+    QHash<ushort, int> slots;
+    int count;
+};
+
+// Draws text in a fixed-pitch font one cell per character by copying glyphs
+// out of cached sheets, which skips shaping and line breaking altogether.
+// It only takes text where each character is known to fill exactly one cell.
+class GlyphCache
+{
+public:
+    GlyphCache();
+    ~GlyphCache();
+
+    void setFont(const QFont &font);
+    void clear();
+
+    bool isFixedPitch() const { return m_fixedPitch; }
+    qreal cellWidth() const { return m_cellWidth; }
+    qreal cellHeight() const { return m_cellHeight; }
+
+    bool fits(const QString &text);
+    bool fits(const QFont &font);
+
+    void draw(QPainter *painter, const QPointF &pos, const QChar *text, int count,
+              const QFont &font, const QColor &color);
+
+private:
+    GlyphSheet * sheet(const QFont &font, const QColor &color);
+    int slot(GlyphSheet *sheet, QChar ch);
+    QRectF slotRect(int slot) const;
+
+    QFont m_font;
+    bool m_fixedPitch;
+    qreal m_cellWidth;
+    qreal m_cellHeight;
+    qreal m_ascent;
+    int m_pixelRatio;
+
+    QHash<QString, GlyphSheet *> m_sheets;
+    QHash<ushort, bool> m_fitsChar;
+    QHash<QString, bool> m_fitsFont;
+};
+
+#endif // GLYPHCACHE_H
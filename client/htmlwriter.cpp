@@ -0,0 +1,226 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+
+
+#include "htmlwriter.h"
+
+HtmlWriter::HtmlWriter(const QVector<QTextCharFormat> &formats, const QColor &fg, const QColor &bg, const QFont &font) :
+    m_formats(formats),
+    m_foreground(fg),
+    m_background(bg),
+    m_font(font),
+    m_classes(formats.size(), -2)
+{
+}
+
+void HtmlWriter::writeLine(QString &out, const QString &text, const QVector<LineRun> &runs, int start, int stop)
+{
+    if (stop < 0 || stop > text.length())
+    {
+        stop = text.length();
+    }
+
+    for (int n = 0; n < runs.size(); n++)
+    {
+        const int runStart = qMax(runs.at(n).offset, start);
+        const int runEnd = qMin(n + 1 < runs.size() ? runs.at(n + 1).offset : text.length(), stop);
+        if (runStart >= runEnd)
+        {
+            continue;
+        }
+
+        const int style = styleClass(runs.at(n).format);
+        if (style >= 0)
+        {
+            out.append(QString("<span class='s%1'>").arg(style));
+        }
+
+        appendEscaped(out, text, runStart, runEnd);
+
+        if (style >= 0)
+        {
+            out.append("</span>");
+        }
+    }
+}
+
+void HtmlWriter::addAllFormats()
+{
+    for (int n = 0; n < m_formats.size(); n++)
+    {
+        styleClass(n);
+    }
+}
+
+QString HtmlWriter::header(const QString &title) const
+{
+    QString html(QString("<!DOCTYPE HTML PUBLIC '-//W3C//DTD HTML 4.01//EN' 'http://www.w3.org/TR/html4/strict.dtd'>\n"
+        "<html>\n"
+        " <head>\n"
+        "  <style>\n"
+        "  <!--\n"
+        "   body { font-family: '%1', 'Courier New', 'Monospace', 'Courier'; }\n"
+        "   body { font-size: %2pt; }\n"
+        "   body { white-space: pre-wrap; }\n"
+        "   body { color: %3; }\n"
+        "   body { background-color: %4; }\n")
+        .arg(m_font.family())
+        .arg(m_font.pointSize())
+        .arg(m_foreground.name())
+        .arg(m_background.name()));
+
+    foreach (const QString &rule, m_rules)
+    {
+        html.append(rule);
+    }
+
+    html.append(QString("  -->\n"
+        "  </style>\n"
+        "  <title>%1</title>\n"
+        "  <meta http-equiv='content-type' content='text/html; charset=utf-8'>\n"
+        " </head>\n"
+        " <body>\n").arg(title.toHtmlEscaped()));
+
+    return html;
+}
+
+QString HtmlWriter::footer()
+{
+    return QString("\n </body>\n</html>\n");
+}
+
+// Appends text[start, stop) to out, escaped for HTML
+void HtmlWriter::appendEscaped(QString &out, const QString &text, int start, int stop)
+{
+    if (stop < 0)
+    {
+        stop = text.length();
+    }
+
+    const QChar *data = text.constData();
+    int plain = start;
+    for (int n = start; n < stop; n++)
+    {
+        const char *entity;
+        switch (data[n].unicode())
+        {
+        case '<':
+            entity = "&lt;";
+            break;
+
+        case '>':
+            entity = "&gt;";
+            break;
+
+        case '&':
+            entity = "&amp;";
+            break;
+
+        case '\'':
+            entity = "&apos;";
+            break;
+
+        case '\"':
+            entity = "&quot;";
+            break;
+
+        default:
+            continue;
+        }
+
+        out.append(data + plain, n - plain);
+        out.append(QLatin1String(entity));
+        plain = n + 1;
+    }
+
+    out.append(data + plain, stop - plain);
+}
+
+int HtmlWriter::styleClass(int format)
+{
+    if (format < 0 || format >= m_classes.size())
+    {
+        return -1;
+    }
+
+    if (m_classes.at(format) == -2)
+    {
+        // Formats that differ only in ways the page doesn't show share a class
+        const QString style(declarations(m_formats.at(format)));
+        int id = -1;
+        if (!style.isEmpty())
+        {
+            id = m_styles.value(style, -1);
+            if (id < 0)
+            {
+                id = m_rules.size();
+                m_styles.insert(style, id);
+                m_rules.append(QString("   .s%1 { %2}\n").arg(id).arg(style));
+            }
+        }
+        m_classes[format] = id;
+    }
+
+    return m_classes.at(format);
+}
+
+// Only what differs from the page's defaults
+QString HtmlWriter::declarations(const QTextCharFormat &fmt) const
+{
+    const QColor background(fmt.background() != Qt::NoBrush ? fmt.background().color() : m_background);
+    const QColor foreground(fmt.foreground() != Qt::NoBrush ? fmt.foreground().color() : m_foreground);
+    const QFont font(fmt.font());
+
+    QString style;
+    if (background != m_background)
+    {
+        style.append(QString("background: %1; ").arg(background.name()));
+    }
+    if (foreground != m_foreground)
+    {
+        style.append(QString("color: %1; ").arg(foreground.name()));
+    }
+    if (font.family() != m_font.family())
+    {
+        style.append(QString("font-family: '%1'; ").arg(font.family()));
+    }
+    if (font.pointSize() != m_font.pointSize())
+    {
+        style.append(QString("font-size: %1pt; ").arg(font.pointSize()));
+    }
+    if (fmt.fontWeight() >= QFont::Bold)
+    {
+        style.append("font-weight: bold; ");
+    }
+    if (fmt.fontItalic())
+    {
+        style.append("font-style: italic; ");
+    }
+    if (fmt.fontUnderline())
+    {
+        style.append("text-decoration: underline; ");
+    }
+
+    return style;
+}
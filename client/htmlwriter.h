@@ -0,0 +1,71 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+
+#ifndef HTMLWRITER_H
+#define HTMLWRITER_H
+
+#include <QColor>
+#include <QFont>
+#include <QHash>
+#include <QString>
+#include <QStringList>
+#include <QTextCharFormat>
+#include <QVector>
+#include "linebuffer.h"
+
+// Turns console lines into HTML. Each distinct style gets one CSS class,
+// handed out the first time a run uses it, so spans carry a short class
+// name instead of repeating the whole style.
+class HtmlWriter
+{
+public:
+    HtmlWriter(const QVector<QTextCharFormat> &formats, const QColor &fg, const QColor &bg, const QFont &font);
+
+    // Columns [start, stop) of a line; stop < 0 runs to the end
+    void writeLine(QString &out, const QString &text, const QVector<LineRun> &runs, int start = 0, int stop = -1);
+
+    // For a header written ahead of the lines it covers
+    void addAllFormats();
+
+    QString header(const QString &title) const;
+    static QString footer();
+
+    static void appendEscaped(QString &out, const QString &text, int start = 0, int stop = -1);
+
+private:
+    int styleClass(int format);
+    QString declarations(const QTextCharFormat &fmt) const;
+
+    QVector<QTextCharFormat> m_formats;
+    QColor m_foreground;
+    QColor m_background;
+    QFont m_font;
+
+    // Class per format id, -1 for none and -2 until the format is first seen
+    QVector<int> m_classes;
+    QHash<QString, int> m_styles;
+    QStringList m_rules;
+};
+
+#endif // HTMLWRITER_H
@@ -0,0 +1,856 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#include "luajson.h"
+#include <QVarLengthArray>
+#include <math.h>
+
+static const int MAX_DEPTH = 200;
+
+// Only its address matters
+static char nullSentinel;
+
+namespace
+{
+
+class Decoder
+{
+public:
+    Decoder(lua_State *L, const char *data, int length) :
+        m_L(L),
+        m_pos(data),
+        m_end(data + length),
+        m_depth(0)
+    {}
+
+    bool parse(QString *error)
+    {
+        int top = lua_gettop(m_L);
+
+        skipSpace();
+        bool ok = value();
+        skipSpace();
+
+        if (ok && m_pos != m_end)
+        {
+            m_error = "trailing characters";
+            ok = false;
+        }
+
+        if (!ok)
+        {
+            lua_settop(m_L, top);
+
+            if (error)
+            {
+                *error = m_error;
+            }
+        }
+
+        return ok;
+    }
+
+private:
+    void skipSpace()
+    {
+        while (m_pos < m_end && (*m_pos == ' ' || *m_pos == '\t' || *m_pos == '\n' || *m_pos == '\r'))
+        {
+            m_pos++;
+        }
+    }
+
+    bool literal(const char *word, int length)
+    {
+        if (m_end - m_pos < length || memcmp(m_pos, word, length) != 0)
+        {
+            m_error = "invalid literal";
+            return false;
+        }
+
+        m_pos += length;
+        return true;
+    }
+
+    bool value()
+    {
+        if (m_pos >= m_end)
+        {
+            m_error = "unexpected end of input";
+            return false;
+        }
+
+        switch (*m_pos)
+        {
+        case '{':
+            return object();
+        case '[':
+            return array();
+        case '"':
+            return string();
+        case 't':
+            if (!literal("true", 4))
+            {
+                return false;
+            }
+            lua_pushboolean(m_L, 1);
+            return true;
+        case 'f':
+            if (!literal("false", 5))
+            {
+                return false;
+            }
+            lua_pushboolean(m_L, 0);
+            return true;
+        case 'n':
+            if (!literal("null", 4))
+            {
+                return false;
+            }
+            LuaJson::pushNull(m_L);
+            return true;
+        default:
+            return number();
+        }
+    }
+
+    bool enter()
+    {
+        if (++m_depth > MAX_DEPTH || !lua_checkstack(m_L, 4))
+        {
+            m_error = "nested too deeply";
+            return false;
+        }
+
+        m_pos++;
+        skipSpace();
+        return true;
+    }
+
+    bool object()
+    {
+        if (!enter())
+        {
+            return false;
+        }
+
+        lua_newtable(m_L);
+
+        if (m_pos < m_end && *m_pos == '}')
+        {
+            m_pos++;
+            m_depth--;
+            return true;
+        }
+
+        while (true)
+        {
+            if (m_pos >= m_end || *m_pos != '"')
+            {
+                m_error = "expected string key";
+                return false;
+            }
+
+            if (!string())
+            {
+                return false;
+            }
+
+            skipSpace();
+            if (m_pos >= m_end || *m_pos != ':')
+            {
+                m_error = "expected ':'";
+                return false;
+            }
+            m_pos++;
+            skipSpace();
+
+            if (!value())
+            {
+                return false;
+            }
+            lua_rawset(m_L, -3);
+
+            skipSpace();
+            if (m_pos < m_end && *m_pos == ',')
+            {
+                m_pos++;
+                skipSpace();
+                continue;
+            }
+            if (m_pos < m_end && *m_pos == '}')
+            {
+                m_pos++;
+                m_depth--;
+                return true;
+            }
+
+            m_error = "expected ',' or '}'";
+            return false;
+        }
+    }
+
+    bool array()
+    {
+        if (!enter())
+        {
+            return false;
+        }
+
+        lua_newtable(m_L);
+
+        if (m_pos < m_end && *m_pos == ']')
+        {
+            m_pos++;
+            m_depth--;
+            return true;
+        }
+
+        int n = 0;
+        while (true)
+        {
+            if (!value())
+            {
+                return false;
+            }
+            lua_rawseti(m_L, -2, ++n);
+
+            skipSpace();
+            if (m_pos < m_end && *m_pos == ',')
+            {
+                m_pos++;
+                skipSpace();
+                continue;
+            }
+            if (m_pos < m_end && *m_pos == ']')
+            {
+                m_pos++;
+                m_depth--;
+                return true;
+            }
+
+            m_error = "expected ',' or ']'";
+            return false;
+        }
+    }
+
+    static int hexDigit(char ch)
+    {
+        if (ch >= '0' && ch <= '9')
+        {
+            return ch - '0';
+        }
+        if (ch >= 'a' && ch <= 'f')
+        {
+            return ch - 'a' + 10;
+        }
+        if (ch >= 'A' && ch <= 'F')
+        {
+            return ch - 'A' + 10;
+        }
+        return -1;
+    }
+
+    bool hex4(uint &code)
+    {
+        if (m_end - m_pos < 4)
+        {
+            m_error = "truncated \\u escape";
+            return false;
+        }
+
+        code = 0;
+        for (int n = 0; n < 4; n++)
+        {
+            int digit = hexDigit(*m_pos++);
+            if (digit < 0)
+            {
+                m_error = "invalid \\u escape";
+                return false;
+            }
+            code = (code << 4) | uint(digit);
+        }
+        return true;
+    }
+
+    void appendUtf8(uint code)
+    {
+        if (code < 0x80)
+        {
+            m_buffer.append(char(code));
+        }
+        else if (code < 0x800)
+        {
+            m_buffer.append(char(0xC0 | (code >> 6)));
+            m_buffer.append(char(0x80 | (code & 0x3F)));
+        }
+        else if (code < 0x10000)
+        {
+            m_buffer.append(char(0xE0 | (code >> 12)));
+            m_buffer.append(char(0x80 | ((code >> 6) & 0x3F)));
+            m_buffer.append(char(0x80 | (code & 0x3F)));
+        }
+        else
+        {
+            m_buffer.append(char(0xF0 | (code >> 18)));
+            m_buffer.append(char(0x80 | ((code >> 12) & 0x3F)));
+            m_buffer.append(char(0x80 | ((code >> 6) & 0x3F)));
+            m_buffer.append(char(0x80 | (code & 0x3F)));
+        }
+    }
+
+    bool string()
+    {
+        const char *start = ++m_pos;
+
+        // Most strings have no escapes and go to Lua straight from the input
+        while (m_pos < m_end && *m_pos != '"' && *m_pos != '\\')
+        {
+            m_pos++;
+        }
+
+        if (m_pos >= m_end)
+        {
+            m_error = "unterminated string";
+            return false;
+        }
+
+        if (*m_pos == '"')
+        {
+            lua_pushlstring(m_L, start, m_pos - start);
+            m_pos++;
+            return true;
+        }
+
+        m_buffer.clear();
+        m_buffer.append(start, m_pos - start);
+
+        while (m_pos < m_end)
+        {
+            char ch = *m_pos++;
+            if (ch == '"')
+            {
+                lua_pushlstring(m_L, m_buffer.constData(), m_buffer.size());
+                return true;
+            }
+
+            if (ch != '\\')
+            {
+                m_buffer.append(ch);
+                continue;
+            }
+
+            if (m_pos >= m_end)
+            {
+                break;
+            }
+
+            switch (*m_pos++)
+            {
+            case '"':
+                m_buffer.append('"');
+                break;
+            case '\\':
+                m_buffer.append('\\');
+                break;
+            case '/':
+                m_buffer.append('/');
+                break;
+            case 'b':
+                m_buffer.append('\b');
+                break;
+            case 'f':
+                m_buffer.append('\f');
+                break;
+            case 'n':
+                m_buffer.append('\n');
+                break;
+            case 'r':
+                m_buffer.append('\r');
+                break;
+            case 't':
+                m_buffer.append('\t');
+                break;
+            case 'u':
+            {
+                uint code;
+                if (!hex4(code))
+                {
+                    return false;
+                }
+
+                // Characters outside the BMP arrive as a surrogate pair
+                if (code >= 0xD800 && code <= 0xDBFF && m_end - m_pos >= 6 && m_pos[0] == '\\' && m_pos[1] == 'u')
+                {
+                    m_pos += 2;
+
+                    uint low;
+                    if (!hex4(low))
+                    {
+                        return false;
+                    }
+
+                    if (low >= 0xDC00 && low <= 0xDFFF)
+                    {
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    else
+                    {
+                        appendUtf8(0xFFFD);
+
+                        // The second escape may be a lone surrogate itself
+                        code = low >= 0xD800 && low <= 0xDFFF ? 0xFFFD : low;
+                    }
+                }
+                else if (code >= 0xD800 && code <= 0xDFFF)
+                {
+                    code = 0xFFFD;
+                }
+
+                appendUtf8(code);
+            }
+                break;
+            default:
+                m_error = "invalid escape";
+                return false;
+            }
+        }
+
+        m_error = "unterminated string";
+        return false;
+    }
+
+    bool number()
+    {
+        const char *start = m_pos;
+
+        bool negative = false;
+        if (m_pos < m_end && *m_pos == '-')
+        {
+            negative = true;
+            m_pos++;
+        }
+
+        quint64 mantissa = 0;
+        int digits = 0;
+        int exponent = 0;
+
+        while (m_pos < m_end && *m_pos >= '0' && *m_pos <= '9')
+        {
+            if (digits < 19)
+            {
+                mantissa = mantissa * 10 + quint64(*m_pos - '0');
+            }
+            else
+            {
+                exponent++;
+            }
+            if (mantissa > 0 || digits > 0)
+            {
+                digits++;
+            }
+            m_pos++;
+        }
+
+        if (m_pos == start + (negative ? 1 : 0))
+        {
+            m_error = "unexpected character";
+            return false;
+        }
+
+        if (m_pos < m_end && *m_pos == '.')
+        {
+            m_pos++;
+            const char *fraction = m_pos;
+            while (m_pos < m_end && *m_pos >= '0' && *m_pos <= '9')
+            {
+                if (digits < 19)
+                {
+                    mantissa = mantissa * 10 + quint64(*m_pos - '0');
+                    exponent--;
+                }
+                if (mantissa > 0 || digits > 0)
+                {
+                    digits++;
+                }
+                m_pos++;
+            }
+
+            if (m_pos == fraction)
+            {
+                m_error = "invalid number";
+                return false;
+            }
+        }
+
+        if (m_pos < m_end && (*m_pos == 'e' || *m_pos == 'E'))
+        {
+            m_pos++;
+
+            bool negativeExponent = false;
+            if (m_pos < m_end && (*m_pos == '+' || *m_pos == '-'))
+            {
+                negativeExponent = *m_pos == '-';
+                m_pos++;
+            }
+
+            const char *power = m_pos;
+            int value = 0;
+            while (m_pos < m_end && *m_pos >= '0' && *m_pos <= '9')
+            {
+                if (value < 10000)
+                {
+                    value = value * 10 + (*m_pos - '0');
+                }
+                m_pos++;
+            }
+
+            if (m_pos == power)
+            {
+                m_error = "invalid number";
+                return false;
+            }
+
+            exponent += negativeExponent ? -value : value;
+        }
+
+        double result;
+        if (mantissa < (Q_UINT64_C(1) << 53) && exponent >= -22 && exponent <= 22)
+        {
+            // Both operands are exact, so one multiply or divide rounds correctly
+            static const double powers[] = {
+                1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+            };
+
+            result = double(mantissa);
+            if (exponent < 0)
+            {
+                result /= powers[-exponent];
+            }
+            else
+            {
+                result *= powers[exponent];
+            }
+        }
+        else
+        {
+            // Rare enough to take the slow but exact route through Qt's locale-independent parser
+            result = QByteArray(start, m_pos - start).toDouble();
+            negative = false;
+        }
+
+        lua_pushnumber(m_L, negative ? -result : result);
+        return true;
+    }
+
+    lua_State *m_L;
+    const char *m_pos;
+    const char *m_end;
+    int m_depth;
+
+    QVarLengthArray<char, 256> m_buffer;
+    QString m_error;
+};
+
+class Encoder
+{
+public:
+    Encoder(lua_State *L, QByteArray &out) :
+        m_L(L),
+        m_out(out),
+        m_depth(0)
+    {}
+
+    bool encode(int index, QString *error)
+    {
+        bool ok = value(lua_absindex(m_L, index));
+        if (!ok && error)
+        {
+            *error = m_error;
+        }
+        return ok;
+    }
+
+private:
+    bool value(int index)
+    {
+        switch (lua_type(m_L, index))
+        {
+        case LUA_TNIL:
+            m_out.append("null", 4);
+            return true;
+
+        case LUA_TBOOLEAN:
+            if (lua_toboolean(m_L, index))
+            {
+                m_out.append("true", 4);
+            }
+            else
+            {
+                m_out.append("false", 5);
+            }
+            return true;
+
+        case LUA_TNUMBER:
+            number(m_out, lua_tonumber(m_L, index));
+            return true;
+
+        case LUA_TSTRING:
+        {
+            size_t length;
+            const char *str = lua_tolstring(m_L, index, &length);
+            string(str, int(length));
+            return true;
+        }
+
+        case LUA_TTABLE:
+            return table(index);
+
+        case LUA_TLIGHTUSERDATA:
+            if (LuaJson::isNull(m_L, index))
+            {
+                m_out.append("null", 4);
+                return true;
+            }
+            break;
+
+        default:
+            break;
+        }
+
+        m_error = QString("cannot encode a %1").arg(lua_typename(m_L, lua_type(m_L, index)));
+        return false;
+    }
+
+    static void number(QByteArray &out, double value)
+    {
+        if (value != value || value == HUGE_VAL || value == -HUGE_VAL)
+        {
+            // JSON has no NaN or infinity
+            out.append("null", 4);
+        }
+        else if (value == floor(value) && fabs(value) < 9007199254740992.0)
+        {
+            out.append(QByteArray::number(qint64(value)));
+        }
+        else
+        {
+            // Shortest precision that survives the round trip, so 0.1 stays 0.1
+            QByteArray text;
+            for (int precision = 15; precision <= 17; precision++)
+            {
+                text = QByteArray::number(value, 'g', precision);
+                if (text.toDouble() == value)
+                {
+                    break;
+                }
+            }
+            out.append(text);
+        }
+    }
+
+    void string(const char *str, int length)
+    {
+        static const char hex[] = "0123456789abcdef";
+
+        m_out.append('"');
+
+        int run = 0;
+        for (int n = 0; n < length; n++)
+        {
+            uchar ch = uchar(str[n]);
+            if (ch >= 0x20 && ch != '"' && ch != '\\')
+            {
+                continue;
+            }
+
+            m_out.append(str + run, n - run);
+            run = n + 1;
+
+            switch (ch)
+            {
+            case '"':
+                m_out.append("\\\"", 2);
+                break;
+            case '\\':
+                m_out.append("\\\\", 2);
+                break;
+            case '\n':
+                m_out.append("\\n", 2);
+                break;
+            case '\r':
+                m_out.append("\\r", 2);
+                break;
+            case '\t':
+                m_out.append("\\t", 2);
+                break;
+            default:
+            {
+                char escape[6] = { '\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 0xF] };
+                m_out.append(escape, 6);
+            }
+                break;
+            }
+        }
+
+        m_out.append(str + run, length - run);
+        m_out.append('"');
+    }
+
+    bool table(int index)
+    {
+        if (++m_depth > MAX_DEPTH || !lua_checkstack(m_L, 4))
+        {
+            m_error = "nested too deeply or recursive";
+            return false;
+        }
+
+        // An array needs keys 1..n and nothing else
+        int length = int(lua_rawlen(m_L, index));
+        int count = 0;
+        bool isArray = length > 0;
+
+        lua_pushnil(m_L);
+        while (lua_next(m_L, index))
+        {
+            lua_pop(m_L, 1);
+            count++;
+
+            if (isArray && (lua_type(m_L, -1) != LUA_TNUMBER || count > length))
+            {
+                isArray = false;
+            }
+        }
+        isArray = isArray && count == length;
+
+        bool ok = isArray ? array(index, length) : object(index);
+
+        m_depth--;
+        return ok;
+    }
+
+    bool array(int index, int length)
+    {
+        m_out.append('[');
+
+        for (int n = 1; n <= length; n++)
+        {
+            if (n > 1)
+            {
+                m_out.append(',');
+            }
+
+            lua_rawgeti(m_L, index, n);
+            bool ok = value(lua_gettop(m_L));
+            lua_pop(m_L, 1);
+
+            if (!ok)
+            {
+                return false;
+            }
+        }
+
+        m_out.append(']');
+        return true;
+    }
+
+    bool object(int index)
+    {
+        m_out.append('{');
+
+        bool first = true;
+        lua_pushnil(m_L);
+        while (lua_next(m_L, index))
+        {
+            if (!first)
+            {
+                m_out.append(',');
+            }
+            first = false;
+
+            int keyType = lua_type(m_L, -2);
+            if (keyType == LUA_TSTRING)
+            {
+                size_t length;
+                const char *key = lua_tolstring(m_L, -2, &length);
+                string(key, int(length));
+            }
+            else if (keyType == LUA_TNUMBER)
+            {
+                // Converting the key in place with lua_tostring would confuse lua_next
+                QByteArray key;
+                number(key, lua_tonumber(m_L, -2));
+                string(key.constData(), key.length());
+            }
+            else
+            {
+                lua_pop(m_L, 2);
+                m_error = QString("cannot use a %1 as an object key").arg(lua_typename(m_L, keyType));
+                return false;
+            }
+
+            m_out.append(':');
+
+            bool ok = value(lua_gettop(m_L));
+            lua_pop(m_L, 1);
+
+            if (!ok)
+            {
+                lua_pop(m_L, 1);
+                return false;
+            }
+        }
+
+        m_out.append('}');
+        return true;
+    }
+
+    lua_State *m_L;
+    QByteArray &m_out;
+    int m_depth;
+    QString m_error;
+};
+
+}
+
+bool LuaJson::decode(lua_State *L, const char *data, int length, QString *error)
+{
+    Decoder decoder(L, data, length);
+    return decoder.parse(error);
+}
+
+bool LuaJson::encode(lua_State *L, int index, QByteArray &out, QString *error)
+{
+    Encoder encoder(L, out);
+    return encoder.encode(index, error);
+}
+
+void LuaJson::pushNull(lua_State *L)
+{
+    lua_pushlightuserdata(L, &nullSentinel);
+}
+
+bool LuaJson::isNull(lua_State *L, int index)
+{
+    return lua_touserdata(L, index) == &nullSentinel && lua_islightuserdata(L, index);
+}
@@ -0,0 +1,46 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#ifndef LUAJSON_H
+#define LUAJSON_H
+
+#include <QByteArray>
+#include <QString>
+#include "lua.hpp"
+
+// JSON straight to and from the Lua stack, with no QJsonDocument or QVariant in between
+namespace LuaJson
+{
+    // Pushes the decoded value, or nothing and returns false if the text isn't valid JSON
+    bool decode(lua_State *L, const char *data, int length, QString *error = 0);
+
+    // Appends the value at index to out; tables with keys 1..n become arrays
+    bool encode(lua_State *L, int index, QByteArray &out, QString *error = 0);
+
+    // JSON null decodes to this light userdata rather than nil, which would
+    // leave a hole in an array or drop an object member; it encodes as null
+    void pushNull(lua_State *L);
+    bool isNull(lua_State *L, int index);
+}
+
+#endif // LUAJSON_H
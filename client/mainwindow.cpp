@@ -187,6 +187,15 @@ void MainWindow::on_actionSaveAs_triggered()
     }
 }
 
+void MainWindow::on_actionExport_triggered()
+{
+    Console *console = activeConsole();
+    if (console)
+    {
+        console->exportScrollback();
+    }
+}
+
 void MainWindow::on_actionConnect_triggered(bool checked)
 {
     Console *console = activeConsole();
@@ -221,6 +230,15 @@ void MainWindow::on_actionOptions_triggered()
     }
 }
 
+void MainWindow::on_actionFind_triggered()
+{
+    Console *console = activeConsole();
+    if (console)
+    {
+        console->showSearch();
+    }
+}
+
 void MainWindow::on_actionClose_triggered()
 {
     ui->mdiArea->closeActiveSubWindow();
@@ -272,12 +290,14 @@ void MainWindow::updateActions()
 
     ui->actionSave->setEnabled(hasConsole && modified);
     ui->actionSaveAs->setEnabled(hasConsole);
+    ui->actionExport->setEnabled(hasConsole);
     ui->actionClose->setEnabled(hasConsole);
     ui->actionCloseAll->setEnabled(hasConsole);
 
     ui->menuGame->menuAction()->setVisible(hasConsole);
     ui->actionConnect->setVisible(hasConsole);
     ui->actionOptions->setVisible(hasConsole);
+    ui->actionFind->setVisible(hasConsole);
 
     if (hasConsole)
     {
@@ -57,8 +57,10 @@ private slots:
     void on_actionOpen_triggered();
     void on_actionSave_triggered();
     void on_actionSaveAs_triggered();
+    void on_actionExport_triggered();
     void on_actionConnect_triggered(bool checked);
     void on_actionOptions_triggered();
+    void on_actionFind_triggered();
     void on_actionClose_triggered();
     void on_actionCloseAll_triggered();
     void on_actionNext_triggered();
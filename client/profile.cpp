@@ -81,6 +81,9 @@ Profile::Profile(QObject *parent) :
     m_options.insert("noteForegroundColor", QColor(Qt::blue));
 
     m_options.insert("scrollbackLines", 1000);
+    m_options.insert("scrollbackFile", false);
+    m_options.insert("scrollbackFileSize", 64);
+    m_options.insert("frameRate", 60);
 }
 
 template <class C>
@@ -296,6 +299,9 @@ void Profile::toXml(QXmlStreamWriter &xml)
 
     xml.writeStartElement("display");
     xml.writeAttribute("scrollback", QString::number(scrollbackLines()));
+    xml.writeAttribute("scrollbackFile", scrollbackFile()?"y":"n");
+    xml.writeAttribute("scrollbackFileSize", QString::number(scrollbackFileSize()));
+    xml.writeAttribute("frameRate", QString::number(frameRate()));
 
     xml.writeStartElement("inputFont");
     xml.writeAttribute("family", inputFont().family());
@@ -965,6 +971,27 @@ void Profile::readProfile(QXmlStreamReader &xml, QList<XmlError *> &errors)
             }
             else if (xml.name() == "display")
             {
+                bool valid = true;
+                int lines = xml.attributes().value("scrollback").toString().toInt(&valid);
+                if (valid)
+                {
+                    setScrollbackLines(lines);
+                }
+
+                setScrollbackFile(xml.attributes().value("scrollbackFile").compare("y", Qt::CaseInsensitive) == 0);
+
+                int size = xml.attributes().value("scrollbackFileSize").toString().toInt(&valid);
+                if (valid && size > 0)
+                {
+                    setScrollbackFileSize(size);
+                }
+
+                int fps = xml.attributes().value("frameRate").toString().toInt(&valid);
+                if (valid && fps > 0)
+                {
+                    setFrameRate(fps);
+                }
+
                 readDisplay(xml, errors);
             }
         }
@@ -113,6 +113,12 @@ public:
 
     int scrollbackLines() const { return m_options.value("scrollbackLines").toInt(); }
     void setScrollbackLines(int max) { changeOption("scrollbackLines", max); }
+    bool scrollbackFile() const { return m_options.value("scrollbackFile").toBool(); }
+    void setScrollbackFile(bool flag) { changeOption("scrollbackFile", flag); }
+    int scrollbackFileSize() const { return m_options.value("scrollbackFileSize").toInt(); }
+    void setScrollbackFileSize(int megabytes) { changeOption("scrollbackFileSize", megabytes); }
+    int frameRate() const { return m_options.value("frameRate").toInt(); }
+    void setFrameRate(int fps) { changeOption("frameRate", fps); }
 
     virtual void toXml(QXmlStreamWriter &xml);
     virtual void fromXml(QXmlStreamReader &xml, QList<XmlError *> &errors);
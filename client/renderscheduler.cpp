@@ -0,0 +1,118 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#include "renderscheduler.h"
+
+static const int FRAME_RATE_MIN = 10;
+static const int FRAME_RATE_MAX = 240;
+
+RenderScheduler::RenderScheduler(QObject *parent) :
+    QObject(parent),
+    m_lastFrame(0),
+    m_frameRate(60),
+    m_requests(0),
+    m_frames(0),
+    m_windowStart(0),
+    m_windowFrames(0),
+    m_fps(0.0)
+{
+    m_timer.setSingleShot(true);
+    m_timer.setTimerType(Qt::PreciseTimer);
+    connect(&m_timer, SIGNAL(timeout()), SLOT(fire()));
+
+    m_clock.start();
+}
+
+void RenderScheduler::setFrameRate(int fps)
+{
+    m_frameRate = qBound(FRAME_RATE_MIN, fps, FRAME_RATE_MAX);
+}
+
+FrameStats RenderScheduler::stats() const
+{
+    FrameStats stats;
+    stats.paint = m_paint.stats();
+    stats.frameRate = m_frameRate;
+    stats.requests = m_requests;
+    stats.frames = m_frames;
+
+    // A display gone quiet isn't still drawing at its last rate
+    stats.fps = m_clock.elapsed() - m_lastFrame > 1000 ? 0.0 : m_fps;
+
+    return stats;
+}
+
+void RenderScheduler::resetStats()
+{
+    m_paint.reset();
+    m_requests = 0;
+    m_frames = 0;
+    m_windowStart = m_clock.elapsed();
+    m_windowFrames = 0;
+    m_fps = 0.0;
+}
+
+void RenderScheduler::schedule()
+{
+    m_requests++;
+
+    if (m_timer.isActive())
+    {
+        return;
+    }
+
+    const qint64 interval = 1000 / m_frameRate;
+    const qint64 since = m_clock.elapsed() - m_lastFrame;
+
+    m_timer.start(int(qBound(qint64(0), interval - since, interval)));
+}
+
+void RenderScheduler::recordPaint(qint64 usecs)
+{
+    m_paint.record(usecs);
+}
+
+void RenderScheduler::optionChanged(const QString &key, const QVariant &val)
+{
+    if (key == "frameRate")
+    {
+        setFrameRate(val.toInt());
+    }
+}
+
+void RenderScheduler::fire()
+{
+    m_lastFrame = m_clock.elapsed();
+    m_frames++;
+
+    m_windowFrames++;
+    const qint64 window = m_lastFrame - m_windowStart;
+    if (window >= 1000)
+    {
+        m_fps = m_windowFrames * 1000.0 / window;
+        m_windowStart = m_lastFrame;
+        m_windowFrames = 0;
+    }
+
+    emit frame();
+}
@@ -0,0 +1,94 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#ifndef RENDERSCHEDULER_H
+#define RENDERSCHEDULER_H
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QTimer>
+#include <QVariant>
+#include "latencyhistogram.h"
+
+// Snapshot of display work: paint times in milliseconds, the rest as counts
+struct FrameStats
+{
+    FrameStats() :
+        frameRate(0),
+        requests(0),
+        frames(0),
+        fps(0.0)
+    {}
+
+    LatencyStats paint;
+
+    int frameRate;
+    quint64 requests;
+    quint64 frames;
+    double fps;
+};
+
+// Gathers repaint requests and hands them on as one frame() at most once per
+// frame interval. A request made with nothing pending still gets its frame
+// on the next pass through the event loop, after whatever else is queued,
+// so everything that changes in one turn is drawn together.
+class RenderScheduler : public QObject
+{
+    Q_OBJECT
+public:
+    explicit RenderScheduler(QObject *parent = 0);
+
+    int frameRate() const { return m_frameRate; }
+    void setFrameRate(int fps);
+
+    FrameStats stats() const;
+    void resetStats();
+
+public slots:
+    void schedule();
+    void recordPaint(qint64 usecs);
+    void optionChanged(const QString &key, const QVariant &val);
+
+signals:
+    void frame();
+
+private slots:
+    void fire();
+
+private:
+    QTimer m_timer;
+    QElapsedTimer m_clock;
+    qint64 m_lastFrame;
+    int m_frameRate;
+
+    LatencyHistogram m_paint;
+    quint64 m_requests;
+    quint64 m_frames;
+
+    // Frames counted over the last second or so
+    qint64 m_windowStart;
+    quint64 m_windowFrames;
+    double m_fps;
+};
+
+#endif // RENDERSCHEDULER_H
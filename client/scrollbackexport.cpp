@@ -0,0 +1,315 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+
+
+#include "scrollbackexport.h"
+#include "consoledocument.h"
+#include "htmlwriter.h"
+#include <QElapsedTimer>
+#include <QThread>
+
+// As with searching: batches big enough to keep the thread busy, few enough
+// queued that cancelling doesn't leave much to get through
+static const int BATCH_LINES = 1024;
+static const int MAX_PENDING = 4;
+static const int FEED_BUDGET = 8;
+
+ExportWorker::ExportWorker(const QString &fileName, HtmlWriter *writer, const QString &title) :
+    QObject(0),
+    m_file(fileName),
+    m_writer(writer),
+    m_title(title),
+    m_failed(false)
+{
+}
+
+ExportWorker::~ExportWorker()
+{
+    delete m_writer;
+}
+
+void ExportWorker::open()
+{
+    if (!m_file.open(QFile::WriteOnly | QFile::Truncate | QFile::Text))
+    {
+        m_failed = true;
+        emit finished(false, m_file.errorString());
+        return;
+    }
+
+    m_stream.setDevice(&m_file);
+    m_stream.setCodec("UTF-8");
+
+    if (m_writer)
+    {
+        // Every format the lines can use is known up front, so the stylesheet can lead
+        m_writer->addAllFormats();
+        m_stream << m_writer->header(m_title);
+    }
+}
+
+void ExportWorker::write(const ExportBatch &batch)
+{
+    if (m_failed)
+    {
+        return;
+    }
+
+    QString out;
+    for (int n = 0; n < batch.texts.size(); n++)
+    {
+        if (m_writer)
+        {
+            m_writer->writeLine(out, batch.texts.at(n), batch.runs.at(n));
+        }
+        else
+        {
+            out.append(batch.texts.at(n));
+        }
+        out.append('\n');
+    }
+    m_stream << out;
+
+    if (m_stream.status() != QTextStream::Ok)
+    {
+        m_failed = true;
+        m_file.close();
+        emit finished(false, m_file.errorString());
+        return;
+    }
+
+    emit written(batch.texts.size());
+}
+
+void ExportWorker::close()
+{
+    if (m_failed)
+    {
+        return;
+    }
+
+    if (m_writer)
+    {
+        m_stream << HtmlWriter::footer();
+    }
+    m_stream.flush();
+
+    const bool ok = m_stream.status() == QTextStream::Ok;
+    m_file.close();
+
+    emit finished(ok, ok ? QString() : m_file.errorString());
+}
+
+void ExportWorker::abort()
+{
+    if (m_file.isOpen())
+    {
+        m_file.close();
+        m_file.remove();
+    }
+    m_failed = true;
+}
+
+ScrollbackExport::ScrollbackExport(ConsoleDocument *doc, QObject *parent) :
+    QObject(parent),
+    m_document(doc),
+    m_thread(0),
+    m_worker(0),
+    m_next(0),
+    m_last(-1),
+    m_total(0),
+    m_done(0),
+    m_pending(0),
+    m_feedQueued(false),
+    m_closing(false)
+{
+    qRegisterMetaType<ExportBatch>("ExportBatch");
+}
+
+ScrollbackExport::~ScrollbackExport()
+{
+    stop();
+}
+
+void ScrollbackExport::start(const QString &fileName, bool html, const QString &title,
+                             const QColor &fg, const QColor &bg, const QFont &font)
+{
+    if (isRunning())
+    {
+        return;
+    }
+
+    const LineBuffer &lines = m_document->lines();
+
+    // What's there now; lines arriving meanwhile aren't part of it
+    m_next = lines.firstLine();
+    m_last = lines.lastLine();
+    if (lines.length(m_last) == 0)
+    {
+        m_last--;
+    }
+    m_total = qMax<qint64>(m_last - m_next + 1, 1);
+    m_done = 0;
+    m_pending = 0;
+    m_closing = false;
+
+    HtmlWriter *writer = 0;
+    if (html)
+    {
+        writer = new HtmlWriter(m_document->formats(), fg, bg, font);
+    }
+
+    m_worker = new ExportWorker(fileName, writer, title);
+    m_thread = new QThread(this);
+    m_worker->moveToThread(m_thread);
+    connect(m_thread, SIGNAL(finished()), m_worker, SLOT(deleteLater()));
+    connect(m_worker, SIGNAL(written(int)), SLOT(written(int)));
+    connect(m_worker, SIGNAL(finished(bool,QString)), SLOT(workerFinished(bool,QString)));
+    m_thread->start(QThread::LowPriority);
+
+    QMetaObject::invokeMethod(m_worker, "open", Qt::QueuedConnection);
+
+    emit progress(0);
+    scheduleFeed();
+}
+
+void ScrollbackExport::cancel()
+{
+    if (!isRunning())
+    {
+        return;
+    }
+
+    stop();
+
+    emit finished(false, QString());
+}
+
+void ScrollbackExport::feed()
+{
+    m_feedQueued = false;
+
+    if (!isRunning() || m_closing)
+    {
+        return;
+    }
+
+    const LineBuffer &lines = m_document->lines();
+
+    QElapsedTimer timer;
+    timer.start();
+
+    while (m_pending < MAX_PENDING && m_next <= m_last)
+    {
+        // Lines can scroll off the top before the export gets to them
+        if (m_next < lines.firstLine())
+        {
+            m_done += qMin(lines.firstLine(), m_last + 1) - m_next;
+            m_next = lines.firstLine();
+            continue;
+        }
+
+        ExportBatch batch;
+        for (; m_next <= m_last && batch.texts.size() < BATCH_LINES; m_next++)
+        {
+            batch.texts.append(lines.text(m_next));
+            batch.runs.append(lines.runs(m_next));
+        }
+
+        m_pending++;
+        QMetaObject::invokeMethod(m_worker, "write", Qt::QueuedConnection, Q_ARG(ExportBatch, batch));
+
+        if (timer.elapsed() >= FEED_BUDGET)
+        {
+            break;
+        }
+    }
+
+    if (m_next > m_last)
+    {
+        m_closing = true;
+        QMetaObject::invokeMethod(m_worker, "close", Qt::QueuedConnection);
+    }
+    else if (m_pending < MAX_PENDING)
+    {
+        scheduleFeed();
+    }
+}
+
+void ScrollbackExport::written(int lines)
+{
+    m_pending--;
+    m_done += lines;
+
+    emit progress(int(qMin<qint64>(m_done * 100 / m_total, 100)));
+
+    scheduleFeed();
+}
+
+void ScrollbackExport::workerFinished(bool ok, const QString &error)
+{
+    if (!isRunning())
+    {
+        return;
+    }
+
+    m_thread->quit();
+    m_thread->wait();
+    m_thread->deleteLater();
+    m_thread = 0;
+    m_worker = 0;
+
+    if (ok)
+    {
+        emit progress(100);
+    }
+    emit finished(ok, error);
+}
+
+void ScrollbackExport::stop()
+{
+    if (!isRunning())
+    {
+        return;
+    }
+
+    // Waits behind the few batches still queued, so the partial file is gone
+    // before the thread's event loop is told to stop
+    QMetaObject::invokeMethod(m_worker, "abort", Qt::BlockingQueuedConnection);
+
+    m_thread->quit();
+    m_thread->wait();
+    m_thread->deleteLater();
+    m_thread = 0;
+    m_worker = 0;
+}
+
+void ScrollbackExport::scheduleFeed()
+{
+    if (!m_feedQueued)
+    {
+        m_feedQueued = true;
+        QMetaObject::invokeMethod(this, "feed", Qt::QueuedConnection);
+    }
+}
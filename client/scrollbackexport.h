@@ -0,0 +1,122 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+
+#ifndef SCROLLBACKEXPORT_H
+#define SCROLLBACKEXPORT_H
+
+#include <QColor>
+#include <QFile>
+#include <QFont>
+#include <QMetaType>
+#include <QObject>
+#include <QStringList>
+#include <QTextStream>
+#include <QVector>
+#include "linebuffer.h"
+
+class ConsoleDocument;
+class HtmlWriter;
+class QThread;
+
+// Lines copied out of the buffer for the export thread
+struct ExportBatch
+{
+    QStringList texts;
+    QVector<QVector<LineRun> > runs;
+};
+
+Q_DECLARE_METATYPE(ExportBatch)
+
+// Writes batches to the file on the export thread; HTML when it has a writer, plain text without
+class ExportWorker : public QObject
+{
+    Q_OBJECT
+public:
+    ExportWorker(const QString &fileName, HtmlWriter *writer, const QString &title);
+    ~ExportWorker();
+
+public slots:
+    void open();
+    void write(const ExportBatch &batch);
+    void close();
+    void abort();
+
+signals:
+    void written(int lines);
+    void finished(bool ok, const QString &error);
+
+private:
+    QFile m_file;
+    QTextStream m_stream;
+    HtmlWriter *m_writer;
+    QString m_title;
+    bool m_failed;
+};
+
+// Saves the whole scrollback to a file. The buffer is only read on the GUI
+// thread, a slice at a time between events; formatting and writing happen on
+// a thread of their own, so a long export doesn't hold up the console.
+class ScrollbackExport : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ScrollbackExport(ConsoleDocument *doc, QObject *parent = 0);
+    ~ScrollbackExport();
+
+    bool isRunning() const { return m_thread != 0; }
+
+    void start(const QString &fileName, bool html, const QString &title,
+               const QColor &fg, const QColor &bg, const QFont &font);
+
+public slots:
+    void cancel();
+
+signals:
+    void progress(int percent);
+    void finished(bool ok, const QString &error);
+
+private slots:
+    void feed();
+    void written(int lines);
+    void workerFinished(bool ok, const QString &error);
+
+private:
+    void stop();
+    void scheduleFeed();
+
+    ConsoleDocument *m_document;
+
+    QThread *m_thread;
+    ExportWorker *m_worker;
+
+    qint64 m_next;
+    qint64 m_last;
+    qint64 m_total;
+    qint64 m_done;
+    int m_pending;
+    bool m_feedQueued;
+    bool m_closing;
+};
+
+#endif // SCROLLBACKEXPORT_H
@@ -0,0 +1,317 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+
+
+#include "scrollbacksearch.h"
+#include "consoledocument.h"
+#include "trigramindex.h"
+#include <QElapsedTimer>
+#include <QThread>
+
+// Lines per batch, and how many batches may be queued at once; enough to keep
+// the worker busy without holding much text that a new search would discard
+static const int BATCH_LINES = 2048;
+static const int MAX_PENDING = 3;
+// How long one call to feed() may spend pulling text out of the buffer
+static const int FEED_BUDGET = 8;
+
+SearchWorker::SearchWorker(const QAtomicInt *generation) :
+    QObject(0),
+    m_generation(generation)
+{
+}
+
+void SearchWorker::search(const SearchBatch &batch)
+{
+    SearchResults results;
+    results.generation = batch.generation;
+
+    for (int n = 0; n < batch.texts.size(); n++)
+    {
+        if ((n & 255) == 0 && m_generation->load() != batch.generation)
+        {
+            return;
+        }
+
+        QVector<SearchMatch> found;
+        QRegularExpressionMatchIterator it(batch.regex.globalMatch(batch.texts.at(n)));
+        while (it.hasNext())
+        {
+            QRegularExpressionMatch match(it.next());
+            if (match.capturedLength() > 0)
+            {
+                found.append(SearchMatch(match.capturedStart(), match.capturedLength()));
+            }
+        }
+
+        if (!found.isEmpty())
+        {
+            results.lines.append(batch.lines.at(n));
+            results.matches.append(found);
+        }
+    }
+
+    emit found(results);
+}
+
+ScrollbackSearch::ScrollbackSearch(ConsoleDocument *doc) :
+    QObject(doc),
+    m_document(doc),
+    m_thread(0),
+    m_worker(0),
+    m_generation(0),
+    m_active(false),
+    m_pending(0),
+    m_feedQueued(false),
+    m_count(0)
+{
+    qRegisterMetaType<SearchBatch>("SearchBatch");
+    qRegisterMetaType<SearchResults>("SearchResults");
+}
+
+ScrollbackSearch::~ScrollbackSearch()
+{
+    if (m_thread)
+    {
+        m_generation.fetchAndAddOrdered(1);
+        m_thread->quit();
+        m_thread->wait();
+    }
+}
+
+void ScrollbackSearch::start(const QRegularExpression &regex, const QStringList &literals)
+{
+    stop();
+
+    if (!regex.isValid() || regex.pattern().isEmpty())
+    {
+        return;
+    }
+
+    // The thread is only started the first time it's needed
+    if (!m_thread)
+    {
+        m_worker = new SearchWorker(&m_generation);
+        m_thread = new QThread(this);
+        m_worker->moveToThread(m_thread);
+        connect(m_thread, SIGNAL(finished()), m_worker, SLOT(deleteLater()));
+        connect(m_worker, SIGNAL(found(SearchResults)), SLOT(found(SearchResults)));
+        m_thread->start(QThread::LowPriority);
+    }
+
+    m_active = true;
+    m_regex = regex;
+
+    const LineBuffer &lines = m_document->lines();
+    const TrigramIndex &index = m_document->index();
+    if (lines.isEmpty())
+    {
+        emit progress(0, true);
+        return;
+    }
+
+    if (index.isEmpty())
+    {
+        addRange(lines.firstLine(), lines.lastLine());
+    }
+    else
+    {
+        // Newest first: whatever came in since the index last caught up, then
+        // the indexed lines, then anything older the index never saw
+        qint64 indexFirst = qMax(index.firstLine(), lines.firstLine());
+        qint64 indexLast = qMin(index.lastLine(), lines.lastLine());
+
+        addRange(indexLast + 1, lines.lastLine());
+
+        QVector<qint64> blocks;
+        if (index.candidates(literals, blocks))
+        {
+            foreach (qint64 block, blocks)
+            {
+                addRange(qMax(block, indexFirst), qMin(block + TrigramIndex::blockLines() - 1, indexLast));
+            }
+        }
+        else
+        {
+            addRange(indexFirst, indexLast);
+        }
+
+        addRange(lines.firstLine(), indexFirst - 1);
+    }
+
+    scheduleFeed();
+}
+
+void ScrollbackSearch::stop()
+{
+    // Anything still queued for the worker is dropped when it sees the new generation
+    m_generation.fetchAndAddOrdered(1);
+
+    m_active = false;
+    m_ranges.clear();
+    m_pending = 0;
+    m_matches.clear();
+    m_count = 0;
+}
+
+QVector<SearchMatch> ScrollbackSearch::matches(qint64 line) const
+{
+    return m_matches.value(line);
+}
+
+qint64 ScrollbackSearch::nextLine(qint64 line) const
+{
+    QMap<qint64, QVector<SearchMatch> >::const_iterator it = m_matches.upperBound(line);
+    if (it == m_matches.constEnd())
+    {
+        return -1;
+    }
+    return it.key();
+}
+
+qint64 ScrollbackSearch::previousLine(qint64 line) const
+{
+    QMap<qint64, QVector<SearchMatch> >::const_iterator it = m_matches.lowerBound(line);
+    if (it == m_matches.constBegin())
+    {
+        return -1;
+    }
+    return (--it).key();
+}
+
+void ScrollbackSearch::linesRemoved(qint64 first)
+{
+    QMap<qint64, QVector<SearchMatch> >::iterator it = m_matches.lowerBound(first);
+    while (it != m_matches.end())
+    {
+        m_count -= it.value().size();
+        it = m_matches.erase(it);
+    }
+}
+
+void ScrollbackSearch::feed()
+{
+    m_feedQueued = false;
+
+    if (!m_active)
+    {
+        return;
+    }
+
+    const LineBuffer &lines = m_document->lines();
+
+    QElapsedTimer timer;
+    timer.start();
+
+    while (m_pending < MAX_PENDING && !m_ranges.isEmpty())
+    {
+        SearchBatch batch;
+        batch.generation = m_generation.load();
+        batch.regex = m_regex;
+        batch.lines.reserve(BATCH_LINES);
+
+        while (batch.lines.size() < BATCH_LINES && !m_ranges.isEmpty())
+        {
+            QPair<qint64, qint64> &range = m_ranges.first();
+            while (range.second >= range.first && batch.lines.size() < BATCH_LINES)
+            {
+                // Lines may have scrolled off since the range was planned
+                if (lines.contains(range.second))
+                {
+                    batch.lines.append(range.second);
+                    batch.texts.append(lines.text(range.second));
+                }
+                range.second--;
+            }
+
+            if (range.second < range.first)
+            {
+                m_ranges.removeFirst();
+            }
+        }
+
+        if (!batch.lines.isEmpty())
+        {
+            m_pending++;
+            QMetaObject::invokeMethod(m_worker, "search", Qt::QueuedConnection, Q_ARG(SearchBatch, batch));
+        }
+
+        if (timer.elapsed() >= FEED_BUDGET)
+        {
+            break;
+        }
+    }
+
+    if (isFinished())
+    {
+        emit progress(m_count, true);
+    }
+    else if (m_pending < MAX_PENDING)
+    {
+        scheduleFeed();
+    }
+}
+
+void ScrollbackSearch::found(const SearchResults &results)
+{
+    if (!m_active || results.generation != m_generation.load())
+    {
+        return;
+    }
+
+    m_pending--;
+
+    for (int n = 0; n < results.lines.size(); n++)
+    {
+        QVector<SearchMatch> &found = m_matches[results.lines.at(n)];
+        m_count += results.matches.at(n).size() - found.size();
+        found = results.matches.at(n);
+    }
+
+    bool finished = isFinished();
+    emit progress(m_count, finished);
+
+    if (!finished)
+    {
+        scheduleFeed();
+    }
+}
+
+void ScrollbackSearch::addRange(qint64 first, qint64 last)
+{
+    if (first <= last)
+    {
+        m_ranges.append(qMakePair(first, last));
+    }
+}
+
+void ScrollbackSearch::scheduleFeed()
+{
+    // Text is gathered a slice at a time so a long search never blocks input
+    if (!m_feedQueued)
+    {
+        m_feedQueued = true;
+        QMetaObject::invokeMethod(this, "feed", Qt::QueuedConnection);
+    }
+}
@@ -0,0 +1,143 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+
+#ifndef SCROLLBACKSEARCH_H
+#define SCROLLBACKSEARCH_H
+
+#include <QAtomicInt>
+#include <QList>
+#include <QMap>
+#include <QMetaType>
+#include <QObject>
+#include <QPair>
+#include <QRegularExpression>
+#include <QStringList>
+#include <QVector>
+
+class ConsoleDocument;
+class QThread;
+
+struct SearchMatch
+{
+    SearchMatch() : start(0), length(0) {}
+    SearchMatch(int s, int l) : start(s), length(l) {}
+
+    int start;
+    int length;
+};
+Q_DECLARE_TYPEINFO(SearchMatch, Q_PRIMITIVE_TYPE);
+
+// Lines handed to the search thread, and what turned up in them
+struct SearchBatch
+{
+    SearchBatch() : generation(0) {}
+
+    int generation;
+    QRegularExpression regex;
+    QVector<qint64> lines;
+    QStringList texts;
+};
+
+struct SearchResults
+{
+    SearchResults() : generation(0) {}
+
+    int generation;
+    QVector<qint64> lines;
+    QVector<QVector<SearchMatch> > matches;
+};
+
+Q_DECLARE_METATYPE(SearchBatch)
+Q_DECLARE_METATYPE(SearchResults)
+
+class SearchWorker : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SearchWorker(const QAtomicInt *generation);
+
+public slots:
+    void search(const SearchBatch &batch);
+
+signals:
+    void found(const SearchResults &results);
+
+private:
+    const QAtomicInt *m_generation;
+};
+
+// Finds a pattern in a ConsoleDocument's scrollback. The trigram index picks
+// out the blocks of lines worth a look, newest first; their text goes to a
+// worker thread a batch at a time and matches come back as they turn up.
+class ScrollbackSearch : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ScrollbackSearch(ConsoleDocument *doc);
+    ~ScrollbackSearch();
+
+    bool isActive() const { return m_active; }
+    bool isFinished() const { return m_ranges.isEmpty() && m_pending == 0; }
+    int count() const { return m_count; }
+
+    void start(const QRegularExpression &regex, const QStringList &literals);
+    void stop();
+
+    QVector<SearchMatch> matches(qint64 line) const;
+    // The nearest line past the given one with a match, or -1
+    qint64 nextLine(qint64 line) const;
+    qint64 previousLine(qint64 line) const;
+
+    // Lines from here on were removed or renumbered
+    void linesRemoved(qint64 first);
+
+signals:
+    void progress(int matches, bool finished);
+
+private slots:
+    void feed();
+    void found(const SearchResults &results);
+
+private:
+    void addRange(qint64 first, qint64 last);
+    void scheduleFeed();
+
+    ConsoleDocument *m_document;
+
+    QThread *m_thread;
+    SearchWorker *m_worker;
+    QAtomicInt m_generation;
+
+    bool m_active;
+    QRegularExpression m_regex;
+    // Inclusive ranges of lines still to search, each taken from its end
+    QList<QPair<qint64, qint64> > m_ranges;
+    int m_pending;
+    bool m_feedQueued;
+
+    QMap<qint64, QVector<SearchMatch> > m_matches;
+    int m_count;
+};
+
+#endif // SCROLLBACKSEARCH_H
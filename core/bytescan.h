@@ -0,0 +1,109 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#ifndef BYTESCAN_H
+#define BYTESCAN_H
+
+#include <QtGlobal>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define BYTESCAN_SSE2
+#endif
+
+#if defined(_MSC_VER)
+#  include <intrin.h>
+#endif
+
+namespace ByteScan
+{
+
+inline int firstSetBit(uint mask)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return int(index);
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// Returns the offset of the first byte matching any of the four needles, or length if there is none
+inline int findAny(const char *data, int length, char a, char b, char c, char d)
+{
+    int pos = 0;
+
+#ifdef BYTESCAN_SSE2
+    const __m128i needleA = _mm_set1_epi8(a);
+    const __m128i needleB = _mm_set1_epi8(b);
+    const __m128i needleC = _mm_set1_epi8(c);
+    const __m128i needleD = _mm_set1_epi8(d);
+
+    for (; pos + 16 <= length; pos += 16)
+    {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos));
+        const __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, needleA), _mm_cmpeq_epi8(chunk, needleB)),
+                                          _mm_or_si128(_mm_cmpeq_epi8(chunk, needleC), _mm_cmpeq_epi8(chunk, needleD)));
+
+        uint mask = uint(_mm_movemask_epi8(hits));
+        if (mask)
+        {
+            return pos + firstSetBit(mask);
+        }
+    }
+#endif
+
+    for (; pos < length; pos++)
+    {
+        const char ch = data[pos];
+        if (ch == a || ch == b || ch == c || ch == d)
+        {
+            return pos;
+        }
+    }
+
+    return length;
+}
+
+inline int findAny(const char *data, int length, char a, char b, char c)
+{
+    return findAny(data, length, a, b, c, c);
+}
+
+inline int findAny(const char *data, int length, char a, char b)
+{
+    return findAny(data, length, a, b, a, b);
+}
+
+inline int find(const char *data, int length, char a)
+{
+    const char *hit = static_cast<const char *>(memchr(data, a, length));
+
+    return hit ? int(hit - data) : length;
+}
+
+}
+
+#endif // BYTESCAN_H
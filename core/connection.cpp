@@ -22,8 +22,13 @@
 
 
 #include "connection.h"
+#include "bytescan.h"
+#include "hostcache.h"
+#include "msdp.h"
 #include <QApplication>
 #include <QDebug>
+#include <QThread>
+#include <QtMath>
 
 static const QLatin1Char ESC('\x1B');
 static const QLatin1Char ANSI_START('[');
@@ -37,6 +42,7 @@ static const QString CRLFGA(CRLF + GA);
 
 static const uchar Telnet_ESC = 0x1Bu;
 
+static const uchar Telnet_EndOfRecord = 239u;
 static const uchar Telnet_SubnegotiationEnd = 240u;
 static const uchar Telnet_NoOperation = 241u;
 static const uchar Telnet_DataMark = 242u;
@@ -76,85 +82,427 @@ static const uchar TelnetOption_Aardwolf = 102u;
 static const uchar TelnetOption_ATCP = 200u;
 static const uchar TelnetOption_GMCP = 201u;
 
+static const int MIB_UTF8 = 106;
+
+static const uchar Charset_Request = 1u;
+static const uchar Charset_Accepted = 2u;
+static const uchar Charset_Rejected = 3u;
+static const uchar Charset_TranslationTableIs = 4u;
+static const uchar Charset_TranslationTableRejected = 5u;
+
 Q_LOGGING_CATEGORY(CORE_CONNECTION, "core.connection")
 Q_LOGGING_CATEGORY(CORE_CONNECTION_TELNET, "core.connection.telnet")
 
 
+static const int INPUT_BUFFER_SIZE = 32768;
+static const qint64 SOCKET_READ_BUFFER_SIZE = 131072;
+static const int INFLATE_BUFFER_SIZE = 32768;
+static const int SUBNEGOTIATION_BUFFER_SIZE = 4096;
+static const int PAYLOAD_RING_SIZE = 1024;
+
+static const int LATENCY_PROBE_INTERVAL = 5000;
+static const int LATENCY_PROBE_TIMEOUT = 10000;
+static const int LATENCY_PROBE_MISSES = 3;
+
+// IAC inside a subnegotiation has to be doubled
+static void appendSubnegotiationData(QByteArray &out, const QByteArray &data)
+{
+    int start = 0;
+    int end;
+    while ((end = data.indexOf(char(0xFF), start)) != -1)
+    {
+        out.append(data.constData() + start, end - start + 1);
+        out.append(char(0xFF));
+        start = end + 1;
+    }
+    out.append(data.constData() + start, data.length() - start);
+}
+
+// RFC 8305 recommends 250ms between connection attempts
+static const int CONNECTION_ATTEMPT_DELAY = 250;
+
+
 Connection::Connection(QObject *parent) :
-    QObject(parent)
+    QObject(parent),
+    m_socket(0),
+    m_socketState(QAbstractSocket::UnconnectedState),
+    m_attemptTimer(this),
+    m_codec(0),
+    m_decoder(0),
+    m_encoder(0),
+    m_payloads(PAYLOAD_RING_SIZE),
+    m_notifyPending(0),
+    m_readStalled(0),
+    m_probeTimer(this),
+    m_flushRequested(0),
+    m_flushTimer(this)
 {
-    connect(&m_socket, SIGNAL(connected()), SLOT(connectionEstablished()));
-    connect(&m_socket, SIGNAL(disconnected()), SLOT(connectionLost()));
-    connect(&m_socket, SIGNAL(readyRead()), SLOT(readyToRead()));
+    // hostFound() crosses from the network thread to the GUI thread
+    qRegisterMetaType<QHostInfo>("QHostInfo");
+
+    m_attemptTimer.setSingleShot(true);
+    m_attemptTimer.setInterval(CONNECTION_ATTEMPT_DELAY);
+    connect(&m_attemptTimer, SIGNAL(timeout()), SLOT(startNextAttempt()));
 
-    setEncoding("UTF-8");
+    m_flushTimer.setSingleShot(true);
+    connect(&m_flushTimer, SIGNAL(timeout()), SLOT(flushQueue()));
+
+    m_probeTimer.setInterval(LATENCY_PROBE_INTERVAL);
+    connect(&m_probeTimer, SIGNAL(timeout()), SLOT(sendProbe()));
+
+    m_sendRate = 0;
+    m_sendBurst = 0;
+    m_sendTokens = 0.0;
+
+    // Matches the console's decoder, so there is nothing to announce
+    m_codec = QTextCodec::codecForName("UTF-8");
+    m_decoder = m_codec->makeDecoder();
+    m_encoder = m_codec->makeEncoder();
 
     m_port = 0;
     m_lookup = 0;
+    m_fromCache = false;
+
+    memset(&m_zstream, 0, sizeof(m_zstream));
+    m_inflateBuffer.resize(INFLATE_BUFFER_SIZE);
+    m_compressing = false;
+
+    m_data.reserve(INPUT_BUFFER_SIZE);
+    m_subnegotiation.reserve(SUBNEGOTIATION_BUFFER_SIZE);
 
     reset();
 }
 
+Connection::~Connection()
+{
+    endCompression();
+
+    delete m_decoder;
+    delete m_encoder;
+}
+
 void Connection::setEncoding(const QString &encoding)
 {
-    m_codec = QTextCodec::codecForName(qPrintable(encoding));
+    if (QThread::currentThread() != thread())
+    {
+        QMetaObject::invokeMethod(this, "setEncoding", Qt::QueuedConnection, Q_ARG(QString, encoding));
+        return;
+    }
 
-    m_decoder = m_codec->makeDecoder();
-    m_encoder = m_codec->makeEncoder();
+    QTextCodec *codec = QTextCodec::codecForName(qPrintable(encoding));
+    if (!codec)
+    {
+        qCWarning(CORE_CONNECTION) << "Unknown encoding:" << encoding;
+        return;
+    }
+
+    if (codec == m_codec)
+    {
+        return;
+    }
+
+    {
+        QMutexLocker locker(&m_sendLock);
+
+        m_codec = codec;
+
+        delete m_decoder;
+        delete m_encoder;
+        m_decoder = m_codec->makeDecoder();
+        m_encoder = m_codec->makeEncoder();
+    }
+
+    // Text already received was sent in the old encoding, so the switch travels in order with it
+    postData();
+    postPayload(ConnectionPayload(ConnectionPayload::Encoding, m_codec->name()));
 }
 
 void Connection::connectRemote(const QString &addr, int port)
 {
-    if (m_socket.state() != QAbstractSocket::UnconnectedState)
+    if (QThread::currentThread() != thread())
     {
-        m_socket.abort();
-        connectRemote(addr, port);
+        QMetaObject::invokeMethod(this, "connectRemote", Qt::QueuedConnection, Q_ARG(QString, addr), Q_ARG(int, port));
         return;
     }
 
+    if (m_lookup)
+    {
+        QHostInfo::abortHostLookup(m_lookup);
+        m_lookup = 0;
+    }
+
+    abortAttempts();
+
+    if (m_socket)
+    {
+        m_socket->abort();
+
+        if (m_socket)
+        {
+            connectionLost();
+        }
+    }
+
     m_hostname = addr;
     m_port = port;
-    m_lookup = QHostInfo::lookupHost(addr, this, SLOT(lookupComplete(QHostInfo)));
 
     qCDebug(CORE_CONNECTION) << "Connecting" << addr << port;
+
+    m_socketState.storeRelease(QAbstractSocket::HostLookupState);
+
+    QList<QHostAddress> cached(HostCache::instance()->addresses(addr));
+    if (!cached.isEmpty())
+    {
+        qCDebug(CORE_CONNECTION) << "Using cached addresses" << cached;
+
+        QHostInfo hostInfo;
+        hostInfo.setHostName(addr);
+        hostInfo.setAddresses(cached);
+        emit hostFound(hostInfo);
+
+        m_fromCache = true;
+        startConnecting(cached);
+        return;
+    }
+
+    m_fromCache = false;
+    m_lookup = QHostInfo::lookupHost(addr, this, SLOT(lookupComplete(QHostInfo)));
 }
 
 void Connection::disconnectRemote()
 {
+    if (QThread::currentThread() != thread())
+    {
+        QMetaObject::invokeMethod(this, "disconnectRemote", Qt::QueuedConnection);
+        return;
+    }
+
     if (m_lookup)
     {
         QHostInfo::abortHostLookup(m_lookup);
         m_lookup = 0;
     }
 
+    abortAttempts();
+
     qCDebug(CORE_CONNECTION) << "Disconnecting";
 
-    m_socket.disconnectFromHost();
+    if (m_socket)
+    {
+        m_socket->disconnectFromHost();
+    }
+    else
+    {
+        m_socketState.storeRelease(QAbstractSocket::UnconnectedState);
+    }
 }
 
 void Connection::lookupComplete(const QHostInfo &hostInfo)
 {
-    if (!hostInfo.addresses().isEmpty())
+    m_lookup = 0;
+
+    qCDebug(CORE_CONNECTION) << "Host lookup complete" << m_hostname << hostInfo.addresses() << m_port;
+
+    emit hostFound(hostInfo);
+
+    if (hostInfo.addresses().isEmpty())
     {
-        m_address = hostInfo.addresses().first();
-        m_socket.connectToHost(m_address, m_port);
+        connectFailed(hostInfo.errorString());
+        return;
     }
-    else
+
+    HostCache::instance()->store(m_hostname, hostInfo.addresses());
+
+    startConnecting(hostInfo.addresses());
+}
+
+void Connection::startConnecting(const QList<QHostAddress> &addresses)
+{
+    m_candidates = interleaveFamilies(addresses);
+    m_attemptError.clear();
+
+    m_socketState.storeRelease(QAbstractSocket::ConnectingState);
+
+    startNextAttempt();
+}
+
+void Connection::startNextAttempt()
+{
+    if (m_candidates.isEmpty())
     {
-        m_hostname = hostInfo.hostName();
-        m_socket.connectToHost(m_hostname, m_port);
+        return;
     }
 
-    qCDebug(CORE_CONNECTION) << "Host lookup complete" << m_hostname << m_address << m_port;
+    QHostAddress address(m_candidates.takeFirst());
 
-    emit hostFound(hostInfo);
+    qCDebug(CORE_CONNECTION) << "Trying" << address << m_port;
+
+    QTcpSocket *socket = new QTcpSocket(this);
+    connect(socket, SIGNAL(connected()), SLOT(attemptConnected()));
+    connect(socket, SIGNAL(error(QAbstractSocket::SocketError)), SLOT(attemptFailed()));
+    m_attempts.append(socket);
+
+    socket->connectToHost(address, m_port);
+
+    // Don't wait out a black-holed address before trying the next one
+    if (!m_candidates.isEmpty())
+    {
+        m_attemptTimer.start();
+    }
+}
+
+void Connection::attemptConnected()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+    if (!socket || !m_attempts.removeOne(socket))
+    {
+        return;
+    }
+
+    abortAttempts();
+    adoptSocket(socket);
+
+    HostCache::instance()->promote(m_hostname, m_address);
+
+    connectionEstablished();
+
+    // Anything that arrived with the handshake was signalled before we were listening
+    if (m_socket->bytesAvailable() > 0)
+    {
+        readyToRead();
+    }
+}
+
+void Connection::attemptFailed()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+    if (!socket || !m_attempts.removeOne(socket))
+    {
+        return;
+    }
+
+    qCDebug(CORE_CONNECTION) << "Attempt failed" << socket->peerName() << socket->errorString();
+
+    m_attemptError = socket->errorString();
+    socket->deleteLater();
+
+    if (!m_candidates.isEmpty())
+    {
+        // A refusal is as good as the stagger timer running out
+        m_attemptTimer.stop();
+        startNextAttempt();
+    }
+    else if (m_attempts.isEmpty())
+    {
+        if (m_fromCache)
+        {
+            // The cached addresses may be stale, so resolve the name properly
+            qCDebug(CORE_CONNECTION) << "Cached addresses failed, looking up" << m_hostname;
+
+            HostCache::instance()->remove(m_hostname);
+
+            m_fromCache = false;
+            m_socketState.storeRelease(QAbstractSocket::HostLookupState);
+            m_lookup = QHostInfo::lookupHost(m_hostname, this, SLOT(lookupComplete(QHostInfo)));
+            return;
+        }
+
+        connectFailed(m_attemptError);
+    }
+}
+
+void Connection::abortAttempts()
+{
+    m_attemptTimer.stop();
+    m_candidates.clear();
+
+    foreach (QTcpSocket *socket, m_attempts)
+    {
+        socket->disconnect(this);
+        socket->abort();
+        socket->deleteLater();
+    }
+    m_attempts.clear();
+}
+
+void Connection::adoptSocket(QTcpSocket *socket)
+{
+    socket->disconnect(this);
+
+    m_socket = socket;
+    m_address = socket->peerAddress();
+
+    // Unbounded by default, the socket would keep draining the kernel while reading is stalled
+    m_socket->setReadBufferSize(SOCKET_READ_BUFFER_SIZE);
+
+    connect(m_socket, SIGNAL(disconnected()), SLOT(connectionLost()));
+    connect(m_socket, SIGNAL(readyRead()), SLOT(readyToRead()));
+    connect(m_socket, SIGNAL(stateChanged(QAbstractSocket::SocketState)), SLOT(socketStateChanged(QAbstractSocket::SocketState)));
+
+    m_socketState.storeRelease(m_socket->state());
+}
+
+void Connection::connectFailed(const QString &reason)
+{
+    qCWarning(CORE_CONNECTION) << "Unable to connect to" << m_hostname << m_port << reason;
+
+    m_socketState.storeRelease(QAbstractSocket::UnconnectedState);
+
+    emit connectionFailed(reason);
+}
+
+QList<QHostAddress> Connection::interleaveFamilies(const QList<QHostAddress> &addresses)
+{
+    if (addresses.isEmpty())
+    {
+        return addresses;
+    }
+
+    // Alternate families, starting with whichever one the list prefers
+    QAbstractSocket::NetworkLayerProtocol first = addresses.first().protocol();
+
+    QList<QHostAddress> preferred;
+    QList<QHostAddress> other;
+    foreach (const QHostAddress &address, addresses)
+    {
+        if (address.protocol() == first)
+        {
+            preferred.append(address);
+        }
+        else
+        {
+            other.append(address);
+        }
+    }
+
+    QList<QHostAddress> result;
+    while (!preferred.isEmpty() || !other.isEmpty())
+    {
+        if (!preferred.isEmpty())
+        {
+            result.append(preferred.takeFirst());
+        }
+        if (!other.isEmpty())
+        {
+            result.append(other.takeFirst());
+        }
+    }
+
+    return result;
 }
 
 void Connection::connectionEstablished()
 {
-    m_connectTime = QDateTime::currentDateTime();
+    QDateTime now(QDateTime::currentDateTime());
+
+    m_statsLock.lock();
+    m_connectTime = now;
+    m_statsLock.unlock();
 
-    qCDebug(CORE_CONNECTION) << "Connected" << m_connectTime;
+    qCDebug(CORE_CONNECTION) << "Connected" << now;
+
+    m_probeMisses = 0;
+    m_probeTimer.start();
 
     emit connected();
 }
@@ -165,21 +513,65 @@ void Connection::connectionLost()
 
     qCDebug(CORE_CONNECTION) << "Disconnected" << QDateTime::currentDateTime();
 
+    if (m_socket)
+    {
+        m_socket->disconnect(this);
+        m_socket->deleteLater();
+        m_socket = 0;
+    }
+    m_socketState.storeRelease(QAbstractSocket::UnconnectedState);
+
     reset();
 
     emit disconnected();
 }
 
+void Connection::socketStateChanged(QAbstractSocket::SocketState state)
+{
+    m_socketState.storeRelease(state);
+}
+
+QDateTime Connection::connectTime() const
+{
+    QMutexLocker locker(&m_statsLock);
+
+    return m_connectTime;
+}
+
 quint64 Connection::connectDuration()
 {
-    if (m_connectTime.isValid())
+    QDateTime connectedAt(connectTime());
+    if (connectedAt.isValid())
     {
-        return m_connectTime.msecsTo(QDateTime::currentDateTime());
+        return connectedAt.msecsTo(QDateTime::currentDateTime());
     }
 
     return 0;
 }
 
+ConnectionStats Connection::stats() const
+{
+    m_statsLock.lock();
+    ConnectionStats result(m_stats);
+    m_statsLock.unlock();
+
+    QMutexLocker locker(&m_sendLock);
+    result.queueDepth = m_sendQueue.count();
+    result.priorityBytes = m_priorityQueue.length();
+
+    return result;
+}
+
+void Connection::acknowledgePayloads()
+{
+    m_notifyPending.storeRelease(0);
+
+    if (m_readStalled.testAndSetOrdered(1, 0))
+    {
+        QMetaObject::invokeMethod(this, "resumeReading", Qt::QueuedConnection);
+    }
+}
+
 QString Connection::telnetString(const uchar option)
 {
     switch (option)
@@ -187,6 +579,8 @@ QString Connection::telnetString(const uchar option)
     case Telnet_ESC:
         return "ESC";
 
+    case Telnet_EndOfRecord:
+        return "EOR";
     case Telnet_SubnegotiationEnd:
         return "SE";
     case Telnet_NoOperation:
@@ -272,165 +666,240 @@ QString Connection::telnetString(const uchar option)
 
 void Connection::readyToRead()
 {
-    if (m_waitResponse)
+    if (!m_overflow.isEmpty())
     {
-        m_waitResponse = false;
+        // The console hasn't caught up yet, leave the rest in the socket until it does
+        m_readStalled.storeRelease(1);
+        notifyConsumer();
+        return;
+    }
 
-        int time = m_latencyTime.elapsed();
-        m_latency = time;
+    if (!m_socket)
+    {
+        return;
     }
 
-    qint64 amt = m_socket.bytesAvailable();
-    m_buffer.setData(m_socket.read(amt));
+    qint64 amt = m_socket->bytesAvailable();
+    if (amt <= 0)
+    {
+        return;
+    }
 
+    m_input.resize(amt);
+    amt = m_socket->read(m_input.data(), amt);
     if (amt <= 0)
     {
         return;
     }
 
-    m_receivedGA = false;
+    if (m_compressing)
+    {
+        decompress(m_input.constData(), amt);
+    }
+    else
+    {
+        processInput(m_input.constData(), amt);
+    }
+
+    if (!m_data.isEmpty())
+    {
+        postData();
+    }
 
-    QByteArray data;
-    for (int b = 0; b < amt; b++)
+    publishStats();
+}
+
+void Connection::resumeReading()
+{
+    while (!m_overflow.isEmpty() && m_payloads.push(m_overflow.head()))
+    {
+        m_overflow.dequeue();
+    }
+
+    notifyConsumer();
+
+    if (!m_overflow.isEmpty())
     {
-        uchar ch = (uchar)m_buffer.data().at(b);
+        m_readStalled.storeRelease(1);
+        return;
+    }
+
+    // readyRead() won't fire again for what the socket already holds; emptying it also lets the socket read on from the kernel
+    readyToRead();
+}
 
-        if (m_IAC || m_IAC2 || m_SB || ch == Telnet_InterpretAsCommand)
+void Connection::processInput(const char *data, int length)
+{
+    int pos = 0;
+    while (pos < length)
+    {
+        switch (m_telnetState)
         {
-            if (!(m_IAC || m_IAC2 || m_SB) && ch == Telnet_InterpretAsCommand)
-            {
-                m_IAC = true;
-                m_command += ch;
-            }
-            else if (m_IAC && ch == Telnet_InterpretAsCommand && !m_SB)
-            {
-                m_IAC = false;
-                data += ch;
-                m_command.clear();
-            }
-            else if (m_IAC && !m_SB && (ch == Telnet_Will || ch == Telnet_Wont || ch == Telnet_Do || ch == Telnet_Dont))
-            {
-                m_IAC = false;
-                m_IAC2 = true;
-                m_command += ch;
-            }
-            else if (m_IAC2)
-            {
-                m_IAC2 = false;
-                m_command += ch;
-                handleTelnetCommand(m_command);
-                m_command.clear();
-            }
-            else if (m_IAC && !m_SB && ch == Telnet_SubnegotiationBegin)
-            {
-                m_IAC = false;
-                m_SB = true;
-                m_command += ch;
-            }
-            else if (m_IAC && !m_SB && ch == Telnet_SubnegotiationEnd)
+        case TelnetText:
+        {
+            // Copy the whole run of plain text up to the next IAC or CR in one go
+            int run = ByteScan::findAny(data + pos, length - pos, char(Telnet_InterpretAsCommand), CR.toLatin1());
+            if (run > 0)
             {
-                m_command.clear();
-                m_IAC = false;
+                m_data.append(data + pos, run);
+                pos += run;
             }
-            else if (m_SB)
-            {
-                m_command += ch;
-
-                if (m_IAC && ch == Telnet_SubnegotiationEnd)
-                {
-                    handleTelnetCommand(m_command);
-                    m_command.clear();
-                    m_IAC = false;
-                    m_SB = false;
-                }
 
-                if (m_IAC)
-                {
-                    m_IAC = false;
-                }
-                else if (ch == Telnet_InterpretAsCommand)
+            if (pos < length)
+            {
+                if (uchar(data[pos]) == Telnet_InterpretAsCommand)
                 {
-                    m_IAC = true;
+                    m_telnetState = TelnetCommand;
                 }
+                pos++;
             }
-            else
-            {
-                m_IAC = false;
-                m_command += ch;
-                handleTelnetCommand(m_command);
-                m_command.clear();
-            }
-        }
-        else
-        {
-            if (ch != CR)
-            {
-                data += ch;
-            }
+            break;
         }
 
-        if (m_receivedGA)
+        case TelnetCommand:
         {
-            if (!m_forceOffGA)
+            uchar ch = uchar(data[pos++]);
+            m_telnetState = TelnetText;
+
+            switch (ch)
             {
-                m_receivedGA = false;
-                m_driverGA = true;
+            case Telnet_InterpretAsCommand:
+                m_data.append(char(Telnet_InterpretAsCommand));
+                break;
 
-                if (m_commands > 0)
-                {
-                    m_commands--;
-                    if (m_latencyTime.elapsed() > 2000)
-                    {
-                        m_commands = 0;
-                    }
-                }
+            case Telnet_Will:
+            case Telnet_Wont:
+            case Telnet_Do:
+            case Telnet_Dont:
+                m_telnetVerb = ch;
+                m_telnetState = TelnetOption;
+                break;
+
+            case Telnet_SubnegotiationBegin:
+                m_subnegotiation.resize(0);
+                m_telnetState = TelnetSubnegotiation;
+                break;
+
+            case Telnet_GoAhead:
+            case Telnet_EndOfRecord:
+                qCDebug(CORE_CONNECTION_TELNET) << telnetString(ch);
+
+                handleGoAhead();
+                break;
+
+            default:
+                qCDebug(CORE_CONNECTION_TELNET) << telnetString(ch) << QString::number(ch);
+                break;
+            }
+            break;
+        }
+
+        case TelnetOption:
+        {
+            m_telnetState = TelnetText;
+
+            handleNegotiation(m_telnetVerb, uchar(data[pos++]));
+            break;
+        }
+
+        case TelnetSubnegotiation:
+        {
+            int run = ByteScan::find(data + pos, length - pos, char(Telnet_InterpretAsCommand));
+            if (run > 0)
+            {
+                m_subnegotiation.append(data + pos, run);
+                pos += run;
+            }
+
+            if (pos < length)
+            {
+                m_telnetState = TelnetSubnegotiationCommand;
+                pos++;
+            }
+            break;
+        }
+
+        case TelnetSubnegotiationCommand:
+        {
+            uchar ch = uchar(data[pos++]);
+            if (ch == Telnet_SubnegotiationEnd)
+            {
+                m_telnetState = TelnetText;
 
-                data.append(GA.toLatin1());
-                handlePrompt(data);
-                data.clear();
+                handleSubnegotiation(m_subnegotiation);
             }
             else
             {
-                if (m_GAtoLF)
+                // IAC IAC is an escaped data byte, anything else is malformed and kept as-is
+                if (ch != Telnet_InterpretAsCommand)
                 {
-                    data.append(LF.toLatin1());
+                    m_subnegotiation.append(char(Telnet_InterpretAsCommand));
                 }
+                m_subnegotiation.append(char(ch));
+
+                m_telnetState = TelnetSubnegotiation;
             }
+            break;
+        }
         }
-    }
 
-    if (!data.isEmpty())
-    {
-        handleData(data);
+        if (m_startCompression)
+        {
+            m_startCompression = false;
+
+            // Everything following IAC SB MCCP2 IAC SE is part of the zlib stream
+            if (startCompression())
+            {
+                decompress(data + pos, length - pos);
+            }
+            return;
+        }
     }
 }
 
-void Connection::handleTelnetCommand(const QString &cmd)
+void Connection::handleGoAhead()
 {
-    if (cmd.length() < 1)
+    if (m_waitResponse)
     {
+        m_waitResponse = false;
+
+        if (!m_probeAnswered)
+        {
+            recordLatency(m_latencyTime.nsecsElapsed() / 1000);
+        }
+    }
+
+    if (m_forceOffGA)
+    {
+        if (m_GAtoLF)
+        {
+            m_data.append(LF.toLatin1());
+        }
         return;
     }
 
-    uchar ch = cmd.at(1).toLatin1();
-    uchar option = 0;
+    m_driverGA = true;
 
-    switch (ch)
+    if (m_commands > 0)
     {
-        case Telnet_GoAhead:
+        m_commands--;
+        if (m_latencyTime.elapsed() > 2000)
         {
-            qCDebug(CORE_CONNECTION_TELNET) << telnetString(ch);
-
-            m_receivedGA = true;
-            break;
+            m_commands = 0;
         }
+    }
 
-        case Telnet_Will:
-        {
-            option = cmd.at(2).toLatin1();
+    handlePrompt();
+}
 
-            qCDebug(CORE_CONNECTION_TELNET) << telnetString(ch) << telnetString(option) << QString::number(option);
+void Connection::handleNegotiation(uchar verb, uchar option)
+{
+    qCDebug(CORE_CONNECTION_TELNET) << telnetString(verb) << telnetString(option) << QString::number(option);
 
+    switch (verb)
+    {
+        case Telnet_Will:
+        {
             switch (option)
             {
                 case TelnetOption_Echo:
@@ -458,7 +927,7 @@ void Connection::handleTelnetCommand(const QString &cmd)
                     hello.append(Telnet_InterpretAsCommand);
                     hello.append(Telnet_SubnegotiationEnd);
 
-                    sendRaw(hello);
+                    queuePriority(hello);
 
                     QByteArray supports;
                     supports.append(Telnet_InterpretAsCommand);
@@ -468,7 +937,50 @@ void Connection::handleTelnetCommand(const QString &cmd)
                     supports.append(Telnet_InterpretAsCommand);
                     supports.append(Telnet_SubnegotiationEnd);
 
-                    sendRaw(supports);
+                    queuePriority(supports);
+                    break;
+                }
+
+                case TelnetOption_CompressV2:
+                case TelnetOption_EndOfRecord:
+                {
+                    sendDo(option);
+                    break;
+                }
+
+                case TelnetOption_TimingMark:
+                {
+                    handleTimingMark();
+                    break;
+                }
+
+                case TelnetOption_CharacterSet:
+                {
+                    // The server sends REQUEST once we agree
+                    sendDo(option);
+                    break;
+                }
+
+                case TelnetOption_MudServerDataProtocol:
+                {
+                    if (m_sentDo[TelnetOption_MudServerDataProtocol])
+                    {
+                        break;
+                    }
+
+                    sendDo(option);
+                    m_msdp = true;
+
+                    if (!m_msdpReported.isEmpty())
+                    {
+                        QList<QByteArray> names;
+                        foreach (const QString &variable, m_msdpReported)
+                        {
+                            names.append(variable.toUtf8());
+                        }
+
+                        sendMsdpCommand(Msdp::variable("REPORT", names));
+                    }
                     break;
                 }
 
@@ -482,9 +994,12 @@ void Connection::handleTelnetCommand(const QString &cmd)
 
         case Telnet_Wont:
         {
-            option = cmd.at(2).toLatin1();
-
-            qCDebug(CORE_CONNECTION_TELNET) << telnetString(ch) << telnetString(option) << QString::number(option);
+            // Either answer to a TIMING-MARK means everything before it was processed
+            if (option == TelnetOption_TimingMark)
+            {
+                handleTimingMark();
+                break;
+            }
 
             sendDont(option);
 
@@ -495,6 +1010,12 @@ void Connection::handleTelnetCommand(const QString &cmd)
                     emit echo(true);
                     break;
                 }
+
+                case TelnetOption_MudServerDataProtocol:
+                {
+                    m_msdp = false;
+                    break;
+                }
             }
 
             break;
@@ -502,15 +1023,33 @@ void Connection::handleTelnetCommand(const QString &cmd)
 
         case Telnet_Do:
         {
-            option = cmd.at(2).toLatin1();
-
-            qCDebug(CORE_CONNECTION_TELNET) << telnetString(ch) << telnetString(option) << QString::number(option);
-
             if (option == TelnetOption_GMCP)
             {
                 sendWill(option);
                 emit toggleGMCP(true);
             }
+            else if (option == TelnetOption_TimingMark)
+            {
+                // Not a lasting option, so answer every request rather than tracking state
+                sendTelnetOption(Telnet_Will, option);
+            }
+            else if (option == TelnetOption_CharacterSet)
+            {
+                if (!m_sentWill[option])
+                {
+                    sendWill(option);
+
+                    // Offer UTF-8 first, with the current encoding as the fallback
+                    QByteArray offer(";UTF-8");
+                    if (m_codec->mibEnum() != MIB_UTF8)
+                    {
+                        offer.append(';');
+                        offer.append(m_codec->name());
+                    }
+
+                    sendCharset(Charset_Request, offer);
+                }
+            }
             else
             {
                 sendWont(option);
@@ -520,10 +1059,6 @@ void Connection::handleTelnetCommand(const QString &cmd)
 
         case Telnet_Dont:
         {
-            option = cmd.at(2).toLatin1();
-
-            qCDebug(CORE_CONNECTION_TELNET) << telnetString(ch) << telnetString(option) << QString::number(option);
-
             sendWont(option);
             if (option == TelnetOption_GMCP)
             {
@@ -531,60 +1066,137 @@ void Connection::handleTelnetCommand(const QString &cmd)
             }
             break;
         }
+    }
+}
+
+void Connection::handleSubnegotiation(const QByteArray &data)
+{
+    if (data.isEmpty())
+    {
+        return;
+    }
+
+    uchar option = uchar(data.at(0));
+
+    qCDebug(CORE_CONNECTION_TELNET) << telnetString(Telnet_SubnegotiationBegin) << telnetString(option) << QString::number(option);
+
+    if (option == TelnetOption_GMCP)
+    {
+        if (data.length() < 2)
+        {
+            return;
+        }
+
+        // Keep GMCP in order with the text around it
+        postData();
+        postPayload(ConnectionPayload(ConnectionPayload::Gmcp, data.mid(1)));
+    }
+    else if (option == TelnetOption_MudServerDataProtocol)
+    {
+        if (!m_msdp)
+        {
+            return;
+        }
+
+        // MSDP variables become an "MSDP" GMCP package, sharing its state store and events
+        QByteArray msg("MSDP ");
+        msg.append(Msdp::toJson(data.mid(1)));
+
+        postData();
+        postPayload(ConnectionPayload(ConnectionPayload::Gmcp, msg));
+    }
+    else if (option == TelnetOption_CharacterSet)
+    {
+        handleCharset(data.mid(1));
+    }
+    else if (option == TelnetOption_CompressV2)
+    {
+        if (m_sentDo[TelnetOption_CompressV2] && !m_compressing)
+        {
+            m_startCompression = true;
+        }
+    }
+}
+
+void Connection::handleCharset(const QByteArray &data)
+{
+    if (data.isEmpty())
+    {
+        return;
+    }
 
-        case Telnet_SubnegotiationBegin:
+    switch (uchar(data.at(0)))
+    {
+        case Charset_Request:
         {
-            option = cmd.at(2).toLatin1();
+            // REQUEST [TTABLE <version>] <sep><charset>[<sep><charset>...]
+            QByteArray list(data.mid(1));
+            if (list.startsWith("[TTABLE]"))
+            {
+                list.remove(0, 9);
+            }
 
-            qCDebug(CORE_CONNECTION_TELNET) << telnetString(ch) << telnetString(option) << QString::number(option);
+            if (list.length() < 2)
+            {
+                sendCharset(Charset_Rejected);
+                break;
+            }
 
-            if (option == TelnetOption_GMCP)
+            QByteArray accepted;
+            foreach (const QByteArray &name, list.mid(1).split(list.at(0)))
             {
-                if (cmd.length() < 6)
+                QTextCodec *codec = QTextCodec::codecForName(name);
+                if (!codec)
                 {
-                    return;
+                    continue;
                 }
 
-                QString msg(cmd.mid(3, cmd.length() - 5));
-
-                QString name;
-                QString args;
-                if (msg.indexOf(LF) > -1)
+                // UTF-8 wins over anything else on offer
+                if (accepted.isEmpty() || codec->mibEnum() == MIB_UTF8)
                 {
-                    name = msg.section(LF, 0, 0);
-                    args = msg.section(LF, 1);
+                    accepted = name;
                 }
-                else
+
+                if (codec->mibEnum() == MIB_UTF8)
                 {
-                    name = msg.section(' ', 0, 0);
-                    args = msg.section(' ', 1);
+                    break;
                 }
+            }
 
-                qCDebug(CORE_CONNECTION) << "GMCP" << name << args;
-
-                emit receivedGMCP(name, args);
+            if (accepted.isEmpty())
+            {
+                qCDebug(CORE_CONNECTION_TELNET) << "No supported character set in" << list;
+                sendCharset(Charset_Rejected);
+                break;
             }
+
+            sendCharset(Charset_Accepted, accepted);
+            setEncoding(QString::fromLatin1(accepted));
             break;
         }
-    }
-}
 
-void Connection::handleData(const QByteArray &data)
-{
-    if (data.isEmpty())
-    {
-        return;
-    }
+        case Charset_Accepted:
+        {
+            setEncoding(QString::fromLatin1(data.mid(1)));
+            break;
+        }
 
-    m_data += data;
+        case Charset_Rejected:
+        {
+            qCDebug(CORE_CONNECTION_TELNET) << "Character set request rejected";
+            break;
+        }
 
-    postData();
+        case Charset_TranslationTableIs:
+        {
+            sendCharset(Charset_TranslationTableRejected);
+            break;
+        }
+    }
 }
 
-void Connection::handlePrompt(const QByteArray &data)
+void Connection::handlePrompt()
 {
-    m_data += data;
-
     // Search for leading linefeed, skip ANSI control sequences
     if (m_driverGA && m_bugfixGA)
     {
@@ -616,7 +1228,31 @@ void Connection::handlePrompt(const QByteArray &data)
         }
     }
 
-    postData();
+    // The payload type marks the prompt, so it's posted even empty when its text came in an earlier read
+    postPayload(ConnectionPayload(ConnectionPayload::Prompt, m_data));
+    m_data.resize(0);
+}
+
+void Connection::handleTimingMark()
+{
+    if (!m_probePending)
+    {
+        return;
+    }
+
+    m_probePending = false;
+    m_probeMisses = 0;
+
+    if (!m_probeAnswered)
+    {
+        // Prompt timings include server think time, so start over with the cleaner samples
+        m_probeAnswered = true;
+        m_latency.reset();
+
+        qCDebug(CORE_CONNECTION) << "Server answers TIMING-MARK, measuring latency with probes";
+    }
+
+    recordLatency(m_probeTime.nsecsElapsed() / 1000);
 }
 
 void Connection::sendDo(const uchar option)
@@ -671,27 +1307,157 @@ void Connection::sendWont(const uchar option)
     m_sentWont[option] = true;
 }
 
-void Connection::postData()
+void Connection::postData(ConnectionPayload::Type type)
+{
+    if (m_data.isEmpty())
+    {
+        return;
+    }
+
+    postPayload(ConnectionPayload(type, m_data));
+    m_data.resize(0);
+}
+
+void Connection::postPayload(const ConnectionPayload &payload)
+{
+    if (!m_overflow.isEmpty() || !m_payloads.push(payload))
+    {
+        m_overflow.enqueue(payload);
+    }
+
+    notifyConsumer();
+}
+
+void Connection::notifyConsumer()
+{
+    // One wake-up at a time, the consumer drains everything queued behind it
+    if (m_notifyPending.testAndSetOrdered(0, 1))
+    {
+        emit payloadsReady();
+    }
+}
+
+void Connection::publishStats()
+{
+    QMutexLocker locker(&m_statsLock);
+
+    m_stats.compressing = m_compressing;
+    m_stats.bytesCompressed = m_bytesCompressed;
+    m_stats.bytesDecompressed = m_bytesDecompressed;
+    m_stats.sendRate = m_sendRate;
+    m_stats.sendBurst = m_sendBurst;
+    m_stats.flushes = m_flushCount;
+    m_stats.commandsSent = m_commandsSent;
+    m_stats.bytesSent = m_bytesSent;
+    m_stats.throttled = m_throttleCount;
+}
+
+bool Connection::startCompression()
 {
-    emit dataReceived(m_data);
-    m_data.clear();
+    endCompression();
+
+    memset(&m_zstream, 0, sizeof(m_zstream));
+    if (inflateInit(&m_zstream) != Z_OK)
+    {
+        qCWarning(CORE_CONNECTION) << "Unable to start MCCP decompression:" << m_zstream.msg;
+
+        sendDont(TelnetOption_CompressV2);
+        return false;
+    }
+
+    qCDebug(CORE_CONNECTION) << "MCCP decompression started";
+
+    m_compressing = true;
+    return true;
+}
+
+void Connection::endCompression()
+{
+    if (!m_compressing)
+    {
+        return;
+    }
+
+    inflateEnd(&m_zstream);
+    m_compressing = false;
+
+    qCDebug(CORE_CONNECTION) << "MCCP decompression ended" << m_bytesCompressed << m_bytesDecompressed << (m_bytesCompressed ? double(m_bytesDecompressed) / double(m_bytesCompressed) : 1.0);
+}
+
+void Connection::decompress(const char *data, int length)
+{
+    if (length <= 0)
+    {
+        return;
+    }
+
+    m_bytesCompressed += length;
+
+    m_zstream.next_in = (Bytef *)data;
+    m_zstream.avail_in = length;
+
+    int result = Z_OK;
+    do
+    {
+        m_zstream.next_out = (Bytef *)m_inflateBuffer.data();
+        m_zstream.avail_out = m_inflateBuffer.size();
+
+        result = inflate(&m_zstream, Z_SYNC_FLUSH);
+
+        int produced = m_inflateBuffer.size() - m_zstream.avail_out;
+        if (produced > 0)
+        {
+            m_bytesDecompressed += produced;
+
+            processInput(m_inflateBuffer.constData(), produced);
+        }
+
+        if (result == Z_BUF_ERROR && produced == 0)
+        {
+            // Nothing more can be done until the next read arrives
+            result = Z_OK;
+            break;
+        }
+    }
+    while (result == Z_OK && (m_zstream.avail_in > 0 || m_zstream.avail_out == 0));
+
+    if (result == Z_STREAM_END)
+    {
+        // The server ended compression, anything left over is plain telnet
+        const char *remaining = (const char *)m_zstream.next_in;
+        int remainingLength = m_zstream.avail_in;
+        m_bytesCompressed -= remainingLength;
+
+        endCompression();
+
+        processInput(remaining, remainingLength);
+    }
+    else if (result != Z_OK)
+    {
+        qCWarning(CORE_CONNECTION) << "MCCP stream error:" << result << m_zstream.msg;
+
+        endCompression();
+
+        // The rest of the stream can't be trusted, ask the server to stop compressing
+        sendDont(TelnetOption_CompressV2);
+    }
 }
 
 void Connection::reset()
 {
-    m_command.clear();
-    m_data.clear();
-    m_buffer.reset();
+    endCompression();
 
-    m_IAC = false;
-    m_IAC2 = false;
-    m_SB = false;
-    m_receivedGA = false;
+    m_data.resize(0);
+    m_subnegotiation.resize(0);
+
+    m_telnetState = TelnetText;
+    m_telnetVerb = 0;
     m_driverGA = true;
     m_GAtoLF = false;
     m_forceOffGA = false;
     m_bugfixGA = true;
     m_waitResponse = false;
+    m_startCompression = false;
 
     memset(&m_sentDo, false, sizeof(m_sentDo));
     memset(&m_sentDont, false, sizeof(m_sentDont));
@@ -704,80 +1470,499 @@ void Connection::reset()
     memset(&m_gotWont, false, sizeof(m_gotWont));
 
     m_commands = 0;
-    m_latency = 0.0;
-    m_latencyMin = 0.0;
-    m_latencyMax = 0.0;
+
+    m_msdp = false;
+
+    m_probeTimer.stop();
+    m_probePending = false;
+    m_probeAnswered = false;
+    m_probeMisses = 0;
+    m_latency.reset();
+
+    m_statsLock.lock();
+    m_stats.latency = LatencyStats();
+    m_statsLock.unlock();
+
+    m_bytesCompressed = 0;
+    m_bytesDecompressed = 0;
+
+    m_flushTimer.stop();
+    m_sendTokens = m_sendBurst;
+
+    m_sendLock.lock();
+    m_sendQueue.clear();
+    m_priorityQueue.clear();
+    m_sendLock.unlock();
+
+    m_flushCount = 0;
+    m_commandsSent = 0;
+    m_bytesSent = 0;
+    m_throttleCount = 0;
+
+    publishStats();
 }
 
 bool Connection::send(const QString &data)
 {
+    if (!isConnected())
+    {
+        return false;
+    }
+
     QString dataSend(data);
     dataSend.replace(QString(LF), "");
 
-    QByteArray dataOut(m_codec->fromUnicode(dataSend).data());
+    m_sendLock.lock();
+    QByteArray dataOut(m_codec->fromUnicode(dataSend));
+    m_sendLock.unlock();
+
     dataOut.append(CRLF);
 
-    return sendRaw(dataOut);
+    queueCommand(dataOut);
+
+    return true;
 }
 
-bool Connection::sendRaw(const QByteArray &data)
+bool Connection::sendSpeedwalk(const QString &path)
 {
-    if (!m_socket.isWritable())
+    bool ok = false;
+    QStringList commands(expandSpeedwalk(path, &ok));
+    if (!ok || !isConnected())
     {
         return false;
     }
 
-    int nRemaining = data.length();
-    do
+    foreach (const QString &cmd, commands)
     {
-        qint64 nWritten = m_socket.write(data);
+        send(cmd);
+    }
 
-        if (nWritten == -1)
-        {
-            return false;
-        }
+    return true;
+}
 
-        nRemaining -= nWritten;
+bool Connection::sendRaw(const QByteArray &data)
+{
+    if (!m_socket || !m_socket->isWritable())
+    {
+        return false;
     }
-    while (nRemaining > 0);
 
-    if (m_driverGA)
+    const char *out = data.constData();
+    qint64 remaining = data.length();
+    while (remaining > 0)
     {
-        m_commands++;
-        if (m_commands == 1)
+        qint64 written = m_socket->write(out, remaining);
+        if (written == -1)
         {
-            m_waitResponse = true;
-            m_latencyTime.restart();
+            qCWarning(CORE_CONNECTION) << "Write failed:" << m_socket->errorString();
+            return false;
         }
+
+        out += written;
+        remaining -= written;
     }
 
+    m_bytesSent += data.length();
+
     return true;
 }
 
 bool Connection::sendGmcp(const QString &msg, const QString &data)
 {
+    return sendGmcpData(msg, data.toUtf8());
+}
+
+bool Connection::sendGmcpData(const QString &msg, const QByteArray &data)
+{
+    if (!isConnected())
+    {
+        return false;
+    }
+
     QByteArray out;
+    out.reserve(msg.length() + data.length() + 6);
     out.append(Telnet_InterpretAsCommand);
     out.append(Telnet_SubnegotiationBegin);
     out.append(TelnetOption_GMCP);
-    out.append(msg);
+    out.append(msg.toUtf8());
     if (!data.isEmpty())
     {
-        out.append(" ");
-        out.append(data);
+        out.append(' ');
+        appendSubnegotiationData(out, data);
     }
     out.append(Telnet_InterpretAsCommand);
     out.append(Telnet_SubnegotiationEnd);
 
-    return sendRaw(out);
+    queuePriority(out);
+
+    return true;
+}
+
+bool Connection::sendMsdp(const QString &variable, const QStringList &values)
+{
+    if (!isConnected())
+    {
+        return false;
+    }
+
+    QList<QByteArray> list;
+    foreach (const QString &value, values)
+    {
+        list.append(value.toUtf8());
+    }
+
+    sendMsdpCommand(Msdp::variable(variable.toUtf8(), list));
+
+    return true;
+}
+
+void Connection::sendMsdpCommand(const QByteArray &body)
+{
+    QByteArray out;
+    out.append(Telnet_InterpretAsCommand);
+    out.append(Telnet_SubnegotiationBegin);
+    out.append(TelnetOption_MudServerDataProtocol);
+    appendSubnegotiationData(out, body);
+    out.append(Telnet_InterpretAsCommand);
+    out.append(Telnet_SubnegotiationEnd);
+
+    queuePriority(out);
+}
+
+void Connection::sendCharset(uchar command, const QByteArray &body)
+{
+    QByteArray out;
+    out.append(Telnet_InterpretAsCommand);
+    out.append(Telnet_SubnegotiationBegin);
+    out.append(TelnetOption_CharacterSet);
+    out.append(command);
+    appendSubnegotiationData(out, body);
+    out.append(Telnet_InterpretAsCommand);
+    out.append(Telnet_SubnegotiationEnd);
+
+    queuePriority(out);
+}
+
+void Connection::reportMsdp(const QString &variable)
+{
+    if (QThread::currentThread() != thread())
+    {
+        QMetaObject::invokeMethod(this, "reportMsdp", Qt::QueuedConnection, Q_ARG(QString, variable));
+        return;
+    }
+
+    if (m_msdpReported.contains(variable))
+    {
+        return;
+    }
+
+    m_msdpReported.insert(variable);
+
+    if (m_msdp)
+    {
+        sendMsdpCommand(Msdp::variable("REPORT", QList<QByteArray>() << variable.toUtf8()));
+    }
+}
+
+void Connection::unreportMsdp(const QString &variable)
+{
+    if (QThread::currentThread() != thread())
+    {
+        QMetaObject::invokeMethod(this, "unreportMsdp", Qt::QueuedConnection, Q_ARG(QString, variable));
+        return;
+    }
+
+    if (!m_msdpReported.remove(variable))
+    {
+        return;
+    }
+
+    if (m_msdp)
+    {
+        sendMsdpCommand(Msdp::variable("UNREPORT", QList<QByteArray>() << variable.toUtf8()));
+    }
 }
 
 bool Connection::sendTelnetOption(uchar type, uchar option)
 {
+    if (!m_socket || !m_socket->isWritable())
+    {
+        return false;
+    }
+
     QByteArray data;
     data.append(Telnet_InterpretAsCommand);
     data.append(type);
     data.append(option);
 
-    return sendRaw(data);
+    queuePriority(data);
+
+    return true;
+}
+
+void Connection::setSendRate(int commandsPerSecond, int burst)
+{
+    if (QThread::currentThread() != thread())
+    {
+        QMetaObject::invokeMethod(this, "setSendRate", Qt::QueuedConnection, Q_ARG(int, commandsPerSecond), Q_ARG(int, burst));
+        return;
+    }
+
+    m_sendRate = qMax(0, commandsPerSecond);
+    m_sendBurst = qMax(1, burst > 0 ? burst : m_sendRate);
+    m_sendTokens = m_sendBurst;
+    m_sendClock.start();
+
+    qCDebug(CORE_CONNECTION) << "Send rate" << m_sendRate << "burst" << m_sendBurst;
+
+    publishStats();
+    scheduleFlush();
+}
+
+QStringList Connection::expandSpeedwalk(const QString &path, bool *ok)
+{
+    // Counted directions, e.g. "3n2e(ne)u" => n, n, n, e, e, ne, u
+    static const QString DIRECTIONS("nsewud");
+
+    QStringList commands;
+    if (ok)
+    {
+        *ok = false;
+    }
+
+    int count = 0;
+    for (int pos = 0; pos < path.length(); pos++)
+    {
+        QChar ch(path.at(pos));
+        if (ch.isSpace())
+        {
+            continue;
+        }
+
+        if (ch.isDigit())
+        {
+            count = count * 10 + ch.digitValue();
+            if (count > 999)
+            {
+                return QStringList();
+            }
+            continue;
+        }
+
+        QString direction;
+        if (ch == '(')
+        {
+            int end = path.indexOf(')', pos + 1);
+            if (end < 0)
+            {
+                return QStringList();
+            }
+
+            direction = path.mid(pos + 1, end - pos - 1).trimmed();
+            pos = end;
+        }
+        else if (DIRECTIONS.contains(ch.toLower()))
+        {
+            direction = ch.toLower();
+        }
+
+        if (direction.isEmpty())
+        {
+            return QStringList();
+        }
+
+        for (int n = qMax(count, 1); n > 0; n--)
+        {
+            commands << direction;
+        }
+        count = 0;
+    }
+
+    if (count > 0)
+    {
+        return QStringList();
+    }
+
+    if (ok)
+    {
+        *ok = true;
+    }
+
+    return commands;
+}
+
+void Connection::queueCommand(const QByteArray &data)
+{
+    m_sendLock.lock();
+    m_sendQueue.enqueue(data);
+    m_sendLock.unlock();
+
+    requestFlush();
+}
+
+void Connection::queuePriority(const QByteArray &data)
+{
+    m_sendLock.lock();
+    m_priorityQueue.append(data);
+    m_sendLock.unlock();
+
+    requestFlush();
+}
+
+void Connection::requestFlush()
+{
+    if (QThread::currentThread() == thread())
+    {
+        scheduleFlush();
+        return;
+    }
+
+    // Only one wake-up needs to be in flight, later commands ride along with it
+    if (m_flushRequested.testAndSetOrdered(0, 1))
+    {
+        QMetaObject::invokeMethod(this, "flushRequested", Qt::QueuedConnection);
+    }
+}
+
+void Connection::flushRequested()
+{
+    m_flushRequested.storeRelease(0);
+
+    scheduleFlush();
+}
+
+void Connection::scheduleFlush(int delay)
+{
+    // Everything queued during this pass through the event loop goes out in a single write
+    if (m_flushTimer.isActive() && m_flushTimer.remainingTime() <= delay)
+    {
+        return;
+    }
+
+    m_flushTimer.start(delay);
+}
+
+void Connection::refillTokens()
+{
+    if (m_sendRate <= 0)
+    {
+        return;
+    }
+
+    if (!m_sendClock.isValid())
+    {
+        m_sendClock.start();
+    }
+
+    m_sendTokens = qMin(double(m_sendBurst), m_sendTokens + m_sendClock.restart() * m_sendRate / 1000.0);
+}
+
+void Connection::flushQueue()
+{
+    if (!m_socket || !m_socket->isWritable())
+    {
+        return;
+    }
+
+    refillTokens();
+
+    // Protocol traffic such as GMCP is never held back by the rate limit
+    m_outgoing.resize(0);
+
+    m_sendLock.lock();
+    m_outgoing.append(m_priorityQueue);
+    m_priorityQueue.resize(0);
+
+    int commands = 0;
+    while (!m_sendQueue.isEmpty() && (m_sendRate <= 0 || m_sendTokens >= 1.0))
+    {
+        m_outgoing.append(m_sendQueue.dequeue());
+        commands++;
+
+        if (m_sendRate > 0)
+        {
+            m_sendTokens -= 1.0;
+        }
+    }
+
+    bool throttled = !m_sendQueue.isEmpty();
+    m_sendLock.unlock();
+
+    if (!m_outgoing.isEmpty())
+    {
+        if (!sendRaw(m_outgoing))
+        {
+            return;
+        }
+
+        m_flushCount++;
+        m_commandsSent += commands;
+    }
+
+    if (commands > 0 && m_driverGA)
+    {
+        m_commands += commands;
+        if (m_commands == commands)
+        {
+            m_waitResponse = true;
+            m_latencyTime.start();
+        }
+    }
+
+    if (throttled)
+    {
+        // Come back when the bucket has another token in it
+        m_throttleCount++;
+
+        scheduleFlush(qCeil((1.0 - m_sendTokens) * 1000.0 / m_sendRate));
+    }
+
+    publishStats();
+}
+
+void Connection::recordLatency(qint64 usecs)
+{
+    m_latency.record(usecs);
+
+    LatencyStats latency(m_latency.stats());
+
+    QMutexLocker locker(&m_statsLock);
+    m_stats.latency = latency;
+}
+
+void Connection::sendProbe()
+{
+    if (!isConnected())
+    {
+        return;
+    }
+
+    if (m_probePending)
+    {
+        if (m_probeTime.elapsed() < LATENCY_PROBE_TIMEOUT)
+        {
+            return;
+        }
+
+        m_probePending = false;
+        if (++m_probeMisses >= LATENCY_PROBE_MISSES)
+        {
+            qCDebug(CORE_CONNECTION) << "TIMING-MARK unanswered, measuring latency from prompts";
+
+            m_probeTimer.stop();
+            m_probeAnswered = false;
+            return;
+        }
+    }
+
+    // Sent raw rather than through sendDo() since every probe needs its own answer
+    QByteArray probe;
+    probe.append(Telnet_InterpretAsCommand);
+    probe.append(Telnet_Do);
+    probe.append(TelnetOption_TimingMark);
+
+    queuePriority(probe);
+
+    m_probePending = true;
+    m_probeTime.start();
 }
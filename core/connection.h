@@ -25,58 +25,173 @@
 #define CONNECTION_H
 
 #include "core_global.h"
-#include <QBuffer>
+#include "latencyhistogram.h"
+#include "ringbuffer.h"
+#include <QElapsedTimer>
 #include <QLoggingCategory>
+#include <QMutex>
+#include <QQueue>
+#include <QSet>
+#include <QTimer>
 #include <QtNetwork>
 #include <QObject>
+#include <zlib.h>
 
 Q_DECLARE_LOGGING_CATEGORY(CORE_CONNECTION)
 Q_DECLARE_LOGGING_CATEGORY(CORE_CONNECTION_TELNET)
 
+struct ConnectionPayload
+{
+    enum Type
+    {
+        Text,
+        Prompt,
+        Gmcp,
+        Encoding
+    };
+
+    ConnectionPayload() : type(Text) {}
+    ConnectionPayload(Type t, const QByteArray &d) : type(t), data(d) {}
+
+    Type type;
+    QByteArray data;
+};
+
+struct ConnectionStats
+{
+    ConnectionStats() :
+        compressing(false),
+        bytesCompressed(0),
+        bytesDecompressed(0),
+        queueDepth(0),
+        priorityBytes(0),
+        sendRate(0),
+        sendBurst(0),
+        flushes(0),
+        commandsSent(0),
+        bytesSent(0),
+        throttled(0)
+    {}
+
+    double compressionRatio() const { return bytesCompressed ? double(bytesDecompressed) / double(bytesCompressed) : 1.0; }
+
+    LatencyStats latency;
+
+    bool compressing;
+    quint64 bytesCompressed;
+    quint64 bytesDecompressed;
+
+    int queueDepth;
+    int priorityBytes;
+    int sendRate;
+    int sendBurst;
+    quint64 flushes;
+    quint64 commandsSent;
+    quint64 bytesSent;
+    quint64 throttled;
+};
+
+// Runs on its own network thread; the public interface below is safe to call from any thread
 class CORESHARED_EXPORT Connection : public QObject
 {
     Q_OBJECT
 public:
     explicit Connection(QObject *parent = 0);
-
-    void connectRemote(const QString &addr, int port);
-    void disconnectRemote();
+    ~Connection();
 
     bool send(const QString &data);
-    bool sendRaw(const QByteArray &data);
+    bool sendSpeedwalk(const QString &path);
     bool sendGmcp(const QString &msg, const QString &data = QString());
-    bool sendTelnetOption(uchar type, uchar option);
+    bool sendGmcpData(const QString &msg, const QByteArray &data);
+    bool sendMsdp(const QString &variable, const QStringList &values = QStringList());
 
-    void setEncoding(const QString &encoding);
+    static QStringList expandSpeedwalk(const QString &path, bool *ok = 0);
 
-    bool isConnected() const { return m_socket.state() == QAbstractSocket::ConnectedState; }
-    bool isConnecting() const { return m_socket.state() == QAbstractSocket::ConnectingState; }
-    bool isDisconnected() const { return m_socket.state() == QAbstractSocket::UnconnectedState; }
-    bool isDisconnecting() const { return m_socket.state() == QAbstractSocket::ClosingState; }
-    const QDateTime & connectTime() const { return m_connectTime; }
+    bool isConnected() const { return m_socketState.load() == QAbstractSocket::ConnectedState; }
+    bool isConnecting() const { return m_socketState.load() == QAbstractSocket::ConnectingState; }
+    bool isDisconnected() const { return m_socketState.load() == QAbstractSocket::UnconnectedState; }
+    bool isDisconnecting() const { return m_socketState.load() == QAbstractSocket::ClosingState; }
+    QDateTime connectTime() const;
     quint64 connectDuration();
-    int latency() const { return m_latency; }
+    LatencyStats latency() const { return stats().latency; }
+
+    ConnectionStats stats() const;
+
+    // Consumer side of the payload ring, for the thread that receives payloadsReady()
+    void acknowledgePayloads();
+    bool readPayload(ConnectionPayload &payload) { return m_payloads.pop(payload); }
 
     static QString telnetString(const uchar option);
 
 private:
-    void handleTelnetCommand(const QString &cmd);
-    void handleData(const QByteArray &data);
-    void handlePrompt(const QByteArray &data);
+    // Feeds processInput() directly, without a socket
+    friend class TelnetTest;
+    // Watches the connection race from inside
+    friend class ConnectTest;
+
+    enum TelnetState
+    {
+        TelnetText,
+        TelnetCommand,
+        TelnetOption,
+        TelnetSubnegotiation,
+        TelnetSubnegotiationCommand
+    };
+
+    void processInput(const char *data, int length);
+    void handleGoAhead();
+    void handleNegotiation(uchar verb, uchar option);
+    void handleSubnegotiation(const QByteArray &data);
+    void handlePrompt();
+    void handleTimingMark();
+    void handleCharset(const QByteArray &data);
+
+    void startConnecting(const QList<QHostAddress> &addresses);
+    void abortAttempts();
+    void adoptSocket(QTcpSocket *socket);
+    void connectFailed(const QString &reason);
+    static QList<QHostAddress> interleaveFamilies(const QList<QHostAddress> &addresses);
 
+    bool sendRaw(const QByteArray &data);
+    bool sendTelnetOption(uchar type, uchar option);
     void sendDo(const uchar option);
     void sendDont(const uchar option);
     void sendWill(const uchar option);
     void sendWont(const uchar option);
+    void sendMsdpCommand(const QByteArray &body);
+    void sendCharset(uchar command, const QByteArray &body = QByteArray());
+
+    void queueCommand(const QByteArray &data);
+    void queuePriority(const QByteArray &data);
+    void requestFlush();
+    void scheduleFlush(int delay = 0);
+    void refillTokens();
+
+    void recordLatency(qint64 usecs);
 
-    void postData();
+    void postData(ConnectionPayload::Type type = ConnectionPayload::Text);
+    void postPayload(const ConnectionPayload &payload);
+    void notifyConsumer();
+    void publishStats();
+
+    bool startCompression();
+    void endCompression();
+    void decompress(const char *data, int length);
 
     void reset();
 
 
-    QTcpSocket m_socket;
+    QTcpSocket *m_socket;
+    QAtomicInt m_socketState;
     int m_lookup;
 
+    // Happy Eyeballs: a new address is tried every stagger interval until one connects
+    QList<QTcpSocket *> m_attempts;
+    QList<QHostAddress> m_candidates;
+    QTimer m_attemptTimer;
+    bool m_fromCache;
+    QString m_attemptError;
+
     QHostAddress m_address;
     QString m_hostname;
     int m_port;
@@ -87,16 +202,20 @@ private:
 
     QDateTime m_connectTime;
 
-    QString m_command;
+    QByteArray m_input;
     QByteArray m_data;
-    QBuffer m_buffer;
+    QByteArray m_subnegotiation;
+
+    TelnetState m_telnetState;
+    uchar m_telnetVerb;
+
+    RingBuffer<ConnectionPayload> m_payloads;
+    QQueue<ConnectionPayload> m_overflow;
+    QAtomicInt m_notifyPending;
+    QAtomicInt m_readStalled;
 
     int m_commands;
 
-    bool m_IAC;
-    bool m_IAC2;
-    bool m_SB;
-    bool m_receivedGA;
     bool m_driverGA;
     bool m_GAtoLF;
     bool m_forceOffGA;
@@ -113,26 +232,79 @@ private:
     bool m_gotWill[256];
     bool m_gotWont[256];
 
-    double m_latency;
-    double m_latencyMin;
-    double m_latencyMax;
-
-    QTime m_latencyTime;
+    // Round trips are measured with TIMING-MARK probes when the server answers
+    // them, otherwise from the first prompt after a command leaves an idle queue
+    LatencyHistogram m_latency;
+    QElapsedTimer m_latencyTime;
+    QTimer m_probeTimer;
+    QElapsedTimer m_probeTime;
+    bool m_probePending;
+    bool m_probeAnswered;
+    int m_probeMisses;
+
+    mutable QMutex m_sendLock;
+    QQueue<QByteArray> m_sendQueue;
+    QByteArray m_priorityQueue;
+    QAtomicInt m_flushRequested;
+
+    QByteArray m_outgoing;
+    QTimer m_flushTimer;
+
+    int m_sendRate;
+    int m_sendBurst;
+    double m_sendTokens;
+    QElapsedTimer m_sendClock;
+
+    quint64 m_flushCount;
+    quint64 m_commandsSent;
+    quint64 m_bytesSent;
+    quint64 m_throttleCount;
+
+    z_stream m_zstream;
+    QByteArray m_inflateBuffer;
+    bool m_compressing;
+    bool m_startCompression;
+
+    // MSDP variables to REPORT, kept across reconnects and sent once the server offers MSDP
+    QSet<QString> m_msdpReported;
+    bool m_msdp;
+    quint64 m_bytesCompressed;
+    quint64 m_bytesDecompressed;
+
+    mutable QMutex m_statsLock;
+    ConnectionStats m_stats;
 
 signals:
     void hostFound(const QHostInfo &hostInfo);
     void connected();
     void disconnected();
-    void dataReceived(const QByteArray &data);
+    void payloadsReady();
     void echo(bool on);
     void toggleGMCP(bool on);
-    void receivedGMCP(const QString &name, const QString &args);
+    void connectionFailed(const QString &reason);
 
 public slots:
+    void connectRemote(const QString &addr, int port);
+    void disconnectRemote();
+    void setEncoding(const QString &encoding);
+    void setSendRate(int commandsPerSecond, int burst = 0);
+    void reportMsdp(const QString &variable);
+    void unreportMsdp(const QString &variable);
+
     void lookupComplete(const QHostInfo &hostInfo);
     void connectionEstablished();
     void connectionLost();
     void readyToRead();
+
+private slots:
+    void socketStateChanged(QAbstractSocket::SocketState state);
+    void flushRequested();
+    void flushQueue();
+    void resumeReading();
+    void sendProbe();
+    void startNextAttempt();
+    void attemptConnected();
+    void attemptFailed();
 };
 
 #endif // CONNECTION_H
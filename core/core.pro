@@ -18,7 +18,16 @@ SOURCES += \
     connection.cpp \
     configpage.cpp \
     configwidget.cpp \
-    contextmanager.cpp
+    contextmanager.cpp \
+    latencyhistogram.cpp \
+    hostcache.cpp \
+    gmcprouter.cpp \
+    msdp.cpp \
+    streamdecoder.cpp \
+    linebuffer.cpp \
+    scrollbackfile.cpp \
+    trigramindex.cpp \
+    layoutindex.cpp
 
 HEADERS +=\
         core_global.h \
@@ -28,7 +37,18 @@ HEADERS +=\
     connection.h \
     configpage.h \
     configwidget.h \
-    contextmanager.h
+    contextmanager.h \
+    bytescan.h \
+    ringbuffer.h \
+    latencyhistogram.h \
+    hostcache.h \
+    gmcprouter.h \
+    msdp.h \
+    streamdecoder.h \
+    linebuffer.h \
+    scrollbackfile.h \
+    trigramindex.h \
+    layoutindex.h
 
 unix {
     target.path = /usr/lib
@@ -42,5 +62,8 @@ else:unix: LIBS += -L$$OUT_PWD/../logging/ -llogging
 INCLUDEPATH += $$PWD/../logging
 DEPENDPATH += $$PWD/../logging
 
+win32: INCLUDEPATH += $$[QT_INSTALL_HEADERS]/QtZlib
+else: LIBS += -lz
+
 FORMS += \
     configwidget.ui
@@ -0,0 +1,207 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#include "gmcprouter.h"
+#include "bytescan.h"
+#include <QVarLengthArray>
+
+static inline char lower(char ch)
+{
+    return (ch >= 'A' && ch <= 'Z') ? char(ch + ('a' - 'A')) : ch;
+}
+
+
+GmcpMessage::GmcpMessage(const QByteArray &payload) :
+    m_payload(payload)
+{
+    const char *data = payload.constData();
+    int length = payload.length();
+
+    // Package name ends at the first space or newline, whatever follows is the payload
+    m_nameLength = ByteScan::findAny(data, length, ' ', '\n');
+
+    m_dataOffset = m_nameLength;
+    while (m_dataOffset < length && (data[m_dataOffset] == ' ' || data[m_dataOffset] == '\n'))
+    {
+        m_dataOffset++;
+    }
+}
+
+
+GmcpRouter::GmcpRouter() :
+    m_routed(0),
+    m_dropped(0)
+{
+}
+
+GmcpRouter::~GmcpRouter()
+{
+}
+
+void GmcpRouter::subscribe(const QString &pattern, GmcpHandler *handler)
+{
+    if (!handler)
+    {
+        return;
+    }
+
+    // Repeat subscriptions are kept so each unsubscribe() undoes exactly one
+    handlerList(pattern, true)->append(handler);
+}
+
+void GmcpRouter::unsubscribe(const QString &pattern, GmcpHandler *handler)
+{
+    QList<GmcpHandler *> *handlers = handlerList(pattern, false);
+    if (handlers)
+    {
+        handlers->removeOne(handler);
+    }
+}
+
+void GmcpRouter::unsubscribeAll(GmcpHandler *handler)
+{
+    removeHandler(&m_root, handler);
+}
+
+bool GmcpRouter::route(const QByteArray &payload)
+{
+    GmcpMessage msg(payload);
+    if (!msg.isValid())
+    {
+        m_dropped++;
+        return false;
+    }
+
+    QVarLengthArray<GmcpHandler *, 16> matched;
+    foreach (GmcpHandler *handler, m_root.subtreeHandlers)
+    {
+        matched.append(handler);
+    }
+
+    const char *name = payload.constData();
+    int length = msg.name().length();
+
+    QVarLengthArray<char, 64> segment;
+
+    const Node *node = &m_root;
+    int start = 0;
+    while (start <= length)
+    {
+        int end = start + ByteScan::find(name + start, length - start, '.');
+
+        segment.resize(end - start);
+        for (int n = start; n < end; n++)
+        {
+            segment[n - start] = lower(name[n]);
+        }
+
+        node = node->children.value(QByteArray::fromRawData(segment.constData(), segment.size()));
+        if (!node)
+        {
+            break;
+        }
+
+        const QList<GmcpHandler *> &handlers = end == length ? node->handlers : node->subtreeHandlers;
+        foreach (GmcpHandler *handler, handlers)
+        {
+            // A handler subscribed at several levels still hears each message once
+            bool seen = false;
+            for (int n = 0; n < matched.size() && !seen; n++)
+            {
+                seen = matched.at(n) == handler;
+            }
+
+            if (!seen)
+            {
+                matched.append(handler);
+            }
+        }
+
+        start = end + 1;
+    }
+
+    if (matched.isEmpty())
+    {
+        m_dropped++;
+        return false;
+    }
+
+    m_routed++;
+
+    for (int n = 0; n < matched.size(); n++)
+    {
+        matched[n]->handleGmcp(msg);
+    }
+
+    return true;
+}
+
+QList<GmcpHandler *> * GmcpRouter::handlerList(const QString &pattern, bool create)
+{
+    QByteArray path(pattern.trimmed().toLower().toUtf8());
+
+    bool subtree = false;
+    if (path == "*")
+    {
+        subtree = true;
+        path.clear();
+    }
+    else if (path.endsWith(".*"))
+    {
+        subtree = true;
+        path.chop(2);
+    }
+
+    Node *node = &m_root;
+    if (!path.isEmpty())
+    {
+        foreach (const QByteArray &key, path.split('.'))
+        {
+            Node *child = node->children.value(key);
+            if (!child)
+            {
+                if (!create)
+                {
+                    return 0;
+                }
+
+                child = new Node;
+                node->children.insert(key, child);
+            }
+            node = child;
+        }
+    }
+
+    return subtree ? &node->subtreeHandlers : &node->handlers;
+}
+
+void GmcpRouter::removeHandler(Node *node, GmcpHandler *handler)
+{
+    node->handlers.removeAll(handler);
+    node->subtreeHandlers.removeAll(handler);
+
+    foreach (Node *child, node->children)
+    {
+        removeHandler(child, handler);
+    }
+}
@@ -0,0 +1,97 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#ifndef GMCPROUTER_H
+#define GMCPROUTER_H
+
+#include "core_global.h"
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QString>
+
+// A GMCP subnegotiation split into package name and payload without copying.
+// The views returned by name() and data() share the original payload buffer.
+class CORESHARED_EXPORT GmcpMessage
+{
+public:
+    explicit GmcpMessage(const QByteArray &payload);
+
+    bool isValid() const { return m_nameLength > 0; }
+
+    QByteArray name() const { return QByteArray::fromRawData(m_payload.constData(), m_nameLength); }
+    QByteArray data() const { return QByteArray::fromRawData(m_payload.constData() + m_dataOffset, m_payload.length() - m_dataOffset); }
+    const QByteArray & payload() const { return m_payload; }
+
+private:
+    QByteArray m_payload;
+    int m_nameLength;
+    int m_dataOffset;
+};
+
+class CORESHARED_EXPORT GmcpHandler
+{
+public:
+    virtual ~GmcpHandler() {}
+
+    virtual void handleGmcp(const GmcpMessage &msg) = 0;
+};
+
+// Dispatches GMCP messages to handlers subscribed by package. "Char.Vitals"
+// matches that package only, "Room.*" everything below Room and "*" every
+// message. Names are matched case-insensitively, as the protocol requires.
+class CORESHARED_EXPORT GmcpRouter
+{
+public:
+    GmcpRouter();
+    ~GmcpRouter();
+
+    void subscribe(const QString &pattern, GmcpHandler *handler);
+    void unsubscribe(const QString &pattern, GmcpHandler *handler);
+    void unsubscribeAll(GmcpHandler *handler);
+
+    bool route(const QByteArray &payload);
+
+    quint64 routed() const { return m_routed; }
+    quint64 dropped() const { return m_dropped; }
+
+private:
+    struct Node
+    {
+        ~Node() { qDeleteAll(children); }
+
+        QHash<QByteArray, Node *> children;
+        QList<GmcpHandler *> handlers;
+        QList<GmcpHandler *> subtreeHandlers;
+    };
+
+    QList<GmcpHandler *> * handlerList(const QString &pattern, bool create);
+    static void removeHandler(Node *node, GmcpHandler *handler);
+
+    Node m_root;
+
+    quint64 m_routed;
+    quint64 m_dropped;
+};
+
+#endif // GMCPROUTER_H
@@ -0,0 +1,120 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#include "hostcache.h"
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QStringList>
+
+// Without the real record TTL, a day is a reasonable guess for MUD servers
+static const int DEFAULT_MAX_AGE = 24 * 60 * 60;
+
+HostCache::HostCache() :
+    m_settings(QSettings::IniFormat, QSettings::UserScope, QCoreApplication::organizationName(), QCoreApplication::applicationName() + "-hosts"),
+    m_maxAge(DEFAULT_MAX_AGE)
+{
+}
+
+HostCache * HostCache::instance()
+{
+    static HostCache instance;
+    return &instance;
+}
+
+QList<QHostAddress> HostCache::addresses(const QString &host)
+{
+    QList<QHostAddress> result;
+
+    QMutexLocker locker(&m_lock);
+
+    m_settings.beginGroup(key(host));
+    QDateTime resolved(m_settings.value("resolved").toDateTime());
+    QStringList addresses(m_settings.value("addresses").toStringList());
+    m_settings.endGroup();
+
+    if (!resolved.isValid() || resolved.secsTo(QDateTime::currentDateTimeUtc()) > m_maxAge)
+    {
+        return result;
+    }
+
+    foreach (const QString &address, addresses)
+    {
+        QHostAddress ha(address);
+        if (!ha.isNull())
+        {
+            result.append(ha);
+        }
+    }
+
+    return result;
+}
+
+void HostCache::store(const QString &host, const QList<QHostAddress> &addresses)
+{
+    if (addresses.isEmpty())
+    {
+        remove(host);
+        return;
+    }
+
+    QStringList list;
+    foreach (const QHostAddress &address, addresses)
+    {
+        list.append(address.toString());
+    }
+
+    QMutexLocker locker(&m_lock);
+
+    m_settings.beginGroup(key(host));
+    m_settings.setValue("resolved", QDateTime::currentDateTimeUtc());
+    m_settings.setValue("addresses", list);
+    m_settings.endGroup();
+}
+
+void HostCache::promote(const QString &host, const QHostAddress &address)
+{
+    QMutexLocker locker(&m_lock);
+
+    m_settings.beginGroup(key(host));
+    QStringList list(m_settings.value("addresses").toStringList());
+    if (list.removeAll(address.toString()) > 0)
+    {
+        // The address that won last time gets tried first next time
+        list.prepend(address.toString());
+        m_settings.setValue("addresses", list);
+    }
+    m_settings.endGroup();
+}
+
+void HostCache::remove(const QString &host)
+{
+    QMutexLocker locker(&m_lock);
+
+    m_settings.remove(key(host));
+}
+
+QString HostCache::key(const QString &host)
+{
+    // QSettings treats slashes as groups and is case sensitive on some platforms
+    return host.trimmed().toLower().replace('/', '_');
+}
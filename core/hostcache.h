@@ -0,0 +1,58 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#ifndef HOSTCACHE_H
+#define HOSTCACHE_H
+
+#include "core_global.h"
+#include <QHostAddress>
+#include <QMutex>
+#include <QSettings>
+
+// Resolved addresses remembered on disk per host name, so reconnecting
+// doesn't have to wait on DNS. Shared by every connection thread.
+class CORESHARED_EXPORT HostCache
+{
+public:
+    static HostCache * instance();
+
+    QList<QHostAddress> addresses(const QString &host);
+    void store(const QString &host, const QList<QHostAddress> &addresses);
+    void promote(const QString &host, const QHostAddress &address);
+    void remove(const QString &host);
+
+    int maxAge() const { return m_maxAge; }
+    void setMaxAge(int secs) { m_maxAge = secs; }
+
+private:
+    HostCache();
+    Q_DISABLE_COPY(HostCache)
+
+    static QString key(const QString &host);
+
+    QMutex m_lock;
+    QSettings m_settings;
+    int m_maxAge;
+};
+
+#endif // HOSTCACHE_H
@@ -0,0 +1,149 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#include "latencyhistogram.h"
+#include <QtMath>
+
+static const int SUB_BUCKET_BITS = 5;
+static const int SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+static const int VALUE_BITS = 31;
+static const int BUCKET_COUNT = SUB_BUCKET_COUNT * (VALUE_BITS - SUB_BUCKET_BITS + 1);
+static const qint64 VALUE_MAX = (Q_INT64_C(1) << VALUE_BITS) - 1;
+
+// Same weight TCP gives new samples when smoothing its RTT estimate
+static const double EWMA_ALPHA = 0.125;
+
+
+LatencyHistogram::LatencyHistogram() :
+    m_buckets(BUCKET_COUNT, 0)
+{
+    reset();
+}
+
+void LatencyHistogram::record(qint64 usecs)
+{
+    usecs = qBound(Q_INT64_C(0), usecs, VALUE_MAX);
+
+    m_buckets[bucketIndex(usecs)]++;
+
+    if (m_count == 0)
+    {
+        m_min = usecs;
+        m_max = usecs;
+        m_ewma = usecs;
+    }
+    else
+    {
+        m_min = qMin(m_min, usecs);
+        m_max = qMax(m_max, usecs);
+        m_ewma += EWMA_ALPHA * (usecs - m_ewma);
+    }
+
+    m_count++;
+    m_sum += usecs;
+    m_last = usecs;
+}
+
+void LatencyHistogram::reset()
+{
+    m_buckets.fill(0);
+    m_count = 0;
+    m_min = 0;
+    m_max = 0;
+    m_last = 0;
+    m_sum = 0.0;
+    m_ewma = 0.0;
+}
+
+qint64 LatencyHistogram::percentile(double pct) const
+{
+    if (m_count == 0)
+    {
+        return 0;
+    }
+
+    quint64 target = qMax(Q_UINT64_C(1), quint64(qCeil(qBound(0.0, pct, 100.0) / 100.0 * m_count)));
+
+    quint64 seen = 0;
+    for (int n = 0; n < BUCKET_COUNT; n++)
+    {
+        seen += m_buckets.at(n);
+        if (seen >= target)
+        {
+            return qBound(m_min, bucketUpperBound(n), m_max);
+        }
+    }
+
+    return m_max;
+}
+
+LatencyStats LatencyHistogram::stats() const
+{
+    LatencyStats result;
+    if (m_count == 0)
+    {
+        return result;
+    }
+
+    result.samples = m_count;
+    result.last = m_last / 1000.0;
+    result.min = m_min / 1000.0;
+    result.average = m_sum / m_count / 1000.0;
+    result.p50 = percentile(50.0) / 1000.0;
+    result.p95 = percentile(95.0) / 1000.0;
+    result.p99 = percentile(99.0) / 1000.0;
+    result.max = m_max / 1000.0;
+    result.ewma = m_ewma / 1000.0;
+
+    return result;
+}
+
+int LatencyHistogram::bucketIndex(qint64 value)
+{
+    if (value < SUB_BUCKET_COUNT)
+    {
+        return int(value);
+    }
+
+    int magnitude = 0;
+    for (qint64 v = value >> (SUB_BUCKET_BITS + 1); v > 0; v >>= 1)
+    {
+        magnitude++;
+    }
+
+    // value >> magnitude lands in [SUB_BUCKET_COUNT, 2 * SUB_BUCKET_COUNT)
+    return SUB_BUCKET_COUNT * magnitude + int(value >> magnitude);
+}
+
+qint64 LatencyHistogram::bucketUpperBound(int index)
+{
+    if (index < SUB_BUCKET_COUNT)
+    {
+        return index;
+    }
+
+    int magnitude = index / SUB_BUCKET_COUNT - 1;
+    qint64 sub = index - SUB_BUCKET_COUNT * magnitude;
+
+    return ((sub + 1) << magnitude) - 1;
+}
@@ -0,0 +1,85 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include "core_global.h"
+#include <QVector>
+
+// Snapshot of round-trip times, all values in milliseconds
+struct LatencyStats
+{
+    LatencyStats() :
+        samples(0),
+        last(0.0),
+        min(0.0),
+        average(0.0),
+        p50(0.0),
+        p95(0.0),
+        p99(0.0),
+        max(0.0),
+        ewma(0.0)
+    {}
+
+    quint64 samples;
+    double last;
+    double min;
+    double average;
+    double p50;
+    double p95;
+    double p99;
+    double max;
+    double ewma;
+};
+
+// Log-linear (HDR-style) histogram of microsecond samples: every power of two
+// is split into 32 equal buckets, so percentiles are accurate to about 3%
+// with a fixed footprint of a few KB no matter how many samples are recorded.
+class CORESHARED_EXPORT LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void record(qint64 usecs);
+    void reset();
+
+    quint64 count() const { return m_count; }
+    qint64 percentile(double pct) const;
+
+    LatencyStats stats() const;
+
+private:
+    static int bucketIndex(qint64 value);
+    static qint64 bucketUpperBound(int index);
+
+    QVector<quint32> m_buckets;
+    quint64 m_count;
+    qint64 m_min;
+    qint64 m_max;
+    qint64 m_last;
+    double m_sum;
+    double m_ewma;
+};
+
+#endif // LATENCYHISTOGRAM_H
@@ -0,0 +1,233 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+
+#include "layoutindex.h"
+
+// Leaves to start with; a fresh console fills this many lines soon enough
+static const int MINIMUM_CAPACITY = 1024;
+
+LayoutIndex::LayoutIndex() :
+    m_capacity(0),
+    m_base(0),
+    m_first(0),
+    m_count(0)
+{
+}
+
+void LayoutIndex::clear(qint64 first)
+{
+    m_sums.clear();
+    m_widths.clear();
+    m_capacity = 0;
+    m_base = first;
+    m_first = first;
+    m_count = 0;
+}
+
+void LayoutIndex::append(qreal height, qreal width)
+{
+    if (m_first + m_count - m_base >= m_capacity)
+    {
+        // Twice what's needed, so the next rebuild is as many appends away
+        // as there are lines now and the cost of copying them evens out
+        int capacity = MINIMUM_CAPACITY;
+        while (capacity < 2 * (m_count + 1))
+        {
+            capacity *= 2;
+        }
+
+        rebuild(capacity);
+    }
+
+    m_count++;
+    setLeaf(int(lastLine() - m_base), height, width);
+}
+
+void LayoutIndex::removeFirst(int count)
+{
+    if (count >= m_count)
+    {
+        clear(m_first + m_count);
+        return;
+    }
+
+    for (int n = 0; n < count; n++)
+    {
+        setLeaf(int(m_first - m_base), 0, 0);
+        m_first++;
+        m_count--;
+    }
+}
+
+void LayoutIndex::removeLast(int count)
+{
+    count = qMin(count, m_count);
+
+    for (int n = 0; n < count; n++)
+    {
+        setLeaf(int(lastLine() - m_base), 0, 0);
+        m_count--;
+    }
+}
+
+void LayoutIndex::remove(qint64 line, int count)
+{
+    if (!contains(line) || count < 1)
+    {
+        return;
+    }
+
+    count = int(qMin(qint64(count), lastLine() - line + 1));
+
+    for (qint64 n = line; n + count <= lastLine(); n++)
+    {
+        const int from = m_capacity + int(n + count - m_base);
+        setLeaf(int(n - m_base), m_sums.at(from), m_widths.at(from));
+    }
+
+    removeLast(count);
+}
+
+void LayoutIndex::setLine(qint64 line, qreal height, qreal width)
+{
+    if (!contains(line))
+    {
+        return;
+    }
+
+    setLeaf(int(line - m_base), height, width);
+}
+
+qreal LayoutIndex::height(qint64 line) const
+{
+    if (!contains(line))
+    {
+        return 0;
+    }
+
+    return m_sums.at(m_capacity + int(line - m_base));
+}
+
+qreal LayoutIndex::width(qint64 line) const
+{
+    if (!contains(line))
+    {
+        return 0;
+    }
+
+    return m_widths.at(m_capacity + int(line - m_base));
+}
+
+qreal LayoutIndex::offset(qint64 line) const
+{
+    if (line <= m_first)
+    {
+        return 0;
+    }
+
+    if (line > lastLine())
+    {
+        return totalHeight();
+    }
+
+    // Leaves ahead of the first line are all zero, so this is everything to
+    // the left of the leaf: every left sibling on the way up to the root
+    qreal y = 0;
+    for (int node = m_capacity + int(line - m_base); node > 1; node /= 2)
+    {
+        if (node & 1)
+        {
+            y += m_sums.at(node - 1);
+        }
+    }
+
+    return y;
+}
+
+qint64 LayoutIndex::lineAt(qreal y) const
+{
+    if (m_count < 1)
+    {
+        return m_first;
+    }
+
+    y = qMax(qreal(0), y);
+    if (y >= totalHeight())
+    {
+        return lastLine();
+    }
+
+    // Down from the root, going right past whatever lies above the offset;
+    // lines of no height are never landed on
+    int node = 1;
+    while (node < m_capacity)
+    {
+        node *= 2;
+        if (y >= m_sums.at(node))
+        {
+            y -= m_sums.at(node);
+            node++;
+        }
+    }
+
+    return qBound(m_first, m_base + node - m_capacity, lastLine());
+}
+
+void LayoutIndex::setLeaf(int leaf, qreal height, qreal width)
+{
+    int node = m_capacity + leaf;
+    m_sums[node] = height;
+    m_widths[node] = width;
+
+    for (node /= 2; node > 0; node /= 2)
+    {
+        m_sums[node] = m_sums.at(2 * node) + m_sums.at(2 * node + 1);
+        m_widths[node] = qMax(m_widths.at(2 * node), m_widths.at(2 * node + 1));
+    }
+}
+
+// Moves the lines there are to the front of a tree this many leaves wide
+void LayoutIndex::rebuild(int capacity)
+{
+    QVector<qreal> sums(2 * capacity, 0);
+    QVector<qreal> widths(2 * capacity, 0);
+
+    const int from = m_capacity + int(m_first - m_base);
+    for (int n = 0; n < m_count; n++)
+    {
+        sums[capacity + n] = m_sums.at(from + n);
+        widths[capacity + n] = m_widths.at(from + n);
+    }
+
+    for (int node = capacity - 1; node > 0; node--)
+    {
+        sums[node] = sums.at(2 * node) + sums.at(2 * node + 1);
+        widths[node] = qMax(widths.at(2 * node), widths.at(2 * node + 1));
+    }
+
+    m_sums = sums;
+    m_widths = widths;
+    m_capacity = capacity;
+    m_base = m_first;
+}
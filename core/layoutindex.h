@@ -0,0 +1,82 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+
+#ifndef LAYOUTINDEX_H
+#define LAYOUTINDEX_H
+
+#include "core_global.h"
+#include <QVector>
+
+// The height and width of each line of a scrolling view, in a segment tree
+// that keeps the sum of the heights and the widest line under every node.
+// Where a line starts, which line covers an offset and the total height are
+// O(log n); the widest line is O(1). Line ids run on like a LineBuffer's:
+// lines are appended at the end and removed from either end, and the slots
+// of lines gone from the front are only reclaimed when the tree is rebuilt.
+class CORESHARED_EXPORT LayoutIndex
+{
+public:
+    LayoutIndex();
+
+    int count() const { return m_count; }
+    bool isEmpty() const { return m_count == 0; }
+    qint64 firstLine() const { return m_first; }
+    qint64 lastLine() const { return m_first + m_count - 1; }
+    bool contains(qint64 line) const { return line >= m_first && line < m_first + m_count; }
+
+    // Forgets every line; the next one appended is given this id
+    void clear(qint64 first = 0);
+
+    void append(qreal height, qreal width);
+    void removeFirst(int count = 1);
+    void removeLast(int count = 1);
+    // Later lines move up to fill the gap, which costs O(log n) for each of them
+    void remove(qint64 line, int count = 1);
+
+    void setLine(qint64 line, qreal height, qreal width);
+    qreal height(qint64 line) const;
+    qreal width(qint64 line) const;
+
+    qreal totalHeight() const { return m_sums.isEmpty() ? 0 : m_sums.at(1); }
+    qreal maximumWidth() const { return m_widths.isEmpty() ? 0 : m_widths.at(1); }
+
+    // Distance from the top of the first line to the top of this one
+    qreal offset(qint64 line) const;
+    // The line drawn at this distance from the top, clamped to the lines there are
+    qint64 lineAt(qreal y) const;
+
+private:
+    void setLeaf(int leaf, qreal height, qreal width);
+    void rebuild(int capacity);
+
+    // Leaves follow the internal nodes, so a node's children are at 2n and 2n + 1
+    QVector<qreal> m_sums;
+    QVector<qreal> m_widths;
+    int m_capacity;
+    qint64 m_base;
+    qint64 m_first;
+    int m_count;
+};
+
+#endif // LAYOUTINDEX_H
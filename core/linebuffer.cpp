@@ -0,0 +1,631 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+
+
+#include "linebuffer.h"
+#include <QDebug>
+
+static const int SEGMENT_LINES = 4096;
+// The segment being written and the one before it stay unpacked, since
+// omits and the view at the bottom of the buffer keep touching them
+static const int HOT_SEGMENTS = 2;
+static const int UNPACKED_SEGMENTS = 4;
+
+LineBuffer::LineBuffer(int maximumLines) :
+    m_unpacked(UNPACKED_SEGMENTS),
+    m_first(0),
+    m_count(0),
+    m_maximum(maximumLines),
+    m_file(0),
+    m_fileGeneration(0),
+    m_tableDirty(true)
+{
+}
+
+LineBuffer::~LineBuffer()
+{
+    closeFile();
+
+    m_unpacked.clear();
+    qDeleteAll(m_segments);
+}
+
+void LineBuffer::setMaximumLines(int lines)
+{
+    m_maximum = lines;
+
+    evict();
+}
+
+qint64 LineBuffer::appendLine()
+{
+    const qint64 id = m_first + m_count;
+
+    if (m_segments.isEmpty() || m_segments.last()->isCold() || m_segments.last()->count >= SEGMENT_LINES)
+    {
+        if (!m_segments.isEmpty() && !m_segments.last()->isCold())
+        {
+            // Sealed for good, so give back the slack from growing it
+            Segment *sealed = m_segments.last();
+            sealed->lines.squeeze();
+            sealed->text.squeeze();
+            sealed->runs.squeeze();
+        }
+
+        Segment *segment = new Segment;
+        segment->base = id;
+        segment->lines.reserve(SEGMENT_LINES);
+        m_segments.append(segment);
+
+        if (m_segments.size() > HOT_SEGMENTS)
+        {
+            Segment *cold = m_segments.at(m_segments.size() - HOT_SEGMENTS - 1);
+            if (!cold->isCold())
+            {
+                pack(cold);
+                spill(cold);
+            }
+        }
+    }
+
+    Segment *segment = m_segments.last();
+
+    Line record;
+    record.text = segment->text.size();
+    record.length = 0;
+    record.runs = segment->runs.size();
+    record.runCount = 0;
+    segment->lines.append(record);
+    segment->count++;
+
+    m_count++;
+
+    evict();
+
+    return id;
+}
+
+void LineBuffer::appendText(const QString &text, int format)
+{
+    if (text.isEmpty())
+    {
+        return;
+    }
+
+    // Restored lines are left as they were
+    if (m_count < 1 || m_segments.last()->isCold())
+    {
+        appendLine();
+    }
+
+    Segment *segment = m_segments.last();
+    Line &record = segment->lines.last();
+
+    if (record.runCount < 1 || segment->runs.last().format != format)
+    {
+        segment->runs.append(LineRun(record.length, format));
+        record.runCount++;
+    }
+
+    segment->text.append(text);
+    record.length += text.length();
+}
+
+QString LineBuffer::text(qint64 id) const
+{
+    const Segment *segment;
+    const Line *record = line(id, &segment);
+    if (!record)
+    {
+        return QString();
+    }
+
+    return segment->text.mid(record->text, record->length);
+}
+
+int LineBuffer::length(qint64 id) const
+{
+    const Segment *segment;
+    const Line *record = line(id, &segment);
+
+    return record ? record->length : 0;
+}
+
+QVector<LineRun> LineBuffer::runs(qint64 id) const
+{
+    const Segment *segment;
+    const Line *record = line(id, &segment);
+    if (!record)
+    {
+        return QVector<LineRun>();
+    }
+
+    return segment->runs.mid(record->runs, record->runCount);
+}
+
+void LineBuffer::remove(qint64 id, int count)
+{
+    const qint64 end = qMin(id + count, m_first + m_count);
+    id = qMax(id, m_first);
+    count = int(end - id);
+    if (count < 1)
+    {
+        return;
+    }
+
+    // Lift off whatever follows, then put it back once the lines are gone
+    struct Saved
+    {
+        QString text;
+        QVector<LineRun> runs;
+    };
+
+    QList<Saved> following;
+    for (qint64 n = id + count; n <= lastLine(); n++)
+    {
+        Saved saved;
+        saved.text = text(n);
+        saved.runs = runs(n);
+        following.append(saved);
+    }
+
+    while (lastLine() >= id)
+    {
+        removeLast();
+    }
+
+    foreach (const Saved &saved, following)
+    {
+        appendLine();
+
+        for (int n = 0; n < saved.runs.size(); n++)
+        {
+            const int start = saved.runs.at(n).offset;
+            const int end = n + 1 < saved.runs.size() ? saved.runs.at(n + 1).offset : saved.text.length();
+            appendText(saved.text.mid(start, end - start), saved.runs.at(n).format);
+        }
+    }
+}
+
+void LineBuffer::clear()
+{
+    m_unpacked.clear();
+    qDeleteAll(m_segments);
+    m_segments.clear();
+
+    // Ids are never handed out twice for lines someone may have seen
+    m_first += m_count;
+    m_count = 0;
+}
+
+bool LineBuffer::attachFile(const QString &fileName, qint64 maximumSize)
+{
+    if (m_file)
+    {
+        return false;
+    }
+
+    m_file = new ScrollbackFile;
+    if (!m_file->open(fileName, maximumSize))
+    {
+        delete m_file;
+        m_file = 0;
+        return false;
+    }
+    m_fileGeneration = m_file->generation();
+
+    // Anything older than lines already evicted would only be evicted in turn
+    if (m_segments.isEmpty() || m_segments.first()->base == m_first)
+    {
+        QList<Segment *> restored;
+        qint64 base = m_first;
+        foreach (const ScrollbackFile::Record &record, m_file->records())
+        {
+            if (record.type == ScrollbackFile::Table)
+            {
+                m_tables.append(m_file->read(record));
+            }
+            else if (record.lines > 0)
+            {
+                Segment *segment = new Segment;
+                segment->base = base;
+                segment->count = record.lines;
+                segment->record = record;
+                segment->table = m_tables.size() - 1;
+                restored.append(segment);
+
+                base += record.lines;
+            }
+        }
+
+        const qint64 shift = base - m_first;
+        foreach (Segment *segment, m_segments)
+        {
+            segment->base += shift;
+        }
+        m_count += int(shift);
+        m_segments = restored + m_segments;
+    }
+
+    // Segments packed before the file was there follow the restored ones
+    for (int n = 0; m_file && n < m_segments.size(); n++)
+    {
+        Segment *segment = m_segments.at(n);
+        if (!segment->packed.isEmpty() && !segment->record.isValid())
+        {
+            const int before = m_segments.size();
+            spill(segment);
+            n -= before - m_segments.size();
+        }
+    }
+
+    evict();
+
+    return true;
+}
+
+void LineBuffer::setFileTable(const QByteArray &table)
+{
+    if (table != m_table)
+    {
+        m_table = table;
+        m_tableDirty = true;
+    }
+}
+
+void LineBuffer::setTableMap(int table, const QVector<int> &map)
+{
+    if (table < 0)
+    {
+        return;
+    }
+
+    if (table >= m_maps.size())
+    {
+        m_maps.resize(table + 1);
+    }
+    m_maps[table] = map;
+
+    // Cached copies carry the old ids
+    m_unpacked.clear();
+}
+
+const LineBuffer::Line * LineBuffer::line(qint64 id, const Segment **segment) const
+{
+    if (!contains(id))
+    {
+        return 0;
+    }
+
+    // Restored segments may be short, so find the last one starting at or before the id
+    int low = 0;
+    int high = m_segments.size() - 1;
+    while (low < high)
+    {
+        const int middle = (low + high + 1) / 2;
+        if (m_segments.at(middle)->base <= id)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+
+    const Segment *found = unpacked(m_segments.at(low));
+    if (!found)
+    {
+        return 0;
+    }
+
+    *segment = found;
+
+    return &found->lines.at(int(id - found->base));
+}
+
+void LineBuffer::evict()
+{
+    if (m_maximum < 1)
+    {
+        return;
+    }
+
+    while (m_count > m_maximum)
+    {
+        m_first++;
+        m_count--;
+
+        Segment *head = m_segments.first();
+        if (m_first >= head->base + head->count)
+        {
+            m_segments.removeFirst();
+            dropSegment(head);
+        }
+    }
+}
+
+void LineBuffer::removeLast()
+{
+    if (m_count < 1)
+    {
+        return;
+    }
+
+    Segment *segment = m_segments.last();
+
+    // Whatever is written next goes here, so it has to be unpacked for good
+    if (segment->isCold())
+    {
+        m_unpacked.remove(segment);
+
+        Segment thawed;
+        if (!unpackCold(segment, &thawed))
+        {
+            qWarning() << "Unable to unpack scrollback segment at line" << segment->base;
+
+            thawed.lines = QVector<Line>(segment->count);
+            thawed.text.clear();
+            thawed.runs.clear();
+        }
+
+        segment->lines = thawed.lines;
+        segment->text = thawed.text;
+        segment->runs = thawed.runs;
+        segment->packed.clear();
+        segment->table = -1;
+
+        // It's written out again once it's cold, so the copy in the file
+        // mustn't be restored alongside it next time
+        if (segment->record.isValid() && m_file)
+        {
+            m_file->withdraw(segment->record);
+            dropRotated();
+        }
+        segment->record = ScrollbackFile::Record();
+    }
+
+    const Line record = segment->lines.last();
+
+    // The last line always sits at the end of its segment's arena
+    segment->text.truncate(record.text);
+    segment->runs.resize(record.runs);
+    segment->lines.removeLast();
+    segment->count--;
+
+    m_count--;
+
+    if (segment->count < 1 && m_segments.size() > 1)
+    {
+        m_segments.removeLast();
+        dropSegment(segment);
+    }
+}
+
+void LineBuffer::dropSegment(Segment *segment)
+{
+    m_unpacked.remove(segment);
+    delete segment;
+}
+
+const LineBuffer::Segment * LineBuffer::unpacked(const Segment *segment) const
+{
+    if (!segment->isCold())
+    {
+        return segment;
+    }
+
+    Segment *cached = m_unpacked.object(segment);
+    if (cached)
+    {
+        return cached;
+    }
+
+    cached = new Segment;
+    if (!unpackCold(segment, cached))
+    {
+        qWarning() << "Unable to unpack scrollback segment at line" << segment->base;
+        delete cached;
+        return 0;
+    }
+
+    m_unpacked.insert(segment, cached);
+
+    return cached;
+}
+
+bool LineBuffer::unpackCold(const Segment *segment, Segment *into) const
+{
+    into->base = segment->base;
+    into->count = segment->count;
+
+    const QByteArray packed(segment->record.isValid() && m_file ? m_file->read(segment->record) : segment->packed);
+    if (!unpack(packed, into) || into->lines.size() != segment->count)
+    {
+        return false;
+    }
+
+    if (segment->table >= 0 && segment->table < m_maps.size())
+    {
+        const QVector<int> &map = m_maps.at(segment->table);
+        for (int n = 0; n < into->runs.size(); n++)
+        {
+            // Anything the table didn't cover falls back to the first format
+            int &format = into->runs[n].format;
+            format = format >= 0 && format < map.size() ? map.at(format) : 0;
+        }
+    }
+
+    return true;
+}
+
+void LineBuffer::spill(Segment *segment)
+{
+    if (!m_file)
+    {
+        return;
+    }
+
+    while (m_tableDirty)
+    {
+        m_tableDirty = false;
+        m_file->append(ScrollbackFile::Table, m_table);
+        dropRotated();
+    }
+
+    const ScrollbackFile::Record record(m_file->append(ScrollbackFile::Segment, segment->packed, segment->count));
+    if (record.isValid())
+    {
+        segment->record = record;
+        segment->packed.clear();
+    }
+
+    dropRotated();
+}
+
+void LineBuffer::dropRotated()
+{
+    if (m_file->generation() == m_fileGeneration)
+    {
+        return;
+    }
+    m_fileGeneration = m_file->generation();
+
+    // The new file gets its own copy of the table
+    m_tableDirty = true;
+
+    while (m_segments.size() > 1)
+    {
+        Segment *head = m_segments.first();
+        if (!head->record.isValid() || head->record.generation >= m_file->oldestGeneration())
+        {
+            break;
+        }
+
+        const qint64 end = head->base + head->count;
+        m_count -= int(end - m_first);
+        m_first = end;
+
+        m_segments.removeFirst();
+        dropSegment(head);
+    }
+}
+
+void LineBuffer::closeFile()
+{
+    if (!m_file)
+    {
+        return;
+    }
+
+    // The line still open is nearly always empty, and keeping it would add a
+    // blank line to the restored scrollback for every session
+    if (!m_segments.isEmpty() && !m_segments.last()->isCold() && m_segments.last()->count > 0 && m_segments.last()->lines.last().length == 0)
+    {
+        removeLast();
+    }
+
+    // Write out what is only in memory so the next session gets all of it
+    for (int n = 0; n < m_segments.size(); n++)
+    {
+        Segment *segment = m_segments.at(n);
+        if (segment->record.isValid() || segment->count < 1)
+        {
+            continue;
+        }
+
+        if (segment->packed.isEmpty())
+        {
+            pack(segment);
+        }
+
+        const int before = m_segments.size();
+        spill(segment);
+        n -= before - m_segments.size();
+    }
+
+    m_unpacked.clear();
+
+    delete m_file;
+    m_file = 0;
+}
+
+void LineBuffer::pack(Segment *segment)
+{
+    const qint32 lineCount = segment->lines.size();
+    const qint32 runCount = segment->runs.size();
+
+    // Line records, then runs, then the UTF-16 arena, all in host order as
+    // the scrollback file is only ever read back on the same machine
+    QByteArray raw;
+    raw.reserve(int(2 * sizeof(qint32) + lineCount * sizeof(Line) + runCount * sizeof(LineRun) + segment->text.size() * sizeof(QChar)));
+    raw.append(reinterpret_cast<const char *>(&lineCount), sizeof(lineCount));
+    raw.append(reinterpret_cast<const char *>(&runCount), sizeof(runCount));
+    raw.append(reinterpret_cast<const char *>(segment->lines.constData()), lineCount * int(sizeof(Line)));
+    raw.append(reinterpret_cast<const char *>(segment->runs.constData()), runCount * int(sizeof(LineRun)));
+    raw.append(reinterpret_cast<const char *>(segment->text.constData()), segment->text.size() * int(sizeof(QChar)));
+
+    // Level 1: this runs on the output path, and text compresses well regardless
+    segment->packed = qCompress(raw, 1);
+
+    segment->lines = QVector<Line>();
+    segment->text = QString();
+    segment->runs = QVector<LineRun>();
+}
+
+bool LineBuffer::unpack(const QByteArray &packed, Segment *segment)
+{
+    const QByteArray raw(qUncompress(packed));
+    if (raw.size() < int(2 * sizeof(qint32)))
+    {
+        return false;
+    }
+
+    const char *data = raw.constData();
+    qint32 lineCount;
+    qint32 runCount;
+    memcpy(&lineCount, data, sizeof(lineCount));
+    memcpy(&runCount, data + sizeof(lineCount), sizeof(runCount));
+    data += 2 * sizeof(qint32);
+
+    const int lineBytes = lineCount * int(sizeof(Line));
+    const int runBytes = runCount * int(sizeof(LineRun));
+    const int textBytes = raw.size() - int(2 * sizeof(qint32)) - lineBytes - runBytes;
+    if (lineCount < 0 || runCount < 0 || textBytes < 0 || textBytes % sizeof(QChar))
+    {
+        return false;
+    }
+
+    segment->lines.resize(lineCount);
+    memcpy(segment->lines.data(), data, lineBytes);
+    data += lineBytes;
+
+    segment->runs.resize(runCount);
+    memcpy(segment->runs.data(), data, runBytes);
+    data += runBytes;
+
+    segment->text = QString(reinterpret_cast<const QChar *>(data), textBytes / int(sizeof(QChar)));
+
+    return true;
+}
@@ -0,0 +1,164 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#ifndef LINEBUFFER_H
+#define LINEBUFFER_H
+
+#include "core_global.h"
+#include "scrollbackfile.h"
+#include <QCache>
+#include <QList>
+#include <QString>
+#include <QVector>
+
+// A style change within a line; the format id applies from offset to the next run
+struct LineRun
+{
+    LineRun() : offset(0), format(0) {}
+    LineRun(int o, int f) : offset(o), format(f) {}
+
+    int offset;
+    int format;
+};
+Q_DECLARE_TYPEINFO(LineRun, Q_PRIMITIVE_TYPE);
+
+// A point in the buffer; line ids keep counting up as old lines are evicted
+struct LinePosition
+{
+    LinePosition() : line(-1), column(0) {}
+    LinePosition(qint64 l, int c) : line(l), column(c) {}
+
+    bool isValid() const { return line >= 0; }
+
+    bool operator==(const LinePosition &other) const { return line == other.line && column == other.column; }
+    bool operator!=(const LinePosition &other) const { return !operator==(other); }
+    bool operator<(const LinePosition &other) const { return line < other.line || (line == other.line && column < other.column); }
+
+    qint64 line;
+    int column;
+};
+
+// Append-only scrollback. Lines live in fixed-size segments, each holding the
+// line records, one contiguous text arena and the style runs, so appending
+// and evicting are O(1) and there is no per-line allocation. Older segments
+// are sealed and kept compressed, either in memory or in an attached
+// scrollback file, and unpacked again on demand into a small cache when
+// something reads from them.
+class CORESHARED_EXPORT LineBuffer
+{
+public:
+    explicit LineBuffer(int maximumLines = 0);
+    ~LineBuffer();
+
+    int maximumLines() const { return m_maximum; }
+    void setMaximumLines(int lines);
+
+    int count() const { return m_count; }
+    bool isEmpty() const { return m_count == 0; }
+    qint64 firstLine() const { return m_first; }
+    qint64 lastLine() const { return m_first + m_count - 1; }
+    bool contains(qint64 line) const { return line >= m_first && line < m_first + m_count; }
+
+    // Starts a new, empty line at the end and returns its id
+    qint64 appendLine();
+    // Adds to the end of the last line
+    void appendText(const QString &text, int format);
+
+    QString text(qint64 line) const;
+    int length(qint64 line) const;
+    QVector<LineRun> runs(qint64 line) const;
+
+    // Later lines move up to fill the gap, so this is meant for lines near the end
+    void remove(qint64 line, int count = 1);
+    void clear();
+
+    // Restores the lines kept in the file ahead of those already here, which
+    // are renumbered, then sends cold segments there rather than keeping them
+    // in memory. Whatever is left in memory is written out on destruction.
+    bool attachFile(const QString &fileName, qint64 maximumSize);
+    bool isAttached() const { return m_file != 0; }
+
+    // The owner's description of its format ids, stored ahead of the segments using it
+    void setFileTable(const QByteArray &table);
+    const QList<QByteArray> & restoredTables() const { return m_tables; }
+    // Translates the format ids of lines restored under one of those tables
+    void setTableMap(int table, const QVector<int> &map);
+
+private:
+    Q_DISABLE_COPY(LineBuffer)
+
+    struct Line
+    {
+        int text;
+        int length;
+        int runs;
+        int runCount;
+    };
+
+    struct Segment
+    {
+        Segment() : base(0), count(0), table(-1) {}
+
+        qint64 base;
+        int count;
+        QVector<Line> lines;
+        QString text;
+        QVector<LineRun> runs;
+
+        // Once the segment is cold, lines, text and runs are empty and the
+        // data is either packed here or in the file
+        QByteArray packed;
+        ScrollbackFile::Record record;
+        int table;
+
+        bool isCold() const { return !packed.isEmpty() || record.isValid(); }
+    };
+
+    const Line * line(qint64 id, const Segment **segment) const;
+    const Segment * unpacked(const Segment *segment) const;
+    bool unpackCold(const Segment *segment, Segment *into) const;
+    void evict();
+    void removeLast();
+    void dropSegment(Segment *segment);
+
+    void spill(Segment *segment);
+    void dropRotated();
+    void closeFile();
+
+    static void pack(Segment *segment);
+    static bool unpack(const QByteArray &packed, Segment *segment);
+
+    QList<Segment *> m_segments;
+    mutable QCache<const Segment *, Segment> m_unpacked;
+    qint64 m_first;
+    int m_count;
+    int m_maximum;
+
+    ScrollbackFile *m_file;
+    int m_fileGeneration;
+    QByteArray m_table;
+    bool m_tableDirty;
+    QList<QByteArray> m_tables;
+    QVector<QVector<int> > m_maps;
+};
+
+#endif // LINEBUFFER_H
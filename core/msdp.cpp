@@ -0,0 +1,255 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#include "msdp.h"
+
+static const int MAX_DEPTH = 64;
+
+namespace
+{
+
+class Parser
+{
+public:
+    Parser(const QByteArray &data, QByteArray &out) :
+        m_pos(data.constData()),
+        m_end(data.constData() + data.length()),
+        m_out(out),
+        m_depth(0)
+    {}
+
+    void parse()
+    {
+        pairs(0);
+    }
+
+private:
+    static bool isControl(char ch)
+    {
+        return ch >= Msdp::Var && ch <= Msdp::ArrayClose;
+    }
+
+    void string(const char *str, int length)
+    {
+        static const char hex[] = "0123456789abcdef";
+
+        m_out.append('"');
+        for (int n = 0; n < length; n++)
+        {
+            uchar ch = uchar(str[n]);
+            if (ch == '"' || ch == '\\')
+            {
+                m_out.append('\\');
+                m_out.append(char(ch));
+            }
+            else if (ch < 0x20)
+            {
+                char escape[6] = { '\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 0xF] };
+                m_out.append(escape, 6);
+            }
+            else
+            {
+                m_out.append(char(ch));
+            }
+        }
+        m_out.append('"');
+    }
+
+    // Runs up to the next MSDP control byte
+    int token()
+    {
+        const char *start = m_pos;
+        while (m_pos < m_end && !isControl(*m_pos))
+        {
+            m_pos++;
+        }
+        return m_pos - start;
+    }
+
+    // VAR name VAL value... until the closing byte, as a JSON object
+    void pairs(char close)
+    {
+        m_out.append('{');
+
+        bool first = true;
+        while (m_pos < m_end)
+        {
+            if (*m_pos == close)
+            {
+                m_pos++;
+                break;
+            }
+
+            if (*m_pos != Msdp::Var)
+            {
+                // Stray data outside a variable is skipped
+                m_pos++;
+                token();
+                continue;
+            }
+
+            m_pos++;
+            const char *name = m_pos;
+            int length = token();
+
+            if (!first)
+            {
+                m_out.append(',');
+            }
+            first = false;
+
+            string(name, length);
+            m_out.append(':');
+            values();
+        }
+
+        m_out.append('}');
+    }
+
+    // One VAL is a plain value, several in a row become an array
+    void values()
+    {
+        int count = 0;
+        int start = m_out.length();
+
+        while (m_pos < m_end && *m_pos == Msdp::Val)
+        {
+            m_pos++;
+
+            if (count == 1)
+            {
+                m_out.insert(start, '[');
+            }
+            if (count > 0)
+            {
+                m_out.append(',');
+            }
+            count++;
+
+            value();
+        }
+
+        if (count == 0)
+        {
+            m_out.append("\"\"", 2);
+        }
+        else if (count > 1)
+        {
+            m_out.append(']');
+        }
+    }
+
+    void value()
+    {
+        if (m_pos < m_end && (*m_pos == Msdp::TableOpen || *m_pos == Msdp::ArrayOpen) && m_depth >= MAX_DEPTH)
+        {
+            m_pos = m_end;
+        }
+
+        if (m_pos < m_end && *m_pos == Msdp::TableOpen)
+        {
+            m_pos++;
+            m_depth++;
+            pairs(Msdp::TableClose);
+            m_depth--;
+        }
+        else if (m_pos < m_end && *m_pos == Msdp::ArrayOpen)
+        {
+            m_pos++;
+            m_depth++;
+            array();
+            m_depth--;
+        }
+        else
+        {
+            const char *str = m_pos;
+            int length = token();
+            string(str, length);
+        }
+    }
+
+    void array()
+    {
+        m_out.append('[');
+
+        bool first = true;
+        while (m_pos < m_end)
+        {
+            if (*m_pos == Msdp::ArrayClose)
+            {
+                m_pos++;
+                break;
+            }
+
+            if (*m_pos != Msdp::Val)
+            {
+                m_pos++;
+                token();
+                continue;
+            }
+
+            m_pos++;
+
+            if (!first)
+            {
+                m_out.append(',');
+            }
+            first = false;
+
+            value();
+        }
+
+        m_out.append(']');
+    }
+
+    const char *m_pos;
+    const char *m_end;
+    QByteArray &m_out;
+    int m_depth;
+};
+
+}
+
+QByteArray Msdp::toJson(const QByteArray &data)
+{
+    QByteArray json;
+    json.reserve(data.length() + 16);
+
+    Parser parser(data, json);
+    parser.parse();
+
+    return json;
+}
+
+QByteArray Msdp::variable(const QByteArray &name, const QList<QByteArray> &values)
+{
+    QByteArray out;
+    out.append(char(Var));
+    out.append(name);
+    foreach (const QByteArray &value, values)
+    {
+        out.append(char(Val));
+        out.append(value);
+    }
+    return out;
+}
@@ -0,0 +1,52 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#ifndef MSDP_H
+#define MSDP_H
+
+#include "core_global.h"
+#include <QByteArray>
+#include <QList>
+
+// Mud Server Data Protocol (telnet option 69) encoding
+namespace Msdp
+{
+    enum
+    {
+        Var = 1,
+        Val = 2,
+        TableOpen = 3,
+        TableClose = 4,
+        ArrayOpen = 5,
+        ArrayClose = 6
+    };
+
+    // Converts the body of an IAC SB MSDP ... IAC SE into a JSON object of
+    // its variables; tables become objects, arrays and repeated VALs arrays
+    CORESHARED_EXPORT QByteArray toJson(const QByteArray &data);
+
+    // VAR name VAL value [VAL value ...], ready to go inside a subnegotiation
+    CORESHARED_EXPORT QByteArray variable(const QByteArray &name, const QList<QByteArray> &values);
+}
+
+#endif // MSDP_H
@@ -0,0 +1,105 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <QAtomicInt>
+
+// Lock-free queue for exactly one producer thread and one consumer thread
+template <class T>
+class RingBuffer
+{
+public:
+    explicit RingBuffer(int capacity = 1024);
+    ~RingBuffer() { delete [] m_items; }
+
+    int capacity() const { return m_mask; }
+    bool isEmpty() const { return m_head.loadAcquire() == m_tail.loadAcquire(); }
+    int count() const { return (m_tail.loadAcquire() - m_head.loadAcquire()) & m_mask; }
+
+    // Producer side
+    bool push(const T &item);
+
+    // Consumer side
+    bool pop(T &item);
+
+private:
+    Q_DISABLE_COPY(RingBuffer)
+
+    T *m_items;
+    int m_mask;
+
+    QAtomicInt m_head;
+    QAtomicInt m_tail;
+};
+
+template <class T>
+RingBuffer<T>::RingBuffer(int capacity) :
+    m_head(0),
+    m_tail(0)
+{
+    // One slot always stays empty to tell a full ring from an empty one
+    int size = 2;
+    while (size <= capacity)
+    {
+        size <<= 1;
+    }
+
+    m_items = new T[size];
+    m_mask = size - 1;
+}
+
+template <class T>
+bool RingBuffer<T>::push(const T &item)
+{
+    const int tail = m_tail.load();
+    const int next = (tail + 1) & m_mask;
+    if (next == m_head.loadAcquire())
+    {
+        return false;
+    }
+
+    m_items[tail] = item;
+    m_tail.storeRelease(next);
+
+    return true;
+}
+
+template <class T>
+bool RingBuffer<T>::pop(T &item)
+{
+    const int head = m_head.load();
+    if (head == m_tail.loadAcquire())
+    {
+        return false;
+    }
+
+    item = m_items[head];
+    m_items[head] = T();
+    m_head.storeRelease((head + 1) & m_mask);
+
+    return true;
+}
+
+#endif // RINGBUFFER_H
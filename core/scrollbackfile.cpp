@@ -0,0 +1,373 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+
+
+#include "scrollbackfile.h"
+#include <QDebug>
+
+static const char FILE_MAGIC[4] = { 'M', 'D', 'S', 'B' };
+static const quint32 FILE_VERSION = 1;
+static const qint64 FILE_HEADER_SIZE = sizeof(FILE_MAGIC) + sizeof(FILE_VERSION);
+
+struct RecordHeader
+{
+    quint32 type;
+    quint32 lines;
+    quint32 size;
+};
+
+// Body of a Withdrawn record: where the withdrawn one is, counting files back
+// from the one this is in, since generations are only numbered per session
+struct WithdrawnRecord
+{
+    quint32 filesBack;
+    quint32 reserved;
+    qint64 offset;
+};
+
+ScrollbackFile::ScrollbackFile() :
+    m_maximumSize(0),
+    m_previous(0),
+    m_current(0),
+    m_generation(0)
+{
+}
+
+ScrollbackFile::~ScrollbackFile()
+{
+    close();
+}
+
+bool ScrollbackFile::open(const QString &fileName, qint64 maximumSize)
+{
+    close();
+
+    m_fileName = fileName;
+    m_maximumSize = maximumSize;
+    m_generation = 1;
+
+    QFile *previous = new QFile(fileName + ".1");
+    if (previous->open(QIODevice::ReadOnly) && scan(previous, m_generation - 1))
+    {
+        m_previous = previous;
+    }
+    else
+    {
+        delete previous;
+    }
+
+    m_current = new QFile(fileName);
+    if (!m_current->open(QIODevice::ReadWrite))
+    {
+        qWarning() << "Unable to open scrollback file" << fileName << m_current->errorString();
+        close();
+        return false;
+    }
+
+    // Anything that isn't one of ours is started over
+    if (!scan(m_current, m_generation) && !startFile(m_current))
+    {
+        qWarning() << "Unable to write scrollback file" << fileName << m_current->errorString();
+        close();
+        return false;
+    }
+
+    if (m_current->size() > m_maximumSize / 2)
+    {
+        rotate();
+    }
+
+    return true;
+}
+
+void ScrollbackFile::close()
+{
+    if (m_previous)
+    {
+        unmap(m_previous, m_previousMap);
+        delete m_previous;
+        m_previous = 0;
+    }
+
+    if (m_current)
+    {
+        unmap(m_current, m_currentMap);
+        delete m_current;
+        m_current = 0;
+    }
+
+    m_records.clear();
+}
+
+ScrollbackFile::Record ScrollbackFile::append(RecordType type, const QByteArray &data, int lines)
+{
+    if (!m_current)
+    {
+        return Record();
+    }
+
+    RecordHeader header;
+    header.type = type;
+    header.lines = lines;
+    header.size = data.size();
+
+    const qint64 offset = m_current->size();
+    if (!m_current->seek(offset) ||
+        m_current->write(reinterpret_cast<const char *>(&header), sizeof(header)) != sizeof(header) ||
+        m_current->write(data) != data.size() ||
+        !m_current->flush())
+    {
+        qWarning() << "Unable to write scrollback file" << m_fileName << m_current->errorString();
+        m_current->resize(offset);
+        return Record();
+    }
+
+    Record record;
+    record.type = type;
+    record.generation = m_generation;
+    record.offset = offset;
+    record.size = data.size();
+    record.lines = lines;
+    if (type != Withdrawn)
+    {
+        m_records.append(record);
+    }
+
+    if (m_current->size() > m_maximumSize / 2)
+    {
+        rotate();
+    }
+
+    return record;
+}
+
+QByteArray ScrollbackFile::read(const Record &record)
+{
+    QFile *file;
+    Mapping *mapping;
+    if (record.generation == m_generation && m_current)
+    {
+        file = m_current;
+        mapping = &m_currentMap;
+    }
+    else if (record.generation == m_generation - 1 && m_previous)
+    {
+        file = m_previous;
+        mapping = &m_previousMap;
+    }
+    else
+    {
+        return QByteArray();
+    }
+
+    const qint64 start = record.offset + sizeof(RecordHeader);
+    const uchar *data = map(file, *mapping, start + record.size);
+    if (!data)
+    {
+        return QByteArray();
+    }
+
+    return QByteArray(reinterpret_cast<const char *>(data + start), record.size);
+}
+
+void ScrollbackFile::withdraw(const Record &record)
+{
+    if (!record.isValid() || record.generation < oldestGeneration())
+    {
+        return;
+    }
+
+    forget(record.generation, record.offset);
+
+    WithdrawnRecord withdrawn;
+    withdrawn.filesBack = m_generation - record.generation;
+    withdrawn.reserved = 0;
+    withdrawn.offset = record.offset;
+
+    append(Withdrawn, QByteArray(reinterpret_cast<const char *>(&withdrawn), sizeof(withdrawn)));
+}
+
+void ScrollbackFile::forget(int generation, qint64 offset)
+{
+    for (int n = m_records.size() - 1; n >= 0; n--)
+    {
+        if (m_records.at(n).generation == generation && m_records.at(n).offset == offset)
+        {
+            m_records.remove(n);
+            return;
+        }
+    }
+}
+
+bool ScrollbackFile::scan(QFile *file, int generation)
+{
+    char magic[sizeof(FILE_MAGIC)];
+    quint32 version;
+    if (file->read(magic, sizeof(magic)) != sizeof(magic) ||
+        memcmp(magic, FILE_MAGIC, sizeof(magic)) != 0 ||
+        file->read(reinterpret_cast<char *>(&version), sizeof(version)) != sizeof(version) ||
+        version != FILE_VERSION)
+    {
+        return false;
+    }
+
+    // Only the headers are read; the records themselves are paged in when wanted
+    const qint64 size = file->size();
+    qint64 offset = FILE_HEADER_SIZE;
+    while (offset + qint64(sizeof(RecordHeader)) <= size)
+    {
+        RecordHeader header;
+        if (!file->seek(offset) ||
+            file->read(reinterpret_cast<char *>(&header), sizeof(header)) != sizeof(header))
+        {
+            break;
+        }
+
+        const qint64 end = offset + sizeof(header) + header.size;
+        if ((header.type != Segment && header.type != Table && header.type != Withdrawn) || end > size)
+        {
+            break;
+        }
+
+        if (header.type == Withdrawn)
+        {
+            WithdrawnRecord withdrawn;
+            if (header.size != sizeof(withdrawn) ||
+                file->read(reinterpret_cast<char *>(&withdrawn), sizeof(withdrawn)) != sizeof(withdrawn))
+            {
+                break;
+            }
+
+            forget(generation - int(withdrawn.filesBack), withdrawn.offset);
+
+            offset = end;
+            continue;
+        }
+
+        Record record;
+        record.type = header.type;
+        record.generation = generation;
+        record.offset = offset;
+        record.size = header.size;
+        record.lines = header.lines;
+        m_records.append(record);
+
+        offset = end;
+    }
+
+    // Cut off whatever was left half written when the last session ended
+    if (offset < size && file->isWritable())
+    {
+        file->resize(offset);
+    }
+
+    return true;
+}
+
+bool ScrollbackFile::startFile(QFile *file)
+{
+    return file->resize(0) &&
+        file->seek(0) &&
+        file->write(FILE_MAGIC, sizeof(FILE_MAGIC)) == sizeof(FILE_MAGIC) &&
+        file->write(reinterpret_cast<const char *>(&FILE_VERSION), sizeof(FILE_VERSION)) == sizeof(FILE_VERSION) &&
+        file->flush();
+}
+
+void ScrollbackFile::rotate()
+{
+    const QString previousName(m_fileName + ".1");
+
+    if (m_previous)
+    {
+        unmap(m_previous, m_previousMap);
+        delete m_previous;
+        m_previous = 0;
+    }
+    QFile::remove(previousName);
+
+    unmap(m_current, m_currentMap);
+    m_current->close();
+    if (m_current->rename(previousName) && m_current->open(QIODevice::ReadOnly))
+    {
+        m_previous = m_current;
+    }
+    else
+    {
+        qWarning() << "Unable to rotate scrollback file" << m_fileName << m_current->errorString();
+        delete m_current;
+    }
+
+    m_generation++;
+
+    int dropped = 0;
+    while (dropped < m_records.size() && m_records.at(dropped).generation < oldestGeneration())
+    {
+        dropped++;
+    }
+    m_records.remove(0, dropped);
+
+    m_current = new QFile(m_fileName);
+    if (!m_current->open(QIODevice::ReadWrite) || !startFile(m_current))
+    {
+        qWarning() << "Unable to write scrollback file" << m_fileName << m_current->errorString();
+        delete m_current;
+        m_current = 0;
+    }
+}
+
+void ScrollbackFile::unmap(QFile *file, Mapping &mapping)
+{
+    if (mapping.data)
+    {
+        file->unmap(mapping.data);
+        mapping = Mapping();
+    }
+}
+
+const uchar * ScrollbackFile::map(QFile *file, Mapping &mapping, qint64 end)
+{
+    if (mapping.data && mapping.size >= end)
+    {
+        return mapping.data;
+    }
+
+    // The current file grows under the mapping, so map it again as a whole
+    unmap(file, mapping);
+
+    const qint64 size = file->size();
+    if (size < end)
+    {
+        return 0;
+    }
+
+    mapping.data = file->map(0, size);
+    if (!mapping.data)
+    {
+        qWarning() << "Unable to map scrollback file" << file->fileName() << file->errorString();
+        return 0;
+    }
+    mapping.size = size;
+
+    return mapping.data;
+}
@@ -0,0 +1,112 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#ifndef SCROLLBACKFILE_H
+#define SCROLLBACKFILE_H
+
+#include "core_global.h"
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+#include <QVector>
+
+// Append-only log of scrollback records, read back through a memory mapping.
+// Once the current file passes half the size cap it is kept as the previous
+// file and a new one started, dropping the one before, so no more than the
+// cap stays on disk. Data is in host byte order; the file is a local cache.
+class CORESHARED_EXPORT ScrollbackFile
+{
+public:
+    enum RecordType
+    {
+        Segment = 1,
+        Table = 2,
+        Withdrawn = 3
+    };
+
+    struct Record
+    {
+        Record() : type(0), generation(-1), offset(0), size(0), lines(0) {}
+
+        bool isValid() const { return generation >= 0; }
+
+        int type;
+        int generation;
+        qint64 offset;
+        int size;
+        int lines;
+    };
+
+    ScrollbackFile();
+    ~ScrollbackFile();
+
+    // Opens the log and indexes the records already in it, oldest first
+    bool open(const QString &fileName, qint64 maximumSize);
+    void close();
+    bool isOpen() const { return m_current != 0; }
+
+    QString fileName() const { return m_fileName; }
+    const QVector<Record> & records() const { return m_records; }
+
+    // Records from generations older than this have been rotated away
+    int oldestGeneration() const { return m_previous ? m_generation - 1 : m_generation; }
+    int generation() const { return m_generation; }
+
+    Record append(RecordType type, const QByteArray &data, int lines = 0);
+    QByteArray read(const Record &record);
+    // Notes that a record has been superseded; it's left out of records()
+    // from now on, and when the file is opened again
+    void withdraw(const Record &record);
+
+private:
+    Q_DISABLE_COPY(ScrollbackFile)
+
+    struct Mapping
+    {
+        Mapping() : data(0), size(0) {}
+
+        uchar *data;
+        qint64 size;
+    };
+
+    bool scan(QFile *file, int generation);
+    void forget(int generation, qint64 offset);
+    bool startFile(QFile *file);
+    void rotate();
+    void unmap(QFile *file, Mapping &mapping);
+    const uchar * map(QFile *file, Mapping &mapping, qint64 end);
+
+    QString m_fileName;
+    qint64 m_maximumSize;
+
+    QFile *m_previous;
+    QFile *m_current;
+    Mapping m_previousMap;
+    Mapping m_currentMap;
+    int m_generation;
+
+    QVector<Record> m_records;
+};
+Q_DECLARE_TYPEINFO(ScrollbackFile::Record, Q_MOVABLE_TYPE);
+
+#endif // SCROLLBACKFILE_H
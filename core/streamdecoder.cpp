@@ -0,0 +1,256 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+
+#include "streamdecoder.h"
+#include "bytescan.h"
+#include <QTextCodec>
+#include <QTextDecoder>
+
+static const int MIB_LATIN1 = 4;
+static const int MIB_UTF8 = 106;
+
+static const ushort REPLACEMENT_CHARACTER = 0xFFFDu;
+
+// Copies the leading 7-bit run of data, returning its length
+static inline int widenAscii(const uchar *data, int length, ushort *out)
+{
+    int pos = 0;
+
+#ifdef BYTESCAN_SSE2
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; pos + 16 <= length; pos += 16)
+    {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos));
+        if (_mm_movemask_epi8(chunk))
+        {
+            break;
+        }
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + pos), _mm_unpacklo_epi8(chunk, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + pos + 8), _mm_unpackhi_epi8(chunk, zero));
+    }
+#endif
+
+    for (; pos < length && data[pos] < 0x80u; pos++)
+    {
+        out[pos] = data[pos];
+    }
+
+    return pos;
+}
+
+static inline void widenLatin1(const uchar *data, int length, ushort *out)
+{
+    int pos = 0;
+
+#ifdef BYTESCAN_SSE2
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; pos + 16 <= length; pos += 16)
+    {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + pos), _mm_unpacklo_epi8(chunk, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + pos + 8), _mm_unpackhi_epi8(chunk, zero));
+    }
+#endif
+
+    for (; pos < length; pos++)
+    {
+        out[pos] = data[pos];
+    }
+}
+
+StreamDecoder::StreamDecoder(const QByteArray &encoding) :
+    m_mode(Utf8),
+    m_encoding("UTF-8"),
+    m_decoder(0)
+{
+    reset();
+    setEncoding(encoding);
+}
+
+StreamDecoder::~StreamDecoder()
+{
+    delete m_decoder;
+}
+
+bool StreamDecoder::setEncoding(const QByteArray &encoding)
+{
+    QTextCodec *codec = QTextCodec::codecForName(encoding);
+    if (!codec)
+    {
+        return false;
+    }
+
+    delete m_decoder;
+    m_decoder = 0;
+
+    switch (codec->mibEnum())
+    {
+        case MIB_UTF8:
+            m_mode = Utf8;
+            break;
+
+        case MIB_LATIN1:
+            m_mode = Latin1;
+            break;
+
+        default:
+            // Other multi-byte encodings can reuse ASCII values inside a sequence, so they get no fast path
+            m_mode = Codec;
+            m_decoder = codec->makeDecoder();
+    }
+
+    m_encoding = codec->name();
+
+    reset();
+
+    return true;
+}
+
+void StreamDecoder::decode(const char *data, int length, QString &out)
+{
+    if (length < 1)
+    {
+        return;
+    }
+
+    if (m_mode == Codec)
+    {
+        out.append(m_decoder->toUnicode(data, length));
+        return;
+    }
+
+    const int size = out.size();
+
+    // A sequence carried over from the last read can finish as a surrogate pair, or be cut short by a replacement
+    out.resize(size + length + 1);
+    ushort *dst = reinterpret_cast<ushort *>(out.data()) + size;
+
+    if (m_mode == Latin1)
+    {
+        widenLatin1(reinterpret_cast<const uchar *>(data), length, dst);
+        out.resize(size + length);
+    }
+    else
+    {
+        out.resize(size + decodeUtf8(reinterpret_cast<const uchar *>(data), length, dst));
+    }
+}
+
+void StreamDecoder::reset()
+{
+    m_codepoint = 0;
+    m_minimum = 0;
+    m_pending = 0;
+
+    if (m_decoder)
+    {
+        // QTextDecoder has no way to drop its state, so start over with a fresh one
+        QTextCodec *codec = QTextCodec::codecForName(m_encoding);
+        delete m_decoder;
+        m_decoder = codec->makeDecoder();
+    }
+}
+
+int StreamDecoder::decodeUtf8(const uchar *data, int length, ushort *out)
+{
+    ushort *start = out;
+    int pos = 0;
+
+    while (pos < length)
+    {
+        if (m_pending == 0)
+        {
+            const int run = widenAscii(data + pos, length - pos, out);
+            pos += run;
+            out += run;
+
+            if (pos >= length)
+            {
+                break;
+            }
+
+            const uchar ch = data[pos++];
+            if (ch >= 0xC2u && ch <= 0xDFu)
+            {
+                m_codepoint = ch & 0x1Fu;
+                m_minimum = 0x80u;
+                m_pending = 1;
+            }
+            else if (ch >= 0xE0u && ch <= 0xEFu)
+            {
+                m_codepoint = ch & 0x0Fu;
+                m_minimum = 0x800u;
+                m_pending = 2;
+            }
+            else if (ch >= 0xF0u && ch <= 0xF4u)
+            {
+                m_codepoint = ch & 0x07u;
+                m_minimum = 0x10000u;
+                m_pending = 3;
+            }
+            else
+            {
+                *out++ = REPLACEMENT_CHARACTER;
+            }
+            continue;
+        }
+
+        const uchar ch = data[pos];
+        if ((ch & 0xC0u) != 0x80u)
+        {
+            // Truncated sequence, so replace what there was and read this byte again as a lead byte
+            *out++ = REPLACEMENT_CHARACTER;
+            m_pending = 0;
+            continue;
+        }
+
+        pos++;
+        m_codepoint = (m_codepoint << 6) | (ch & 0x3Fu);
+
+        if (--m_pending > 0)
+        {
+            continue;
+        }
+
+        if (m_codepoint < m_minimum || m_codepoint > 0x10FFFFu || (m_codepoint >= 0xD800u && m_codepoint <= 0xDFFFu))
+        {
+            *out++ = REPLACEMENT_CHARACTER;
+        }
+        else if (m_codepoint >= 0x10000u)
+        {
+            *out++ = QChar::highSurrogate(m_codepoint);
+            *out++ = QChar::lowSurrogate(m_codepoint);
+        }
+        else
+        {
+            *out++ = ushort(m_codepoint);
+        }
+    }
+
+    return int(out - start);
+}
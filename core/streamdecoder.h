@@ -0,0 +1,68 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#ifndef STREAMDECODER_H
+#define STREAMDECODER_H
+
+#include "core_global.h"
+#include <QByteArray>
+#include <QString>
+
+class QTextDecoder;
+
+// Turns a stream of bytes into text one read at a time; a multi-byte
+// sequence split across reads is held back until the rest arrives
+class CORESHARED_EXPORT StreamDecoder
+{
+public:
+    explicit StreamDecoder(const QByteArray &encoding = QByteArray("UTF-8"));
+    ~StreamDecoder();
+
+    QByteArray encoding() const { return m_encoding; }
+    bool setEncoding(const QByteArray &encoding);
+
+    // Appends the decoded text to out
+    void decode(const char *data, int length, QString &out);
+    void reset();
+
+private:
+    Q_DISABLE_COPY(StreamDecoder)
+
+    enum Mode
+    {
+        Utf8,
+        Latin1,
+        Codec
+    };
+
+    int decodeUtf8(const uchar *data, int length, ushort *out);
+
+    Mode m_mode;
+    QByteArray m_encoding;
+    QTextDecoder *m_decoder;
+
+    uint m_codepoint;
+    uint m_minimum;
+    int m_pending;
+};
+
+#endif // STREAMDECODER_H
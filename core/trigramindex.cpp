@@ -0,0 +1,373 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+
+
+#include "trigramindex.h"
+#include <QtAlgorithms>
+
+// Evicted blocks are swept out of the postings this many at a time
+static const quint32 COMPACT_BLOCKS = 1024;
+
+static inline quint64 trigramKey(const QChar *text)
+{
+    return (quint64(text[0].unicode()) << 32) | (quint64(text[1].unicode()) << 16) | text[2].unicode();
+}
+
+static bool shorterPostings(const QVector<quint32> *a, const QVector<quint32> *b)
+{
+    return a->size() < b->size();
+}
+
+TrigramIndex::TrigramIndex() :
+    m_first(0),
+    m_last(-1),
+    m_compacted(0)
+{
+}
+
+void TrigramIndex::addLine(qint64 line, const QString &text)
+{
+    if (isEmpty())
+    {
+        m_first = line;
+    }
+    m_last = line;
+
+    const QString folded(text.toCaseFolded());
+    if (folded.length() < 3)
+    {
+        return;
+    }
+
+    const quint32 block = quint32(line / BLOCK_LINES);
+    const QChar *data = folded.constData();
+    for (int n = 0; n + 3 <= folded.length(); n++)
+    {
+        QVector<quint32> &postings = m_postings[trigramKey(data + n)];
+        if (postings.isEmpty() || postings.last() < block)
+        {
+            postings.append(block);
+        }
+        else if (postings.last() > block)
+        {
+            // Only after removeFrom() left later blocks behind
+            QVector<quint32>::iterator it = qLowerBound(postings.begin(), postings.end(), block);
+            if (*it != block)
+            {
+                postings.insert(it, block);
+            }
+        }
+    }
+}
+
+void TrigramIndex::removeFrom(qint64 line)
+{
+    m_last = qMin(m_last, line - 1);
+}
+
+void TrigramIndex::removeBefore(qint64 line)
+{
+    if (line <= m_first)
+    {
+        return;
+    }
+
+    m_first = line;
+    if (m_last < m_first)
+    {
+        m_last = m_first - 1;
+    }
+
+    if (quint32(m_first / BLOCK_LINES) >= m_compacted + COMPACT_BLOCKS)
+    {
+        compact();
+    }
+}
+
+void TrigramIndex::clear()
+{
+    m_postings.clear();
+    m_first = 0;
+    m_last = -1;
+    m_compacted = 0;
+}
+
+bool TrigramIndex::candidates(const QStringList &literals, QVector<qint64> &blocks) const
+{
+    blocks.clear();
+
+    QList<quint64> keys;
+    foreach (const QString &literal, literals)
+    {
+        const QString folded(literal.toCaseFolded());
+        for (int n = 0; n + 3 <= folded.length(); n++)
+        {
+            keys.append(trigramKey(folded.constData() + n));
+        }
+    }
+
+    if (keys.isEmpty())
+    {
+        return false;
+    }
+
+    if (isEmpty())
+    {
+        return true;
+    }
+
+    QList<const QVector<quint32> *> lists;
+    foreach (quint64 key, keys)
+    {
+        QHash<quint64, QVector<quint32> >::const_iterator it = m_postings.constFind(key);
+        if (it == m_postings.constEnd())
+        {
+            return true;
+        }
+
+        lists.append(&it.value());
+    }
+
+    // Walk the shortest list and probe the others
+    qSort(lists.begin(), lists.end(), shorterPostings);
+
+    const quint32 firstBlock = quint32(m_first / BLOCK_LINES);
+    const quint32 lastBlock = quint32(m_last / BLOCK_LINES);
+    const QVector<quint32> &shortest = *lists.first();
+    for (int n = shortest.size() - 1; n >= 0; n--)
+    {
+        const quint32 block = shortest.at(n);
+        if (block > lastBlock)
+        {
+            continue;
+        }
+        if (block < firstBlock)
+        {
+            break;
+        }
+
+        bool everywhere = true;
+        for (int k = 1; k < lists.size() && everywhere; k++)
+        {
+            QVector<quint32>::const_iterator it = qBinaryFind(lists.at(k)->constBegin(), lists.at(k)->constEnd(), block);
+            everywhere = it != lists.at(k)->constEnd();
+        }
+
+        if (everywhere)
+        {
+            blocks.append(qMax(m_first, qint64(block) * BLOCK_LINES));
+        }
+    }
+
+    return true;
+}
+
+QStringList TrigramIndex::requiredLiterals(const QString &pattern)
+{
+    QStringList literals;
+    QString current;
+
+    // Literal count when each open group started, and whether the group may be skipped
+    QList<QPair<int, bool> > groups;
+
+    const int length = pattern.length();
+    for (int n = 0; n < length; n++)
+    {
+        const QChar ch(pattern.at(n));
+        const QChar next(n + 1 < length ? pattern.at(n + 1) : QChar());
+
+        switch (ch.unicode())
+        {
+        case '\\':
+            if (next.isNull() || next.isLetterOrNumber())
+            {
+                // A class, an anchor or a code point; none of them are literal text here
+                if (current.length() >= 3)
+                {
+                    literals.append(current);
+                }
+                current.clear();
+            }
+            else
+            {
+                current.append(next);
+            }
+            n++;
+            break;
+
+        case '|':
+            if (groups.isEmpty())
+            {
+                return QStringList();
+            }
+            groups.last().second = true;
+            if (current.length() >= 3)
+            {
+                literals.append(current);
+            }
+            current.clear();
+            break;
+
+        case '(':
+            if (current.length() >= 3)
+            {
+                literals.append(current);
+            }
+            current.clear();
+
+            // Lookarounds don't consume anything, and negative ones forbid their text
+            groups.append(qMakePair(literals.size(), next == '?' && n + 2 < length &&
+                                    (pattern.at(n + 2) == '=' || pattern.at(n + 2) == '!' || pattern.at(n + 2) == '<')));
+            if (next == '?')
+            {
+                // Skip the group's flags up to where its body starts
+                n++;
+                while (n + 1 < length && pattern.at(n + 1) != ':' && pattern.at(n + 1) != ')' &&
+                       pattern.at(n + 1) != '=' && pattern.at(n + 1) != '!')
+                {
+                    n++;
+                }
+                if (n + 1 < length && pattern.at(n + 1) != ')')
+                {
+                    n++;
+                }
+            }
+            break;
+
+        case ')':
+            if (current.length() >= 3)
+            {
+                literals.append(current);
+            }
+            current.clear();
+
+            if (!groups.isEmpty())
+            {
+                const QPair<int, bool> group(groups.takeLast());
+                if (group.second || next == '*' || next == '?' || next == '{')
+                {
+                    while (literals.size() > group.first)
+                    {
+                        literals.removeLast();
+                    }
+                }
+            }
+            break;
+
+        case '[':
+            if (current.length() >= 3)
+            {
+                literals.append(current);
+            }
+            current.clear();
+
+            // Skip to the end of the class; a leading ] is part of it
+            n++;
+            if (n < length && pattern.at(n) == '^')
+            {
+                n++;
+            }
+            if (n < length && pattern.at(n) == ']')
+            {
+                n++;
+            }
+            while (n < length && pattern.at(n) != ']')
+            {
+                if (pattern.at(n) == '\\')
+                {
+                    n++;
+                }
+                n++;
+            }
+            break;
+
+        case '*':
+        case '?':
+        case '{':
+            // The last character may not be there at all
+            if (ch != '{' || (next == '0' || next == ','))
+            {
+                current.chop(1);
+            }
+            if (current.length() >= 3)
+            {
+                literals.append(current);
+            }
+            current.clear();
+
+            if (ch == '{')
+            {
+                while (n < length && pattern.at(n) != '}')
+                {
+                    n++;
+                }
+            }
+            break;
+
+        case '+':
+        case '.':
+        case '^':
+        case '$':
+            if (current.length() >= 3)
+            {
+                literals.append(current);
+            }
+            current.clear();
+            break;
+
+        default:
+            current.append(ch);
+            break;
+        }
+    }
+
+    if (current.length() >= 3 && groups.isEmpty())
+    {
+        literals.append(current);
+    }
+
+    return literals;
+}
+
+void TrigramIndex::compact()
+{
+    const quint32 firstBlock = quint32(m_first / BLOCK_LINES);
+
+    QHash<quint64, QVector<quint32> >::iterator it = m_postings.begin();
+    while (it != m_postings.end())
+    {
+        QVector<quint32> &postings = it.value();
+        const int stale = qLowerBound(postings.begin(), postings.end(), firstBlock) - postings.begin();
+        if (stale == postings.size())
+        {
+            it = m_postings.erase(it);
+            continue;
+        }
+
+        postings.remove(0, stale);
+        ++it;
+    }
+
+    m_compacted = firstBlock;
+}
@@ -0,0 +1,73 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#ifndef TRIGRAMINDEX_H
+#define TRIGRAMINDEX_H
+
+#include "core_global.h"
+#include <QHash>
+#include <QStringList>
+#include <QVector>
+
+// Maps each trigram of case-folded text to the blocks of lines it occurs in.
+// Lines are added in order as they are finished; a block is the unit the
+// index narrows a search down to, which keeps postings short at the cost of
+// checking a few lines that can't match.
+class CORESHARED_EXPORT TrigramIndex
+{
+public:
+    TrigramIndex();
+
+    static int blockLines() { return BLOCK_LINES; }
+
+    bool isEmpty() const { return m_last < m_first; }
+    qint64 firstLine() const { return m_first; }
+    qint64 lastLine() const { return m_last; }
+
+    void addLine(qint64 line, const QString &text);
+    // Forgets lines from here on so they can be added again; blocks already
+    // listed stay listed, which only costs a few extra candidates
+    void removeFrom(qint64 line);
+    // Lines before this one are gone for good
+    void removeBefore(qint64 line);
+    void clear();
+
+    // First lines of the blocks that may hold all of the literals, newest first.
+    // Returns false when the literals are too short to narrow anything down.
+    bool candidates(const QStringList &literals, QVector<qint64> &blocks) const;
+
+    // Fragments every match of the regular expression must contain
+    static QStringList requiredLiterals(const QString &pattern);
+
+private:
+    static const int BLOCK_LINES = 64;
+
+    void compact();
+
+    QHash<quint64, QVector<quint32> > m_postings;
+    qint64 m_first;
+    qint64 m_last;
+    quint32 m_compacted;
+};
+
+#endif // TRIGRAMINDEX_H
@@ -27,7 +27,11 @@
 SearchWidget::SearchWidget(SearchOptions options, SearchMode mode,
                            SearchButtons buttons, QWidget *parent) :
     QWidget(parent),
-    ui(new Ui::SearchWidget)
+    ui(new Ui::SearchWidget),
+    m_target(ExternalTarget),
+    m_textEdit(0),
+    m_plainTextEdit(0),
+    m_notificationMode(NotifyOnChange)
 {
     ui->setupUi(this);
 
@@ -170,6 +174,19 @@ void SearchWidget::setWholeWordsOnly(bool toggle)
     }
 }
 
+SearchWidget::SearchOption SearchWidget::patternSyntax() const
+{
+    if (m_searchRegEx->isChecked())
+    {
+        return RegEx;
+    }
+    if (m_searchFixedString->isChecked())
+    {
+        return RegFixedString;
+    }
+    return RegWildcard;
+}
+
 void SearchWidget::setEditorFocus(bool selectText)
 {
     ui->searchString->setFocus();
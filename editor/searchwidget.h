@@ -95,6 +95,8 @@ public:
     bool wholeWordsOnly() const;
     void setCaseSensitive(bool toggle);
     void setWholeWordsOnly(bool toggle);
+    // RegEx, RegWildcard or RegFixedString, whichever is checked
+    SearchOption patternSyntax() const;
     void setEditorFocus(bool selectText = true);
     void setTextEditor(QTextEdit * textEdit);
     QTextEdit * textEditor() const;
@@ -0,0 +1,227 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+
+#include "connection.h"
+#include "hostcache.h"
+#include <QElapsedTimer>
+#include <QTcpServer>
+#include <QtTest>
+
+// Documentation only, never routed (RFC 5737), so a connect to it usually hangs
+static const QHostAddress BLACK_HOLE("192.0.2.1");
+
+class ConnectTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void interleaveFamilies_data();
+    void interleaveFamilies();
+    void cacheExpiry();
+    void cachePromote();
+    void raceRefused();
+    void raceBlackHole();
+    void staleCache();
+
+private:
+    static QList<QHostAddress> addressList(const QStringList &addresses);
+
+    QTcpServer m_server;
+};
+
+QList<QHostAddress> ConnectTest::addressList(const QStringList &addresses)
+{
+    QList<QHostAddress> result;
+    foreach (const QString &address, addresses)
+    {
+        result.append(QHostAddress(address));
+    }
+    return result;
+}
+
+void ConnectTest::initTestCase()
+{
+    // Keep the host cache away from the real one
+    QCoreApplication::setOrganizationName("Mudder Tests");
+    QCoreApplication::setApplicationName("tst_connect");
+
+    // IPv4 only, so the same port on ::1 refuses
+    QVERIFY(m_server.listen(QHostAddress::LocalHost));
+}
+
+void ConnectTest::cleanupTestCase()
+{
+    HostCache *cache = HostCache::instance();
+    cache->remove("expiry.test");
+    cache->remove("promote.test");
+    cache->remove("refused.test");
+    cache->remove("blackhole.test");
+    cache->remove("localhost");
+}
+
+void ConnectTest::interleaveFamilies_data()
+{
+    QTest::addColumn<QStringList>("addresses");
+    QTest::addColumn<QStringList>("expected");
+
+    QTest::newRow("empty") << QStringList() << QStringList();
+    QTest::newRow("one family") << (QStringList() << "10.0.0.1" << "10.0.0.2") << (QStringList() << "10.0.0.1" << "10.0.0.2");
+    QTest::newRow("IPv6 first") << (QStringList() << "2001:db8::1" << "2001:db8::2" << "10.0.0.1")
+                                << (QStringList() << "2001:db8::1" << "10.0.0.1" << "2001:db8::2");
+    QTest::newRow("IPv4 first") << (QStringList() << "10.0.0.1" << "10.0.0.2" << "10.0.0.3" << "2001:db8::1")
+                                << (QStringList() << "10.0.0.1" << "2001:db8::1" << "10.0.0.2" << "10.0.0.3");
+    QTest::newRow("already mixed") << (QStringList() << "2001:db8::1" << "10.0.0.1" << "2001:db8::2" << "10.0.0.2")
+                                   << (QStringList() << "2001:db8::1" << "10.0.0.1" << "2001:db8::2" << "10.0.0.2");
+}
+
+void ConnectTest::interleaveFamilies()
+{
+    QFETCH(QStringList, addresses);
+    QFETCH(QStringList, expected);
+
+    QCOMPARE(Connection::interleaveFamilies(addressList(addresses)), addressList(expected));
+}
+
+void ConnectTest::cacheExpiry()
+{
+    HostCache *cache = HostCache::instance();
+    QList<QHostAddress> addresses(addressList(QStringList() << "10.0.0.1" << "2001:db8::1"));
+
+    cache->store("expiry.test", addresses);
+    QCOMPARE(cache->addresses("EXPIRY.test"), addresses);
+
+    // Anything resolved before the maximum age is as good as missing
+    int maxAge = cache->maxAge();
+    cache->setMaxAge(-1);
+    QVERIFY(cache->addresses("expiry.test").isEmpty());
+    cache->setMaxAge(maxAge);
+    QCOMPARE(cache->addresses("expiry.test"), addresses);
+
+    // Storing nothing forgets the host
+    cache->store("expiry.test", QList<QHostAddress>());
+    QVERIFY(cache->addresses("expiry.test").isEmpty());
+}
+
+void ConnectTest::cachePromote()
+{
+    HostCache *cache = HostCache::instance();
+
+    cache->store("promote.test", addressList(QStringList() << "10.0.0.1" << "10.0.0.2" << "10.0.0.3"));
+
+    cache->promote("promote.test", QHostAddress("10.0.0.3"));
+    QCOMPARE(cache->addresses("promote.test"), addressList(QStringList() << "10.0.0.3" << "10.0.0.1" << "10.0.0.2"));
+
+    // An address the cache never had doesn't sneak in
+    cache->promote("promote.test", QHostAddress("10.0.0.4"));
+    QCOMPARE(cache->addresses("promote.test"), addressList(QStringList() << "10.0.0.3" << "10.0.0.1" << "10.0.0.2"));
+
+    cache->remove("promote.test");
+    QVERIFY(cache->addresses("promote.test").isEmpty());
+}
+
+void ConnectTest::raceRefused()
+{
+    HostCache *cache = HostCache::instance();
+    cache->store("refused.test", QList<QHostAddress>() << QHostAddress::LocalHostIPv6 << QHostAddress::LocalHost);
+
+    Connection connection;
+    QSignalSpy connected(&connection, SIGNAL(connected()));
+    QSignalSpy failed(&connection, SIGNAL(connectionFailed(QString)));
+
+    connection.connectRemote("refused.test", m_server.serverPort());
+    QVERIFY(connected.wait(5000));
+    QCOMPARE(failed.count(), 0);
+
+    QCOMPARE(connection.m_address, QHostAddress(QHostAddress::LocalHost));
+    QVERIFY(!connection.m_attemptError.isEmpty());
+    QVERIFY(connection.m_attempts.isEmpty());
+
+    // The winner goes first next time
+    QCOMPARE(cache->addresses("refused.test").first(), QHostAddress(QHostAddress::LocalHost));
+
+    connection.disconnectRemote();
+}
+
+void ConnectTest::raceBlackHole()
+{
+    HostCache *cache = HostCache::instance();
+    cache->store("blackhole.test", QList<QHostAddress>() << BLACK_HOLE << QHostAddress::LocalHost);
+
+    Connection connection;
+    QSignalSpy connected(&connection, SIGNAL(connected()));
+
+    QElapsedTimer timer;
+    timer.start();
+
+    connection.connectRemote("blackhole.test", m_server.serverPort());
+    QCOMPARE(connection.m_attempts.count(), 1);
+    QVERIFY(connection.m_attemptTimer.isActive());
+
+    QVERIFY(connected.wait(5000));
+    QCOMPARE(connection.m_address, QHostAddress(QHostAddress::LocalHost));
+
+    // Only the stagger could have moved on from an attempt that never failed
+    if (connection.m_attemptError.isEmpty())
+    {
+        QVERIFY(timer.elapsed() >= connection.m_attemptTimer.interval() * 9 / 10);
+    }
+
+    // The loser was dropped, not left to time out
+    QVERIFY(connection.m_attempts.isEmpty());
+
+    connection.disconnectRemote();
+}
+
+void ConnectTest::staleCache()
+{
+    // Nothing listens on ::1, so the cached address fails and the name is resolved properly
+    HostCache *cache = HostCache::instance();
+    cache->store("localhost", QList<QHostAddress>() << QHostAddress::LocalHostIPv6);
+
+    Connection connection;
+    QSignalSpy connected(&connection, SIGNAL(connected()));
+    QSignalSpy found(&connection, SIGNAL(hostFound(QHostInfo)));
+
+    connection.connectRemote("localhost", m_server.serverPort());
+    QVERIFY(connection.m_fromCache);
+
+    QVERIFY(connected.wait(10000));
+    QCOMPARE(found.count(), 2);
+    QVERIFY(!connection.m_fromCache);
+    QCOMPARE(connection.m_address, QHostAddress(QHostAddress::LocalHost));
+
+    // The lookup replaced the stale entry
+    QList<QHostAddress> addresses(cache->addresses("localhost"));
+    QVERIFY(addresses.contains(QHostAddress(QHostAddress::LocalHost)));
+    QCOMPARE(addresses.first(), QHostAddress(QHostAddress::LocalHost));
+
+    connection.disconnectRemote();
+}
+
+QTEST_MAIN(ConnectTest)
+
+#include "tst_connect.moc"
@@ -0,0 +1,30 @@
+#-------------------------------------------------
+#
+# LuaJson round trip tests and benchmarks
+#
+#-------------------------------------------------
+
+QT += testlib
+QT -= gui
+
+TARGET = tst_luajson
+TEMPLATE = app
+
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+SOURCES += \
+    tst_luajson.cpp \
+    ../../client/luajson.cpp
+
+HEADERS += \
+    ../../client/luajson.h
+
+INCLUDEPATH += $$PWD/../../client
+
+win32:CONFIG(release, debug|release): LIBS += -L$$OUT_PWD/../../lua52/release/ -llua52
+else:win32:CONFIG(debug, debug|release): LIBS += -L$$OUT_PWD/../../lua52/debug/ -llua52
+else:unix: LIBS += -L$$OUT_PWD/../../lua52/ -llua52
+
+INCLUDEPATH += $$PWD/../../lua52/src
+DEPENDPATH += $$PWD/../../lua52/src
@@ -0,0 +1,375 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+
+#include "luajson.h"
+#include <QtTest>
+
+class LuaJsonTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+    void cleanup();
+
+    void roundTrip_data();
+    void roundTrip();
+    void numbers_data();
+    void numbers();
+    void strings_data();
+    void strings();
+    void tables_data();
+    void tables();
+    void null();
+    void invalid_data();
+    void invalid();
+    void nesting();
+
+    void benchmarkDecode();
+    void benchmarkEncode();
+
+private:
+    QByteArray encodeTop(bool *ok = 0);
+    QByteArray document();
+
+    lua_State *m_L;
+};
+
+void LuaJsonTest::init()
+{
+    m_L = luaL_newstate();
+}
+
+void LuaJsonTest::cleanup()
+{
+    lua_close(m_L);
+    m_L = 0;
+}
+
+// Encodes and pops the value on top of the stack
+QByteArray LuaJsonTest::encodeTop(bool *ok)
+{
+    QByteArray out;
+    bool encoded = LuaJson::encode(m_L, -1, out);
+    lua_pop(m_L, 1);
+
+    if (ok)
+    {
+        *ok = encoded;
+    }
+    return out;
+}
+
+// A busy GMCP room update: a few hundred items and players, escapes and non-ASCII text included
+QByteArray LuaJsonTest::document()
+{
+    QByteArray json("{\"num\":12345,\"name\":\"The Crossroads\",\"area\":\"Caf\\u00e9 district\",\"exits\":{\"n\":12346,\"s\":12344,\"e\":22001,\"w\":9001},\"items\":[");
+    for (int n = 0; n < 500; n++)
+    {
+        if (n > 0)
+        {
+            json.append(',');
+        }
+        json.append(QString("{\"id\":%1,\"name\":\"a \\\"rusty\\\" dagger #%1\",\"weight\":%2,\"value\":-%3.25e2,\"attrib\":[\"t\",\"m\",\"c\"],\"cursed\":%4}")
+                    .arg(n).arg(n * 0.37).arg(n).arg(n % 7 == 0 ? "true" : "false").toLatin1());
+    }
+    json.append("],\"players\":[");
+    for (int n = 0; n < 200; n++)
+    {
+        if (n > 0)
+        {
+            json.append(',');
+        }
+        json.append(QString("{\"name\":\"Player%1\",\"title\":\"the \\ud83d\\udde1 Swordsman\\n\",\"level\":%1,\"guild\":null}").arg(n).toLatin1());
+    }
+    json.append("]}");
+
+    return json;
+}
+
+void LuaJsonTest::roundTrip_data()
+{
+    QTest::addColumn<QByteArray>("json");
+    QTest::addColumn<QByteArray>("expected");
+
+    QTest::newRow("null") << QByteArray("null") << QByteArray("null");
+    QTest::newRow("true") << QByteArray(" true ") << QByteArray("true");
+    QTest::newRow("false") << QByteArray("false") << QByteArray("false");
+    QTest::newRow("zero") << QByteArray("0") << QByteArray("0");
+    QTest::newRow("negative zero") << QByteArray("-0") << QByteArray("0");
+    QTest::newRow("integer") << QByteArray("-42") << QByteArray("-42");
+    QTest::newRow("fraction") << QByteArray("0.1") << QByteArray("0.1");
+    QTest::newRow("exponent") << QByteArray("1.5e3") << QByteArray("1500");
+    QTest::newRow("negative exponent") << QByteArray("-2.5E-3") << QByteArray("-0.0025");
+    QTest::newRow("large exponent") << QByteArray("1e300") << QByteArray("1e+300");
+    QTest::newRow("past 2^53") << QByteArray("9007199254740993") << QByteArray("9007199254740992");
+    QTest::newRow("string") << QByteArray("\"plain\"") << QByteArray("\"plain\"");
+    QTest::newRow("escapes") << QByteArray("\"a\\\"b\\\\c\\/d\\n\\t\\u0001\"") << QByteArray("\"a\\\"b\\\\c/d\\n\\t\\u0001\"");
+    QTest::newRow("utf-8") << QByteArray("\"caf\xC3\xA9\"") << QByteArray("\"caf\xC3\xA9\"");
+    QTest::newRow("empty array") << QByteArray("[]") << QByteArray("{}");
+    QTest::newRow("empty object") << QByteArray("{ }") << QByteArray("{}");
+    QTest::newRow("array") << QByteArray("[1, \"two\", [3], {\"four\": 4}]") << QByteArray("[1,\"two\",[3],{\"four\":4}]");
+    QTest::newRow("null member") << QByteArray("{\"a\": null}") << QByteArray("{\"a\":null}");
+    QTest::newRow("null element") << QByteArray("[1, null, 3]") << QByteArray("[1,null,3]");
+    QTest::newRow("trailing null") << QByteArray("[null]") << QByteArray("[null]");
+}
+
+void LuaJsonTest::roundTrip()
+{
+    QFETCH(QByteArray, json);
+    QFETCH(QByteArray, expected);
+
+    QString error;
+    QVERIFY2(LuaJson::decode(m_L, json.constData(), json.length(), &error), qPrintable(error));
+    QCOMPARE(lua_gettop(m_L), 1);
+
+    bool ok;
+    QCOMPARE(encodeTop(&ok), expected);
+    QVERIFY(ok);
+    QCOMPARE(lua_gettop(m_L), 0);
+}
+
+void LuaJsonTest::numbers_data()
+{
+    QTest::addColumn<QByteArray>("json");
+
+    // Exact multiply or divide first, then the slow path for wide mantissas and big exponents
+    QTest::newRow("small") << QByteArray("3.14159");
+    QTest::newRow("22 digits") << QByteArray("1234567890123456789012");
+    QTest::newRow("2^53 - 1") << QByteArray("9007199254740991");
+    QTest::newRow("2^53") << QByteArray("9007199254740992");
+    QTest::newRow("2^53 + 1") << QByteArray("9007199254740993");
+    QTest::newRow("2^64 - 1") << QByteArray("18446744073709551615");
+    QTest::newRow("long fraction") << QByteArray("0.30000000000000004");
+    QTest::newRow("wide mantissa") << QByteArray("123456789012345678e-10");
+    QTest::newRow("1e22") << QByteArray("1e22");
+    QTest::newRow("1e23") << QByteArray("1e23");
+    QTest::newRow("1e-22") << QByteArray("1e-22");
+    QTest::newRow("1e-23") << QByteArray("1e-23");
+    QTest::newRow("maximum") << QByteArray("1.7976931348623157e308");
+    QTest::newRow("denormal") << QByteArray("-5e-324");
+    QTest::newRow("plus exponent") << QByteArray("2E+10");
+}
+
+void LuaJsonTest::numbers()
+{
+    QFETCH(QByteArray, json);
+
+    double expected = json.toDouble();
+
+    QVERIFY(LuaJson::decode(m_L, json.constData(), json.length()));
+    QVERIFY(lua_tonumber(m_L, -1) == expected);
+
+    // Whatever the encoder writes must come back as the same double
+    QByteArray encoded = encodeTop();
+    QVERIFY(LuaJson::decode(m_L, encoded.constData(), encoded.length()));
+    QVERIFY2(lua_tonumber(m_L, -1) == expected, encoded.constData());
+    lua_pop(m_L, 1);
+}
+
+void LuaJsonTest::strings_data()
+{
+    QTest::addColumn<QByteArray>("json");
+    QTest::addColumn<QByteArray>("expected");
+
+    QTest::newRow("two bytes") << QByteArray("\"\\u00e9\"") << QByteArray("\xC3\xA9");
+    QTest::newRow("three bytes") << QByteArray("\"\\u20AC\"") << QByteArray("\xE2\x82\xAC");
+    QTest::newRow("surrogate pair") << QByteArray("\"\\ud83d\\ude00\"") << QByteArray("\xF0\x9F\x98\x80");
+    QTest::newRow("highest pair") << QByteArray("\"\\uDBFF\\uDFFF\"") << QByteArray("\xF4\x8F\xBF\xBF");
+    QTest::newRow("lone high") << QByteArray("\"\\ud83dx\"") << QByteArray("\xEF\xBF\xBDx");
+    QTest::newRow("lone high at end") << QByteArray("\"\\ud83d\"") << QByteArray("\xEF\xBF\xBD");
+    QTest::newRow("lone low") << QByteArray("\"\\ude00\"") << QByteArray("\xEF\xBF\xBD");
+    QTest::newRow("high then high") << QByteArray("\"\\ud83d\\ud83d\"") << QByteArray("\xEF\xBF\xBD\xEF\xBF\xBD");
+    QTest::newRow("high then other") << QByteArray("\"\\ud83d\\u0041\"") << QByteArray("\xEF\xBF\xBD" "A");
+    QTest::newRow("embedded nul") << QByteArray("\"a\\u0000b\"") << QByteArray("a\0b", 3);
+}
+
+void LuaJsonTest::strings()
+{
+    QFETCH(QByteArray, json);
+    QFETCH(QByteArray, expected);
+
+    QVERIFY(LuaJson::decode(m_L, json.constData(), json.length()));
+
+    size_t length;
+    const char *str = lua_tolstring(m_L, -1, &length);
+    QCOMPARE(QByteArray(str, int(length)), expected);
+
+    // Decoded text goes back out as UTF-8, only control characters are escaped
+    QByteArray encoded = encodeTop();
+    QVERIFY(LuaJson::decode(m_L, encoded.constData(), encoded.length()));
+    str = lua_tolstring(m_L, -1, &length);
+    QCOMPARE(QByteArray(str, int(length)), expected);
+    lua_pop(m_L, 1);
+}
+
+void LuaJsonTest::tables_data()
+{
+    QTest::addColumn<QByteArray>("script");
+    QTest::addColumn<QByteArray>("expected");
+
+    // Only keys 1..n make an array, anything else makes an object with string keys
+    QTest::newRow("empty") << QByteArray("return {}") << QByteArray("{}");
+    QTest::newRow("sequence") << QByteArray("return {1, 2, 3}") << QByteArray("[1,2,3]");
+    QTest::newRow("hole") << QByteArray("return {1, nil, 3}") << QByteArray("{\"1\":1,\"3\":3}");
+    QTest::newRow("sparse") << QByteArray("return {[2] = 'b'}") << QByteArray("{\"2\":\"b\"}");
+    QTest::newRow("mixed") << QByteArray("return {1, 2, x = 3}") << QByteArray("{\"1\":1,\"2\":2,\"x\":3}");
+    QTest::newRow("fractional key") << QByteArray("return {[1.5] = true}") << QByteArray("{\"1.5\":true}");
+    QTest::newRow("string key") << QByteArray("return {x = 'y'}") << QByteArray("{\"x\":\"y\"}");
+    QTest::newRow("nested") << QByteArray("return {{}, {a = {1}}}") << QByteArray("[{},{\"a\":[1]}]");
+}
+
+void LuaJsonTest::tables()
+{
+    QFETCH(QByteArray, script);
+    QFETCH(QByteArray, expected);
+
+    QCOMPARE(luaL_dostring(m_L, script.constData()), LUA_OK);
+
+    bool ok;
+    QCOMPARE(encodeTop(&ok), expected);
+    QVERIFY(ok);
+}
+
+void LuaJsonTest::null()
+{
+    // null is one value, not nil, so it keeps its place in arrays and objects
+    QByteArray json("[null, {\"a\": null}]");
+    QVERIFY(LuaJson::decode(m_L, json.constData(), json.length()));
+
+    lua_rawgeti(m_L, -1, 1);
+    QVERIFY(LuaJson::isNull(m_L, -1));
+    lua_pop(m_L, 1);
+
+    lua_rawgeti(m_L, -1, 2);
+    lua_getfield(m_L, -1, "a");
+    QVERIFY(LuaJson::isNull(m_L, -1));
+    lua_pop(m_L, 3);
+
+    // Anything else isn't, nil and other light userdata included
+    lua_pushnil(m_L);
+    QVERIFY(!LuaJson::isNull(m_L, -1));
+    lua_pushlightuserdata(m_L, m_L);
+    QVERIFY(!LuaJson::isNull(m_L, -1));
+    QByteArray out;
+    QVERIFY(!LuaJson::encode(m_L, -1, out));
+    lua_pop(m_L, 2);
+
+    // nil still encodes as null on its own
+    lua_pushnil(m_L);
+    QCOMPARE(encodeTop(), QByteArray("null"));
+}
+
+void LuaJsonTest::invalid_data()
+{
+    QTest::addColumn<QByteArray>("json");
+
+    QTest::newRow("empty") << QByteArray("");
+    QTest::newRow("trailing comma") << QByteArray("[1,]");
+    QTest::newRow("missing comma") << QByteArray("[1 2]");
+    QTest::newRow("missing colon") << QByteArray("{\"a\" 1}");
+    QTest::newRow("bare key") << QByteArray("{a: 1}");
+    QTest::newRow("unterminated string") << QByteArray("[\"abc");
+    QTest::newRow("unterminated array") << QByteArray("[1, [2]");
+    QTest::newRow("bad escape") << QByteArray("\"\\x\"");
+    QTest::newRow("truncated escape") << QByteArray("\"\\u12\"");
+    QTest::newRow("bad pair") << QByteArray("\"\\ud83d\\uzzzz\"");
+    QTest::newRow("bad literal") << QByteArray("tru");
+    QTest::newRow("lone minus") << QByteArray("-");
+    QTest::newRow("empty fraction") << QByteArray("1.");
+    QTest::newRow("empty exponent") << QByteArray("1e+");
+    QTest::newRow("trailing text") << QByteArray("[1] x");
+}
+
+void LuaJsonTest::invalid()
+{
+    QFETCH(QByteArray, json);
+
+    QString error;
+    QVERIFY(!LuaJson::decode(m_L, json.constData(), json.length(), &error));
+    QVERIFY(!error.isEmpty());
+
+    // A failed decode leaves nothing behind, however deep it got
+    QCOMPARE(lua_gettop(m_L), 0);
+}
+
+void LuaJsonTest::nesting()
+{
+    QByteArray deep = QByteArray(200, '[') + QByteArray(200, ']');
+    QVERIFY(LuaJson::decode(m_L, deep.constData(), deep.length()));
+    lua_pop(m_L, 1);
+
+    QByteArray deeper = QByteArray(201, '[') + QByteArray(201, ']');
+    QVERIFY(!LuaJson::decode(m_L, deeper.constData(), deeper.length()));
+    QCOMPARE(lua_gettop(m_L), 0);
+
+    // Tables that contain themselves, functions and boolean keys can't be encoded
+    QString error;
+    QByteArray out;
+
+    QCOMPARE(luaL_dostring(m_L, "local t = {} t.t = t return t"), LUA_OK);
+    QVERIFY(!LuaJson::encode(m_L, -1, out, &error));
+    QVERIFY(!error.isEmpty());
+    lua_settop(m_L, 0);
+
+    QCOMPARE(luaL_dostring(m_L, "return {f = function() end}"), LUA_OK);
+    QVERIFY(!LuaJson::encode(m_L, -1, out));
+    lua_settop(m_L, 0);
+
+    QCOMPARE(luaL_dostring(m_L, "return {[true] = 1}"), LUA_OK);
+    QVERIFY(!LuaJson::encode(m_L, -1, out));
+    QCOMPARE(lua_gettop(m_L), 1);
+    lua_settop(m_L, 0);
+}
+
+void LuaJsonTest::benchmarkDecode()
+{
+    QByteArray json(document());
+
+    QBENCHMARK
+    {
+        LuaJson::decode(m_L, json.constData(), json.length());
+        lua_pop(m_L, 1);
+    }
+}
+
+void LuaJsonTest::benchmarkEncode()
+{
+    QByteArray json(document());
+    QVERIFY(LuaJson::decode(m_L, json.constData(), json.length()));
+
+    QByteArray out;
+    QBENCHMARK
+    {
+        out.resize(0);
+        LuaJson::encode(m_L, -1, out);
+    }
+    lua_pop(m_L, 1);
+
+    QVERIFY(!out.isEmpty());
+}
+
+QTEST_GUILESS_MAIN(LuaJsonTest)
+
+#include "tst_luajson.moc"
@@ -0,0 +1,46 @@
+#-------------------------------------------------
+#
+# Output painting benchmarks
+#
+#-------------------------------------------------
+
+QT += gui widgets testlib
+
+TARGET = tst_render
+TEMPLATE = app
+
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+SOURCES += \
+    tst_render.cpp \
+    ../../client/consoledocument.cpp \
+    ../../client/consoledocumentlayout.cpp \
+    ../../client/glyphcache.cpp \
+    ../../client/htmlwriter.cpp \
+    ../../client/logging.cpp \
+    ../../client/scrollbacksearch.cpp
+
+HEADERS += \
+    ../../client/consoledocument.h \
+    ../../client/consoledocumentlayout.h \
+    ../../client/glyphcache.h \
+    ../../client/htmlwriter.h \
+    ../../client/logging.h \
+    ../../client/scrollbacksearch.h
+
+INCLUDEPATH += $$PWD/../../client
+
+win32:CONFIG(release, debug|release): LIBS += -L$$OUT_PWD/../../core/release/ -lcore
+else:win32:CONFIG(debug, debug|release): LIBS += -L$$OUT_PWD/../../core/debug/ -lcore
+else:unix: LIBS += -L$$OUT_PWD/../../core/ -lcore
+
+INCLUDEPATH += $$PWD/../../core
+DEPENDPATH += $$PWD/../../core
+
+win32:CONFIG(release, debug|release): LIBS += -L$$OUT_PWD/../../logging/release/ -llogging
+else:win32:CONFIG(debug, debug|release): LIBS += -L$$OUT_PWD/../../logging/debug/ -llogging
+else:unix: LIBS += -L$$OUT_PWD/../../logging/ -llogging
+
+INCLUDEPATH += $$PWD/../../logging
+DEPENDPATH += $$PWD/../../logging
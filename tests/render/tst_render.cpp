@@ -0,0 +1,143 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+
+#include "consoledocument.h"
+#include "consoledocumentlayout.h"
+#include <QFontDatabase>
+#include <QtTest>
+
+static const int VIEW_WIDTH = 960;
+static const int VIEW_HEIGHT = 720;
+
+class RenderTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void paint_data();
+    void paint();
+
+private:
+    ConsoleDocument *m_document;
+};
+
+void RenderTest::initTestCase()
+{
+    m_document = new ConsoleDocument;
+    m_document->optionChanged("outputFont", QVariant::fromValue(QFontDatabase::systemFont(QFontDatabase::FixedFont)));
+
+    // A screenful and more of the usual: coloured room text, truecolor, bold and a few lines long enough to wrap
+    QByteArray output;
+    for (int n = 0; n < 2000; n++)
+    {
+        switch (n % 5)
+        {
+        case 0:
+            output.append("\x1B[1;36mThe Crossroads\x1B[0m\r\n");
+            break;
+        case 1:
+            output.append("A well-trodden road runs north and south, crossing a narrow path that winds east to the river "
+                          "and west into the hills, where the smoke of a dozen chimneys hangs over the village.\r\n");
+            break;
+        case 2:
+            output.append("\x1B[38;2;255;160;0mA merchant\x1B[0m is here, hawking his \x1B[4mwares\x1B[0m.\r\n");
+            break;
+        case 3:
+            output.append(QString("You slash at the goblin, \x1B[1;31mmaiming\x1B[0m it! (%1)\r\n").arg(n).toLatin1());
+            break;
+        case 4:
+            output.append("\x1B[32m<4000hp 3000mp 120mv>\x1B[0m\r\n");
+            break;
+        }
+    }
+    m_document->process(output);
+
+    ConsoleDocumentLayout *layout = m_document->documentLayout();
+    layout->setTextWidth(VIEW_WIDTH);
+    layout->setViewportHeight(VIEW_HEIGHT);
+    layout->scrollToBottom();
+}
+
+void RenderTest::cleanupTestCase()
+{
+    delete m_document;
+}
+
+void RenderTest::paint_data()
+{
+    QTest::addColumn<bool>("grid");
+    QTest::addColumn<bool>("relayout");
+
+    // Cold lays every line out again each frame, as a flood of output does; warm draws from the layout cache
+    QTest::newRow("grid cold") << true << true;
+    QTest::newRow("grid warm") << true << false;
+    QTest::newRow("layout cold") << false << true;
+    QTest::newRow("layout warm") << false << false;
+}
+
+void RenderTest::paint()
+{
+    QFETCH(bool, grid);
+    QFETCH(bool, relayout);
+
+    ConsoleDocumentLayout *layout = m_document->documentLayout();
+    if (grid && !layout->isFixedPitch())
+    {
+        QSKIP("No fixed-pitch font to draw the grid with");
+    }
+
+    layout->setGridEnabled(grid);
+    // Tiles would hide the difference after the first frame
+    layout->setTilesEnabled(false);
+
+    QPixmap pixmap(VIEW_WIDTH, VIEW_HEIGHT);
+    const QRectF clip(pixmap.rect());
+
+    // The first frame only warms up the glyph cache
+    {
+        QPainter painter(&pixmap);
+        painter.setPen(Qt::lightGray);
+        layout->draw(&painter, clip);
+    }
+
+    QBENCHMARK
+    {
+        if (relayout)
+        {
+            layout->invalidate();
+        }
+
+        QPainter painter(&pixmap);
+        painter.setPen(Qt::lightGray);
+        painter.fillRect(pixmap.rect(), Qt::black);
+        layout->draw(&painter, clip);
+    }
+}
+
+QTEST_MAIN(RenderTest)
+
+#include "tst_render.moc"
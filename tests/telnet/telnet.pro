@@ -0,0 +1,30 @@
+#-------------------------------------------------
+#
+# Telnet fast path tests and benchmarks
+#
+#-------------------------------------------------
+
+QT += gui widgets network testlib
+
+TARGET = tst_telnet
+TEMPLATE = app
+
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+SOURCES += \
+    tst_telnet.cpp
+
+win32:CONFIG(release, debug|release): LIBS += -L$$OUT_PWD/../../core/release/ -lcore
+else:win32:CONFIG(debug, debug|release): LIBS += -L$$OUT_PWD/../../core/debug/ -lcore
+else:unix: LIBS += -L$$OUT_PWD/../../core/ -lcore
+
+INCLUDEPATH += $$PWD/../../core
+DEPENDPATH += $$PWD/../../core
+
+win32:CONFIG(release, debug|release): LIBS += -L$$OUT_PWD/../../logging/release/ -llogging
+else:win32:CONFIG(debug, debug|release): LIBS += -L$$OUT_PWD/../../logging/debug/ -llogging
+else:unix: LIBS += -L$$OUT_PWD/../../logging/ -llogging
+
+INCLUDEPATH += $$PWD/../../logging
+DEPENDPATH += $$PWD/../../logging
@@ -0,0 +1,268 @@
+/*
+  Mudder, a cross-platform text gaming client
+
+  Copyright (C) 2014 Jason Douglas
+  jkdoug@gmail.com
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along
+  with this program; if not, write to the Free Software Foundation, Inc.,
+  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+
+#include "bytescan.h"
+#include "connection.h"
+#include <QtTest>
+
+static const char Telnet_InterpretAsCommand = '\xFF';
+static const char Telnet_Will = '\xFB';
+static const char Telnet_Wont = '\xFC';
+static const char Telnet_SubnegotiationBegin = '\xFA';
+static const char Telnet_SubnegotiationEnd = '\xF0';
+static const char Telnet_GoAhead = '\xF9';
+static const char TelnetOption_Echo = '\x01';
+static const char TelnetOption_GMCP = '\xC9';
+
+static const int CHUNK_SIZE = 4096;
+
+class TelnetTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+
+    void findAny_data();
+    void findAny();
+    void escapedIac();
+    void chunkBoundaries_data();
+    void chunkBoundaries();
+    void capture();
+
+    void benchmarkFindAny();
+    void benchmarkProcessInput();
+
+private:
+    QByteArray feed(Connection &connection, const QByteArray &data, int chunkSize);
+
+    QByteArray m_capture;
+    QByteArray m_expected;
+};
+
+// Returns everything the connection posted: text as it is, prompts ended by <prompt>, GMCP wrapped in <gmcp ...>
+QByteArray TelnetTest::feed(Connection &connection, const QByteArray &data, int chunkSize)
+{
+    QByteArray result;
+
+    for (int pos = 0; pos < data.length(); pos += chunkSize)
+    {
+        connection.processInput(data.constData() + pos, qMin(chunkSize, data.length() - pos));
+        connection.postData();
+
+        ConnectionPayload payload;
+        while (connection.readPayload(payload))
+        {
+            if (payload.type == ConnectionPayload::Gmcp)
+            {
+                result.append("<gmcp ").append(payload.data).append('>');
+            }
+            else if (payload.type == ConnectionPayload::Prompt)
+            {
+                result.append(payload.data).append("<prompt>");
+            }
+            else
+            {
+                result.append(payload.data);
+            }
+        }
+        connection.acknowledgePayloads();
+    }
+
+    return result;
+}
+
+void TelnetTest::initTestCase()
+{
+    // A few megabytes of a busy session: coloured room and combat text, prompts after every few
+    // lines, the odd escaped 0xFF byte, echo toggles and GMCP vitals between them
+    qsrand(2014);
+
+    static const char *lines[] =
+    {
+        "\x1B[1;36mThe Crossroads\x1B[0m",
+        "A well-trodden road runs north and south, crossing a narrow path east to west.",
+        "\x1B[33mA merchant\x1B[0m is here, hawking his wares.",
+        "You slash at the goblin, \x1B[1;31mmaiming\x1B[0m it!",
+        "The goblin misses you.",
+        "\x1B[32mObvious exits: north south east west\x1B[0m"
+    };
+    static const int lineCount = sizeof(lines) / sizeof(lines[0]);
+
+    while (m_capture.length() < 4 * 1024 * 1024)
+    {
+        int count = 1 + qrand() % 6;
+        for (int n = 0; n < count; n++)
+        {
+            const char *line = lines[qrand() % lineCount];
+            m_capture.append(line).append("\r\n");
+            m_expected.append(line).append('\n');
+        }
+
+        switch (qrand() % 8)
+        {
+        case 0:
+            m_capture.append("Rune: ").append(Telnet_InterpretAsCommand).append(Telnet_InterpretAsCommand).append("\r\n");
+            m_expected.append("Rune: ").append(Telnet_InterpretAsCommand).append('\n');
+            break;
+
+        case 1:
+            m_capture.append(Telnet_InterpretAsCommand).append(Telnet_Will).append(TelnetOption_Echo).append(Telnet_InterpretAsCommand).append(Telnet_Wont).append(TelnetOption_Echo);
+            break;
+
+        case 2:
+            m_capture.append(Telnet_InterpretAsCommand).append(Telnet_SubnegotiationBegin).append(TelnetOption_GMCP).append("Char.Vitals { \"hp\": 4000, \"mp\": 3000 }").append(Telnet_InterpretAsCommand).append(Telnet_SubnegotiationEnd);
+            m_expected.append("<gmcp Char.Vitals { \"hp\": 4000, \"mp\": 3000 }>");
+            break;
+        }
+
+        m_capture.append("\x1B[1;33m<4000hp 3000mp>\x1B[0m ").append(Telnet_InterpretAsCommand).append(Telnet_GoAhead);
+        m_expected.append("\x1B[1;33m<4000hp 3000mp>\x1B[0m <prompt>");
+    }
+}
+
+void TelnetTest::findAny_data()
+{
+    QTest::addColumn<int>("length");
+
+    // Either side of the 16 byte blocks, and the scalar tail after them
+    for (int length = 0; length <= 50; length++)
+    {
+        QTest::newRow(qPrintable(QString::number(length))) << length;
+    }
+}
+
+void TelnetTest::findAny()
+{
+    QFETCH(int, length);
+
+    QByteArray data(length + 1, 'x');
+    for (int hit = 0; hit <= length; hit++)
+    {
+        data.fill('x');
+        if (hit < length)
+        {
+            data[hit] = Telnet_InterpretAsCommand;
+        }
+        // A needle just past the end must not be found
+        data[length] = '\r';
+
+        QCOMPARE(ByteScan::findAny(data.constData(), length, Telnet_InterpretAsCommand, '\r'), hit);
+        QCOMPARE(ByteScan::find(data.constData(), length, Telnet_InterpretAsCommand), hit);
+    }
+}
+
+void TelnetTest::escapedIac()
+{
+    Connection connection;
+
+    QByteArray data;
+    data.append("a").append(Telnet_InterpretAsCommand).append(Telnet_InterpretAsCommand).append("b").append(Telnet_InterpretAsCommand).append(Telnet_InterpretAsCommand).append(Telnet_InterpretAsCommand).append(Telnet_InterpretAsCommand);
+
+    QByteArray expected;
+    expected.append("a").append(Telnet_InterpretAsCommand).append("b").append(Telnet_InterpretAsCommand).append(Telnet_InterpretAsCommand);
+
+    QCOMPARE(feed(connection, data, data.length()), expected);
+}
+
+void TelnetTest::chunkBoundaries_data()
+{
+    QTest::addColumn<int>("chunkSize");
+
+    // One byte at a time splits every command, a few odd sizes land the split inside them differently
+    QTest::newRow("1") << 1;
+    QTest::newRow("2") << 2;
+    QTest::newRow("3") << 3;
+    QTest::newRow("5") << 5;
+    QTest::newRow("7") << 7;
+    QTest::newRow("16") << 16;
+    QTest::newRow("whole") << 1024;
+}
+
+void TelnetTest::chunkBoundaries()
+{
+    QFETCH(int, chunkSize);
+
+    QByteArray data;
+    data.append("Hello\r\n");
+    data.append(Telnet_InterpretAsCommand).append(Telnet_InterpretAsCommand).append("x\r\n");
+    data.append("prompt> ").append(Telnet_InterpretAsCommand).append(Telnet_GoAhead);
+    data.append(Telnet_InterpretAsCommand).append(Telnet_Will).append(TelnetOption_Echo);
+    data.append("pw");
+    data.append(Telnet_InterpretAsCommand).append(Telnet_SubnegotiationBegin).append(TelnetOption_GMCP).append("Char.Name ").append(Telnet_InterpretAsCommand).append(Telnet_InterpretAsCommand).append(Telnet_InterpretAsCommand).append(Telnet_SubnegotiationEnd);
+    data.append("done\r\n");
+
+    QByteArray expected;
+    expected.append("Hello\n");
+    expected.append(Telnet_InterpretAsCommand).append("x\n");
+    expected.append("prompt> <prompt>");
+    expected.append("pw");
+    expected.append("<gmcp Char.Name ").append(Telnet_InterpretAsCommand).append('>');
+    expected.append("done\n");
+
+    Connection connection;
+    QCOMPARE(feed(connection, data, chunkSize), expected);
+}
+
+void TelnetTest::capture()
+{
+    Connection connection;
+    // The prompt clean-up depends on where reads happened to split the stream, leave it out of a byte comparison
+    connection.m_bugfixGA = false;
+
+    QCOMPARE(feed(connection, m_capture, CHUNK_SIZE), m_expected);
+}
+
+void TelnetTest::benchmarkFindAny()
+{
+    const char *data = m_capture.constData();
+    int length = m_capture.length();
+
+    int hits = 0;
+    QBENCHMARK
+    {
+        hits = 0;
+        int pos = 0;
+        while (pos < length)
+        {
+            pos += ByteScan::findAny(data + pos, length - pos, Telnet_InterpretAsCommand, '\r') + 1;
+            hits++;
+        }
+    }
+    QVERIFY(hits > 0);
+}
+
+void TelnetTest::benchmarkProcessInput()
+{
+    Connection connection;
+
+    QBENCHMARK
+    {
+        feed(connection, m_capture, CHUNK_SIZE);
+    }
+}
+
+QTEST_MAIN(TelnetTest)
+
+#include "tst_telnet.moc"
@@ -0,0 +1,7 @@
+TEMPLATE = subdirs
+
+SUBDIRS += \
+    telnet \
+    connect \
+    luajson \
+    render